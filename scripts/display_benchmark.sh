@@ -0,0 +1,65 @@
+#!/bin/sh
+# Compares what the GL and shared memory displays cost on a machine without a
+# GPU. Runs the app under Xvfb with each in turn, where Mesa falls back to
+# software rendering just as it does on our GPU-less hosts, and measures the
+# CPU time used by both the app and the X server, since the shared memory
+# path moves the final copy into the server.
+#
+# Usage: scripts/display_benchmark.sh [seconds] [WIDTHxHEIGHT] [feeds]
+# The binary defaults to build/bin/v4l2_opengl, and can be set with BIN.
+
+set -e
+
+BIN=${BIN:-build/bin/v4l2_opengl}
+RUN_SECONDS=${1:-10}
+SIZE=${2:-1280x720}
+FEEDS=${3:-1}
+# Left out of the measurement, while the window and capture start up.
+WARM_UP_SECONDS=2
+SERVER=:${DISPLAY_NUMBER:-99}
+
+if ! command -v Xvfb > /dev/null; then
+  echo "Xvfb is needed to run the display benchmark" >&2
+  exit 1
+fi
+
+TICKS_PER_SECOND=$(getconf CLK_TCK)
+
+# User plus system time, in clock ticks.
+cpu_ticks() {
+  awk '{print $14 + $15}' "/proc/$1/stat"
+}
+
+Xvfb "$SERVER" -screen 0 1920x1080x24 -nolisten tcp > /dev/null 2>&1 &
+XVFB_PID=$!
+trap 'kill $XVFB_PID 2> /dev/null' EXIT
+sleep 1
+
+# Prints the app's and the server's CPU use as percentages of one core.
+measure() {
+  DISPLAY=$SERVER LIBGL_ALWAYS_SOFTWARE=1 "$BIN" --display "$1" -t bars -n "$FEEDS" -s "$SIZE" -p 30 \
+    > /dev/null 2>&1 &
+  APP_PID=$!
+  sleep "$WARM_UP_SECONDS"
+  APP_START=$(cpu_ticks $APP_PID)
+  SERVER_START=$(cpu_ticks $XVFB_PID)
+  sleep "$RUN_SECONDS"
+  APP_END=$(cpu_ticks $APP_PID)
+  SERVER_END=$(cpu_ticks $XVFB_PID)
+  kill -INT $APP_PID
+  wait $APP_PID || true
+  awk -v app=$((APP_END - APP_START)) -v server=$((SERVER_END - SERVER_START)) \
+    -v ticks="$TICKS_PER_SECOND" -v seconds="$RUN_SECONDS" \
+    'BEGIN { scale = 100 / (ticks * seconds); printf "%.1f %.1f\n", app * scale, server * scale }'
+}
+
+echo "Showing $FEEDS feeds of $SIZE test pattern at 30 fps for $RUN_SECONDS seconds each"
+GL=$(measure gl)
+SHM=$(measure shm)
+echo "$GL" "$SHM" | awk '{
+  gl = $1 + $2
+  shm = $3 + $4
+  printf "gl:  app %5.1f%% CPU, X server %5.1f%%, total %5.1f%%\n", $1, $2, gl
+  printf "shm: app %5.1f%% CPU, X server %5.1f%%, total %5.1f%%\n", $3, $4, shm
+  if (shm > 0) printf "shm uses %.1fx less CPU than gl\n", gl / shm
+}'
@@ -1,22 +1,255 @@
 #include "app_main.h"
 
 #include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "capture_main.h"
+#include "frame_latency.h"
+#include "headless_main.h"
+#include "metrics.h"
+#include "shm_window_main.h"
+#include "trace.h"
 #include "window_main.h"
 
+typedef void *(*ThreadMainFunc)(void *cookie);
+
+static void handle_stop_signal(int signal_number)
+{
+  capture_main_stop();
+}
+
+// Logs the latency histograms whenever SIGUSR1 arrives. The signal is blocked
+// in every thread and picked up here, so the logging isn't done in a handler.
+static void *latency_report_main(void *cookie)
+{
+  const sigset_t *signals = (const sigset_t *)(cookie);
+  while (1)
+  {
+    int signal_number;
+    if (sigwait(signals, &signal_number) == 0)
+    {
+      frame_latency_log_stats();
+    }
+  }
+  return NULL;
+}
+
+bool app_main_match_value_option(int argc, char **argv, int *i, const char *name, const char **value)
+{
+  const size_t length = strlen(name);
+  if (strncmp(argv[*i], name, length) != 0)
+  {
+    return false;
+  }
+  if ((argv[*i][length] == '=') && (argv[*i][length + 1] != '\0'))
+  {
+    *value = argv[*i] + length + 1;
+    return true;
+  }
+  if ((argv[*i][length] == '\0') && ((*i + 1) < argc))
+  {
+    *i += 1;
+    *value = argv[*i];
+    return true;
+  }
+  return false;
+}
+
+static void exit_with_bad_option(const char *option, const char *value)
+{
+  fprintf(stderr, "Bad value '%s' for %s\n", value, option);
+  exit(EXIT_FAILURE);
+}
+
+// Takes the display's options out of the arguments, since the capture side
+// has options of its own and would reject them. These are:
+//   --display gl|shm|headless
+//                       Draw with OpenGL, the default, or X11 shared memory,
+//                       or consume frames without drawing them at all.
+//   --swap-interval N   Vertical blanks to wait between swaps.
+//   --finish            Wait for every frame to go out before the next.
+//   --low-latency       Both of the above with an interval of one, unless
+//                       another was given, and draw each frame as late as
+//                       possible before its swap.
+//   --latency-report    Log how long each frame took to reach the screen.
+//   --headless-fps N    How often the headless display takes frames, 60 by
+//                       default, or 0 for every frame as it arrives.
+// Only the GL display does anything with the swap, finish and latency options.
+static ThreadMainFunc take_display_args(int *argc, char **argv, DisplayOptions *options)
+{
+  memset(options, 0, sizeof(DisplayOptions));
+  options->headless_fps = 60.0;
+  ThreadMainFunc display_main = window_main;
+  int kept = 0;
+  for (int i = 0; i < *argc; ++i)
+  {
+    const char *value;
+    if (app_main_match_value_option(*argc, argv, &i, "--display", &value))
+    {
+      if (strcmp(value, "gl") == 0)
+      {
+        display_main = window_main;
+      }
+      else if (strcmp(value, "shm") == 0)
+      {
+        display_main = shm_window_main;
+      }
+      else if (strcmp(value, "headless") == 0)
+      {
+        display_main = headless_main;
+      }
+      else
+      {
+        exit_with_bad_option("--display", value);
+      }
+    }
+    else if (app_main_match_value_option(*argc, argv, &i, "--swap-interval", &value))
+    {
+      char *end;
+      options->swap_interval = strtol(value, &end, 10);
+      if ((*end != '\0') || (options->swap_interval < 0))
+      {
+        exit_with_bad_option("--swap-interval", value);
+      }
+      options->has_swap_interval = true;
+    }
+    else if (app_main_match_value_option(*argc, argv, &i, "--headless-fps", &value))
+    {
+      char *end;
+      options->headless_fps = strtod(value, &end);
+      if ((*end != '\0') || (options->headless_fps < 0.0))
+      {
+        exit_with_bad_option("--headless-fps", value);
+      }
+    }
+    else if (strcmp(argv[i], "--finish") == 0)
+    {
+      options->finish_frames = true;
+    }
+    else if (strcmp(argv[i], "--low-latency") == 0)
+    {
+      options->finish_frames = true;
+      options->late_latch = true;
+    }
+    else if (strcmp(argv[i], "--latency-report") == 0)
+    {
+      options->report_latency = true;
+    }
+    else
+    {
+      argv[kept++] = argv[i];
+    }
+  }
+  // Late latching goes by when the swaps happen, so it needs them paced.
+  if (options->late_latch && !options->has_swap_interval)
+  {
+    options->has_swap_interval = true;
+    options->swap_interval = 1;
+  }
+  argv[kept] = NULL;
+  *argc = kept;
+  return display_main;
+}
+
+// How the app reports on itself, besides logging to stderr.
+typedef struct
+{
+  // NULL unless asked for.
+  const char *trace_path;
+  const char *metrics_destination;
+  int metrics_interval_ms;
+} MonitoringOptions;
+
+// Takes the monitoring options out of the arguments. These are:
+//   --trace file             Record a Chrome trace, in builds with TRACE=1.
+//   --metrics file|unix:path Write metrics snapshots there.
+//   --metrics-interval ms    How often to write them, every second by default.
+static void take_monitoring_args(int *argc, char **argv, MonitoringOptions *options)
+{
+  options->trace_path = NULL;
+  options->metrics_destination = NULL;
+  options->metrics_interval_ms = 1000;
+  int kept = 0;
+  for (int i = 0; i < *argc; ++i)
+  {
+    const char *value;
+    if (app_main_match_value_option(*argc, argv, &i, "--trace", &value))
+    {
+      options->trace_path = value;
+    }
+    else if (app_main_match_value_option(*argc, argv, &i, "--metrics-interval", &value))
+    {
+      char *end;
+      options->metrics_interval_ms = strtol(value, &end, 10);
+      if ((*end != '\0') || (options->metrics_interval_ms <= 0))
+      {
+        exit_with_bad_option("--metrics-interval", value);
+      }
+    }
+    else if (app_main_match_value_option(*argc, argv, &i, "--metrics", &value))
+    {
+      options->metrics_destination = value;
+    }
+    else
+    {
+      argv[kept++] = argv[i];
+    }
+  }
+  argv[kept] = NULL;
+  *argc = kept;
+}
+
 int app_main(int argc, char **argv)
 {
-  Args args = {argc, argv};
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handle_stop_signal;
+  // Capture may be stuck somewhere the request to stop can't reach, like
+  // waiting on a stalled camera, so a second signal kills the process.
+  action.sa_flags = SA_RESETHAND;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  // Blocked before any other threads start, so they all inherit it.
+  static sigset_t report_signals;
+  sigemptyset(&report_signals);
+  sigaddset(&report_signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &report_signals, NULL);
+  pthread_t report_thread;
+  pthread_create(&report_thread, NULL, latency_report_main, &report_signals);
+  pthread_detach(report_thread);
+
+  MonitoringOptions monitoring;
+  take_monitoring_args(&argc, argv, &monitoring);
+  if ((monitoring.trace_path != NULL) && !trace_start(monitoring.trace_path))
+  {
+    exit(EXIT_FAILURE);
+  }
+  if ((monitoring.metrics_destination != NULL) &&
+      !metrics_start(monitoring.metrics_destination, monitoring.metrics_interval_ms))
+  {
+    exit(EXIT_FAILURE);
+  }
+
+  Args args;
+  ThreadMainFunc display_main = take_display_args(&argc, argv, &args.display);
+  args.argc = argc;
+  args.argv = argv;
 
   pthread_t window_thread;
-  pthread_create(&window_thread, NULL, window_main, &args);
+  pthread_create(&window_thread, NULL, display_main, &args);
 
   pthread_t capture_thread;
   pthread_create(&capture_thread, NULL, capture_main, &args);
 
-  pthread_join(window_thread, NULL);
+  // The window has no way of closing on its own, so the app runs until a
+  // signal stops capture, and the window goes with the process.
   pthread_join(capture_thread, NULL);
+  metrics_stop();
+  trace_stop();
 
   return 0;
-}
\ No newline at end of file
+}
@@ -1,15 +1,46 @@
 #ifndef INCLUDE_APP_MAIN_H
 #define INCLUDE_APP_MAIN_H
 
+#include <stdbool.h>
+
 // Putting the main logic here allows us to call it separately for testing
 // purposes.
 int app_main(int argc, char **argv);
 
+// Returns true if argv[*i] is the named option, either as "--name value" or
+// "--name=value", setting value and skipping past it. For the options
+// app_main() takes itself, and those of programs that wrap it.
+bool app_main_match_value_option(int argc, char **argv, int *i, const char *name, const char **value);
+
+// How the window presents frames, from options app_main() takes out of the
+// command line before the capture side sees it. Everything off leaves the
+// driver's defaults alone.
+typedef struct DisplayOptionsStruct
+{
+    // Vertical blanks to wait between swaps, with zero for no waiting. Only
+    // used if has_swap_interval is set.
+    bool has_swap_interval;
+    int swap_interval;
+    // Waits in glFinish() after every swap, so frames never queue up inside
+    // the driver, and the time it returns is when the frame went out.
+    bool finish_frames;
+    // Waits until just before the next swap is due to pick up the newest
+    // frame and draw it.
+    bool late_latch;
+    // Writes a line to stderr for every frame shown, with how long it took
+    // from capture to the screen.
+    bool report_latency;
+    // How many times a second the headless display looks for new frames,
+    // or zero to take every frame as it arrives.
+    double headless_fps;
+} DisplayOptions;
+
 // Used for passing arg information to pthreads.
 typedef struct ArgsStruct
 {
     int argc;
     char **argv;
+    DisplayOptions display;
 } Args;
 
 #endif // INCLUDE_APP_MAIN_H
\ No newline at end of file
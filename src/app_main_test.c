@@ -2,6 +2,104 @@
 
 #include "app_main.c"
 
+void test_take_display_args() {
+  DisplayOptions options;
+  char* args[] = {"app", "-t", "bars", "--display", "shm", "-n", "2", NULL};
+  int argc = 7;
+  TEST_CHECK(take_display_args(&argc, args, &options) == shm_window_main);
+  TEST_CHECK(argc == 5);
+  TEST_CHECK(strcmp(args[3], "-n") == 0);
+  TEST_CHECK(strcmp(args[4], "2") == 0);
+  TEST_CHECK(args[5] == NULL);
+
+  char* equals_args[] = {"app", "--display=gl", "-t", "bars", NULL};
+  argc = 4;
+  TEST_CHECK(take_display_args(&argc, equals_args, &options) == window_main);
+  TEST_CHECK(argc == 3);
+  TEST_CHECK(strcmp(equals_args[1], "-t") == 0);
+
+  // GL is the default, and everything else is left alone.
+  char* default_args[] = {"app", "-d", "/dev/video1", NULL};
+  argc = 3;
+  TEST_CHECK(take_display_args(&argc, default_args, &options) == window_main);
+  TEST_CHECK(argc == 3);
+  TEST_CHECK(!options.has_swap_interval);
+  TEST_CHECK(!options.finish_frames);
+  TEST_CHECK(!options.late_latch);
+}
+
+void test_take_display_args_headless() {
+  DisplayOptions options;
+  char* args[] = {"app", "--display", "headless", "--headless-fps", "0", "-t", "bars", NULL};
+  int argc = 7;
+  TEST_CHECK(take_display_args(&argc, args, &options) == headless_main);
+  TEST_CHECK(argc == 3);
+  TEST_CHECK(options.headless_fps == 0.0);
+
+  // Headless consumers run at a typical refresh rate unless told otherwise.
+  char* default_args[] = {"app", "--display=headless", NULL};
+  argc = 2;
+  TEST_CHECK(take_display_args(&argc, default_args, &options) == headless_main);
+  TEST_CHECK(argc == 1);
+  TEST_CHECK(options.headless_fps == 60.0);
+}
+
+void test_take_display_args_latency() {
+  DisplayOptions options;
+  char* args[] = {"app", "--low-latency", "-t", "bars", "--latency-report", NULL};
+  int argc = 5;
+  TEST_CHECK(take_display_args(&argc, args, &options) == window_main);
+  TEST_CHECK(argc == 3);
+  TEST_CHECK(options.late_latch);
+  TEST_CHECK(options.finish_frames);
+  TEST_CHECK(options.report_latency);
+  // Late latching needs the swaps paced, so it asks for every vblank.
+  TEST_CHECK(options.has_swap_interval);
+  TEST_CHECK(options.swap_interval == 1);
+
+  char* interval_args[] = {"app", "--swap-interval=0", "--low-latency", NULL};
+  argc = 3;
+  take_display_args(&argc, interval_args, &options);
+  TEST_CHECK(argc == 1);
+  TEST_CHECK(options.has_swap_interval);
+  TEST_CHECK(options.swap_interval == 0);
+
+  char* finish_args[] = {"app", "--swap-interval", "2", "--finish", NULL};
+  argc = 4;
+  take_display_args(&argc, finish_args, &options);
+  TEST_CHECK(argc == 1);
+  TEST_CHECK(options.swap_interval == 2);
+  TEST_CHECK(options.finish_frames);
+  TEST_CHECK(!options.late_latch);
+}
+
+void test_take_monitoring_args() {
+  char* args[] = {"app", "-t", "bars", "--trace", "/tmp/out.json", "--metrics", "unix:/tmp/metrics.sock",
+    "--metrics-interval", "250", "--low-latency", NULL};
+  int argc = 10;
+  MonitoringOptions options;
+  take_monitoring_args(&argc, args, &options);
+  TEST_CHECK((options.trace_path != NULL) && (strcmp(options.trace_path, "/tmp/out.json") == 0));
+  TEST_CHECK((options.metrics_destination != NULL) &&
+    (strcmp(options.metrics_destination, "unix:/tmp/metrics.sock") == 0));
+  TEST_CHECK(options.metrics_interval_ms == 250);
+  TEST_CHECK(argc == 4);
+  TEST_CHECK(strcmp(args[3], "--low-latency") == 0);
+  TEST_CHECK(args[4] == NULL);
+
+  char* plain_args[] = {"app", "-t", "bars", NULL};
+  argc = 3;
+  take_monitoring_args(&argc, plain_args, &options);
+  TEST_CHECK(options.trace_path == NULL);
+  TEST_CHECK(options.metrics_destination == NULL);
+  TEST_CHECK(options.metrics_interval_ms == 1000);
+  TEST_CHECK(argc == 3);
+}
+
 TEST_LIST = {
+    {"take_display_args", test_take_display_args},
+    {"take_display_args_headless", test_take_display_args_headless},
+    {"take_display_args_latency", test_take_display_args_latency},
+    {"take_monitoring_args", test_take_monitoring_args},
     {NULL, NULL},
-};
\ No newline at end of file
+};
@@ -0,0 +1,352 @@
+#include "capture_frames.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "capture_main.h"
+#include "trace.h"
+
+// One frame being captured into, one newest frame, and the rest for consumers
+// that are still holding on to older ones.
+#define CAPTURE_FRAMES_BUFFER_COUNT 8
+
+// Conversions in progress, the newest conversion, and the rest for consumers
+// still holding older ones.
+#define CAPTURE_FRAMES_CONVERTED_BUFFER_COUNT 4
+
+// Everything consumers can get at for one device. The pools are only touched
+// by the device's capture side, and the rest is published atomically, since
+// consumers may come looking before the device has started.
+typedef struct
+{
+    FramePool *frame_pool;
+    FrameStore *_Atomic frame_store;
+    FramePool *converted_pool;
+    FrameCache *_Atomic frame_cache;
+    // Created on first use, by the renderer.
+    UploadSlots *_Atomic upload_slots;
+    // Only ever touched by the borrow_latest_device_capture() consumer thread.
+    const Frame *borrowed_frame;
+} CaptureFramesDevice;
+
+static CaptureFramesDevice g_devices[CAPTURE_FRAMES_MAX_DEVICES];
+static _Atomic int g_device_count = 0;
+
+// Created on first use, since consumers may ask for it before capture starts.
+static pthread_once_t g_event_fd_once = PTHREAD_ONCE_INIT;
+static int g_event_fd = -1;
+
+static void create_event_fd(void)
+{
+    g_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+}
+
+static CaptureFramesDevice *find_device(int device)
+{
+    if ((device < 0) || (device >= CAPTURE_FRAMES_MAX_DEVICES))
+    {
+        return NULL;
+    }
+    return &g_devices[device];
+}
+
+// Copies the frame into a buffer the renderer has mapped for us, if it has
+// one ready, while the pixels are still warm in the cache from conversion.
+// Otherwise the renderer falls back to uploading from the frame store.
+static void fill_upload_slot(CaptureFramesDevice *entry, const Frame *frame)
+{
+    // Nobody can have offered a slot if the renderer hasn't asked for them.
+    UploadSlots *slots = atomic_load_explicit(&entry->upload_slots, memory_order_acquire);
+    if (slots == NULL)
+    {
+        return;
+    }
+    const size_t byte_count = frame_byte_count(frame);
+    int index;
+    uint8_t *data = upload_slots_begin_fill(slots, byte_count, &index);
+    if (data == NULL)
+    {
+        return;
+    }
+    memcpy(data, frame->data, byte_count);
+    upload_slots_end_fill(slots, index, frame);
+}
+
+bool capture_frames_init(int device, size_t frame_byte_count)
+{
+    return capture_frames_init_with_leases(device, frame_byte_count, 0, NULL, NULL);
+}
+
+bool capture_frames_init_with_leases(int device, size_t frame_byte_count, int lease_count,
+                                     FrameStoreReturnLeaseFunc return_lease, void *context)
+{
+    CaptureFramesDevice *entry = find_device(device);
+    if (entry == NULL)
+    {
+        return false;
+    }
+    entry->frame_pool = frame_pool_alloc(CAPTURE_FRAMES_BUFFER_COUNT, frame_byte_count);
+    if (entry->frame_pool == NULL)
+    {
+        return false;
+    }
+    FrameStore *store = frame_store_alloc_with_leases(entry->frame_pool, lease_count, return_lease, context);
+    if (store == NULL)
+    {
+        frame_pool_free(entry->frame_pool);
+        entry->frame_pool = NULL;
+        return false;
+    }
+    atomic_store_explicit(&entry->frame_store, store, memory_order_release);
+    int count = atomic_load(&g_device_count);
+    while ((count <= device) && !atomic_compare_exchange_weak(&g_device_count, &count, device + 1))
+    {
+    }
+    return true;
+}
+
+bool capture_frames_init_conversion(int device, size_t converted_byte_count, FrameCacheConvertFunc convert,
+                                    void *context)
+{
+    CaptureFramesDevice *entry = find_device(device);
+    if (entry == NULL)
+    {
+        return false;
+    }
+    entry->converted_pool = frame_pool_alloc(CAPTURE_FRAMES_CONVERTED_BUFFER_COUNT, converted_byte_count);
+    if (entry->converted_pool == NULL)
+    {
+        return false;
+    }
+    FrameCache *cache = frame_cache_alloc(entry->converted_pool, convert, context);
+    if (cache == NULL)
+    {
+        frame_pool_free(entry->converted_pool);
+        entry->converted_pool = NULL;
+        return false;
+    }
+    atomic_store_explicit(&entry->frame_cache, cache, memory_order_release);
+    return true;
+}
+
+FrameStore *capture_frames_store(int device)
+{
+    CaptureFramesDevice *entry = find_device(device);
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+    return atomic_load_explicit(&entry->frame_store, memory_order_acquire);
+}
+
+static FrameCache *device_frame_cache(int device)
+{
+    CaptureFramesDevice *entry = find_device(device);
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+    return atomic_load_explicit(&entry->frame_cache, memory_order_acquire);
+}
+
+static void wake_consumers(void)
+{
+    const int event_fd = get_capture_event_fd();
+    if (event_fd != -1)
+    {
+        // Only fails if the counter would overflow, which still wakes readers.
+        const uint64_t one = 1;
+        const ssize_t written = write(event_fd, &one, sizeof(one));
+        (void)(written);
+    }
+}
+
+void capture_frames_publish(int device, Frame *frame)
+{
+    // Publishing fills in the sequence number the renderer goes by.
+    frame_store_publish(capture_frames_store(device), frame);
+    fill_upload_slot(&g_devices[device], frame);
+    wake_consumers();
+}
+
+void capture_frames_prepare(int device, Frame *frame, uint64_t sequence)
+{
+    frame->sequence = sequence;
+    fill_upload_slot(&g_devices[device], frame);
+}
+
+void capture_frames_publish_prepared(int device, Frame *frame)
+{
+    frame_store_publish_sequence(capture_frames_store(device), frame, frame->sequence);
+    wake_consumers();
+}
+
+void capture_frames_withdraw(int device)
+{
+    FrameStore *store = capture_frames_store(device);
+    if (store != NULL)
+    {
+        frame_store_withdraw_latest(store);
+    }
+}
+
+void capture_frames_log_stats(int device)
+{
+    CaptureFramesDevice *entry = find_device(device);
+    if ((entry == NULL) || (entry->frame_pool == NULL))
+    {
+        return;
+    }
+    frame_pool_log_stats(entry->frame_pool, "Frame");
+    FrameCache *cache = device_frame_cache(device);
+    if (cache != NULL)
+    {
+        frame_pool_log_stats(entry->converted_pool, "Converted frame");
+        FrameCacheStats stats;
+        frame_cache_get_stats(cache, &stats);
+        fprintf(stderr, "Converted %llu frames on demand, reused %llu conversions, dropped %llu requests\n",
+                (unsigned long long)(stats.converted), (unsigned long long)(stats.reused),
+                (unsigned long long)(stats.dropped));
+    }
+}
+
+int get_capture_device_count(void)
+{
+    return atomic_load(&g_device_count);
+}
+
+const Frame *get_latest_device_frame(int device)
+{
+    TRACE_SCOPE("get latest frame");
+    FrameStore *store = capture_frames_store(device);
+    if (store == NULL)
+    {
+        return NULL;
+    }
+    return frame_store_acquire_latest(store);
+}
+
+const Frame *get_latest_frame(void)
+{
+    return get_latest_device_frame(0);
+}
+
+const Frame *get_latest_device_rgb_frame(int device)
+{
+    TRACE_SCOPE("get latest rgb frame");
+    const Frame *frame = get_latest_device_frame(device);
+    FrameCache *cache = device_frame_cache(device);
+    if ((frame == NULL) || (cache == NULL))
+    {
+        return frame;
+    }
+    const Frame *converted = frame_cache_get(cache, frame);
+    frame_release(frame);
+    return converted;
+}
+
+const Frame *get_latest_rgb_frame(void)
+{
+    return get_latest_device_rgb_frame(0);
+}
+
+bool get_latest_device_capture(int device, int *width, int *height, uint8_t **rgba_buffer)
+{
+    *rgba_buffer = NULL;
+    const Frame *frame = get_latest_device_rgb_frame(device);
+    if (frame == NULL)
+    {
+        return false;
+    }
+    // Callers own the buffer and may write to it or free() it, so they get
+    // their own copy, packed as tightly as it always was.
+    const size_t row_byte_count = (size_t)(frame->width) * 4;
+    *rgba_buffer = malloc(row_byte_count * frame->height);
+    if (*rgba_buffer == NULL)
+    {
+        frame_release(frame);
+        return false;
+    }
+    for (int y = 0; y < frame->height; ++y)
+    {
+        memcpy(*rgba_buffer + (y * row_byte_count), frame->data + ((size_t)(y) * frame->stride), row_byte_count);
+    }
+    *width = frame->width;
+    *height = frame->height;
+    frame_release(frame);
+    return true;
+}
+
+bool get_latest_capture(int *width, int *height, uint8_t **rgba_buffer)
+{
+    return get_latest_device_capture(0, width, height, rgba_buffer);
+}
+
+bool borrow_latest_device_capture(int device, int *width, int *height, const uint8_t **rgba_buffer,
+                                  uint64_t *sequence)
+{
+    const Frame *frame = get_latest_device_rgb_frame(device);
+    if (frame == NULL)
+    {
+        return false;
+    }
+    CaptureFramesDevice *entry = &g_devices[device];
+    frame_release(entry->borrowed_frame);
+    entry->borrowed_frame = frame;
+    *width = frame->width;
+    *height = frame->height;
+    *rgba_buffer = frame->data;
+    if (sequence != NULL)
+    {
+        *sequence = frame->sequence;
+    }
+    return true;
+}
+
+bool borrow_latest_capture(int *width, int *height, const uint8_t **rgba_buffer, uint64_t *sequence)
+{
+    return borrow_latest_device_capture(0, width, height, rgba_buffer, sequence);
+}
+
+int get_capture_event_fd(void)
+{
+    pthread_once(&g_event_fd_once, create_event_fd);
+    return g_event_fd;
+}
+
+UploadSlots *get_device_upload_slots(int device)
+{
+    CaptureFramesDevice *entry = find_device(device);
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+    UploadSlots *slots = atomic_load_explicit(&entry->upload_slots, memory_order_acquire);
+    if (slots != NULL)
+    {
+        return slots;
+    }
+    // Whoever loses a race to create them frees their own and uses the
+    // winner's.
+    UploadSlots *created = upload_slots_alloc();
+    if (created == NULL)
+    {
+        return NULL;
+    }
+    if (!atomic_compare_exchange_strong(&entry->upload_slots, &slots, created))
+    {
+        upload_slots_free(created);
+        return slots;
+    }
+    return created;
+}
+
+UploadSlots *get_capture_upload_slots(void)
+{
+    return get_device_upload_slots(0);
+}
@@ -0,0 +1,59 @@
+#ifndef INCLUDE_CAPTURE_FRAMES_H
+#define INCLUDE_CAPTURE_FRAMES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frame_cache.h"
+#include "frame_store.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define CAPTURE_FRAMES_MAX_DEVICES 16
+
+    // The capture side of the frame stores that back the consumer functions in
+    // capture_main.h, one for each device, numbered from zero. A device's
+    // store is set up once its output format is known, so the pool can be
+    // sized to match. Until then consumers just see no frames from it.
+    bool capture_frames_init(int device, size_t frame_byte_count);
+    // The same, but the store can also publish frames leased from the
+    // source's buffers. See frame_store_alloc_with_leases().
+    bool capture_frames_init_with_leases(int device, size_t frame_byte_count, int lease_count,
+                                         FrameStoreReturnLeaseFunc return_lease, void *context);
+
+    // For when frames are published in a YUV layout. Consumers that need RGB
+    // get frames converted by the given function the first time one of them
+    // asks, and every frame is converted at most once. Without this, frames
+    // are assumed to be RGB already and everyone gets the published ones.
+    bool capture_frames_init_conversion(int device, size_t converted_byte_count, FrameCacheConvertFunc convert,
+                                        void *context);
+
+    // NULL until capture_frames_init() has succeeded for the device.
+    FrameStore *capture_frames_store(int device);
+
+    // Publishes a frame from capture_frames_store() and wakes up anyone waiting
+    // on get_capture_event_fd().
+    void capture_frames_publish(int device, Frame *frame);
+
+    // The same in two halves, for when frames are worked on by several
+    // threads. Preparing gives the frame its sequence number and does the
+    // copying, and can happen on any thread in any order. Prepared frames
+    // must then be published one at a time, in sequence order.
+    void capture_frames_prepare(int device, Frame *frame, uint64_t sequence);
+    void capture_frames_publish_prepared(int device, Frame *frame);
+
+    // For when capture is stopping. Consumers get no more frames from the
+    // device, so the only ones left are those they're already holding.
+    void capture_frames_withdraw(int device);
+
+    void capture_frames_log_stats(int device);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // INCLUDE_CAPTURE_FRAMES_H
@@ -0,0 +1,162 @@
+#include "acutest.h"
+
+#include "capture_frames.c"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "convert_pool.h"
+
+#define TEST_WIDTH 640
+#define TEST_HEIGHT 480
+#define TEST_YUYV_STRIDE (TEST_WIDTH * 2)
+#define TEST_RGBA_STRIDE (TEST_WIDTH * 4)
+#define TEST_DEVICE_COUNT 2
+#define TEST_CHECK_COUNT 200
+
+// Converts through a pool shared by every device, the way capture_main.c does.
+static void convert_yuyv(void* context, const Frame* source, uint8_t* output, Frame* converted) {
+  ConvertPool* pool = (ConvertPool*)(context);
+  convert_pool_yuyv_to_rgba(pool, source->data, source->stride, output, TEST_RGBA_STRIDE, source->width,
+    source->height, YUV_MATRIX_BT601, YUV_RANGE_LIMITED);
+  converted->width = source->width;
+  converted->height = source->height;
+  converted->stride = TEST_RGBA_STRIDE;
+  converted->format = FRAME_FORMAT_RGBA;
+  converted->timestamp_ns = source->timestamp_ns;
+}
+
+// Every byte of a frame is the same, and that value is its timestamp, so each
+// converted frame should be a single colour that can be worked out from it.
+static void publish_filled(int device, uint8_t value) {
+  Frame* frame;
+  uint8_t* buffer = frame_store_begin(capture_frames_store(device), &frame);
+  if (buffer == NULL) {
+    sched_yield();
+    return;
+  }
+  memset(buffer, value, TEST_YUYV_STRIDE * TEST_HEIGHT);
+  frame->width = TEST_WIDTH;
+  frame->height = TEST_HEIGHT;
+  frame->stride = TEST_YUYV_STRIDE;
+  frame->format = FRAME_FORMAT_YUYV;
+  frame->timestamp_ns = value;
+  capture_frames_publish(device, frame);
+}
+
+typedef struct {
+  int device;
+  _Atomic bool* done;
+  _Atomic int frames_checked;
+  int mismatches;
+} ConsumerArgs;
+
+static void* consume(void* cookie) {
+  ConsumerArgs* args = (ConsumerArgs*)(cookie);
+  while (!atomic_load(args->done)) {
+    const Frame* frame = get_latest_device_rgb_frame(args->device);
+    if (frame == NULL) {
+      continue;
+    }
+    const uint8_t value = (uint8_t)(frame->timestamp_ns);
+    const uint8_t yuyv[4] = {value, value, value, value};
+    uint8_t expected[8];
+    yuyv_to_rgba(yuyv, 4, expected, 8, 2, 1, YUV_MATRIX_BT601, YUV_RANGE_LIMITED);
+    bool matches = true;
+    for (int y = 0; y < frame->height; ++y) {
+      const uint8_t* row = frame->data + (y * frame->stride);
+      for (int x = 0; x < frame->width; ++x) {
+        matches = matches && (memcmp(row + (x * 4), expected, 4) == 0);
+      }
+    }
+    atomic_fetch_add(&args->frames_checked, 1);
+    args->mismatches += matches ? 0 : 1;
+    frame_release(frame);
+  }
+  return NULL;
+}
+
+void test_capture_frames_concurrent_rgb_devices() {
+  ConvertPool* pool = convert_pool_alloc(4);
+  TEST_ASSERT(pool != NULL);
+  for (int device = 0; device < TEST_DEVICE_COUNT; ++device) {
+    TEST_ASSERT(capture_frames_init(device, TEST_YUYV_STRIDE * TEST_HEIGHT));
+    TEST_ASSERT(capture_frames_init_conversion(device, TEST_RGBA_STRIDE * TEST_HEIGHT, convert_yuyv, pool));
+  }
+  TEST_CHECK(get_capture_device_count() == TEST_DEVICE_COUNT);
+
+  // Each device has its own consumer, so their conversions overlap on the pool.
+  _Atomic bool done = false;
+  pthread_t threads[TEST_DEVICE_COUNT];
+  ConsumerArgs args[TEST_DEVICE_COUNT];
+  for (int device = 0; device < TEST_DEVICE_COUNT; ++device) {
+    args[device] = (ConsumerArgs){device, &done, 0, 0};
+    TEST_ASSERT(pthread_create(&threads[device], NULL, consume, &args[device]) == 0);
+  }
+  bool checked_enough = false;
+  for (int i = 0; !checked_enough; ++i) {
+    for (int device = 0; device < TEST_DEVICE_COUNT; ++device) {
+      // Different values for each device, so bands converted from the wrong
+      // device's frame would show up.
+      publish_filled(device, (uint8_t)((i * 2) + (device * 101)));
+    }
+    // Gives the consumers a chance to run even on a single CPU.
+    sched_yield();
+    checked_enough = true;
+    for (int device = 0; device < TEST_DEVICE_COUNT; ++device) {
+      checked_enough = checked_enough && (atomic_load(&args[device].frames_checked) >= TEST_CHECK_COUNT);
+    }
+  }
+  atomic_store(&done, true);
+  for (int device = 0; device < TEST_DEVICE_COUNT; ++device) {
+    pthread_join(threads[device], NULL);
+    TEST_CHECK(args[device].mismatches == 0);
+    TEST_MSG("device %d: %d of %d frames mismatched", device, args[device].mismatches,
+      atomic_load(&args[device].frames_checked));
+  }
+  convert_pool_free(pool);
+}
+
+void test_capture_frames_latest_capture_copy() {
+  // A device of its own, with RGBA frames published as they are.
+  const int device = TEST_DEVICE_COUNT;
+  const int width = 4;
+  const int height = 3;
+  const int stride = 24;
+  TEST_ASSERT(capture_frames_init(device, stride * height));
+  Frame* frame;
+  uint8_t* buffer = frame_store_begin(capture_frames_store(device), &frame);
+  TEST_ASSERT(buffer != NULL);
+  for (int i = 0; i < (stride * height); ++i) {
+    buffer[i] = (uint8_t)(i);
+  }
+  frame->width = width;
+  frame->height = height;
+  frame->stride = stride;
+  frame->format = FRAME_FORMAT_RGBA;
+  capture_frames_publish(device, frame);
+
+  // Callers get a packed copy they're free to write to and free().
+  int copy_width;
+  int copy_height;
+  uint8_t* copy;
+  TEST_ASSERT(get_latest_device_capture(device, &copy_width, &copy_height, &copy));
+  TEST_CHECK(copy_width == width);
+  TEST_CHECK(copy_height == height);
+  for (int y = 0; y < height; ++y) {
+    TEST_CHECK(memcmp(copy + (y * width * 4), buffer + (y * stride), width * 4) == 0);
+  }
+  memset(copy, 0, width * height * 4);
+  free(copy);
+
+  const Frame* latest = get_latest_device_frame(device);
+  TEST_ASSERT(latest != NULL);
+  TEST_CHECK(latest->data[1] == 1);
+  frame_release(latest);
+}
+
+TEST_LIST = {
+  {"capture_frames_concurrent_rgb_devices", test_capture_frames_concurrent_rgb_devices},
+  {"capture_frames_latest_capture_copy", test_capture_frames_latest_capture_copy},
+  {NULL, NULL},
+};
@@ -0,0 +1,104 @@
+#include "capture_leases.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "time_utils.h"
+
+struct CaptureLeasesStruct
+{
+    CaptureSource *source;
+    int lease_count;
+    int reserve_count;
+    int64_t late_ns;
+    // Written by the capture thread when a buffer is leased, and read by the
+    // thread returning it, which the frame's reference count orders.
+    int64_t *leased_at_ns;
+    _Atomic int outstanding;
+    _Atomic uint64_t leased;
+    _Atomic uint64_t starved;
+    _Atomic uint64_t late;
+};
+
+CaptureLeases *capture_leases_alloc(CaptureSource *source, int reserve_count, int64_t late_ns)
+{
+    CaptureLeases *leases = calloc(1, sizeof(CaptureLeases));
+    if (leases == NULL)
+    {
+        return NULL;
+    }
+    leases->source = source;
+    leases->lease_count = capture_source_lease_count(source);
+    leases->reserve_count = reserve_count;
+    leases->late_ns = late_ns;
+    if (leases->lease_count > 0)
+    {
+        leases->leased_at_ns = calloc(leases->lease_count, sizeof(int64_t));
+        if (leases->leased_at_ns == NULL)
+        {
+            free(leases);
+            return NULL;
+        }
+    }
+    atomic_init(&leases->outstanding, 0);
+    atomic_init(&leases->leased, 0);
+    atomic_init(&leases->starved, 0);
+    atomic_init(&leases->late, 0);
+    return leases;
+}
+
+void capture_leases_free(CaptureLeases *leases)
+{
+    if (leases == NULL)
+    {
+        return;
+    }
+    free(leases->leased_at_ns);
+    free(leases);
+}
+
+int capture_leases_count(const CaptureLeases *leases)
+{
+    return leases->lease_count;
+}
+
+bool capture_leases_begin(CaptureLeases *leases, const CaptureBuffer *buffer)
+{
+    if (leases->lease_count == 0)
+    {
+        return false;
+    }
+    // Only this thread adds leases, so the count can only have gone down by
+    // the time the lease is taken.
+    const int outstanding = atomic_load_explicit(&leases->outstanding, memory_order_relaxed);
+    // The buffer we've just dequeued isn't with the source either.
+    if ((leases->lease_count - outstanding - 1) < leases->reserve_count)
+    {
+        atomic_fetch_add_explicit(&leases->starved, 1, memory_order_relaxed);
+        return false;
+    }
+    leases->leased_at_ns[buffer->index] = time_monotonic_ns();
+    atomic_fetch_add_explicit(&leases->outstanding, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&leases->leased, 1, memory_order_relaxed);
+    return true;
+}
+
+void capture_leases_return(void *context, int index)
+{
+    CaptureLeases *leases = (CaptureLeases *)(context);
+    if ((time_monotonic_ns() - leases->leased_at_ns[index]) > leases->late_ns)
+    {
+        atomic_fetch_add_explicit(&leases->late, 1, memory_order_relaxed);
+    }
+    const CaptureBuffer buffer = {.index = index};
+    capture_source_requeue(leases->source, &buffer);
+    atomic_fetch_sub_explicit(&leases->outstanding, 1, memory_order_relaxed);
+}
+
+void capture_leases_get_stats(CaptureLeases *leases, CaptureLeaseStats *stats)
+{
+    stats->leased = atomic_load_explicit(&leases->leased, memory_order_relaxed);
+    stats->starved = atomic_load_explicit(&leases->starved, memory_order_relaxed);
+    stats->late = atomic_load_explicit(&leases->late, memory_order_relaxed);
+    stats->outstanding = atomic_load_explicit(&leases->outstanding, memory_order_relaxed);
+}
@@ -0,0 +1,59 @@
+#ifndef INCLUDE_CAPTURE_LEASES_H
+#define INCLUDE_CAPTURE_LEASES_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "capture_source.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    // Keeps track of which of a source's buffers have been lent to consumers
+    // as frames, so they can be read where the driver wrote them instead of
+    // being copied out. A buffer is only requeued once its frame's last
+    // reference is released, and lending always leaves the source a reserve
+    // of buffers to keep capturing into.
+    typedef struct CaptureLeasesStruct CaptureLeases;
+
+    typedef struct
+    {
+        // Buffers lent out since the start.
+        uint64_t leased;
+        // Buffers that had to be copied because lending them would have left
+        // the source with less than its reserve.
+        uint64_t starved;
+        // Leases that were held for longer than the late threshold.
+        uint64_t late;
+        // Leases held right now.
+        int outstanding;
+    } CaptureLeaseStats;
+
+    // Leases that last longer than late_ns are counted as late requeues.
+    CaptureLeases *capture_leases_alloc(CaptureSource *source, int reserve_count, int64_t late_ns);
+    // Every lease must have been returned first.
+    void capture_leases_free(CaptureLeases *leases);
+
+    // How many buffers could ever be leased at once, which is zero if the
+    // source can't lend its buffers at all.
+    int capture_leases_count(const CaptureLeases *leases);
+
+    // Capture thread side. Returns true if the dequeued buffer is now leased,
+    // and must only be requeued by capture_leases_return(). Otherwise the
+    // caller should copy what it needs and requeue the buffer as usual.
+    bool capture_leases_begin(CaptureLeases *leases, const CaptureBuffer *buffer);
+
+    // Requeues a leased buffer, from whichever thread is done with it. The
+    // context is the CaptureLeases, so this can be handed straight to
+    // frame_store_alloc_with_leases().
+    void capture_leases_return(void *context, int index);
+
+    void capture_leases_get_stats(CaptureLeases *leases, CaptureLeaseStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // INCLUDE_CAPTURE_LEASES_H
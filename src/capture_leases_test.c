@@ -0,0 +1,116 @@
+#include "acutest.h"
+
+#include "capture_leases.c"
+
+#include <pthread.h>
+#include <string.h>
+
+#define FAKE_BUFFER_COUNT 6
+
+// Just enough of a source to see what gets requeued.
+typedef struct {
+  CaptureSource base;
+  int lease_count;
+  _Atomic int requeued[FAKE_BUFFER_COUNT];
+} FakeSource;
+
+static void fake_requeue(CaptureSource* base, const CaptureBuffer* buffer) {
+  FakeSource* source = (FakeSource*)(base);
+  atomic_fetch_add(&source->requeued[buffer->index], 1);
+}
+
+static int fake_lease_count(CaptureSource* base) {
+  return ((FakeSource*)(base))->lease_count;
+}
+
+static const CaptureSourceOps fake_ops = {
+  .name = "fake",
+  .requeue = fake_requeue,
+  .lease_count = fake_lease_count,
+};
+
+static void init_fake_source(FakeSource* source, int lease_count) {
+  memset(source, 0, sizeof(*source));
+  source->base.ops = &fake_ops;
+  source->lease_count = lease_count;
+}
+
+static CaptureBuffer make_buffer(int index) {
+  CaptureBuffer buffer;
+  memset(&buffer, 0, sizeof(buffer));
+  buffer.index = index;
+  return buffer;
+}
+
+void test_capture_leases_reserve() {
+  FakeSource source;
+  init_fake_source(&source, FAKE_BUFFER_COUNT);
+  CaptureLeases* leases = capture_leases_alloc(&source.base, 2, 1000000000);
+  TEST_ASSERT(leases != NULL);
+  TEST_CHECK(capture_leases_count(leases) == FAKE_BUFFER_COUNT);
+
+  // Six buffers with two kept back for the driver means four can be out at
+  // once.
+  for (int i = 0; i < 4; ++i) {
+    const CaptureBuffer buffer = make_buffer(i);
+    TEST_CHECK(capture_leases_begin(leases, &buffer));
+  }
+  const CaptureBuffer refused = make_buffer(4);
+  TEST_CHECK(!capture_leases_begin(leases, &refused));
+  CaptureLeaseStats stats;
+  capture_leases_get_stats(leases, &stats);
+  TEST_CHECK(stats.leased == 4);
+  TEST_CHECK(stats.starved == 1);
+  TEST_CHECK(stats.outstanding == 4);
+  // Nothing is requeued until a lease comes back.
+  TEST_CHECK(atomic_load(&source.requeued[0]) == 0);
+
+  capture_leases_return(leases, 1);
+  TEST_CHECK(atomic_load(&source.requeued[1]) == 1);
+  TEST_CHECK(capture_leases_begin(leases, &refused));
+
+  capture_leases_return(leases, 0);
+  capture_leases_return(leases, 2);
+  capture_leases_return(leases, 3);
+  capture_leases_return(leases, 4);
+  capture_leases_get_stats(leases, &stats);
+  TEST_CHECK(stats.outstanding == 0);
+  TEST_CHECK(stats.late == 0);
+  capture_leases_free(leases);
+}
+
+void test_capture_leases_late() {
+  FakeSource source;
+  init_fake_source(&source, FAKE_BUFFER_COUNT);
+  // Anything held at all is late.
+  CaptureLeases* leases = capture_leases_alloc(&source.base, 2, -1);
+  const CaptureBuffer buffer = make_buffer(4);
+  TEST_CHECK(capture_leases_begin(leases, &buffer));
+  capture_leases_return(leases, 4);
+  CaptureLeaseStats stats;
+  capture_leases_get_stats(leases, &stats);
+  TEST_CHECK(stats.late == 1);
+  capture_leases_free(leases);
+}
+
+void test_capture_leases_unsupported() {
+  FakeSource source;
+  init_fake_source(&source, 0);
+  CaptureLeases* leases = capture_leases_alloc(&source.base, 2, 0);
+  TEST_ASSERT(leases != NULL);
+  TEST_CHECK(capture_leases_count(leases) == 0);
+  const CaptureBuffer buffer = make_buffer(0);
+  TEST_CHECK(!capture_leases_begin(leases, &buffer));
+  // Sources that can't lend aren't starved, they just always copy.
+  CaptureLeaseStats stats;
+  capture_leases_get_stats(leases, &stats);
+  TEST_CHECK(stats.starved == 0);
+  capture_leases_free(leases);
+}
+
+TEST_LIST = {
+  {"capture_leases_reserve", test_capture_leases_reserve},
+  {"capture_leases_late", test_capture_leases_late},
+  {"capture_leases_unsupported", test_capture_leases_unsupported},
+  {NULL, NULL},
+};
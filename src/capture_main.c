@@ -1,64 +1,147 @@
+// For pthread_setaffinity_np().
+#define _GNU_SOURCE
+
 #include "capture_main.h"
 
-#include <assert.h>
 #include <errno.h>
-#include <fcntl.h>  /* low-level i/o */
 #include <getopt.h> /* getopt_long() */
-#include <linux/videodev2.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/ioctl.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <sys/time.h>
-#include <sys/types.h>
-#include <unistd.h>
 
 #include "app_main.h"
+#include "capture_frames.h"
+#include "capture_leases.h"
+#include "capture_reactor.h"
+#include "capture_source.h"
+#include "convert_pool.h"
+#include "frame_latency.h"
 #include "lodepng.h"
+#include "metrics.h"
+#include "ordered_stage.h"
 #include "string_utils.h"
+#include "synthetic_source.h"
+#include "time_utils.h"
 #include "trace.h"
+#include "v4l2_source.h"
+#include "yuv_convert.h"
 
-#define CLEAR(x) memset(&(x), 0, sizeof(x))
-
-#ifndef V4L2_PIX_FMT_H264
-#define V4L2_PIX_FMT_H264 \
-    v4l2_fourcc('H', '2', '6', '4') /* H264 with start codes */
-#endif
-
-enum io_method
-{
-    IO_METHOD_READ,
-    IO_METHOD_MMAP,
-    IO_METHOD_USERPTR,
-};
+#define DEFAULT_DEV_NAME "/dev/video0"
 
-struct buffer
-{
-    void *start;
-    size_t length;
-};
-
-static char *dev_name;
-static enum io_method io = IO_METHOD_READ;
-static int fd = -1;
-struct buffer *buffers;
-static unsigned int n_buffers;
+// Given once for each camera to capture from, or just the default one.
+static const char *dev_names[CAPTURE_REACTOR_MAX_DEVICES];
+static int dev_name_count = 0;
+static V4l2SourceIo io = V4L2_SOURCE_IO_READ;
 static int out_buf;
 static int force_format = true;
-static int frame_count = 2;
-static int frame_number = 0;
-
-static pthread_mutex_t g_frame_mutex = PTHREAD_MUTEX_INITIALIZER;
-uint8_t *g_frame_buffer = NULL;
-const int frame_width = 640;
-const int frame_height = 480;
+// Capture stops once every device has given us this many frames, unless it's
+// zero.
+static int frame_count = 0;
+static YuvMatrix yuv_matrix = YUV_MATRIX_BT601;
+static YuvRange yuv_range = YUV_RANGE_LIMITED;
+// BGRA by default, since that's what GPUs keep textures in, so the display can
+// upload frames without the driver swizzling them.
+static FrameFormat output_format = FRAME_FORMAT_BGRA;
+
+// Zero means one conversion thread per CPU. The threads are shared by every
+// device.
+static int convert_thread_count = 0;
+static ConvertPool *convert_pool = NULL;
+
+// If set, frames come from generated test patterns instead of cameras.
+static bool use_test_pattern = false;
+static SyntheticPattern test_pattern = SYNTHETIC_PATTERN_BARS;
+static FrameFormat test_pattern_format = FRAME_FORMAT_YUYV;
+static int test_pattern_count = 1;
+
+// CPUs to keep threads on: the capture thread on the first, then each
+// device's workers on the next, going round again if there are more devices
+// than CPUs. Nothing is pinned if the list is empty.
+static int pin_cpus[CAPTURE_REACTOR_MAX_DEVICES + 1];
+static int pin_cpu_count = 0;
+
+// Buffers the driver is always left to capture into, however many frames
+// consumers hold on to: one being filled and one queued behind it.
+#define CAPTURE_LEASE_RESERVE 2
+
+// Copying frames and handing them to the renderer happens on a few workers
+// for each device, which is plenty for memory-bound copies, with room for a
+// couple of frames each to queue up behind them before new ones are dropped.
+#define CAPTURE_WORKER_COUNT 2
+#define CAPTURE_QUEUE_DEPTH 4
+
+// A camera that goes this long without a frame is restarted.
+#define CAPTURE_TIMEOUT_MS 2000
+static _Atomic(CaptureReactor *) capture_reactor = NULL;
+static _Atomic bool stop_requested = false;
+
+// What we ask every camera for. The closest mode each supports is used.
+static CaptureRequest capture_request = {640, 480, 30.0};
 
 const int rgba_bytes_per_pixel = 4;
-const int rgba_bytes_per_row = (frame_width * rgba_bytes_per_pixel);
-const int rgba_byte_count = (frame_height * frame_width * rgba_bytes_per_pixel);
+
+// Everything that belongs to one camera. Only the reactor thread and the
+// device's own workers touch it once capture has started, and consumers get
+// at its frames through the device's index.
+typedef struct
+{
+    int index;
+    CaptureSource *source;
+    // What the source actually gave us, filled in by capture_source_configure().
+    CaptureFormat format;
+    int rgba_bytes_per_row;
+    int rgba_byte_count;
+    CaptureLeases *leases;
+    OrderedStage *stage;
+    // Only sources that lend out their buffers keep them intact until they're
+    // requeued. Others, like read() I/O, reuse theirs on the next dequeue, so
+    // frames from them have to be copied before then.
+    bool copy_on_workers;
+    uint64_t next_frame_sequence;
+    int frame_number;
+    int dropped_frame_count;
+    int short_frame_count;
+    int backlog_frame_count;
+    // The driver's sequence number for the last frame, so gaps show up the
+    // frames it dropped.
+    bool has_driver_sequence;
+    uint32_t last_driver_sequence;
+    int driver_dropped_frame_count;
+} CaptureContext;
+
+static CaptureContext capture_contexts[CAPTURE_REACTOR_MAX_DEVICES];
+static int capture_context_count = 0;
+
+// Totals across every device, for the metrics snapshots.
+static Metric *frames_dequeued_metric;
+static Metric *frames_prepared_metric;
+static Metric *frames_published_metric;
+static Metric *frames_converted_metric;
+static Metric *frames_dropped_driver_metric;
+static Metric *frames_dropped_short_metric;
+static Metric *frames_dropped_no_buffer_metric;
+static Metric *frames_dropped_backlog_metric;
+static Metric *prepare_ns_metric;
+static Metric *convert_ns_metric;
+static Metric *capture_queue_depth_metric;
+
+static void register_metrics(void)
+{
+    frames_dequeued_metric = metrics_counter("frames_dequeued");
+    frames_prepared_metric = metrics_counter("frames_prepared");
+    frames_published_metric = metrics_counter("frames_published");
+    frames_converted_metric = metrics_counter("frames_converted");
+    frames_dropped_driver_metric = metrics_counter("frames_dropped_driver");
+    frames_dropped_short_metric = metrics_counter("frames_dropped_short");
+    frames_dropped_no_buffer_metric = metrics_counter("frames_dropped_no_buffer");
+    frames_dropped_backlog_metric = metrics_counter("frames_dropped_backlog");
+    prepare_ns_metric = metrics_counter("prepare_ns");
+    convert_ns_metric = metrics_counter("convert_ns");
+    capture_queue_depth_metric = metrics_gauge("capture_queue_depth");
+}
 
 static void errno_exit(const char *s)
 {
@@ -66,115 +149,55 @@ static void errno_exit(const char *s)
     exit(EXIT_FAILURE);
 }
 
-static int xioctl(int fh, int request, void *arg)
+static void convert_image(const CaptureContext *capture, const uint8_t *data, uint8_t *rgba_buffer)
 {
-    int r;
-
-    do
+    const int width = capture->format.width;
+    const int height = capture->format.height;
+    const int stride = capture->format.stride;
+    const int rgba_bytes_per_row = capture->rgba_bytes_per_row;
+    const uint8_t *chroma = data + (stride * height);
+    const bool bgra = (output_format == FRAME_FORMAT_BGRA);
+
+    switch (capture->format.format)
     {
-        r = ioctl(fh, request, arg);
-    } while (-1 == r && EINTR == errno);
-
-    return r;
-}
-
-static void process_image(const void *yuyv_buffer, int yuyv_byte_count)
-{
-    frame_number++;
+    case FRAME_FORMAT_YUYV:
+        (bgra ? convert_pool_yuyv_to_bgra : convert_pool_yuyv_to_rgba)(
+            convert_pool, data, stride, rgba_buffer, rgba_bytes_per_row, width, height, yuv_matrix, yuv_range);
+        break;
 
-    const int yuyv_bytes_per_pixel = 2;
-    const int yuyv_bytes_per_row = (frame_width * yuyv_bytes_per_pixel);
-    const int expected_yuyv_byte_count = (frame_height * frame_width * yuyv_bytes_per_pixel);
-    assert(yuyv_byte_count == expected_yuyv_byte_count);
+    case FRAME_FORMAT_NV12:
+        (bgra ? convert_pool_nv12_to_bgra : convert_pool_nv12_to_rgba)(convert_pool, data, stride, chroma, stride,
+                                                                        rgba_buffer, rgba_bytes_per_row, width,
+                                                                        height, yuv_matrix, yuv_range);
+        break;
 
-    uint8_t *rgba_buffer = calloc(1, rgba_byte_count);
+    case FRAME_FORMAT_I420:
+        (bgra ? convert_pool_i420_to_bgra : convert_pool_i420_to_rgba)(
+            convert_pool, data, stride, chroma, chroma + ((stride / 2) * ((height + 1) / 2)), stride / 2,
+            rgba_buffer, rgba_bytes_per_row, width, height, yuv_matrix, yuv_range);
+        break;
 
-    for (int y = 0; y < frame_height; ++y)
-    {
-        const uint8_t *yuyv_row = yuyv_buffer + (y * yuyv_bytes_per_row);
-        uint8_t *rgba_row = rgba_buffer + (y * rgba_bytes_per_row);
-        for (int x = 0; x < frame_width; x += 2)
-        {
-            const uint8_t *yuyv_pixel0 = yuyv_row + (x * yuyv_bytes_per_pixel);
-            const uint8_t *yuyv_pixel1 = yuyv_pixel0 + yuyv_bytes_per_pixel;
-            const int y0 = (yuyv_pixel0[0] - 16) * 1.164f;
-            const int u = yuyv_pixel0[1] - 128;
-            const int y1 = (yuyv_pixel1[0] - 16) * 1.164f;
-            const int v = yuyv_pixel1[1] - 128;
-            int r0 = y0 + (1.596f * v);
-            if (r0 < 0)
-            {
-                r0 = 0;
-            }
-            else if (r0 > 255)
-            {
-                r0 = 255;
-            }
-            int g0 = y0 + (-0.392f * u) + (-0.813f * v);
-            if (g0 < 0)
-            {
-                g0 = 0;
-            }
-            else if (g0 > 255)
-            {
-                g0 = 255;
-            }
-            int b0 = y0 + (2.017f * u);
-            if (b0 < 0)
-            {
-                b0 = 0;
-            }
-            else if (b0 > 255)
-            {
-                b0 = 255;
-            }
-            const uint8_t a0 = 255;
-            int r1 = y1 + (1.596 * v);
-            if (r1 < 0)
-            {
-                r1 = 0;
-            }
-            else if (r1 > 255)
-            {
-                r1 = 255;
-            }
-            int g1 = y1 + (-0.392f * u) + (-0.813f * v);
-            if (g1 < 0)
-            {
-                g1 = 0;
-            }
-            else if (g1 > 255)
-            {
-                g1 = 255;
-            }
-            int b1 = y1 + (2.017f * u);
-            if (b1 < 0)
-            {
-                b1 = 0;
-            }
-            else if (b1 > 255)
-            {
-                b1 = 255;
-            }
-            const uint8_t a1 = 255;
-            uint8_t *rgba_pixel0 = rgba_row + (x * rgba_bytes_per_pixel);
-            uint8_t *rgba_pixel1 = rgba_pixel0 + rgba_bytes_per_pixel;
-            rgba_pixel0[0] = r0;
-            rgba_pixel0[1] = g0;
-            rgba_pixel0[2] = b0;
-            rgba_pixel0[3] = a0;
-            rgba_pixel1[0] = r1;
-            rgba_pixel1[1] = g1;
-            rgba_pixel1[2] = b1;
-            rgba_pixel1[3] = a1;
-        }
+    default:
+        fprintf(stderr, "Can't convert %s frames\n", frame_format_name(capture->format.format));
+        exit(EXIT_FAILURE);
     }
+}
+
+// Only called when a consumer asks for an RGB version of a frame, so frames
+// that are only drawn, or that nobody looks at, are never converted here.
+static void convert_frame(void *context, const Frame *source, uint8_t *output, Frame *converted)
+{
+    TRACE_SCOPE("convert frame");
+    const CaptureContext *capture = (const CaptureContext *)(context);
+    const int64_t start_ns = time_monotonic_ns();
+    convert_image(capture, source->data, output);
+    metrics_add(convert_ns_metric, time_monotonic_ns() - start_ns);
+    metrics_add(frames_converted_metric, 1);
 
     if (false)
     {
-        char *filename = string_alloc_sprintf("frame-%d.png", frame_number);
-        const unsigned int encode_error =
-            lodepng_encode32_file(filename, rgba_buffer, frame_width, frame_height);
+        char *filename = string_alloc_sprintf("frame-%llu.png", (unsigned long long)(source->sequence));
+        const unsigned int encode_error = lodepng_encode32_file(filename, output, source->width, source->height);
         if (encode_error)
         {
             printf("error %u: %s\n", encode_error, lodepng_error_text(encode_error));
@@ -182,530 +205,226 @@ static void process_image(const void *yuyv_buffer, int yuyv_byte_count)
         free(filename);
     }
 
-    pthread_mutex_lock(&g_frame_mutex);
-    free(g_frame_buffer);
-    g_frame_buffer = rgba_buffer;
-    pthread_mutex_unlock(&g_frame_mutex);
+    converted->width = source->width;
+    converted->height = source->height;
+    converted->stride = capture->rgba_bytes_per_row;
+    converted->format = output_format;
+    converted->timestamp_ns = source->timestamp_ns;
+    converted->driver_sequence = source->driver_sequence;
+    converted->dequeued_ns = source->dequeued_ns;
+    converted->prepared_ns = source->prepared_ns;
 }
 
-static int read_frame(void)
+static void describe_frame(const CaptureContext *capture, const CaptureBuffer *buffer, int64_t dequeued_ns,
+                           Frame *frame)
 {
-    struct v4l2_buffer buf;
-    unsigned int i;
-
-    switch (io)
-    {
-    case IO_METHOD_READ:
-        if (-1 == read(fd, buffers[0].start, buffers[0].length))
-        {
-            switch (errno)
-            {
-            case EAGAIN:
-                return 0;
-
-            case EIO:
-                /* Could ignore EIO, see spec. */
-
-                /* fall through */
-
-            default:
-                errno_exit("read");
-            }
-        }
-
-        process_image(buffers[0].start, buffers[0].length);
-        break;
-
-    case IO_METHOD_MMAP:
-        CLEAR(buf);
-
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-
-        if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf))
-        {
-            switch (errno)
-            {
-            case EAGAIN:
-                return 0;
-
-            case EIO:
-                /* Could ignore EIO, see spec. */
-
-                /* fall through */
-
-            default:
-                errno_exit("VIDIOC_DQBUF");
-            }
-        }
-
-        assert(buf.index < n_buffers);
-
-        process_image(buffers[buf.index].start, buf.bytesused);
-
-        if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-            errno_exit("VIDIOC_QBUF");
-        break;
-
-    case IO_METHOD_USERPTR:
-        CLEAR(buf);
-
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_USERPTR;
-
-        if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf))
-        {
-            switch (errno)
-            {
-            case EAGAIN:
-                return 0;
-
-            case EIO:
-                /* Could ignore EIO, see spec. */
-
-                /* fall through */
-
-            default:
-                errno_exit("VIDIOC_DQBUF");
-            }
-        }
-
-        for (i = 0; i < n_buffers; ++i)
-            if (buf.m.userptr == (unsigned long)buffers[i].start &&
-                buf.length == buffers[i].length)
-                break;
-
-        assert(i < n_buffers);
-
-        process_image((void *)buf.m.userptr, buf.bytesused);
-
-        if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-            errno_exit("VIDIOC_QBUF");
-        break;
-    }
-
-    return 1;
+    frame->width = capture->format.width;
+    frame->height = capture->format.height;
+    frame->stride = capture->format.stride;
+    frame->format = capture->format.format;
+    frame->yuv_matrix = yuv_matrix;
+    frame->yuv_range = yuv_range;
+    frame->timestamp_ns = buffer->timestamp_ns;
+    frame->driver_sequence = buffer->sequence;
+    frame->dequeued_ns = dequeued_ns;
 }
 
-static void mainloop(void)
+// Drivers number every frame they capture, so a jump means they dropped the
+// ones in between, usually because we'd left them without a buffer. Numbering
+// starts again from zero when a device restarts.
+static void count_driver_drops(CaptureContext *capture, uint32_t sequence)
 {
-    while (true)
+    if (capture->has_driver_sequence && (sequence > (capture->last_driver_sequence + 1)))
     {
-        for (;;)
-        {
-            fd_set fds;
-            struct timeval tv;
-            int r;
-
-            FD_ZERO(&fds);
-            FD_SET(fd, &fds);
-
-            /* Timeout. */
-            tv.tv_sec = 2;
-            tv.tv_usec = 0;
-
-            r = select(fd + 1, &fds, NULL, NULL, &tv);
-
-            if (-1 == r)
-            {
-                if (EINTR == errno)
-                    continue;
-                errno_exit("select");
-            }
-
-            if (0 == r)
-            {
-                fprintf(stderr, "select timeout\n");
-                exit(EXIT_FAILURE);
-            }
-
-            if (read_frame())
-                break;
-            /* EAGAIN - continue select loop. */
-        }
+        const uint32_t dropped = sequence - capture->last_driver_sequence - 1;
+        capture->driver_dropped_frame_count += dropped;
+        frame_latency_add_driver_drops(dropped);
+        metrics_add(frames_dropped_driver_metric, dropped);
+        TRACE_COUNTER("driver dropped frames", capture->driver_dropped_frame_count);
     }
+    capture->has_driver_sequence = true;
+    capture->last_driver_sequence = sequence;
 }
 
-static void stop_capturing(void)
+// Stops the reactor once every device has reached the frame count. The frame
+// that reaches it is still published, but nothing after it is dequeued.
+static void stop_at_frame_count(void)
 {
-    enum v4l2_buf_type type;
-
-    switch (io)
+    if (frame_count <= 0)
+        return;
+    for (int i = 0; i < capture_context_count; ++i)
     {
-    case IO_METHOD_READ:
-        /* Nothing to do. */
-        break;
-
-    case IO_METHOD_MMAP:
-    case IO_METHOD_USERPTR:
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        if (-1 == xioctl(fd, VIDIOC_STREAMOFF, &type))
-            errno_exit("VIDIOC_STREAMOFF");
-        break;
+        if (capture_contexts[i].frame_number < frame_count)
+            return;
     }
+    capture_main_stop();
 }
 
-static void start_capturing(void)
+// A captured frame on its way through the workers.
+typedef struct
 {
-    unsigned int i;
-    enum v4l2_buf_type type;
-
-    switch (io)
-    {
-    case IO_METHOD_READ:
-        /* Nothing to do. */
-        break;
-
-    case IO_METHOD_MMAP:
-        for (i = 0; i < n_buffers; ++i)
-        {
-            struct v4l2_buffer buf;
-
-            CLEAR(buf);
-            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-            buf.memory = V4L2_MEMORY_MMAP;
-            buf.index = i;
-
-            if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-                errno_exit("VIDIOC_QBUF");
-        }
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        if (-1 == xioctl(fd, VIDIOC_STREAMON, &type))
-            errno_exit("VIDIOC_STREAMON");
-        break;
-
-    case IO_METHOD_USERPTR:
-        for (i = 0; i < n_buffers; ++i)
-        {
-            struct v4l2_buffer buf;
-
-            CLEAR(buf);
-            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-            buf.memory = V4L2_MEMORY_USERPTR;
-            buf.index = i;
-            buf.m.userptr = (unsigned long)buffers[i].start;
-            buf.length = buffers[i].length;
-
-            if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-                errno_exit("VIDIOC_QBUF");
-        }
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        if (-1 == xioctl(fd, VIDIOC_STREAMON, &type))
-            errno_exit("VIDIOC_STREAMON");
-        break;
-    }
-}
-
-static void uninit_device(void)
+    CaptureBuffer buffer;
+    Frame *frame;
+    uint64_t sequence;
+    // Where the image still has to be copied to, or NULL if it's leased or has
+    // been copied already.
+    uint8_t *copy_to;
+} CaptureJob;
+
+// Runs on the workers, several frames at a time.
+static void process_job(void *context, void *item)
 {
-    unsigned int i;
-
-    switch (io)
+    TRACE_SCOPE("prepare frame");
+    CaptureContext *capture = (CaptureContext *)(context);
+    CaptureJob *job = (CaptureJob *)(item);
+    const int64_t start_ns = time_monotonic_ns();
+    if (job->copy_to != NULL)
     {
-    case IO_METHOD_READ:
-        free(buffers[0].start);
-        break;
-
-    case IO_METHOD_MMAP:
-        for (i = 0; i < n_buffers; ++i)
-            if (-1 == munmap(buffers[i].start, buffers[i].length))
-                errno_exit("munmap");
-        break;
-
-    case IO_METHOD_USERPTR:
-        for (i = 0; i < n_buffers; ++i)
-            free(buffers[i].start);
-        break;
+        memcpy(job->copy_to, job->buffer.data, frame_byte_count(job->frame));
+        capture_source_requeue(capture->source, &job->buffer);
     }
-
-    free(buffers);
+    job->frame->prepared_ns = time_monotonic_ns();
+    frame_latency_record(FRAME_LATENCY_PREPARED, job->frame->timestamp_ns, job->frame->prepared_ns);
+    metrics_add(prepare_ns_metric, job->frame->prepared_ns - start_ns);
+    metrics_add(frames_prepared_metric, 1);
+    capture_frames_prepare(capture->index, job->frame, job->sequence);
 }
 
-static void init_read(unsigned int buffer_size)
+// Runs once per frame, in the order they were captured.
+static void finish_job(void *context, void *item)
 {
-    buffers = calloc(1, sizeof(*buffers));
-
-    if (!buffers)
-    {
-        fprintf(stderr, "Out of memory\n");
-        exit(EXIT_FAILURE);
-    }
-
-    buffers[0].length = buffer_size;
-    buffers[0].start = malloc(buffer_size);
-
-    if (!buffers[0].start)
-    {
-        fprintf(stderr, "Out of memory\n");
-        exit(EXIT_FAILURE);
-    }
+    TRACE_SCOPE("publish frame");
+    CaptureContext *capture = (CaptureContext *)(context);
+    CaptureJob *job = (CaptureJob *)(item);
+    capture_frames_publish_prepared(capture->index, job->frame);
+    metrics_add(frames_published_metric, 1);
+    metrics_add(capture_queue_depth_metric, -1);
 }
 
-static void init_mmap(void)
+// Called by the reactor for every image, from any of the devices. This thread
+// only ever dequeues buffers and hands them on, so however long the workers
+// take over a frame, the next one is dequeued on time. Returns true if the
+// buffer will be requeued by someone else, either once it's been copied or
+// when its lease ends, instead of straight away.
+static bool submit_image(void *context, int device, const CaptureBuffer *buffer)
 {
-    struct v4l2_requestbuffers req;
-
-    CLEAR(req);
-
-    req.count = 4;
-    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_MMAP;
-
-    if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req))
-    {
-        if (EINVAL == errno)
-        {
-            fprintf(stderr,
-                    "%s does not support "
-                    "memory mapping\n",
-                    dev_name);
-            exit(EXIT_FAILURE);
-        }
-        else
-        {
-            errno_exit("VIDIOC_REQBUFS");
-        }
-    }
-
-    if (req.count < 2)
-    {
-        fprintf(stderr, "Insufficient buffer memory on %s\n", dev_name);
-        exit(EXIT_FAILURE);
-    }
-
-    buffers = calloc(req.count, sizeof(*buffers));
-
-    if (!buffers)
+    TRACE_SCOPE("submit image");
+    CaptureContext *capture = &capture_contexts[device];
+    FrameStore *store = capture_frames_store(capture->index);
+    capture->frame_number++;
+    stop_at_frame_count();
+    const int64_t dequeued_ns = time_monotonic_ns();
+    frame_latency_record(FRAME_LATENCY_DEQUEUED, buffer->timestamp_ns, dequeued_ns);
+    metrics_add(frames_dequeued_metric, 1);
+    count_driver_drops(capture, buffer->sequence);
+
+    // Drivers can hand back partial frames after an error, or when the format
+    // is compressed, so skip anything too small to hold a whole image.
+    if (buffer->bytes_used < capture->format.byte_count)
     {
-        fprintf(stderr, "Out of memory\n");
-        exit(EXIT_FAILURE);
+        capture->short_frame_count++;
+        metrics_add(frames_dropped_short_metric, 1);
+        return false;
     }
 
-    for (n_buffers = 0; n_buffers < req.count; ++n_buffers)
+    // Frames are published as they were captured. The display converts them
+    // in a shader, and anyone else wanting RGB gets them converted on demand.
+    // Where the driver allows, consumers read the frame in the buffer it was
+    // captured into, and it's only copied if they're holding on to so many
+    // that the driver would run out.
+    CaptureJob job = {.buffer = *buffer, .sequence = capture->next_frame_sequence};
+    const bool is_leased = capture_leases_begin(capture->leases, buffer);
+    if (is_leased)
     {
-        struct v4l2_buffer buf;
-
-        CLEAR(buf);
-
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index = n_buffers;
-
-        if (-1 == xioctl(fd, VIDIOC_QUERYBUF, &buf))
-            errno_exit("VIDIOC_QUERYBUF");
-
-        buffers[n_buffers].length = buf.length;
-        buffers[n_buffers].start =
-            mmap(NULL /* start anywhere */, buf.length,
-                 PROT_READ | PROT_WRITE /* required */,
-                 MAP_SHARED /* recommended */, fd, buf.m.offset);
-
-        if (MAP_FAILED == buffers[n_buffers].start)
-            errno_exit("mmap");
+        job.frame = frame_store_begin_lease(store, buffer->index, buffer->data);
     }
-}
-
-static void init_userp(unsigned int buffer_size)
-{
-    struct v4l2_requestbuffers req;
-
-    CLEAR(req);
-
-    req.count = 4;
-    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_USERPTR;
-
-    if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req))
+    else
     {
-        if (EINVAL == errno)
+        job.copy_to = frame_store_begin(store, &job.frame);
+        if (!job.copy_to)
         {
-            fprintf(stderr,
-                    "%s does not support "
-                    "user pointer i/o\n",
-                    dev_name);
-            exit(EXIT_FAILURE);
-        }
-        else
-        {
-            errno_exit("VIDIOC_REQBUFS");
+            // Consumers are holding on to every buffer we have.
+            capture->dropped_frame_count++;
+            metrics_add(frames_dropped_no_buffer_metric, 1);
+            return false;
         }
     }
-
-    buffers = calloc(4, sizeof(*buffers));
-
-    if (!buffers)
+    describe_frame(capture, buffer, dequeued_ns, job.frame);
+    if ((job.copy_to != NULL) && !capture->copy_on_workers)
     {
-        fprintf(stderr, "Out of memory\n");
-        exit(EXIT_FAILURE);
+        memcpy(job.copy_to, buffer->data, frame_byte_count(job.frame));
+        job.copy_to = NULL;
     }
 
-    for (n_buffers = 0; n_buffers < 4; ++n_buffers)
+    // Counted first, since the workers could finish it before we return.
+    metrics_add(capture_queue_depth_metric, 1);
+    if (!ordered_stage_submit(capture->stage, &job))
     {
-        buffers[n_buffers].length = buffer_size;
-        buffers[n_buffers].start = malloc(buffer_size);
-
-        if (!buffers[n_buffers].start)
-        {
-            fprintf(stderr, "Out of memory\n");
-            exit(EXIT_FAILURE);
-        }
+        metrics_add(capture_queue_depth_metric, -1);
+        // The workers have fallen behind, and waiting for them would leave
+        // the driver short of buffers, so this frame goes. Discarding a lease
+        // requeues its buffer.
+        capture->backlog_frame_count++;
+        metrics_add(frames_dropped_backlog_metric, 1);
+        frame_store_discard(store, job.frame);
+        return is_leased;
     }
+    capture->next_frame_sequence += 1;
+    return is_leased || (job.copy_to != NULL);
 }
 
-static void init_device(void)
+void capture_main_stop(void)
 {
-    struct v4l2_capability cap;
-    struct v4l2_cropcap cropcap;
-    struct v4l2_crop crop;
-    struct v4l2_format fmt;
-    unsigned int min;
-
-    if (-1 == xioctl(fd, VIDIOC_QUERYCAP, &cap))
-    {
-        if (EINVAL == errno)
-        {
-            fprintf(stderr, "%s is no V4L2 device\n", dev_name);
-            exit(EXIT_FAILURE);
-        }
-        else
-        {
-            errno_exit("VIDIOC_QUERYCAP");
-        }
-    }
-
-    if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE))
-    {
-        fprintf(stderr, "%s is no video capture device\n", dev_name);
-        exit(EXIT_FAILURE);
-    }
-
-    switch (io)
-    {
-    case IO_METHOD_READ:
-        if (!(cap.capabilities & V4L2_CAP_READWRITE))
-        {
-            fprintf(stderr, "%s does not support read i/o\n", dev_name);
-            exit(EXIT_FAILURE);
-        }
-        break;
-
-    case IO_METHOD_MMAP:
-    case IO_METHOD_USERPTR:
-        if (!(cap.capabilities & V4L2_CAP_STREAMING))
-        {
-            fprintf(stderr, "%s does not support streaming i/o\n", dev_name);
-            exit(EXIT_FAILURE);
-        }
-        break;
-    }
-
-    /* Select video input, video standard and tune here. */
-
-    CLEAR(cropcap);
-
-    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-
-    if (0 == xioctl(fd, VIDIOC_CROPCAP, &cropcap))
-    {
-        crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        crop.c = cropcap.defrect; /* reset to default */
-
-        if (-1 == xioctl(fd, VIDIOC_S_CROP, &crop))
-        {
-            switch (errno)
-            {
-            case EINVAL:
-                /* Cropping not supported. */
-                break;
-            default:
-                /* Errors ignored. */
-                break;
-            }
-        }
-    }
-    else
-    {
-        /* Errors ignored. */
-    }
-
-    CLEAR(fmt);
-
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (force_format)
-    {
-        fprintf(stderr, "Set YUYV\r\n");
-        fmt.fmt.pix.width = frame_width;             // replace
-        fmt.fmt.pix.height = frame_height;           // replace
-        fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV; // replace
-        fmt.fmt.pix.field = V4L2_FIELD_ANY;
-
-        if (-1 == xioctl(fd, VIDIOC_S_FMT, &fmt))
-            errno_exit("VIDIOC_S_FMT");
-
-        /* Note VIDIOC_S_FMT may change width and height. */
-    }
-    else
-    {
-        /* Preserve original settings as set by v4l2-ctl for example */
-        if (-1 == xioctl(fd, VIDIOC_G_FMT, &fmt))
-            errno_exit("VIDIOC_G_FMT");
-    }
-
-    /* Buggy driver paranoia. */
-    min = fmt.fmt.pix.width * 2;
-    if (fmt.fmt.pix.bytesperline < min)
-        fmt.fmt.pix.bytesperline = min;
-    min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
-    if (fmt.fmt.pix.sizeimage < min)
-        fmt.fmt.pix.sizeimage = min;
-
-    switch (io)
-    {
-    case IO_METHOD_READ:
-        init_read(fmt.fmt.pix.sizeimage);
-        break;
-
-    case IO_METHOD_MMAP:
-        init_mmap();
-        break;
-
-    case IO_METHOD_USERPTR:
-        init_userp(fmt.fmt.pix.sizeimage);
-        break;
-    }
+    atomic_store(&stop_requested, true);
+    CaptureReactor *reactor = atomic_load(&capture_reactor);
+    if (reactor != NULL)
+        capture_reactor_stop(reactor);
 }
 
-static void close_device(void)
+static bool frame_format_from_name(const char *name, FrameFormat *format)
 {
-    if (-1 == close(fd))
-        errno_exit("close");
-
-    fd = -1;
+    if (0 == strcmp(name, "yuyv"))
+        *format = FRAME_FORMAT_YUYV;
+    else if (0 == strcmp(name, "nv12"))
+        *format = FRAME_FORMAT_NV12;
+    else if (0 == strcmp(name, "yuv420"))
+        *format = FRAME_FORMAT_I420;
+    else
+        return false;
+    return true;
 }
 
-static void open_device(void)
+// Reads a comma separated list like "2,3,4" into pin_cpus.
+static bool pin_cpus_from_list(const char *list)
 {
-    struct stat st;
-
-    if (-1 == stat(dev_name, &st))
-    {
-        fprintf(stderr, "Cannot identify '%s': %d, %s\n", dev_name, errno,
-                strerror(errno));
-        exit(EXIT_FAILURE);
-    }
-
-    if (!S_ISCHR(st.st_mode))
+    pin_cpu_count = 0;
+    const char *next = list;
+    for (;;)
     {
-        fprintf(stderr, "%s is no device\n", dev_name);
-        exit(EXIT_FAILURE);
+        char *end;
+        errno = 0;
+        const long cpu = strtol(next, &end, 10);
+        if (errno || (end == next) || (cpu < 0) || (cpu >= CPU_SETSIZE) ||
+            (pin_cpu_count == (CAPTURE_REACTOR_MAX_DEVICES + 1)))
+            return false;
+        pin_cpus[pin_cpu_count++] = (int)(cpu);
+        if (*end == '\0')
+            return true;
+        if (*end != ',')
+            return false;
+        next = end + 1;
     }
+}
 
-    fd = open(dev_name, O_RDWR /* required */ | O_NONBLOCK, 0);
-
-    if (-1 == fd)
+static void pin_capture_thread(int cpu)
+{
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    const int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (error != 0)
     {
-        fprintf(stderr, "Cannot open '%s': %d, %s\n", dev_name, errno,
-                strerror(errno));
+        fprintf(stderr, "Couldn't pin the capture thread to CPU %d, error %d, %s\n", cpu, error, strerror(error));
         exit(EXIT_FAILURE);
     }
 }
@@ -716,19 +435,42 @@ static void usage(FILE *fp, int argc, char **argv)
             "Usage: %s [options]\n\n"
             "Version 1.3\n"
             "Options:\n"
-            "-d | --device name   Video device name [%s]\n"
+            "-d | --device name   Video device name, given again for each extra camera [%s]\n"
             "-h | --help          Print this message\n"
             "-m | --mmap          Use memory mapped buffers [default]\n"
             "-r | --read          Use read() calls\n"
             "-u | --userp         Use application allocated buffers\n"
             "-o | --output        Outputs stream to stdout\n"
-            "-f | --format        Force format to 640x480 YUYV\n"
-            "-c | --count         Number of frames to grab [%i]\n"
+            "-f | --format        Pick the closest YUV mode to --size and --fps [default]\n"
+            "-k | --keep-format   Keep the format already set, by v4l2-ctl for example\n"
+            "-s | --size          Frame size to ask for, as WIDTHxHEIGHT [%dx%d]\n"
+            "-p | --fps           Frame rate to ask for, or 0 for the fastest [%g]\n"
+            "-c | --count         Frames to grab from each device before stopping, or 0 for no limit [%i]\n"
+            "-e | --encoding      YUV matrix, bt601 or bt709 [bt601]\n"
+            "-l | --full-range    YUV data uses the full 0-255 range\n"
+            "-t | --test-pattern  Generate frames instead of using a camera, bars, noise or static\n"
+            "-y | --yuv-format    Test pattern layout, yuyv, nv12 or yuv420 [yuyv]\n"
+            "-n | --patterns      Number of test pattern devices [%d]\n"
+            "-j | --threads       Colour conversion threads, or 0 for one per CPU [%d]\n"
+            "-a | --rgba          Publish RGBA frames instead of BGRA\n"
+            "-C | --cpus list     CPUs to pin threads to, like 0,2,3: the capture thread's,\n"
+            "                     then each device's workers' in turn\n"
+            "--display gl|shm     Draw with OpenGL, or with X11 shared memory images [gl],\n"
+            "                     or use 'headless' to consume frames without drawing them\n"
+            "--swap-interval N    Vertical blanks per swap with OpenGL, or 0 to not wait for them\n"
+            "--finish             Wait for each OpenGL frame to go out before starting the next\n"
+            "--low-latency        As --finish, and draw the newest frame just before each vertical blank\n"
+            "--latency-report     Print how long each frame took from capture to the screen\n"
+            "--headless-fps N     How often the headless display takes frames, or 0 for every one [60]\n"
+            "--trace file         Record a Chrome trace of the pipeline, in builds made with TRACE=1\n"
+            "--metrics dest       Write metrics snapshots to a file, or to a unix:/path socket\n"
+            "--metrics-interval N Milliseconds between metrics snapshots [1000]\n"
             "",
-            argv[0], dev_name, frame_count);
+            argv[0], DEFAULT_DEV_NAME, capture_request.width, capture_request.height, capture_request.fps, frame_count,
+            test_pattern_count, convert_thread_count);
 }
 
-static const char short_options[] = "d:hmruofc:";
+static const char short_options[] = "d:hmruofks:p:c:e:lt:y:n:j:aC:";
 
 static const struct option long_options[] = {
     {"device", required_argument, NULL, 'd'},
@@ -738,16 +480,139 @@ static const struct option long_options[] = {
     {"userp", no_argument, NULL, 'u'},
     {"output", no_argument, NULL, 'o'},
     {"format", no_argument, NULL, 'f'},
+    {"keep-format", no_argument, NULL, 'k'},
+    {"size", required_argument, NULL, 's'},
+    {"fps", required_argument, NULL, 'p'},
     {"count", required_argument, NULL, 'c'},
+    {"encoding", required_argument, NULL, 'e'},
+    {"full-range", no_argument, NULL, 'l'},
+    {"test-pattern", required_argument, NULL, 't'},
+    {"yuv-format", required_argument, NULL, 'y'},
+    {"patterns", required_argument, NULL, 'n'},
+    {"threads", required_argument, NULL, 'j'},
+    {"rgba", no_argument, NULL, 'a'},
+    {"cpus", required_argument, NULL, 'C'},
     {0, 0, 0, 0}};
 
+// Opens and configures a camera, and gets everything ready for its frames to
+// be published under the next device index. Like any other setup error, a
+// camera that can't be used ends the process.
+static void open_device(CaptureSource *source)
+{
+    if (!source)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    CaptureContext *capture = &capture_contexts[capture_context_count];
+    capture->index = capture_context_count;
+    capture->source = source;
+    capture->next_frame_sequence = 1;
+
+    capture_source_open(source);
+    capture_source_configure(source, &capture_request, &capture->format);
+    capture->rgba_bytes_per_row = capture->format.width * rgba_bytes_per_pixel;
+    capture->rgba_byte_count = capture->rgba_bytes_per_row * capture->format.height;
+
+    fprintf(stderr, "Device %d capturing %dx%d %s from %s at %.2f fps, %d bytes per row, %d bytes per image\n",
+            capture->index, capture->format.width, capture->format.height, frame_format_name(capture->format.format),
+            capture_source_name(source), capture->format.fps, capture->format.stride, capture->format.byte_count);
+
+    // A lease counts as late if it's held for as long as the driver's spare
+    // buffers would last, since a few more like it would have starved it.
+    const int lease_count = capture_source_lease_count(source);
+    const int spare_count = (lease_count > CAPTURE_LEASE_RESERVE) ? (lease_count - CAPTURE_LEASE_RESERVE) : 0;
+    const double fps = (capture->format.fps > 0.0) ? capture->format.fps : 30.0;
+    const int64_t late_lease_ns = (int64_t)((1e9 / fps) * ((spare_count > 0) ? spare_count : 1));
+    capture->leases = capture_leases_alloc(source, CAPTURE_LEASE_RESERVE, late_lease_ns);
+    if (!capture->leases)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "Leasing up to %d of %d capture buffers to consumers\n", spare_count, lease_count);
+
+    if (!capture_frames_init_with_leases(capture->index, capture->format.byte_count, lease_count,
+                                         capture_leases_return, capture->leases) ||
+        !capture_frames_init_conversion(capture->index, capture->rgba_byte_count, convert_frame, capture))
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    capture->copy_on_workers = (lease_count > 0);
+    char stage_name[ORDERED_STAGE_NAME_SIZE];
+    snprintf(stage_name, sizeof(stage_name), "stage%d", capture->index);
+    capture->stage = ordered_stage_alloc_named(CAPTURE_WORKER_COUNT, CAPTURE_QUEUE_DEPTH, sizeof(CaptureJob),
+                                               process_job, finish_job, capture, stage_name);
+    if (!capture->stage)
+    {
+        fprintf(stderr, "Couldn't start the capture workers\n");
+        exit(EXIT_FAILURE);
+    }
+    if (pin_cpu_count > 0)
+    {
+        const int cpu = pin_cpus[(capture->index + 1) % pin_cpu_count];
+        if (!ordered_stage_pin_workers(capture->stage, cpu))
+        {
+            fprintf(stderr, "Couldn't pin the workers for device %d to CPU %d\n", capture->index, cpu);
+            exit(EXIT_FAILURE);
+        }
+        fprintf(stderr, "Device %d workers pinned to CPU %d\n", capture->index, cpu);
+    }
+    capture_context_count += 1;
+}
+
+// Called once the reactor has stopped, so nothing new is arriving. Lets the
+// workers finish the frames they have, then stops consumers getting any more.
+static void close_device(CaptureContext *capture)
+{
+    if (capture_context_count > 1)
+        fprintf(stderr, "Device %d, %s:\n", capture->index, capture_source_name(capture->source));
+    ordered_stage_log_stats(capture->stage, "Capture");
+    ordered_stage_free(capture->stage);
+    capture_frames_withdraw(capture->index);
+    capture_source_stop(capture->source);
+    capture_frames_log_stats(capture->index);
+    CaptureLeaseStats lease_stats;
+    capture_leases_get_stats(capture->leases, &lease_stats);
+    fprintf(stderr, "Leased %llu buffers, copied %llu to keep the driver supplied, %llu requeued late, %d still held\n",
+            (unsigned long long)(lease_stats.leased), (unsigned long long)(lease_stats.starved),
+            (unsigned long long)(lease_stats.late), lease_stats.outstanding);
+    // Consumers still holding leased frames are reading the source's
+    // buffers, and will requeue them through it when they're done.
+    if (lease_stats.outstanding == 0)
+        capture_source_free(capture->source);
+    else
+        fprintf(stderr, "Leaving the capture buffers mapped, since consumers are still holding %d of them\n",
+                lease_stats.outstanding);
+    if (capture->backlog_frame_count > 0)
+    {
+        fprintf(stderr, "Dropped %d frames because the capture workers were behind\n", capture->backlog_frame_count);
+    }
+    if (capture->dropped_frame_count > 0)
+    {
+        fprintf(stderr, "Dropped %d frames because every buffer was in use\n", capture->dropped_frame_count);
+    }
+    if (capture->driver_dropped_frame_count > 0)
+    {
+        fprintf(stderr, "The driver dropped %d frames, going by their sequence numbers\n",
+                capture->driver_dropped_frame_count);
+    }
+    if (capture->short_frame_count > 0)
+    {
+        fprintf(stderr, "Skipped %d frames that were smaller than %d bytes\n", capture->short_frame_count,
+                capture->format.byte_count);
+    }
+}
+
 void *capture_main(void *cookie)
 {
     Args *args = (Args *)(cookie);
     int argc = args->argc;
     char **argv = args->argv;
-
-    dev_name = "/dev/video0";
+    TRACE_THREAD_NAME("capture");
+    metrics_register_thread("capture");
+    register_metrics();
 
     for (;;)
     {
@@ -765,7 +630,12 @@ void *capture_main(void *cookie)
             break;
 
         case 'd':
-            dev_name = optarg;
+            if (dev_name_count == CAPTURE_REACTOR_MAX_DEVICES)
+            {
+                fprintf(stderr, "Can't capture from more than %d devices\n", CAPTURE_REACTOR_MAX_DEVICES);
+                exit(EXIT_FAILURE);
+            }
+            dev_names[dev_name_count++] = optarg;
             break;
 
         case 'h':
@@ -773,15 +643,15 @@ void *capture_main(void *cookie)
             exit(EXIT_SUCCESS);
 
         case 'm':
-            io = IO_METHOD_MMAP;
+            io = V4L2_SOURCE_IO_MMAP;
             break;
 
         case 'r':
-            io = IO_METHOD_READ;
+            io = V4L2_SOURCE_IO_READ;
             break;
 
         case 'u':
-            io = IO_METHOD_USERPTR;
+            io = V4L2_SOURCE_IO_USERPTR;
             break;
 
         case 'o':
@@ -789,44 +659,166 @@ void *capture_main(void *cookie)
             break;
 
         case 'f':
-            force_format++;
+            force_format = true;
+            break;
+
+        case 'k':
+            force_format = false;
+            break;
+
+        case 's':
+            if ((2 != sscanf(optarg, "%dx%d", &capture_request.width, &capture_request.height)) ||
+                (capture_request.width <= 0) || (capture_request.height <= 0))
+            {
+                usage(stderr, argc, argv);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'p':
+            errno = 0;
+            capture_request.fps = strtod(optarg, NULL);
+            if (errno || (capture_request.fps < 0.0))
+                errno_exit(optarg);
             break;
 
         case 'c':
             errno = 0;
             frame_count = strtol(optarg, NULL, 0);
-            if (errno)
+            if (errno || (frame_count < 0))
                 errno_exit(optarg);
             break;
 
+        case 'e':
+            if (0 == strcmp(optarg, "bt601"))
+                yuv_matrix = YUV_MATRIX_BT601;
+            else if (0 == strcmp(optarg, "bt709"))
+                yuv_matrix = YUV_MATRIX_BT709;
+            else
+            {
+                usage(stderr, argc, argv);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'l':
+            yuv_range = YUV_RANGE_FULL;
+            break;
+
+        case 't':
+            use_test_pattern = true;
+            if (!synthetic_pattern_from_name(optarg, &test_pattern))
+            {
+                usage(stderr, argc, argv);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'y':
+            if (!frame_format_from_name(optarg, &test_pattern_format))
+            {
+                usage(stderr, argc, argv);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'n':
+            errno = 0;
+            test_pattern_count = strtol(optarg, NULL, 0);
+            if (errno || (test_pattern_count < 1) || (test_pattern_count > CAPTURE_REACTOR_MAX_DEVICES))
+            {
+                usage(stderr, argc, argv);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'j':
+            errno = 0;
+            convert_thread_count = strtol(optarg, NULL, 0);
+            if (errno || (convert_thread_count < 0))
+                errno_exit(optarg);
+            break;
+
+        case 'a':
+            output_format = FRAME_FORMAT_RGBA;
+            break;
+
+        case 'C':
+            if (!pin_cpus_from_list(optarg))
+            {
+                usage(stderr, argc, argv);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
         default:
             usage(stderr, argc, argv);
             exit(EXIT_FAILURE);
         }
     }
 
-    open_device();
-    init_device();
-    start_capturing();
-    mainloop();
-    stop_capturing();
-    uninit_device();
-    close_device();
-    fprintf(stderr, "\n");
-    return 0;
-}
+    if (use_test_pattern)
+    {
+        for (int i = 0; i < test_pattern_count; ++i)
+            open_device(synthetic_source_alloc(test_pattern, test_pattern_format));
+    }
+    else
+    {
+        if (dev_name_count == 0)
+            dev_names[dev_name_count++] = DEFAULT_DEV_NAME;
+        for (int i = 0; i < dev_name_count; ++i)
+            open_device(v4l2_source_alloc(dev_names[i], io, force_format));
+    }
 
-bool get_latest_capture(int *width, int *height, uint8_t **rgba_buffer)
-{
-    *rgba_buffer = malloc(rgba_byte_count);
-    pthread_mutex_lock(&g_frame_mutex);
-    const bool has_data = (g_frame_buffer != NULL);
-    if (has_data)
+    // Every device converts on the same threads, taking turns. Bands are sized
+    // for each frame as it's converted, so the first device's are only logged
+    // as an example.
+    const CaptureContext *first = &capture_contexts[0];
+    convert_pool = convert_pool_alloc_named(convert_thread_count, "convert");
+    if (!convert_pool)
     {
-        memcpy(*rgba_buffer, g_frame_buffer, rgba_byte_count);
+        fprintf(stderr, "Couldn't start the conversion threads\n");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "Using %s %s %s-range YUV to %s conversion on demand on %d threads, %d rows per band\n",
+            yuv_kernel_name(yuv_best_kernel()), yuv_matrix_name(yuv_matrix), yuv_range_name(yuv_range),
+            frame_format_name(output_format), convert_pool_thread_count(convert_pool),
+            convert_pool_band_rows(convert_pool, first->format.stride + first->rgba_bytes_per_row,
+                                   first->format.height));
+
+    // Every device is serviced from this thread.
+    if (pin_cpu_count > 0)
+        pin_capture_thread(pin_cpus[0]);
+    CaptureReactor *reactor = capture_reactor_alloc(submit_image, NULL);
+    if (!reactor)
+    {
+        fprintf(stderr, "Couldn't create the capture reactor, error %d, %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
     }
-    pthread_mutex_unlock(&g_frame_mutex);
-    *width = frame_width;
-    *height = frame_height;
-    return has_data;
+    for (int i = 0; i < capture_context_count; ++i)
+    {
+        CaptureSource *source = capture_contexts[i].source;
+        capture_source_start(source);
+        // Devices are added in order, so the reactor's indices match ours.
+        if (i != capture_reactor_add(reactor, source, CAPTURE_TIMEOUT_MS))
+        {
+            fprintf(stderr, "Couldn't wait on %s, error %d, %s\n", capture_source_name(source), errno,
+                    strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    atomic_store(&capture_reactor, reactor);
+    if (atomic_load(&stop_requested))
+        capture_reactor_stop(reactor);
+    capture_reactor_run(reactor);
+    // The reactor is left allocated, since a late capture_main_stop() from a
+    // signal handler could still be on its way to it.
+    capture_reactor_log_stats(reactor);
+
+    for (int i = 0; i < capture_context_count; ++i)
+        close_device(&capture_contexts[i]);
+    convert_pool_free(convert_pool);
+    frame_latency_log_stats();
+    fprintf(stderr, "\n");
+    return 0;
 }
@@ -4,15 +4,63 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "frame_store.h"
+#include "upload_slots.h"
+
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
     void *capture_main(void *cookie);
+    // Asks capture_main() to stop capturing, release what it can and return.
+    // Safe to call from any thread, and from signal handlers.
+    void capture_main_stop(void);
+
+    // How many devices are capturing, or have been set up to. Consumers can
+    // ask for frames from each of them by index, counting from zero, and the
+    // functions that don't take a device use the first.
+    int get_capture_device_count(void);
+
+    // Returns a reference to the device's newest frame, or NULL if nothing
+    // has been captured from it yet. Any number of threads can hold frames at
+    // once without copying them, and each must frame_release() every frame it
+    // gets.
+    const Frame *get_latest_device_frame(int device);
+    const Frame *get_latest_frame(void);
+    // The same, but always RGBA or BGRA. Frames that were captured as YUV are
+    // converted on the first call that asks for them, and later calls for the
+    // same frame share the result. May return NULL if consumers are holding on
+    // to every converted frame.
+    const Frame *get_latest_device_rgb_frame(int device);
+    const Frame *get_latest_rgb_frame(void);
 
+    // Older interface to the newest frame, which costs an allocation and a
+    // full copy on every call. The caller owns the copy, and must free() it.
+    bool get_latest_device_capture(int device, int *width, int *height, uint8_t **rgba_buffer);
     bool get_latest_capture(int *width, int *height, uint8_t **rgba_buffer);
 
+    // Returns the newest frame, keeping hold of it until the next call for the
+    // same device, so the caller doesn't have to release anything. All calls
+    // for a device must come from the same consumer thread. The sequence
+    // number goes up by one for every frame captured from the device, and may
+    // be NULL if it's not needed.
+    bool borrow_latest_device_capture(int device, int *width, int *height, const uint8_t **rgba_buffer,
+                                      uint64_t *sequence);
+    bool borrow_latest_capture(int *width, int *height, const uint8_t **rgba_buffer, uint64_t *sequence);
+
+    // An eventfd that becomes readable whenever a new frame is captured from
+    // any device, so consumers can sleep in poll() alongside their other file
+    // descriptors instead of spinning. Reading eight bytes from it resets it.
+    // Returns -1 if it couldn't be created.
+    int get_capture_event_fd(void);
+
+    // Buffers a renderer can lend to the device's capture workers, so each new
+    // frame is copied straight into memory it can upload from. The renderer is
+    // the only consumer. Returns NULL if they couldn't be created.
+    UploadSlots *get_device_upload_slots(int device);
+    UploadSlots *get_capture_upload_slots(void);
+
 #ifdef __cplusplus
 }
 #endif
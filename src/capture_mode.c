@@ -0,0 +1,67 @@
+#include "capture_mode.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+// Added to the cost of any mode that falls short of the request, so that every
+// mode that meets it is preferred, however far over it goes.
+#define CAPTURE_MODE_SHORTFALL_COST 1e12
+
+// Frame rates are fractions, so allow a little slack when comparing them.
+#define CAPTURE_MODE_FPS_EPSILON 0.01
+
+double capture_mode_fps(const CaptureMode *mode)
+{
+    if ((mode->interval_numerator == 0) || (mode->interval_denominator == 0))
+    {
+        return 0.0;
+    }
+    return (double)(mode->interval_denominator) / (double)(mode->interval_numerator);
+}
+
+static double size_cost(const CaptureMode *mode, int width, int height)
+{
+    const double area = (double)(mode->width) * (double)(mode->height);
+    const double requested_area = (double)(width) * (double)(height);
+    if ((mode->width >= width) && (mode->height >= height))
+    {
+        return area - requested_area;
+    }
+    const double difference = area - requested_area;
+    return CAPTURE_MODE_SHORTFALL_COST + (difference < 0.0 ? -difference : difference);
+}
+
+static double fps_cost(const CaptureMode *mode, double fps)
+{
+    const double mode_fps = capture_mode_fps(mode);
+    if (fps <= 0.0)
+    {
+        return -mode_fps;
+    }
+    if (mode_fps >= (fps - CAPTURE_MODE_FPS_EPSILON))
+    {
+        return mode_fps - fps;
+    }
+    return CAPTURE_MODE_SHORTFALL_COST + (fps - mode_fps);
+}
+
+int capture_mode_choose(const CaptureMode *modes, int mode_count, int width, int height, double fps)
+{
+    int best_index = -1;
+    double best_size_cost = 0.0;
+    double best_fps_cost = 0.0;
+    for (int i = 0; i < mode_count; ++i)
+    {
+        const double current_size_cost = size_cost(&modes[i], width, height);
+        const double current_fps_cost = fps_cost(&modes[i], fps);
+        const bool is_better = (best_index == -1) || (current_size_cost < best_size_cost) ||
+                               ((current_size_cost == best_size_cost) && (current_fps_cost < best_fps_cost));
+        if (is_better)
+        {
+            best_index = i;
+            best_size_cost = current_size_cost;
+            best_fps_cost = current_fps_cost;
+        }
+    }
+    return best_index;
+}
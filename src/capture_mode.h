@@ -0,0 +1,39 @@
+#ifndef INCLUDE_CAPTURE_MODE_H
+#define INCLUDE_CAPTURE_MODE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    // One combination of pixel format, frame size and frame rate that a camera
+    // says it can deliver.
+    typedef struct
+    {
+        uint32_t pixel_format;
+        int width;
+        int height;
+        // Time between frames in seconds, as a fraction, the same way V4L2's
+        // timeperframe works. Both are zero if the driver didn't say.
+        uint32_t interval_numerator;
+        uint32_t interval_denominator;
+    } CaptureMode;
+
+    // Frames per second, or zero if the interval is unknown.
+    double capture_mode_fps(const CaptureMode *mode);
+
+    // Picks the mode that best matches the requested size and frame rate, and
+    // returns its index, or -1 if there are no modes. The closest size that's at
+    // least as big as the request wins, falling back to the closest in area if
+    // none are big enough. Among modes of that size, the closest rate that's at
+    // least as fast as the request wins, falling back to the fastest slower one.
+    // An fps of zero means any rate will do, and the fastest is picked.
+    int capture_mode_choose(const CaptureMode *modes, int mode_count, int width, int height, double fps);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // INCLUDE_CAPTURE_MODE_H
@@ -0,0 +1,88 @@
+#include "acutest.h"
+
+#include "capture_mode.c"
+
+#include <linux/videodev2.h>
+
+#define MODE(w, h, fps) {V4L2_PIX_FMT_YUYV, (w), (h), 1, (fps)}
+
+// A typical UVC webcam, listed in the same jumbled order drivers use.
+static const CaptureMode webcam_modes[] = {
+  MODE(1920, 1080, 30),
+  MODE(1920, 1080, 60),
+  MODE(640, 480, 30),
+  MODE(1280, 720, 120),
+  MODE(1280, 720, 60),
+  MODE(1280, 720, 30),
+  MODE(320, 240, 30),
+};
+static const int webcam_mode_count = sizeof(webcam_modes) / sizeof(webcam_modes[0]);
+
+static const CaptureMode* choose(int width, int height, double fps) {
+  const int index = capture_mode_choose(webcam_modes, webcam_mode_count, width, height, fps);
+  TEST_ASSERT(index >= 0);
+  return &webcam_modes[index];
+}
+
+void test_capture_mode_exact() {
+  const CaptureMode* mode = choose(1280, 720, 120);
+  TEST_CHECK(mode->width == 1280 && mode->height == 720);
+  TEST_CHECK(capture_mode_fps(mode) == 120.0);
+
+  mode = choose(1920, 1080, 60);
+  TEST_CHECK(mode->width == 1920 && mode->height == 1080);
+  TEST_CHECK(capture_mode_fps(mode) == 60.0);
+
+  mode = choose(640, 480, 30);
+  TEST_CHECK(mode->width == 640 && mode->height == 480);
+}
+
+void test_capture_mode_rounds_up() {
+  // No 800x600, so the next size up is the best fit.
+  const CaptureMode* mode = choose(800, 600, 30);
+  TEST_CHECK(mode->width == 1280 && mode->height == 720);
+  TEST_CHECK(capture_mode_fps(mode) == 30.0);
+
+  // 90fps isn't offered, but 120fps is faster, so it's better than 60fps.
+  mode = choose(1280, 720, 90);
+  TEST_CHECK(capture_mode_fps(mode) == 120.0);
+
+  // Fractional rates like 29.97 should still count as matching 30.
+  const CaptureMode ntsc_modes[] = {
+    {V4L2_PIX_FMT_YUYV, 640, 480, 1001, 30000},
+    {V4L2_PIX_FMT_YUYV, 640, 480, 1, 60},
+  };
+  const int index = capture_mode_choose(ntsc_modes, 2, 640, 480, 29.97);
+  TEST_CHECK(index == 0);
+}
+
+void test_capture_mode_falls_back() {
+  // Nothing is big enough, or fast enough, so take the closest on offer.
+  const CaptureMode* mode = choose(3840, 2160, 30);
+  TEST_CHECK(mode->width == 1920 && mode->height == 1080);
+
+  mode = choose(1920, 1080, 120);
+  TEST_CHECK(mode->width == 1920 && mode->height == 1080);
+  TEST_CHECK(capture_mode_fps(mode) == 60.0);
+}
+
+void test_capture_mode_any_rate() {
+  const CaptureMode* mode = choose(1280, 720, 0);
+  TEST_CHECK(capture_mode_fps(mode) == 120.0);
+}
+
+void test_capture_mode_unknown_interval() {
+  const CaptureMode mode = {V4L2_PIX_FMT_YUYV, 640, 480, 0, 0};
+  TEST_CHECK(capture_mode_fps(&mode) == 0.0);
+  TEST_CHECK(capture_mode_choose(&mode, 1, 640, 480, 30) == 0);
+  TEST_CHECK(capture_mode_choose(&mode, 0, 640, 480, 30) == -1);
+}
+
+TEST_LIST = {
+  {"capture_mode_exact", test_capture_mode_exact},
+  {"capture_mode_rounds_up", test_capture_mode_rounds_up},
+  {"capture_mode_falls_back", test_capture_mode_falls_back},
+  {"capture_mode_any_rate", test_capture_mode_any_rate},
+  {"capture_mode_unknown_interval", test_capture_mode_unknown_interval},
+  {NULL, NULL},
+};
@@ -0,0 +1,311 @@
+#include "capture_reactor.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "time_utils.h"
+#include "trace.h"
+
+// How long to leave a device alone after it woke us up without an image.
+// Drivers report an error through poll() when every buffer has been dequeued,
+// which would otherwise keep waking us until one is requeued.
+#define CAPTURE_REACTOR_RETRY_NS 1000000
+
+// Stands in for a device index in the control eventfd's epoll data.
+#define CAPTURE_REACTOR_CONTROL UINT64_MAX
+
+typedef struct
+{
+    CaptureSource *source;
+    int fd;
+    int64_t timeout_ns;
+    // When the device last delivered an image, or was last restarted.
+    int64_t last_image_ns;
+    // When to start listening to a device again that woke us up for nothing,
+    // or zero if it's being listened to.
+    int64_t retry_ns;
+    _Atomic bool restart_requested;
+    _Atomic uint64_t frames;
+    _Atomic uint64_t timeouts;
+    _Atomic uint64_t failures;
+    _Atomic uint64_t restarts;
+    _Atomic uint64_t failed_restarts;
+} ReactorDevice;
+
+// Device fds are added as one-shot, so each wakeup dequeues a single image
+// and then re-arms the fd. Level triggering brings us straight back if
+// there's another waiting, after every other device has had its turn.
+struct CaptureReactorStruct
+{
+    CaptureReactorImageFunc on_image;
+    void *context;
+    int epoll_fd;
+    int control_fd;
+    _Atomic bool stop_requested;
+    int device_count;
+    ReactorDevice devices[CAPTURE_REACTOR_MAX_DEVICES];
+};
+
+static void wake_reactor(CaptureReactor *reactor)
+{
+    const uint64_t one = 1;
+    const ssize_t bytes_written = write(reactor->control_fd, &one, sizeof(one));
+    (void)(bytes_written);
+}
+
+CaptureReactor *capture_reactor_alloc(CaptureReactorImageFunc on_image, void *context)
+{
+    CaptureReactor *reactor = calloc(1, sizeof(CaptureReactor));
+    if (reactor == NULL)
+    {
+        return NULL;
+    }
+    reactor->on_image = on_image;
+    reactor->context = context;
+    atomic_init(&reactor->stop_requested, false);
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    reactor->control_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event event = {.events = EPOLLIN, .data.u64 = CAPTURE_REACTOR_CONTROL};
+    if ((reactor->epoll_fd == -1) || (reactor->control_fd == -1) ||
+        (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->control_fd, &event) == -1))
+    {
+        capture_reactor_free(reactor);
+        return NULL;
+    }
+    return reactor;
+}
+
+void capture_reactor_free(CaptureReactor *reactor)
+{
+    if (reactor == NULL)
+    {
+        return;
+    }
+    if (reactor->control_fd != -1)
+    {
+        close(reactor->control_fd);
+    }
+    if (reactor->epoll_fd != -1)
+    {
+        close(reactor->epoll_fd);
+    }
+    free(reactor);
+}
+
+int capture_reactor_add(CaptureReactor *reactor, CaptureSource *source, int timeout_ms)
+{
+    if (reactor->device_count == CAPTURE_REACTOR_MAX_DEVICES)
+    {
+        return -1;
+    }
+    const int index = reactor->device_count;
+    ReactorDevice *device = &reactor->devices[index];
+    memset(device, 0, sizeof(ReactorDevice));
+    device->source = source;
+    device->fd = capture_source_poll_fd(source);
+    device->timeout_ns = (int64_t)(timeout_ms) * 1000000;
+    atomic_init(&device->restart_requested, false);
+    atomic_init(&device->frames, 0);
+    atomic_init(&device->timeouts, 0);
+    atomic_init(&device->failures, 0);
+    atomic_init(&device->restarts, 0);
+    atomic_init(&device->failed_restarts, 0);
+    struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT, .data.u64 = index};
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, device->fd, &event) == -1)
+    {
+        return -1;
+    }
+    reactor->device_count += 1;
+    return index;
+}
+
+static void listen_to_device(CaptureReactor *reactor, int index)
+{
+    ReactorDevice *device = &reactor->devices[index];
+    device->retry_ns = 0;
+    struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT, .data.u64 = index};
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, device->fd, &event) == -1)
+    {
+        fprintf(stderr, "epoll_ctl error %d, %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void restart_device(CaptureReactor *reactor, int index, const char *reason)
+{
+    ReactorDevice *device = &reactor->devices[index];
+    fprintf(stderr, "Restarting %s device %d, %s\n", capture_source_name(device->source), index, reason);
+    TRACE_SCOPE("restart device");
+    // Whether or not it works, it gets a whole timeout before it counts as
+    // stuck again.
+    device->last_image_ns = time_monotonic_ns();
+    device->retry_ns = 0;
+    if (capture_source_restart(device->source))
+    {
+        atomic_fetch_add(&device->restarts, 1);
+        listen_to_device(reactor, index);
+    }
+    else
+    {
+        // A device that's gone away polls as readable forever, so it's left
+        // alone until the timeout comes round and tries again.
+        atomic_fetch_add(&device->failed_restarts, 1);
+        fprintf(stderr, "Couldn't restart %s device %d, trying again in %lld ms\n",
+                capture_source_name(device->source), index, (long long)(device->timeout_ns / 1000000));
+    }
+}
+
+static void service_device(CaptureReactor *reactor, int index)
+{
+    TRACE_SCOPE("service device");
+    ReactorDevice *device = &reactor->devices[index];
+    CaptureBuffer buffer;
+    if (capture_source_dequeue(device->source, &buffer, 0))
+    {
+        device->last_image_ns = time_monotonic_ns();
+        atomic_fetch_add(&device->frames, 1);
+        if (!reactor->on_image(reactor->context, index, &buffer))
+        {
+            capture_source_requeue(device->source, &buffer);
+        }
+        listen_to_device(reactor, index);
+    }
+    else if (capture_source_has_failed(device->source))
+    {
+        atomic_fetch_add(&device->failures, 1);
+        restart_device(reactor, index, "after an error");
+    }
+    else
+    {
+        device->retry_ns = time_monotonic_ns() + CAPTURE_REACTOR_RETRY_NS;
+    }
+}
+
+// Handles anything that's come due by now, and returns how long epoll can
+// sleep before something else will, or -1 for as long as it likes.
+static int check_devices(CaptureReactor *reactor)
+{
+    const int64_t now_ns = time_monotonic_ns();
+    int64_t wait_ns = -1;
+    for (int i = 0; i < reactor->device_count; ++i)
+    {
+        ReactorDevice *device = &reactor->devices[i];
+        if (atomic_exchange(&device->restart_requested, false))
+        {
+            restart_device(reactor, i, "as asked");
+        }
+        else if ((device->timeout_ns > 0) && ((now_ns - device->last_image_ns) >= device->timeout_ns))
+        {
+            atomic_fetch_add(&device->timeouts, 1);
+            char reason[64];
+            snprintf(reason, sizeof(reason), "no images for %lld ms", (long long)(device->timeout_ns / 1000000));
+            restart_device(reactor, i, reason);
+        }
+        else if ((device->retry_ns != 0) && (now_ns >= device->retry_ns))
+        {
+            listen_to_device(reactor, i);
+        }
+
+        if (device->timeout_ns > 0)
+        {
+            const int64_t until_timeout_ns = (device->last_image_ns + device->timeout_ns) - now_ns;
+            if ((wait_ns == -1) || (until_timeout_ns < wait_ns))
+            {
+                wait_ns = until_timeout_ns;
+            }
+        }
+        if (device->retry_ns != 0)
+        {
+            const int64_t until_retry_ns = device->retry_ns - now_ns;
+            if ((wait_ns == -1) || (until_retry_ns < wait_ns))
+            {
+                wait_ns = until_retry_ns;
+            }
+        }
+    }
+    if (wait_ns == -1)
+    {
+        return -1;
+    }
+    // Rounded up, so we don't wake just before the deadline and spin.
+    return (wait_ns > 0) ? (int)((wait_ns + 999999) / 1000000) : 0;
+}
+
+void capture_reactor_run(CaptureReactor *reactor)
+{
+    const int64_t now_ns = time_monotonic_ns();
+    for (int i = 0; i < reactor->device_count; ++i)
+    {
+        reactor->devices[i].last_image_ns = now_ns;
+    }
+
+    int wait_ms = check_devices(reactor);
+    while (!atomic_load(&reactor->stop_requested))
+    {
+        struct epoll_event events[CAPTURE_REACTOR_MAX_DEVICES + 1];
+        const int event_count = epoll_wait(reactor->epoll_fd, events, CAPTURE_REACTOR_MAX_DEVICES + 1, wait_ms);
+        if (event_count == -1)
+        {
+            if (errno != EINTR)
+            {
+                fprintf(stderr, "epoll_wait error %d, %s\n", errno, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (int i = 0; i < event_count; ++i)
+        {
+            if (events[i].data.u64 == CAPTURE_REACTOR_CONTROL)
+            {
+                uint64_t count;
+                const ssize_t bytes_read = read(reactor->control_fd, &count, sizeof(count));
+                (void)(bytes_read);
+            }
+            else
+            {
+                service_device(reactor, (int)(events[i].data.u64));
+            }
+        }
+        wait_ms = check_devices(reactor);
+    }
+}
+
+void capture_reactor_stop(CaptureReactor *reactor)
+{
+    atomic_store(&reactor->stop_requested, true);
+    wake_reactor(reactor);
+}
+
+void capture_reactor_restart(CaptureReactor *reactor, int device)
+{
+    atomic_store(&reactor->devices[device].restart_requested, true);
+    wake_reactor(reactor);
+}
+
+void capture_reactor_get_stats(CaptureReactor *reactor, int device, CaptureReactorDeviceStats *stats)
+{
+    const ReactorDevice *entry = &reactor->devices[device];
+    stats->frames = atomic_load(&entry->frames);
+    stats->timeouts = atomic_load(&entry->timeouts);
+    stats->failures = atomic_load(&entry->failures);
+    stats->restarts = atomic_load(&entry->restarts);
+    stats->failed_restarts = atomic_load(&entry->failed_restarts);
+}
+
+void capture_reactor_log_stats(CaptureReactor *reactor)
+{
+    for (int i = 0; i < reactor->device_count; ++i)
+    {
+        CaptureReactorDeviceStats stats;
+        capture_reactor_get_stats(reactor, i, &stats);
+        fprintf(stderr, "%s device %d: %llu frames, %llu timeouts, %llu failures, %llu restarts (%llu failed)\n",
+                capture_source_name(reactor->devices[i].source), i, (unsigned long long)(stats.frames),
+                (unsigned long long)(stats.timeouts), (unsigned long long)(stats.failures),
+                (unsigned long long)(stats.restarts), (unsigned long long)(stats.failed_restarts));
+    }
+}
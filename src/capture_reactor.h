@@ -0,0 +1,72 @@
+#ifndef INCLUDE_CAPTURE_REACTOR_H
+#define INCLUDE_CAPTURE_REACTOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "capture_source.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define CAPTURE_REACTOR_MAX_DEVICES 16
+
+    // Services any number of capture sources from one thread, sleeping in
+    // epoll until one of them has an image or something asks it to stop. A
+    // device that goes quiet for too long, or whose driver gives up on the
+    // stream, is restarted on its own, so a hiccup on one camera doesn't stop
+    // the others or bring the process down.
+    typedef struct CaptureReactorStruct CaptureReactor;
+
+    // Called on the reactor's thread for every image, with the index
+    // capture_reactor_add() returned for its source. Returns true if the
+    // buffer will be requeued by someone else, or false to have the reactor
+    // requeue it straight away.
+    typedef bool (*CaptureReactorImageFunc)(void *context, int device, const CaptureBuffer *buffer);
+
+    typedef struct
+    {
+        uint64_t frames;
+        // Times the device went its whole timeout without an image.
+        uint64_t timeouts;
+        // Times the source reported an error only a restart would fix.
+        uint64_t failures;
+        uint64_t restarts;
+        // Restarts that didn't work, and will be tried again after another
+        // timeout.
+        uint64_t failed_restarts;
+    } CaptureReactorDeviceStats;
+
+    // Returns NULL if the epoll instance or the control eventfd couldn't be
+    // created.
+    CaptureReactor *capture_reactor_alloc(CaptureReactorImageFunc on_image, void *context);
+    // The sources aren't touched, so stopping and freeing them is up to the
+    // caller.
+    void capture_reactor_free(CaptureReactor *reactor);
+
+    // Adds a source that has already been started, to be restarted whenever
+    // timeout_ms passes without an image from it, or never if it's zero.
+    // Returns the device's index, or -1 if there are too many already. Must
+    // be called before capture_reactor_run().
+    int capture_reactor_add(CaptureReactor *reactor, CaptureSource *source, int timeout_ms);
+
+    // Dequeues images as they arrive until capture_reactor_stop() is called,
+    // then returns.
+    void capture_reactor_run(CaptureReactor *reactor);
+    // Both of these can be called from any thread, or from a signal handler,
+    // and wake the reactor through its control eventfd. Once stopped, any
+    // later call to capture_reactor_run() returns straight away.
+    void capture_reactor_stop(CaptureReactor *reactor);
+    void capture_reactor_restart(CaptureReactor *reactor, int device);
+
+    void capture_reactor_get_stats(CaptureReactor *reactor, int device, CaptureReactorDeviceStats *stats);
+    // Writes one line of stats to stderr for each device.
+    void capture_reactor_log_stats(CaptureReactor *reactor);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // INCLUDE_CAPTURE_REACTOR_H
@@ -0,0 +1,267 @@
+#include "acutest.h"
+
+#include "capture_reactor.c"
+
+#include <pthread.h>
+
+#include "synthetic_source.h"
+
+// A source that can be told to deliver, to fail, or to fail to restart.
+typedef struct {
+  CaptureSource base;
+  int ready_fd;
+  bool delivers;
+  bool failed;
+  bool restart_works;
+  // Whether a restart starts it delivering.
+  bool delivers_after_restart;
+  int dequeues;
+  int requeues;
+  int restarts;
+  uint32_t sequence;
+  uint8_t pixels[16];
+} FakeSource;
+
+// Nothing ever reads the eventfd, so it stays readable from then on.
+static void make_readable(FakeSource* source) {
+  const uint64_t count = 1;
+  TEST_CHECK(write(source->ready_fd, &count, sizeof(count)) == sizeof(count));
+}
+
+static void fake_nothing(CaptureSource* base) {
+}
+
+static void fake_configure(CaptureSource* base, const CaptureRequest* request, CaptureFormat* format) {
+}
+
+static bool fake_dequeue(CaptureSource* base, CaptureBuffer* buffer, int timeout_ms) {
+  FakeSource* source = (FakeSource*)(base);
+  source->dequeues += 1;
+  if (!source->delivers || source->failed) {
+    return false;
+  }
+  buffer->data = source->pixels;
+  buffer->bytes_used = sizeof(source->pixels);
+  buffer->timestamp_ns = time_monotonic_ns();
+  buffer->sequence = source->sequence++;
+  buffer->index = 0;
+  return true;
+}
+
+static void fake_requeue(CaptureSource* base, const CaptureBuffer* buffer) {
+  ((FakeSource*)(base))->requeues += 1;
+}
+
+static int fake_lease_count(CaptureSource* base) {
+  return 0;
+}
+
+static int fake_poll_fd(CaptureSource* base) {
+  return ((FakeSource*)(base))->ready_fd;
+}
+
+static bool fake_has_failed(CaptureSource* base) {
+  return ((FakeSource*)(base))->failed;
+}
+
+static bool fake_restart(CaptureSource* base) {
+  FakeSource* source = (FakeSource*)(base);
+  source->restarts += 1;
+  if (!source->restart_works) {
+    return false;
+  }
+  source->failed = false;
+  if (source->delivers_after_restart) {
+    source->delivers = true;
+    make_readable(source);
+  }
+  return true;
+}
+
+static const CaptureSourceOps fake_source_ops = {
+  .name = "fake",
+  .open = fake_nothing,
+  .configure = fake_configure,
+  .start = fake_nothing,
+  .dequeue = fake_dequeue,
+  .requeue = fake_requeue,
+  .lease_count = fake_lease_count,
+  .poll_fd = fake_poll_fd,
+  .has_failed = fake_has_failed,
+  .restart = fake_restart,
+  .stop = fake_nothing,
+  .free = fake_nothing,
+};
+
+static void init_fake(FakeSource* source) {
+  memset(source, 0, sizeof(FakeSource));
+  source->base.ops = &fake_source_ops;
+  source->ready_fd = eventfd(0, EFD_NONBLOCK);
+  source->restart_works = true;
+  TEST_ASSERT(source->ready_fd != -1);
+}
+
+typedef struct {
+  CaptureReactor* reactor;
+  int counts[CAPTURE_REACTOR_MAX_DEVICES];
+  // Stops the reactor once every device has had at least this many.
+  int stop_after;
+  int device_count;
+} ImageCounts;
+
+static bool count_image(void* context, int device, const CaptureBuffer* buffer) {
+  ImageCounts* counts = (ImageCounts*)(context);
+  counts->counts[device] += 1;
+  bool done = true;
+  for (int i = 0; i < counts->device_count; ++i) {
+    done &= (counts->counts[i] >= counts->stop_after);
+  }
+  if (done) {
+    capture_reactor_stop(counts->reactor);
+  }
+  return false;
+}
+
+typedef struct {
+  CaptureReactor* reactor;
+  int delay_ms;
+} Stopper;
+
+static void* stop_later(void* cookie) {
+  Stopper* stopper = (Stopper*)(cookie);
+  struct timespec delay = {stopper->delay_ms / 1000, (stopper->delay_ms % 1000) * 1000000};
+  nanosleep(&delay, NULL);
+  capture_reactor_stop(stopper->reactor);
+  return NULL;
+}
+
+static CaptureSource* start_synthetic(double fps) {
+  CaptureSource* source = synthetic_source_alloc(SYNTHETIC_PATTERN_STATIC, FRAME_FORMAT_YUYV);
+  TEST_ASSERT(source != NULL);
+  const CaptureRequest request = {16, 16, fps};
+  CaptureFormat format;
+  capture_source_open(source);
+  capture_source_configure(source, &request, &format);
+  capture_source_start(source);
+  return source;
+}
+
+void test_capture_reactor_services_devices() {
+  ImageCounts counts;
+  memset(&counts, 0, sizeof(counts));
+  counts.reactor = capture_reactor_alloc(count_image, &counts);
+  TEST_ASSERT(counts.reactor != NULL);
+  counts.stop_after = 10;
+
+  // Two cameras at different rates, both on the one thread.
+  CaptureSource* fast = start_synthetic(200.0);
+  CaptureSource* slow = start_synthetic(100.0);
+  TEST_CHECK(capture_reactor_add(counts.reactor, fast, 1000) == 0);
+  TEST_CHECK(capture_reactor_add(counts.reactor, slow, 1000) == 1);
+  counts.device_count = 2;
+  capture_reactor_run(counts.reactor);
+
+  TEST_CHECK(counts.counts[1] == 10);
+  TEST_CHECK(counts.counts[0] >= 10);
+  TEST_MSG("fast device delivered %d", counts.counts[0]);
+  for (int i = 0; i < 2; ++i) {
+    CaptureReactorDeviceStats stats;
+    capture_reactor_get_stats(counts.reactor, i, &stats);
+    TEST_CHECK(stats.frames == (uint64_t)(counts.counts[i]));
+    TEST_CHECK(stats.timeouts == 0);
+    TEST_CHECK(stats.restarts == 0);
+  }
+
+  // Once stopped, it stays stopped.
+  capture_reactor_run(counts.reactor);
+  capture_reactor_free(counts.reactor);
+  capture_source_free(slow);
+  capture_source_free(fast);
+}
+
+void test_capture_reactor_retries_restarts() {
+  ImageCounts counts;
+  memset(&counts, 0, sizeof(counts));
+  counts.reactor = capture_reactor_alloc(count_image, &counts);
+  TEST_ASSERT(counts.reactor != NULL);
+  counts.device_count = 1;
+
+  // Gone for good, so every restart fails, and each is retried one timeout
+  // after the last rather than as fast as the reactor can go.
+  FakeSource gone;
+  init_fake(&gone);
+  gone.restart_works = false;
+  TEST_CHECK(capture_reactor_add(counts.reactor, &gone.base, 20) == 0);
+
+  Stopper stopper = {counts.reactor, 200};
+  pthread_t stop_thread;
+  TEST_ASSERT(pthread_create(&stop_thread, NULL, stop_later, &stopper) == 0);
+  capture_reactor_restart(counts.reactor, 0);
+  capture_reactor_run(counts.reactor);
+  pthread_join(stop_thread, NULL);
+
+  CaptureReactorDeviceStats stats;
+  capture_reactor_get_stats(counts.reactor, 0, &stats);
+  TEST_CHECK(stats.timeouts >= 2);
+  TEST_CHECK(stats.timeouts < 20);
+  TEST_CHECK(stats.failed_restarts == stats.timeouts + 1);
+  TEST_MSG("%llu timeouts, %llu failed restarts", (unsigned long long)(stats.timeouts),
+    (unsigned long long)(stats.failed_restarts));
+  TEST_CHECK(stats.restarts == 0);
+  TEST_CHECK(gone.restarts == (int)(stats.failed_restarts));
+  TEST_CHECK(counts.counts[0] == 0);
+  capture_reactor_free(counts.reactor);
+  close(gone.ready_fd);
+}
+
+void test_capture_reactor_recovers() {
+  ImageCounts counts;
+  memset(&counts, 0, sizeof(counts));
+  counts.reactor = capture_reactor_alloc(count_image, &counts);
+  TEST_ASSERT(counts.reactor != NULL);
+  counts.stop_after = 5;
+  counts.device_count = 2;
+
+  // One device goes quiet and comes back once restarted, and the other
+  // reports an error, which only a restart clears.
+  FakeSource quiet;
+  init_fake(&quiet);
+  quiet.delivers_after_restart = true;
+  FakeSource broken;
+  init_fake(&broken);
+  broken.failed = true;
+  broken.delivers = true;
+  make_readable(&broken);
+  TEST_CHECK(capture_reactor_add(counts.reactor, &quiet.base, 20) == 0);
+  TEST_CHECK(capture_reactor_add(counts.reactor, &broken.base, 60000) == 1);
+
+  Stopper stopper = {counts.reactor, 5000};
+  pthread_t stop_thread;
+  TEST_ASSERT(pthread_create(&stop_thread, NULL, stop_later, &stopper) == 0);
+  capture_reactor_run(counts.reactor);
+  pthread_join(stop_thread, NULL);
+
+  CaptureReactorDeviceStats stats;
+  capture_reactor_get_stats(counts.reactor, 0, &stats);
+  TEST_CHECK(stats.timeouts == 1);
+  TEST_CHECK(stats.failures == 0);
+  TEST_CHECK(stats.restarts == 1);
+  TEST_CHECK(counts.counts[0] >= 5);
+  capture_reactor_get_stats(counts.reactor, 1, &stats);
+  TEST_CHECK(stats.timeouts == 0);
+  TEST_CHECK(stats.failures == 1);
+  TEST_CHECK(stats.restarts == 1);
+  TEST_CHECK(counts.counts[1] >= 5);
+  // Images the callback didn't keep went straight back.
+  TEST_CHECK(broken.requeues == counts.counts[1]);
+  capture_reactor_free(counts.reactor);
+  close(broken.ready_fd);
+  close(quiet.ready_fd);
+}
+
+TEST_LIST = {
+  {"capture_reactor_services_devices", test_capture_reactor_services_devices},
+  {"capture_reactor_retries_restarts", test_capture_reactor_retries_restarts},
+  {"capture_reactor_recovers", test_capture_reactor_recovers},
+  {NULL, NULL},
+};
@@ -0,0 +1,177 @@
+#ifndef INCLUDE_CAPTURE_SOURCE_H
+#define INCLUDE_CAPTURE_SOURCE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "frame_store.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    // What the caller would like to capture. Sources pick the closest they can
+    // actually deliver.
+    typedef struct
+    {
+        int width;
+        int height;
+        // Zero means as fast as possible.
+        double fps;
+    } CaptureRequest;
+
+    // What a source has agreed to deliver, once it's been configured.
+    typedef struct
+    {
+        FrameFormat format;
+        int width;
+        int height;
+        // Bytes from the start of one row of the first plane to the next. Any
+        // chroma planes follow the luma plane directly, with rows half as long
+        // (or the same length for NV12's interleaved plane).
+        int stride;
+        // The smallest number of bytes a complete image takes up.
+        int byte_count;
+        // Zero if the source doesn't know.
+        double fps;
+    } CaptureFormat;
+
+    // One captured image, owned by the source until it's requeued. Sources
+    // that lend out their buffers let it be requeued from any thread.
+    typedef struct
+    {
+        const uint8_t *data;
+        int bytes_used;
+        // When the image was captured, in CLOCK_MONOTONIC nanoseconds.
+        int64_t timestamp_ns;
+        uint32_t sequence;
+        // Private to the source, so it knows which buffer is coming back.
+        int index;
+    } CaptureBuffer;
+
+    // How many bytes an image takes up, given the stride of its first plane.
+    static inline int capture_image_byte_count(FrameFormat format, int stride, int height)
+    {
+        switch (format)
+        {
+        case FRAME_FORMAT_NV12:
+        case FRAME_FORMAT_I420:
+            return (stride * height) + (stride * ((height + 1) / 2));
+        default:
+            return stride * height;
+        }
+    }
+
+    typedef struct CaptureSourceStruct CaptureSource;
+
+    // The operations every kind of source implements. Errors while a source
+    // is being set up are reported and exit the process, the same way the
+    // original V4L2 capture code always has. Once it's capturing, errors are
+    // reported through has_failed() instead, so one misbehaving camera can be
+    // restarted without taking the others down with it.
+    typedef struct
+    {
+        const char *name;
+        void (*open)(CaptureSource *source);
+        void (*configure)(CaptureSource *source, const CaptureRequest *request, CaptureFormat *format);
+        void (*start)(CaptureSource *source);
+        // Waits up to timeout_ms for the next image. Returns false if none
+        // arrived in time.
+        bool (*dequeue)(CaptureSource *source, CaptureBuffer *buffer, int timeout_ms);
+        // Hands a dequeued buffer back so it can be filled again.
+        void (*requeue)(CaptureSource *source, const CaptureBuffer *buffer);
+        // How many buffers the source has, all of which can be held by
+        // consumers at once, as long as it's left enough to keep capturing
+        // into. Zero if buffers are reused as soon as they're requeued, or
+        // between dequeues, so anything kept has to be copied out first.
+        int (*lease_count)(CaptureSource *source);
+        // A file descriptor that polls as readable whenever an image may be
+        // ready to dequeue, so one thread can wait on many sources at once.
+        // Only valid once the source has been started.
+        int (*poll_fd)(CaptureSource *source);
+        // True once the source has hit an error it can only get over by
+        // restarting, like a driver that has given up on the stream. Dequeues
+        // return false until then.
+        bool (*has_failed)(CaptureSource *source);
+        // Stops capturing and starts again, for when images have stopped
+        // arriving. Buffers that consumers are holding stay valid. Returns
+        // false if it didn't work, so it can be tried again later.
+        bool (*restart)(CaptureSource *source);
+        void (*stop)(CaptureSource *source);
+        // Closes the source if needed, and frees it.
+        void (*free)(CaptureSource *source);
+    } CaptureSourceOps;
+
+    // Every source's own struct starts with one of these.
+    struct CaptureSourceStruct
+    {
+        const CaptureSourceOps *ops;
+    };
+
+    static inline const char *capture_source_name(const CaptureSource *source)
+    {
+        return source->ops->name;
+    }
+
+    static inline void capture_source_open(CaptureSource *source)
+    {
+        source->ops->open(source);
+    }
+
+    static inline void capture_source_configure(CaptureSource *source, const CaptureRequest *request,
+                                                CaptureFormat *format)
+    {
+        source->ops->configure(source, request, format);
+    }
+
+    static inline void capture_source_start(CaptureSource *source)
+    {
+        source->ops->start(source);
+    }
+
+    static inline bool capture_source_dequeue(CaptureSource *source, CaptureBuffer *buffer, int timeout_ms)
+    {
+        return source->ops->dequeue(source, buffer, timeout_ms);
+    }
+
+    static inline void capture_source_requeue(CaptureSource *source, const CaptureBuffer *buffer)
+    {
+        source->ops->requeue(source, buffer);
+    }
+
+    static inline int capture_source_lease_count(CaptureSource *source)
+    {
+        return source->ops->lease_count(source);
+    }
+
+    static inline int capture_source_poll_fd(CaptureSource *source)
+    {
+        return source->ops->poll_fd(source);
+    }
+
+    static inline bool capture_source_has_failed(CaptureSource *source)
+    {
+        return source->ops->has_failed(source);
+    }
+
+    static inline bool capture_source_restart(CaptureSource *source)
+    {
+        return source->ops->restart(source);
+    }
+
+    static inline void capture_source_stop(CaptureSource *source)
+    {
+        source->ops->stop(source);
+    }
+
+    static inline void capture_source_free(CaptureSource *source)
+    {
+        source->ops->free(source);
+    }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // INCLUDE_CAPTURE_SOURCE_H
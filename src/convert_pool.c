@@ -0,0 +1,410 @@
+#include "convert_pool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+// Used when the C library can't tell us how big the L2 cache is, which is
+// common on ARM. Small enough for any board we're likely to run on.
+#define CONVERT_POOL_DEFAULT_L2_BYTES (256 * 1024)
+
+struct ConvertPoolStruct
+{
+    int thread_count;
+    int worker_count;
+    pthread_t *workers;
+    size_t l2_bytes;
+    // Workers report their CPU time as name.index, if there's a name.
+    char name[CONVERT_POOL_NAME_SIZE];
+    int registered_workers;
+
+    // Held for the whole of convert_pool_run(), so runs from different
+    // threads take turns rather than trampling on each other's job.
+    pthread_mutex_t run_mutex;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    // Goes up by one for every call to convert_pool_run(), so workers can tell
+    // new work from a spurious wakeup.
+    uint64_t generation;
+    // Workers that haven't finished with the current generation yet.
+    int busy_workers;
+    bool quit;
+
+    // The current job, only changed while no workers are busy.
+    convert_pool_job_func job;
+    void *context;
+    int job_count;
+    _Atomic int next_index;
+};
+
+static void run_jobs(ConvertPool *pool)
+{
+    for (;;)
+    {
+        const int index = atomic_fetch_add_explicit(&pool->next_index, 1, memory_order_relaxed);
+        if (index >= pool->job_count)
+        {
+            return;
+        }
+        pool->job(pool->context, index);
+    }
+}
+
+static void register_worker(ConvertPool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    const int index = pool->registered_workers;
+    pool->registered_workers += 1;
+    pthread_mutex_unlock(&pool->mutex);
+    char name[CONVERT_POOL_NAME_SIZE + 16];
+    snprintf(name, sizeof(name), "%s.%d", pool->name, index);
+    metrics_register_thread(name);
+}
+
+static void *worker_main(void *cookie)
+{
+    ConvertPool *pool = (ConvertPool *)(cookie);
+    uint64_t seen_generation = 0;
+    if (pool->name[0] != '\0')
+    {
+        register_worker(pool);
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    for (;;)
+    {
+        while (!pool->quit && (pool->generation == seen_generation))
+        {
+            pthread_cond_wait(&pool->work_ready, &pool->mutex);
+        }
+        if (pool->quit)
+        {
+            break;
+        }
+        seen_generation = pool->generation;
+        pthread_mutex_unlock(&pool->mutex);
+
+        run_jobs(pool);
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->busy_workers -= 1;
+        if (pool->busy_workers == 0)
+        {
+            pthread_cond_signal(&pool->work_done);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+static size_t l2_cache_bytes(void)
+{
+#if defined(_SC_LEVEL2_CACHE_SIZE)
+    const long l2_bytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (l2_bytes > 0)
+    {
+        return l2_bytes;
+    }
+#endif
+    return CONVERT_POOL_DEFAULT_L2_BYTES;
+}
+
+ConvertPool *convert_pool_alloc(int thread_count)
+{
+    return convert_pool_alloc_named(thread_count, NULL);
+}
+
+ConvertPool *convert_pool_alloc_named(int thread_count, const char *name)
+{
+    if (thread_count <= 0)
+    {
+        const long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = (cpu_count > 0) ? cpu_count : 1;
+    }
+
+    ConvertPool *pool = calloc(1, sizeof(ConvertPool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    pool->thread_count = thread_count;
+    pool->l2_bytes = l2_cache_bytes();
+    if (name != NULL)
+    {
+        snprintf(pool->name, sizeof(pool->name), "%s", name);
+    }
+    pthread_mutex_init(&pool->run_mutex, NULL);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+    atomic_init(&pool->next_index, 0);
+
+    pool->workers = calloc(thread_count, sizeof(pthread_t));
+    if (pool->workers == NULL)
+    {
+        convert_pool_free(pool);
+        return NULL;
+    }
+    for (int i = 0; i < (thread_count - 1); ++i)
+    {
+        if (pthread_create(&pool->workers[i], NULL, worker_main, pool) != 0)
+        {
+            convert_pool_free(pool);
+            return NULL;
+        }
+        pool->worker_count += 1;
+    }
+    return pool;
+}
+
+void convert_pool_free(ConvertPool *pool)
+{
+    if (pool == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int i = 0; i < pool->worker_count; ++i)
+    {
+        pthread_join(pool->workers[i], NULL);
+    }
+    free(pool->workers);
+    pthread_cond_destroy(&pool->work_done);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_mutex_destroy(&pool->run_mutex);
+    free(pool);
+}
+
+int convert_pool_thread_count(const ConvertPool *pool)
+{
+    return pool->thread_count;
+}
+
+int convert_pool_band_rows(const ConvertPool *pool, int bytes_per_row, int height)
+{
+    // Leave half the cache for everything else that's going on.
+    int band_rows = (pool->l2_bytes / 2) / ((bytes_per_row > 0) ? bytes_per_row : 1);
+    // Small frames shouldn't leave threads idle, so make sure there are at
+    // least as many bands as threads.
+    const int rows_per_thread = (height + pool->thread_count - 1) / pool->thread_count;
+    if (band_rows > rows_per_thread)
+    {
+        band_rows = rows_per_thread;
+    }
+    band_rows &= ~1;
+    return (band_rows < 2) ? 2 : band_rows;
+}
+
+void convert_pool_run(ConvertPool *pool, int job_count, convert_pool_job_func job, void *context)
+{
+    if ((pool->worker_count == 0) || (job_count <= 1))
+    {
+        for (int i = 0; i < job_count; ++i)
+        {
+            job(context, i);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->run_mutex);
+    pthread_mutex_lock(&pool->mutex);
+    pool->job = job;
+    pool->context = context;
+    pool->job_count = job_count;
+    atomic_store_explicit(&pool->next_index, 0, memory_order_relaxed);
+    pool->busy_workers = pool->worker_count;
+    pool->generation += 1;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->mutex);
+
+    run_jobs(pool);
+
+    // Every worker has to check in before the job can be changed again, even
+    // ones that woke too late to find anything left to do.
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->busy_workers > 0)
+    {
+        pthread_cond_wait(&pool->work_done, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    pthread_mutex_unlock(&pool->run_mutex);
+}
+
+typedef enum
+{
+    CONVERT_YUYV,
+    CONVERT_I420,
+    CONVERT_NV12,
+} ConvertKind;
+
+typedef struct
+{
+    ConvertKind kind;
+    const uint8_t *y_plane;
+    int y_stride;
+    const uint8_t *u_plane;
+    const uint8_t *v_plane;
+    int uv_stride;
+    uint8_t *rgba;
+    int rgba_stride;
+    int width;
+    int height;
+    int band_rows;
+    YuvMatrix matrix;
+    YuvRange range;
+    // Writes BGRA instead of RGBA.
+    bool bgra;
+} ConvertBands;
+
+static void convert_band(void *cookie, int index)
+{
+    const ConvertBands *bands = (const ConvertBands *)(cookie);
+    const int y = index * bands->band_rows;
+    const int rows = ((bands->height - y) < bands->band_rows) ? (bands->height - y) : bands->band_rows;
+    const uint8_t *y_plane = bands->y_plane + ((size_t)(y) * bands->y_stride);
+    // Bands always start on an even row, so they line up with chroma rows.
+    const size_t uv_offset = (size_t)(y / 2) * bands->uv_stride;
+    uint8_t *rgba = bands->rgba + ((size_t)(y) * bands->rgba_stride);
+
+    switch (bands->kind)
+    {
+    case CONVERT_YUYV:
+        (bands->bgra ? yuyv_to_bgra : yuyv_to_rgba)(y_plane, bands->y_stride, rgba, bands->rgba_stride, bands->width,
+                                                    rows, bands->matrix, bands->range);
+        break;
+    case CONVERT_I420:
+        (bands->bgra ? i420_to_bgra : i420_to_rgba)(y_plane, bands->y_stride, bands->u_plane + uv_offset,
+                                                    bands->v_plane + uv_offset, bands->uv_stride, rgba,
+                                                    bands->rgba_stride, bands->width, rows, bands->matrix,
+                                                    bands->range);
+        break;
+    case CONVERT_NV12:
+        (bands->bgra ? nv12_to_bgra : nv12_to_rgba)(y_plane, bands->y_stride, bands->u_plane + uv_offset,
+                                                    bands->uv_stride, rgba, bands->rgba_stride, bands->width, rows,
+                                                    bands->matrix, bands->range);
+        break;
+    }
+}
+
+static void convert_in_bands(ConvertPool *pool, ConvertBands *bands, int bytes_per_row)
+{
+    bands->band_rows = convert_pool_band_rows(pool, bytes_per_row, bands->height);
+    const int band_count = (bands->height + bands->band_rows - 1) / bands->band_rows;
+    convert_pool_run(pool, band_count, convert_band, bands);
+}
+
+static void convert_yuyv(ConvertPool *pool, const uint8_t *yuyv, int yuyv_stride, uint8_t *out, int out_stride,
+                         int width, int height, YuvMatrix matrix, YuvRange range, bool bgra)
+{
+    ConvertBands bands = {
+        .kind = CONVERT_YUYV,
+        .y_plane = yuyv,
+        .y_stride = yuyv_stride,
+        .rgba = out,
+        .rgba_stride = out_stride,
+        .width = width,
+        .height = height,
+        .matrix = matrix,
+        .range = range,
+        .bgra = bgra,
+    };
+    convert_in_bands(pool, &bands, (width * 2) + (width * 4));
+}
+
+static void convert_i420(ConvertPool *pool, const uint8_t *y_plane, int y_stride, const uint8_t *u_plane,
+                         const uint8_t *v_plane, int uv_stride, uint8_t *out, int out_stride, int width, int height,
+                         YuvMatrix matrix, YuvRange range, bool bgra)
+{
+    ConvertBands bands = {
+        .kind = CONVERT_I420,
+        .y_plane = y_plane,
+        .y_stride = y_stride,
+        .u_plane = u_plane,
+        .v_plane = v_plane,
+        .uv_stride = uv_stride,
+        .rgba = out,
+        .rgba_stride = out_stride,
+        .width = width,
+        .height = height,
+        .matrix = matrix,
+        .range = range,
+        .bgra = bgra,
+    };
+    // 1.5 bytes of YUV per pixel on average.
+    convert_in_bands(pool, &bands, ((width * 3) / 2) + (width * 4));
+}
+
+static void convert_nv12(ConvertPool *pool, const uint8_t *y_plane, int y_stride, const uint8_t *uv_plane,
+                         int uv_stride, uint8_t *out, int out_stride, int width, int height, YuvMatrix matrix,
+                         YuvRange range, bool bgra)
+{
+    ConvertBands bands = {
+        .kind = CONVERT_NV12,
+        .y_plane = y_plane,
+        .y_stride = y_stride,
+        .u_plane = uv_plane,
+        .uv_stride = uv_stride,
+        .rgba = out,
+        .rgba_stride = out_stride,
+        .width = width,
+        .height = height,
+        .matrix = matrix,
+        .range = range,
+        .bgra = bgra,
+    };
+    convert_in_bands(pool, &bands, ((width * 3) / 2) + (width * 4));
+}
+
+void convert_pool_yuyv_to_rgba(ConvertPool *pool, const uint8_t *yuyv, int yuyv_stride, uint8_t *rgba,
+                               int rgba_stride, int width, int height, YuvMatrix matrix, YuvRange range)
+{
+    convert_yuyv(pool, yuyv, yuyv_stride, rgba, rgba_stride, width, height, matrix, range, false);
+}
+
+void convert_pool_i420_to_rgba(ConvertPool *pool, const uint8_t *y_plane, int y_stride, const uint8_t *u_plane,
+                               const uint8_t *v_plane, int uv_stride, uint8_t *rgba, int rgba_stride, int width,
+                               int height, YuvMatrix matrix, YuvRange range)
+{
+    convert_i420(pool, y_plane, y_stride, u_plane, v_plane, uv_stride, rgba, rgba_stride, width, height, matrix,
+                 range, false);
+}
+
+void convert_pool_nv12_to_rgba(ConvertPool *pool, const uint8_t *y_plane, int y_stride, const uint8_t *uv_plane,
+                               int uv_stride, uint8_t *rgba, int rgba_stride, int width, int height,
+                               YuvMatrix matrix, YuvRange range)
+{
+    convert_nv12(pool, y_plane, y_stride, uv_plane, uv_stride, rgba, rgba_stride, width, height, matrix, range,
+                 false);
+}
+
+void convert_pool_yuyv_to_bgra(ConvertPool *pool, const uint8_t *yuyv, int yuyv_stride, uint8_t *bgra,
+                               int bgra_stride, int width, int height, YuvMatrix matrix, YuvRange range)
+{
+    convert_yuyv(pool, yuyv, yuyv_stride, bgra, bgra_stride, width, height, matrix, range, true);
+}
+
+void convert_pool_i420_to_bgra(ConvertPool *pool, const uint8_t *y_plane, int y_stride, const uint8_t *u_plane,
+                               const uint8_t *v_plane, int uv_stride, uint8_t *bgra, int bgra_stride, int width,
+                               int height, YuvMatrix matrix, YuvRange range)
+{
+    convert_i420(pool, y_plane, y_stride, u_plane, v_plane, uv_stride, bgra, bgra_stride, width, height, matrix,
+                 range, true);
+}
+
+void convert_pool_nv12_to_bgra(ConvertPool *pool, const uint8_t *y_plane, int y_stride, const uint8_t *uv_plane,
+                               int uv_stride, uint8_t *bgra, int bgra_stride, int width, int height,
+                               YuvMatrix matrix, YuvRange range)
+{
+    convert_nv12(pool, y_plane, y_stride, uv_plane, uv_stride, bgra, bgra_stride, width, height, matrix, range,
+                 true);
+}
@@ -0,0 +1,69 @@
+#ifndef INCLUDE_CONVERT_POOL_H
+#define INCLUDE_CONVERT_POOL_H
+
+#include <stdint.h>
+
+#include "yuv_convert.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    // Splits whole-frame conversions into horizontal bands and runs them on a
+    // set of threads that are started once and kept waiting between frames.
+    // The calling thread works on bands too, so a pool of one thread has no
+    // workers and just converts inline. Bands are sized so that the input and
+    // output rows of each one fit comfortably in the L2 cache.
+    typedef struct ConvertPoolStruct ConvertPool;
+
+#define CONVERT_POOL_NAME_SIZE 32
+
+    // A thread count of zero or less means one thread per online CPU. Returns
+    // NULL if the threads couldn't be created.
+    ConvertPool *convert_pool_alloc(int thread_count);
+    // The same, but each worker adds its CPU time to the metrics snapshots as
+    // name.index, counting from zero. The calling thread's share of the work
+    // is counted under its own name.
+    ConvertPool *convert_pool_alloc_named(int thread_count, const char *name);
+    void convert_pool_free(ConvertPool *pool);
+
+    // Including the calling thread.
+    int convert_pool_thread_count(const ConvertPool *pool);
+
+    // How many rows go in each band, for rows that read and write the given
+    // number of bytes in total. Always even, so 4:2:0 chroma rows aren't split.
+    int convert_pool_band_rows(const ConvertPool *pool, int bytes_per_row, int height);
+
+    // Calls job(context, index) once for every index below job_count, spread
+    // across the pool, and returns when they have all finished. Safe to call
+    // from several threads at once, such as the consumers of different
+    // devices, though since each run keeps every thread in the pool busy,
+    // they take turns.
+    typedef void (*convert_pool_job_func)(void *context, int index);
+    void convert_pool_run(ConvertPool *pool, int job_count, convert_pool_job_func job, void *context);
+
+    // Band-parallel versions of the conversions in yuv_convert.h, with the
+    // same arguments and results.
+    void convert_pool_yuyv_to_rgba(ConvertPool *pool, const uint8_t *yuyv, int yuyv_stride, uint8_t *rgba,
+                                   int rgba_stride, int width, int height, YuvMatrix matrix, YuvRange range);
+    void convert_pool_i420_to_rgba(ConvertPool *pool, const uint8_t *y_plane, int y_stride, const uint8_t *u_plane,
+                                   const uint8_t *v_plane, int uv_stride, uint8_t *rgba, int rgba_stride, int width,
+                                   int height, YuvMatrix matrix, YuvRange range);
+    void convert_pool_nv12_to_rgba(ConvertPool *pool, const uint8_t *y_plane, int y_stride, const uint8_t *uv_plane,
+                                   int uv_stride, uint8_t *rgba, int rgba_stride, int width, int height,
+                                   YuvMatrix matrix, YuvRange range);
+    void convert_pool_yuyv_to_bgra(ConvertPool *pool, const uint8_t *yuyv, int yuyv_stride, uint8_t *bgra,
+                                   int bgra_stride, int width, int height, YuvMatrix matrix, YuvRange range);
+    void convert_pool_i420_to_bgra(ConvertPool *pool, const uint8_t *y_plane, int y_stride, const uint8_t *u_plane,
+                                   const uint8_t *v_plane, int uv_stride, uint8_t *bgra, int bgra_stride, int width,
+                                   int height, YuvMatrix matrix, YuvRange range);
+    void convert_pool_nv12_to_bgra(ConvertPool *pool, const uint8_t *y_plane, int y_stride, const uint8_t *uv_plane,
+                                   int uv_stride, uint8_t *bgra, int bgra_stride, int width, int height,
+                                   YuvMatrix matrix, YuvRange range);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // INCLUDE_CONVERT_POOL_H
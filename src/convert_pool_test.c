@@ -0,0 +1,186 @@
+#include "acutest.h"
+
+#include "convert_pool.c"
+
+#include <string.h>
+
+static uint32_t test_random_state = 12345;
+
+static uint8_t test_random_byte() {
+  test_random_state = (test_random_state * 1103515245) + 12345;
+  return (test_random_state >> 16) & 0xff;
+}
+
+static uint8_t* alloc_random(int byte_count) {
+  uint8_t* buffer = malloc(byte_count);
+  for (int i = 0; i < byte_count; ++i) {
+    buffer[i] = test_random_byte();
+  }
+  return buffer;
+}
+
+void test_convert_pool_band_rows() {
+  ConvertPool* pool = convert_pool_alloc(4);
+  TEST_ASSERT(pool != NULL);
+  TEST_CHECK(convert_pool_thread_count(pool) == 4);
+
+  // A 4K frame should be split into many bands, each fitting in half of L2.
+  const int bytes_per_row = 3840 * 6;
+  const int rows = convert_pool_band_rows(pool, bytes_per_row, 2160);
+  TEST_CHECK((rows % 2) == 0);
+  TEST_CHECK(rows >= 2);
+  TEST_CHECK(rows < 2160 / 4);
+  TEST_CHECK((rows == 2) || ((size_t)(rows * bytes_per_row) <= pool->l2_bytes / 2));
+  TEST_MSG("%d rows per band with %zu bytes of L2", rows, pool->l2_bytes);
+
+  // Tiny frames still get shared out, and rows never drop below a pair.
+  TEST_CHECK(convert_pool_band_rows(pool, 64, 16) == 4);
+  TEST_CHECK(convert_pool_band_rows(pool, 64, 3) == 2);
+  TEST_CHECK(convert_pool_band_rows(pool, 1 << 30, 1080) == 2);
+  convert_pool_free(pool);
+
+  // Zero means one thread per CPU.
+  pool = convert_pool_alloc(0);
+  TEST_ASSERT(pool != NULL);
+  TEST_CHECK(convert_pool_thread_count(pool) >= 1);
+  convert_pool_free(pool);
+}
+
+typedef struct {
+  _Atomic int counts[1000];
+} JobCounts;
+
+static void count_job(void* context, int index) {
+  JobCounts* counts = (JobCounts*)(context);
+  atomic_fetch_add(&counts->counts[index], 1);
+}
+
+void test_convert_pool_run() {
+  const int thread_counts[] = {1, 2, 3, 8};
+  for (int t = 0; t < 4; ++t) {
+    ConvertPool* pool = convert_pool_alloc(thread_counts[t]);
+    TEST_ASSERT(pool != NULL);
+    // Lots of short runs back to back, to shake out any mixups between one
+    // run and the next.
+    for (int run = 0; run < 200; ++run) {
+      static JobCounts counts;
+      const int job_count = (run * 7) % 1000;
+      memset(&counts, 0, sizeof(counts));
+      convert_pool_run(pool, job_count, count_job, &counts);
+      for (int i = 0; i < 1000; ++i) {
+        const int expected = (i < job_count) ? 1 : 0;
+        if (atomic_load(&counts.counts[i]) != expected) {
+          TEST_CHECK(false);
+          TEST_MSG("%d threads, run %d, job %d ran %d times", thread_counts[t], run, i,
+            atomic_load(&counts.counts[i]));
+          break;
+        }
+      }
+    }
+    convert_pool_free(pool);
+  }
+}
+
+void test_convert_pool_matches_single_thread() {
+  const int sizes[][2] = {{640, 480}, {1920, 1080}, {34, 7}, {2, 1}, {1366, 769}};
+  const int thread_counts[] = {1, 2, 3, 8};
+  for (int s = 0; s < 5; ++s) {
+    const int width = sizes[s][0];
+    const int height = sizes[s][1];
+    const int chroma_height = (height + 1) / 2;
+    const int rgba_stride = width * 4;
+    uint8_t* yuyv = alloc_random(width * 2 * height);
+    uint8_t* planes = alloc_random((width * height) + (width * chroma_height));
+    uint8_t* expected_yuyv = malloc(rgba_stride * height);
+    uint8_t* expected_i420 = malloc(rgba_stride * height);
+    uint8_t* expected_nv12 = malloc(rgba_stride * height);
+    uint8_t* actual = malloc(rgba_stride * height);
+
+    const uint8_t* u_plane = planes + (width * height);
+    const uint8_t* v_plane = u_plane + ((width / 2) * chroma_height);
+    yuyv_to_rgba(yuyv, width * 2, expected_yuyv, rgba_stride, width, height, YUV_MATRIX_BT709, YUV_RANGE_LIMITED);
+    i420_to_rgba(planes, width, u_plane, v_plane, width / 2, expected_i420, rgba_stride, width, height,
+      YUV_MATRIX_BT601, YUV_RANGE_FULL);
+    nv12_to_rgba(planes, width, u_plane, width, expected_nv12, rgba_stride, width, height, YUV_MATRIX_BT601,
+      YUV_RANGE_LIMITED);
+
+    for (int t = 0; t < 4; ++t) {
+      ConvertPool* pool = convert_pool_alloc(thread_counts[t]);
+      TEST_ASSERT(pool != NULL);
+
+      memset(actual, 0, rgba_stride * height);
+      convert_pool_yuyv_to_rgba(pool, yuyv, width * 2, actual, rgba_stride, width, height, YUV_MATRIX_BT709,
+        YUV_RANGE_LIMITED);
+      TEST_CHECK(0 == memcmp(expected_yuyv, actual, rgba_stride * height));
+      TEST_MSG("YUYV %dx%d with %d threads", width, height, thread_counts[t]);
+
+      memset(actual, 0, rgba_stride * height);
+      convert_pool_i420_to_rgba(pool, planes, width, u_plane, v_plane, width / 2, actual, rgba_stride, width,
+        height, YUV_MATRIX_BT601, YUV_RANGE_FULL);
+      TEST_CHECK(0 == memcmp(expected_i420, actual, rgba_stride * height));
+      TEST_MSG("I420 %dx%d with %d threads", width, height, thread_counts[t]);
+
+      memset(actual, 0, rgba_stride * height);
+      convert_pool_nv12_to_rgba(pool, planes, width, u_plane, width, actual, rgba_stride, width, height,
+        YUV_MATRIX_BT601, YUV_RANGE_LIMITED);
+      TEST_CHECK(0 == memcmp(expected_nv12, actual, rgba_stride * height));
+      TEST_MSG("NV12 %dx%d with %d threads", width, height, thread_counts[t]);
+
+      // BGRA only differs in the kernels, so one layout is enough to check
+      // the flag makes it through to every band.
+      uint8_t* expected_bgra = malloc(rgba_stride * height);
+      nv12_to_bgra(planes, width, u_plane, width, expected_bgra, rgba_stride, width, height, YUV_MATRIX_BT601,
+        YUV_RANGE_LIMITED);
+      memset(actual, 0, rgba_stride * height);
+      convert_pool_nv12_to_bgra(pool, planes, width, u_plane, width, actual, rgba_stride, width, height,
+        YUV_MATRIX_BT601, YUV_RANGE_LIMITED);
+      TEST_CHECK(0 == memcmp(expected_bgra, actual, rgba_stride * height));
+      TEST_MSG("NV12 to BGRA %dx%d with %d threads", width, height, thread_counts[t]);
+      free(expected_bgra);
+
+      convert_pool_free(pool);
+    }
+
+    free(actual);
+    free(expected_nv12);
+    free(expected_i420);
+    free(expected_yuyv);
+    free(planes);
+    free(yuyv);
+  }
+}
+
+// Workers register as they start, so this waits a while for them to show up.
+static bool snapshot_has_thread(const char* name) {
+  char expected[64];
+  snprintf(expected, sizeof(expected), "thread=%s ", name);
+  static char snapshot[16384];
+  for (int i = 0; i < 1000; ++i) {
+    metrics_format_snapshot(snapshot, sizeof(snapshot));
+    if (strstr(snapshot, expected) != NULL) {
+      return true;
+    }
+    usleep(1000);
+  }
+  return false;
+}
+
+void test_convert_pool_named_workers() {
+  // Three threads including the caller, so two workers.
+  ConvertPool* pool = convert_pool_alloc_named(3, "convert0");
+  TEST_ASSERT(pool != NULL);
+  TEST_CHECK(snapshot_has_thread("convert0.0"));
+  TEST_CHECK(snapshot_has_thread("convert0.1"));
+  char snapshot[16384];
+  metrics_format_snapshot(snapshot, sizeof(snapshot));
+  TEST_CHECK(strstr(snapshot, "thread=convert0.2 ") == NULL);
+  convert_pool_free(pool);
+}
+
+TEST_LIST = {
+  {"convert_pool_band_rows", test_convert_pool_band_rows},
+  {"convert_pool_run", test_convert_pool_run},
+  {"convert_pool_matches_single_thread", test_convert_pool_matches_single_thread},
+  {"convert_pool_named_workers", test_convert_pool_named_workers},
+  {NULL, NULL},
+};
@@ -0,0 +1,91 @@
+#include "frame_cache.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+// Consumers almost always want the newest frame, so only the last conversion
+// is remembered, and it's the newest frame in the cache's store. The lock is
+// only held for as long as a conversion takes, which the waiting consumers
+// would have had to spend anyway.
+struct FrameCacheStruct
+{
+    FrameStore *store;
+    FrameCacheConvertFunc convert;
+    void *context;
+    pthread_mutex_t mutex;
+    FrameCacheStats stats;
+};
+
+FrameCache *frame_cache_alloc(FramePool *pool, FrameCacheConvertFunc convert, void *context)
+{
+    FrameCache *cache = calloc(1, sizeof(FrameCache));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    cache->store = frame_store_alloc(pool);
+    if (cache->store == NULL)
+    {
+        free(cache);
+        return NULL;
+    }
+    cache->convert = convert;
+    cache->context = context;
+    pthread_mutex_init(&cache->mutex, NULL);
+    return cache;
+}
+
+void frame_cache_free(FrameCache *cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+    frame_store_free(cache->store);
+    pthread_mutex_destroy(&cache->mutex);
+    free(cache);
+}
+
+const Frame *frame_cache_get(FrameCache *cache, const Frame *source)
+{
+    pthread_mutex_lock(&cache->mutex);
+    const Frame *cached = frame_store_acquire_latest(cache->store);
+    // A consumer that fetched its source before another's may only get here
+    // after a newer frame was converted. Publishing its older one then would
+    // take the store backwards, so it gets the newer frame instead.
+    if ((cached != NULL) && (cached->sequence >= source->sequence))
+    {
+        cache->stats.reused += 1;
+        pthread_mutex_unlock(&cache->mutex);
+        return cached;
+    }
+    frame_release(cached);
+
+    Frame *converted;
+    uint8_t *output = frame_store_begin(cache->store, &converted);
+    if (output == NULL)
+    {
+        cache->stats.dropped += 1;
+        pthread_mutex_unlock(&cache->mutex);
+        return NULL;
+    }
+    cache->convert(cache->context, source, output, converted);
+    converted->data = output;
+    frame_store_publish_sequence(cache->store, converted, source->sequence);
+    cache->stats.converted += 1;
+    const Frame *result = frame_store_acquire_latest(cache->store);
+    pthread_mutex_unlock(&cache->mutex);
+    return result;
+}
+
+FrameStore *frame_cache_store(FrameCache *cache)
+{
+    return cache->store;
+}
+
+void frame_cache_get_stats(FrameCache *cache, FrameCacheStats *stats)
+{
+    pthread_mutex_lock(&cache->mutex);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->mutex);
+}
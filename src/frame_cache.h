@@ -0,0 +1,55 @@
+#ifndef INCLUDE_FRAME_CACHE_H
+#define INCLUDE_FRAME_CACHE_H
+
+#include <stdint.h>
+
+#include "frame_pool.h"
+#include "frame_store.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    // Fills in converted from source, writing its pixels to output. Everything
+    // but the data pointer and sequence number is up to the converter.
+    typedef void (*FrameCacheConvertFunc)(void *context, const Frame *source, uint8_t *output, Frame *converted);
+
+    // Converts frames the first time a consumer asks for them, and hands the
+    // same result to anyone else who asks for the same frame afterwards, so
+    // frames that nobody wants are never converted at all. Converted frames
+    // live in their own store, with the sequence number of their source.
+    typedef struct FrameCacheStruct FrameCache;
+
+    typedef struct
+    {
+        // Frames that had to be converted.
+        uint64_t converted;
+        // Requests answered from the cache.
+        uint64_t reused;
+        // Requests that failed because consumers held every buffer.
+        uint64_t dropped;
+    } FrameCacheStats;
+
+    FrameCache *frame_cache_alloc(FramePool *pool, FrameCacheConvertFunc convert, void *context);
+    // Any converted frames consumers are still holding must be released first.
+    void frame_cache_free(FrameCache *cache);
+
+    // Returns a new reference to the converted version of source, converting
+    // it now if this is the first request for it, or NULL if there was no
+    // buffer to convert into. If a newer frame than source has already been
+    // converted, that's returned instead, so the frames handed out never go
+    // backwards. Safe to call from any thread, though callers wait while
+    // another thread converts.
+    const Frame *frame_cache_get(FrameCache *cache, const Frame *source);
+
+    // Where the converted frames live, for looking frames up by their data.
+    FrameStore *frame_cache_store(FrameCache *cache);
+
+    void frame_cache_get_stats(FrameCache *cache, FrameCacheStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // INCLUDE_FRAME_CACHE_H
@@ -0,0 +1,258 @@
+#include "acutest.h"
+
+#include "frame_cache.c"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#define TEST_BYTE_COUNT 16
+
+typedef struct {
+  int call_count;
+  uint64_t last_sequence;
+} ConvertCalls;
+
+// Adds one to every byte, so it's easy to tell which source a result came from.
+static void add_one(void* context, const Frame* source, uint8_t* output, Frame* converted) {
+  ConvertCalls* calls = (ConvertCalls*)(context);
+  calls->call_count += 1;
+  calls->last_sequence = source->sequence;
+  for (int i = 0; i < TEST_BYTE_COUNT; ++i) {
+    output[i] = source->data[i] + 1;
+  }
+  converted->width = source->width;
+  converted->height = source->height;
+  converted->stride = source->stride;
+  converted->format = FRAME_FORMAT_RGBA;
+  converted->timestamp_ns = source->timestamp_ns;
+}
+
+static void publish_filled(FrameStore* store, uint8_t value) {
+  Frame* frame;
+  uint8_t* buffer = frame_store_begin(store, &frame);
+  TEST_ASSERT(buffer != NULL);
+  memset(buffer, value, TEST_BYTE_COUNT);
+  frame->width = TEST_BYTE_COUNT / 2;
+  frame->height = 1;
+  frame->stride = TEST_BYTE_COUNT;
+  frame->format = FRAME_FORMAT_YUYV;
+  frame->timestamp_ns = value;
+  frame_store_publish(store, frame);
+}
+
+void test_frame_cache_converts_once() {
+  FramePool* source_pool = frame_pool_alloc(4, TEST_BYTE_COUNT);
+  FrameStore* sources = frame_store_alloc(source_pool);
+  FramePool* pool = frame_pool_alloc(4, TEST_BYTE_COUNT);
+  ConvertCalls calls = {0};
+  FrameCache* cache = frame_cache_alloc(pool, add_one, &calls);
+  TEST_ASSERT(cache != NULL);
+
+  publish_filled(sources, 10);
+  const Frame* source = frame_store_acquire_latest(sources);
+  const Frame* first = frame_cache_get(cache, source);
+  TEST_ASSERT(first != NULL);
+  TEST_CHECK(first->data[0] == 11);
+  TEST_CHECK(first->sequence == source->sequence);
+  TEST_CHECK(first->format == FRAME_FORMAT_RGBA);
+  TEST_CHECK(first->timestamp_ns == 10);
+  const Frame* second = frame_cache_get(cache, source);
+  TEST_CHECK(second == first);
+  TEST_CHECK(calls.call_count == 1);
+  TEST_CHECK(frame_store_frame_for_data(frame_cache_store(cache), first->data) == first);
+  frame_release(second);
+  frame_release(first);
+  frame_release(source);
+
+  // Frames nobody asks for are never converted.
+  for (int i = 0; i < 5; ++i) {
+    publish_filled(sources, 20 + i);
+  }
+  source = frame_store_acquire_latest(sources);
+  const Frame* newest = frame_cache_get(cache, source);
+  TEST_ASSERT(newest != NULL);
+  TEST_CHECK(newest->data[0] == 25);
+  TEST_CHECK(newest->sequence == 6);
+  TEST_CHECK(calls.call_count == 2);
+  TEST_CHECK(calls.last_sequence == 6);
+  frame_release(newest);
+  frame_release(source);
+
+  FrameCacheStats stats;
+  frame_cache_get_stats(cache, &stats);
+  TEST_CHECK(stats.converted == 2);
+  TEST_CHECK(stats.reused == 1);
+  TEST_CHECK(stats.dropped == 0);
+
+  frame_cache_free(cache);
+  frame_pool_free(pool);
+  frame_store_free(sources);
+  frame_pool_free(source_pool);
+}
+
+void test_frame_cache_exhaustion() {
+  FramePool* source_pool = frame_pool_alloc(8, TEST_BYTE_COUNT);
+  FrameStore* sources = frame_store_alloc(source_pool);
+  FramePool* pool = frame_pool_alloc(2, TEST_BYTE_COUNT);
+  ConvertCalls calls = {0};
+  FrameCache* cache = frame_cache_alloc(pool, add_one, &calls);
+
+  const Frame* held[2];
+  for (int i = 0; i < 2; ++i) {
+    publish_filled(sources, i);
+    const Frame* source = frame_store_acquire_latest(sources);
+    held[i] = frame_cache_get(cache, source);
+    TEST_CHECK(held[i] != NULL);
+    frame_release(source);
+  }
+
+  // Consumers are holding both buffers, so there's nowhere to convert into.
+  publish_filled(sources, 2);
+  const Frame* source = frame_store_acquire_latest(sources);
+  TEST_CHECK(frame_cache_get(cache, source) == NULL);
+  FrameCacheStats stats;
+  frame_cache_get_stats(cache, &stats);
+  TEST_CHECK(stats.dropped == 1);
+
+  // Once one is released the request can be answered.
+  frame_release(held[0]);
+  const Frame* converted = frame_cache_get(cache, source);
+  TEST_ASSERT(converted != NULL);
+  TEST_CHECK(converted->data[0] == 3);
+  frame_release(converted);
+  frame_release(source);
+  frame_release(held[1]);
+
+  frame_cache_free(cache);
+  frame_pool_free(pool);
+  frame_store_free(sources);
+  frame_pool_free(source_pool);
+}
+
+void test_frame_cache_never_goes_backwards() {
+  FramePool* source_pool = frame_pool_alloc(4, TEST_BYTE_COUNT);
+  FrameStore* sources = frame_store_alloc(source_pool);
+  FramePool* pool = frame_pool_alloc(4, TEST_BYTE_COUNT);
+  ConvertCalls calls = {0};
+  FrameCache* cache = frame_cache_alloc(pool, add_one, &calls);
+
+  // One consumer fetches a source, and another fetches a newer one and gets
+  // it converted first.
+  publish_filled(sources, 10);
+  const Frame* older = frame_store_acquire_latest(sources);
+  publish_filled(sources, 20);
+  const Frame* newer = frame_store_acquire_latest(sources);
+  const Frame* first = frame_cache_get(cache, newer);
+  TEST_ASSERT(first != NULL);
+  TEST_CHECK(first->data[0] == 21);
+
+  // The slower consumer gets the newer frame too, rather than its older one
+  // being converted and published over it.
+  const Frame* second = frame_cache_get(cache, older);
+  TEST_CHECK(second == first);
+  TEST_CHECK(calls.call_count == 1);
+  const Frame* latest = frame_store_acquire_latest(frame_cache_store(cache));
+  TEST_CHECK(latest->sequence == newer->sequence);
+  frame_release(latest);
+  frame_release(second);
+  frame_release(first);
+  frame_release(newer);
+  frame_release(older);
+
+  FrameCacheStats stats;
+  frame_cache_get_stats(cache, &stats);
+  TEST_CHECK(stats.converted == 1);
+  TEST_CHECK(stats.reused == 1);
+
+  frame_cache_free(cache);
+  frame_pool_free(pool);
+  frame_store_free(sources);
+  frame_pool_free(source_pool);
+}
+
+#define CONSUMER_COUNT 3
+#define PUBLISH_COUNT 2000
+
+typedef struct {
+  FrameStore* sources;
+  FrameCache* cache;
+  _Atomic bool* done;
+  int mismatches;
+  int regressions;
+} ConsumerArgs;
+
+static void* consume(void* cookie) {
+  ConsumerArgs* args = (ConsumerArgs*)(cookie);
+  uint64_t last_sequence = 0;
+  while (!atomic_load(args->done)) {
+    const Frame* source = frame_store_acquire_latest(args->sources);
+    if (source == NULL) {
+      continue;
+    }
+    const Frame* converted = frame_cache_get(args->cache, source);
+    if (converted != NULL) {
+      // Another consumer may have had a newer frame converted in the meantime.
+      const bool matches = (converted->sequence > source->sequence) ||
+        ((converted->sequence == source->sequence) && (converted->data[0] == (uint8_t)(source->data[0] + 1)));
+      args->mismatches += matches ? 0 : 1;
+      args->regressions += (converted->sequence < last_sequence) ? 1 : 0;
+      last_sequence = converted->sequence;
+      frame_release(converted);
+    }
+    frame_release(source);
+  }
+  return NULL;
+}
+
+void test_frame_cache_threaded() {
+  FramePool* source_pool = frame_pool_alloc(8, TEST_BYTE_COUNT);
+  FrameStore* sources = frame_store_alloc(source_pool);
+  FramePool* pool = frame_pool_alloc(CONSUMER_COUNT + 2, TEST_BYTE_COUNT);
+  ConvertCalls calls = {0};
+  FrameCache* cache = frame_cache_alloc(pool, add_one, &calls);
+  _Atomic bool done = false;
+
+  pthread_t threads[CONSUMER_COUNT];
+  ConsumerArgs args[CONSUMER_COUNT];
+  for (int i = 0; i < CONSUMER_COUNT; ++i) {
+    args[i] = (ConsumerArgs){sources, cache, &done, 0, 0};
+    TEST_ASSERT(pthread_create(&threads[i], NULL, consume, &args[i]) == 0);
+  }
+  for (int i = 0; i < PUBLISH_COUNT; ++i) {
+    Frame* frame;
+    uint8_t* buffer = frame_store_begin(sources, &frame);
+    if (buffer == NULL) {
+      sched_yield();
+      continue;
+    }
+    memset(buffer, i, TEST_BYTE_COUNT);
+    frame_store_publish(sources, frame);
+  }
+  atomic_store(&done, true);
+  for (int i = 0; i < CONSUMER_COUNT; ++i) {
+    pthread_join(threads[i], NULL);
+    TEST_CHECK(args[i].mismatches == 0);
+    TEST_CHECK(args[i].regressions == 0);
+  }
+
+  FrameCacheStats stats;
+  frame_cache_get_stats(cache, &stats);
+  TEST_CHECK(stats.converted == (uint64_t)(calls.call_count));
+  TEST_MSG("converted %llu, reused %llu", (unsigned long long)(stats.converted),
+    (unsigned long long)(stats.reused));
+
+  frame_cache_free(cache);
+  frame_pool_free(pool);
+  frame_store_free(sources);
+  frame_pool_free(source_pool);
+}
+
+TEST_LIST = {
+  {"frame_cache_converts_once", test_frame_cache_converts_once},
+  {"frame_cache_exhaustion", test_frame_cache_exhaustion},
+  {"frame_cache_never_goes_backwards", test_frame_cache_never_goes_backwards},
+  {"frame_cache_threaded", test_frame_cache_threaded},
+  {NULL, NULL},
+};
@@ -0,0 +1,166 @@
+#include "frame_latency.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+// Buckets are microseconds wide up to 16 us, and beyond that each power of two
+// is split into 16 buckets, so every bucket is within 1/16th of its value.
+// The last bucket, a little over an hour, takes anything bigger.
+#define FRAME_LATENCY_SUB_BUCKET_BITS 4
+#define FRAME_LATENCY_SUB_BUCKETS (1 << FRAME_LATENCY_SUB_BUCKET_BITS)
+#define FRAME_LATENCY_MAX_BIT 31
+#define FRAME_LATENCY_BUCKET_COUNT \
+    ((FRAME_LATENCY_MAX_BIT - FRAME_LATENCY_SUB_BUCKET_BITS + 2) * FRAME_LATENCY_SUB_BUCKETS)
+
+typedef struct
+{
+    _Atomic uint64_t buckets[FRAME_LATENCY_BUCKET_COUNT];
+    _Atomic int64_t max_ns;
+} LatencyHistogram;
+
+static LatencyHistogram g_histograms[FRAME_LATENCY_STAGE_COUNT];
+static _Atomic uint64_t g_driver_drops = 0;
+
+static const char *stage_names[FRAME_LATENCY_STAGE_COUNT] = {
+    "dequeue",
+    "prepared",
+    "consumed",
+    "presented",
+};
+
+static int bucket_for_us(uint64_t us)
+{
+    if (us < FRAME_LATENCY_SUB_BUCKETS)
+    {
+        return (int)(us);
+    }
+    const int top_bit = 63 - __builtin_clzll(us);
+    if (top_bit > FRAME_LATENCY_MAX_BIT)
+    {
+        return FRAME_LATENCY_BUCKET_COUNT - 1;
+    }
+    const int shift = top_bit - FRAME_LATENCY_SUB_BUCKET_BITS;
+    return ((shift + 1) * FRAME_LATENCY_SUB_BUCKETS) + (int)((us >> shift) - FRAME_LATENCY_SUB_BUCKETS);
+}
+
+// The first microsecond count past the end of a bucket.
+static uint64_t bucket_end_us(int bucket)
+{
+    if (bucket < FRAME_LATENCY_SUB_BUCKETS)
+    {
+        return bucket + 1;
+    }
+    const int shift = (bucket / FRAME_LATENCY_SUB_BUCKETS) - 1;
+    const uint64_t start = (uint64_t)(FRAME_LATENCY_SUB_BUCKETS + (bucket % FRAME_LATENCY_SUB_BUCKETS)) << shift;
+    return start + (1ull << shift);
+}
+
+void frame_latency_record(FrameLatencyStage stage, int64_t timestamp_ns, int64_t now_ns)
+{
+    LatencyHistogram *histogram = &g_histograms[stage];
+    const int64_t latency_ns = (now_ns > timestamp_ns) ? (now_ns - timestamp_ns) : 0;
+    atomic_fetch_add_explicit(&histogram->buckets[bucket_for_us(latency_ns / 1000)], 1, memory_order_relaxed);
+    int64_t max_ns = atomic_load_explicit(&histogram->max_ns, memory_order_relaxed);
+    while ((latency_ns > max_ns) && !atomic_compare_exchange_weak_explicit(&histogram->max_ns, &max_ns, latency_ns,
+                                                                           memory_order_relaxed, memory_order_relaxed))
+    {
+    }
+}
+
+void frame_latency_add_driver_drops(uint64_t count)
+{
+    atomic_fetch_add_explicit(&g_driver_drops, count, memory_order_relaxed);
+}
+
+// Finds the bucket holding the given rank, counting from one.
+static int64_t rank_ns(const uint64_t *buckets, uint64_t rank)
+{
+    uint64_t seen = 0;
+    for (int i = 0; i < FRAME_LATENCY_BUCKET_COUNT; ++i)
+    {
+        seen += buckets[i];
+        if (seen >= rank)
+        {
+            return (int64_t)(bucket_end_us(i)) * 1000;
+        }
+    }
+    return 0;
+}
+
+void frame_latency_get_stats(FrameLatencyStage stage, FrameLatencyStats *stats)
+{
+    LatencyHistogram *histogram = &g_histograms[stage];
+    // Other threads may be recording, so the total comes from the same copy
+    // of the buckets as the ranks do.
+    uint64_t buckets[FRAME_LATENCY_BUCKET_COUNT];
+    uint64_t count = 0;
+    for (int i = 0; i < FRAME_LATENCY_BUCKET_COUNT; ++i)
+    {
+        buckets[i] = atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        count += buckets[i];
+    }
+    stats->count = count;
+    stats->max_ns = atomic_load_explicit(&histogram->max_ns, memory_order_relaxed);
+    if (count == 0)
+    {
+        stats->p50_ns = 0;
+        stats->p99_ns = 0;
+        return;
+    }
+    stats->p50_ns = rank_ns(buckets, (count + 1) / 2);
+    stats->p99_ns = rank_ns(buckets, count - (count / 100));
+    // Nothing was slower than the slowest, whatever its bucket says.
+    if (stats->p50_ns > stats->max_ns)
+    {
+        stats->p50_ns = stats->max_ns;
+    }
+    if (stats->p99_ns > stats->max_ns)
+    {
+        stats->p99_ns = stats->max_ns;
+    }
+}
+
+uint64_t frame_latency_driver_drops(void)
+{
+    return atomic_load_explicit(&g_driver_drops, memory_order_relaxed);
+}
+
+void frame_latency_log_stats(void)
+{
+    for (int i = 0; i < FRAME_LATENCY_STAGE_COUNT; ++i)
+    {
+        FrameLatencyStats stats;
+        frame_latency_get_stats(i, &stats);
+        if (stats.count == 0)
+        {
+            continue;
+        }
+        fprintf(stderr, "Capture to %s: %llu frames, p50 %.2f ms, p99 %.2f ms, max %.2f ms\n", stage_names[i],
+                (unsigned long long)(stats.count), stats.p50_ns / 1e6, stats.p99_ns / 1e6, stats.max_ns / 1e6);
+    }
+    const uint64_t drops = frame_latency_driver_drops();
+    if (drops > 0)
+    {
+        fprintf(stderr, "Drivers dropped %llu frames in all, going by their sequence numbers\n",
+                (unsigned long long)(drops));
+    }
+}
+
+void frame_latency_reset(void)
+{
+    for (int i = 0; i < FRAME_LATENCY_STAGE_COUNT; ++i)
+    {
+        frame_latency_reset_stage(i);
+    }
+    atomic_store(&g_driver_drops, 0);
+}
+
+void frame_latency_reset_stage(FrameLatencyStage stage)
+{
+    LatencyHistogram *histogram = &g_histograms[stage];
+    for (int i = 0; i < FRAME_LATENCY_BUCKET_COUNT; ++i)
+    {
+        atomic_store(&histogram->buckets[i], 0);
+    }
+    atomic_store(&histogram->max_ns, 0);
+}
@@ -0,0 +1,60 @@
+#ifndef INCLUDE_FRAME_LATENCY_H
+#define INCLUDE_FRAME_LATENCY_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    // How old frames are at each point on their way from the driver to the
+    // screen, measured from the driver's capture timestamp, gathered into one
+    // histogram per point for the whole process. Recording is a couple of
+    // atomic adds, so it's safe from any thread, and cheap enough to do for
+    // every frame.
+    typedef enum
+    {
+        // Taken off the driver's queue by the capture thread.
+        FRAME_LATENCY_DEQUEUED = 0,
+        // Copied or converted by the capture workers, ready to publish.
+        FRAME_LATENCY_PREPARED,
+        // Picked up by the display, and uploaded or drawn.
+        FRAME_LATENCY_CONSUMED,
+        // On the screen, as far as the display can tell.
+        FRAME_LATENCY_PRESENTED,
+        FRAME_LATENCY_STAGE_COUNT,
+    } FrameLatencyStage;
+
+    typedef struct
+    {
+        uint64_t count;
+        // Percentiles come from the histogram's buckets, so they're the upper
+        // edge of the bucket they fall in, within about 6% of the true value.
+        // The maximum is exact.
+        int64_t p50_ns;
+        int64_t p99_ns;
+        int64_t max_ns;
+    } FrameLatencyStats;
+
+    // Records a frame reaching a stage at now_ns, both in CLOCK_MONOTONIC
+    // nanoseconds. Frames that seem to arrive before they were captured, from
+    // drivers stamping with another clock, count as zero.
+    void frame_latency_record(FrameLatencyStage stage, int64_t timestamp_ns, int64_t now_ns);
+    // Frames the driver skipped, going by the gaps in its sequence numbers.
+    void frame_latency_add_driver_drops(uint64_t count);
+
+    void frame_latency_get_stats(FrameLatencyStage stage, FrameLatencyStats *stats);
+    uint64_t frame_latency_driver_drops(void);
+    void frame_latency_log_stats(void);
+    // Clears everything, though not atomically with respect to recording.
+    void frame_latency_reset(void);
+    // Clears one stage's histogram, with the same caveat, so it's best done
+    // from the only thread that records that stage.
+    void frame_latency_reset_stage(FrameLatencyStage stage);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // INCLUDE_FRAME_LATENCY_H
@@ -0,0 +1,103 @@
+#include "acutest.h"
+
+#include "frame_latency.c"
+
+#include <pthread.h>
+
+void test_frame_latency_buckets() {
+  // Every value lands in a bucket that ends past it, and not by much.
+  for (uint64_t us = 0; us < 100000000; us += 1 + (us / 7)) {
+    const int bucket = bucket_for_us(us);
+    TEST_CHECK(bucket >= 0);
+    TEST_CHECK(bucket < FRAME_LATENCY_BUCKET_COUNT);
+    TEST_CHECK(bucket_end_us(bucket) > us);
+    TEST_CHECK(bucket_end_us(bucket) <= (us + 1 + (us / 16)));
+    TEST_MSG("%llu us went in bucket %d, which ends at %llu", (unsigned long long)(us), bucket,
+      (unsigned long long)(bucket_end_us(bucket)));
+    if (bucket > 0) {
+      TEST_CHECK(bucket_end_us(bucket - 1) <= us);
+    }
+  }
+  TEST_CHECK(bucket_for_us(UINT64_MAX) == (FRAME_LATENCY_BUCKET_COUNT - 1));
+}
+
+void test_frame_latency_percentiles() {
+  frame_latency_reset();
+  FrameLatencyStats stats;
+  frame_latency_get_stats(FRAME_LATENCY_PRESENTED, &stats);
+  TEST_CHECK(stats.count == 0);
+  TEST_CHECK(stats.p99_ns == 0);
+
+  // A hundred frames from 1 to 100 ms, each captured at a different time.
+  for (int i = 1; i <= 100; ++i) {
+    const int64_t timestamp_ns = i * 1000000000ll;
+    frame_latency_record(FRAME_LATENCY_PRESENTED, timestamp_ns, timestamp_ns + (i * 1000000ll));
+  }
+  frame_latency_get_stats(FRAME_LATENCY_PRESENTED, &stats);
+  TEST_CHECK(stats.count == 100);
+  TEST_CHECK(stats.max_ns == 100000000);
+  TEST_CHECK((stats.p50_ns >= 50000000) && (stats.p50_ns <= 53200000));
+  TEST_MSG("p50 was %lld ns", (long long)(stats.p50_ns));
+  TEST_CHECK((stats.p99_ns >= 99000000) && (stats.p99_ns <= stats.max_ns));
+  TEST_MSG("p99 was %lld ns", (long long)(stats.p99_ns));
+
+  // Other stages are kept apart, and time going backwards counts as zero.
+  frame_latency_record(FRAME_LATENCY_DEQUEUED, 2000, 1000);
+  frame_latency_get_stats(FRAME_LATENCY_DEQUEUED, &stats);
+  TEST_CHECK(stats.count == 1);
+  TEST_CHECK(stats.max_ns == 0);
+  TEST_CHECK(stats.p50_ns == 0);
+
+  frame_latency_add_driver_drops(3);
+  frame_latency_add_driver_drops(2);
+  TEST_CHECK(frame_latency_driver_drops() == 5);
+  frame_latency_reset();
+  TEST_CHECK(frame_latency_driver_drops() == 0);
+  frame_latency_get_stats(FRAME_LATENCY_PRESENTED, &stats);
+  TEST_CHECK(stats.count == 0);
+  TEST_CHECK(stats.max_ns == 0);
+
+  // Clearing one stage leaves the others, and the driver drops, alone.
+  frame_latency_record(FRAME_LATENCY_DEQUEUED, 0, 1000000);
+  frame_latency_record(FRAME_LATENCY_CONSUMED, 0, 900000000);
+  frame_latency_add_driver_drops(1);
+  frame_latency_reset_stage(FRAME_LATENCY_CONSUMED);
+  frame_latency_get_stats(FRAME_LATENCY_CONSUMED, &stats);
+  TEST_CHECK(stats.count == 0);
+  TEST_CHECK(stats.max_ns == 0);
+  frame_latency_get_stats(FRAME_LATENCY_DEQUEUED, &stats);
+  TEST_CHECK(stats.count == 1);
+  TEST_CHECK(stats.max_ns == 1000000);
+  TEST_CHECK(frame_latency_driver_drops() == 1);
+}
+
+static void* record_many(void* cookie) {
+  const int64_t latency_ns = (int64_t)(intptr_t)(cookie);
+  for (int i = 0; i < 10000; ++i) {
+    frame_latency_record(FRAME_LATENCY_CONSUMED, 0, latency_ns);
+  }
+  return NULL;
+}
+
+void test_frame_latency_threads() {
+  frame_latency_reset();
+  pthread_t threads[4];
+  for (int i = 0; i < 4; ++i) {
+    TEST_ASSERT(pthread_create(&threads[i], NULL, record_many, (void*)(intptr_t)((i + 1) * 1000000)) == 0);
+  }
+  for (int i = 0; i < 4; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  FrameLatencyStats stats;
+  frame_latency_get_stats(FRAME_LATENCY_CONSUMED, &stats);
+  TEST_CHECK(stats.count == 40000);
+  TEST_CHECK(stats.max_ns == 4000000);
+  frame_latency_reset();
+}
+
+TEST_LIST = {
+  {"frame_latency_buckets", test_frame_latency_buckets},
+  {"frame_latency_percentiles", test_frame_latency_percentiles},
+  {"frame_latency_threads", test_frame_latency_threads},
+  {NULL, NULL},
+};
@@ -0,0 +1,172 @@
+#include "frame_pool.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAME_POOL_CACHE_LINE_SIZE 64
+
+// The head of the free list packs a buffer index (plus one, so zero means the
+// list is empty) into the low 32 bits, and a counter that goes up on every pop
+// into the high 32 bits. The counter stops a stale compare-and-swap from
+// succeeding if a buffer is popped and pushed again in between (the ABA
+// problem).
+#define FRAME_POOL_EMPTY 0
+#define FRAME_POOL_INDEX_MASK 0xffffffffull
+#define FRAME_POOL_TAG_INCREMENT (1ull << 32)
+
+struct FramePoolStruct
+{
+    uint8_t *memory;
+    int buffer_count;
+    size_t buffer_size;
+    size_t buffer_stride;
+    _Atomic uint64_t free_head;
+    // For each buffer, the index plus one of the next free buffer.
+    atomic_uint *next_free;
+    atomic_int in_use;
+    atomic_int high_water_mark;
+    _Atomic uint64_t exhausted_count;
+};
+
+static size_t round_up_to_cache_line(size_t size)
+{
+    return (size + (FRAME_POOL_CACHE_LINE_SIZE - 1)) & ~(size_t)(FRAME_POOL_CACHE_LINE_SIZE - 1);
+}
+
+FramePool *frame_pool_alloc(int buffer_count, size_t buffer_size)
+{
+    FramePool *pool = calloc(1, sizeof(FramePool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    pool->buffer_count = buffer_count;
+    pool->buffer_size = buffer_size;
+    pool->buffer_stride = round_up_to_cache_line(buffer_size);
+    void *memory = NULL;
+    if (0 != posix_memalign(&memory, FRAME_POOL_CACHE_LINE_SIZE, pool->buffer_stride * buffer_count))
+    {
+        free(pool);
+        return NULL;
+    }
+    pool->memory = memory;
+    // Fault every page in now, rather than on the capture thread later.
+    memset(pool->memory, 0, pool->buffer_stride * buffer_count);
+
+    pool->next_free = calloc(buffer_count, sizeof(atomic_uint));
+    if (pool->next_free == NULL)
+    {
+        free(pool->memory);
+        free(pool);
+        return NULL;
+    }
+    for (int i = 0; i < buffer_count; ++i)
+    {
+        const unsigned int next = (i + 1) < buffer_count ? (i + 2) : FRAME_POOL_EMPTY;
+        atomic_init(&pool->next_free[i], next);
+    }
+    atomic_init(&pool->free_head, buffer_count > 0 ? 1 : FRAME_POOL_EMPTY);
+    atomic_init(&pool->in_use, 0);
+    atomic_init(&pool->high_water_mark, 0);
+    atomic_init(&pool->exhausted_count, 0);
+    return pool;
+}
+
+void frame_pool_free(FramePool *pool)
+{
+    if (pool == NULL)
+    {
+        return;
+    }
+    free(pool->next_free);
+    free(pool->memory);
+    free(pool);
+}
+
+uint8_t *frame_pool_acquire(FramePool *pool)
+{
+    uint64_t head = atomic_load_explicit(&pool->free_head, memory_order_acquire);
+    uint64_t new_head;
+    unsigned int index;
+    do
+    {
+        index = head & FRAME_POOL_INDEX_MASK;
+        if (index == FRAME_POOL_EMPTY)
+        {
+            atomic_fetch_add_explicit(&pool->exhausted_count, 1, memory_order_relaxed);
+            return NULL;
+        }
+        const unsigned int next = atomic_load_explicit(&pool->next_free[index - 1], memory_order_relaxed);
+        new_head = ((head & ~FRAME_POOL_INDEX_MASK) + FRAME_POOL_TAG_INCREMENT) | next;
+    } while (!atomic_compare_exchange_weak_explicit(&pool->free_head, &head, new_head,
+                                                    memory_order_acq_rel, memory_order_acquire));
+
+    const int in_use = atomic_fetch_add_explicit(&pool->in_use, 1, memory_order_relaxed) + 1;
+    int high_water_mark = atomic_load_explicit(&pool->high_water_mark, memory_order_relaxed);
+    while ((in_use > high_water_mark) &&
+           !atomic_compare_exchange_weak_explicit(&pool->high_water_mark, &high_water_mark, in_use,
+                                                  memory_order_relaxed, memory_order_relaxed))
+    {
+    }
+    return pool->memory + ((index - 1) * pool->buffer_stride);
+}
+
+void frame_pool_release(FramePool *pool, uint8_t *buffer)
+{
+    if (buffer == NULL)
+    {
+        return;
+    }
+    const unsigned int index = frame_pool_buffer_index(pool, buffer) + 1;
+    uint64_t head = atomic_load_explicit(&pool->free_head, memory_order_relaxed);
+    uint64_t new_head;
+    do
+    {
+        atomic_store_explicit(&pool->next_free[index - 1], head & FRAME_POOL_INDEX_MASK, memory_order_relaxed);
+        new_head = (head & ~FRAME_POOL_INDEX_MASK) | index;
+    } while (!atomic_compare_exchange_weak_explicit(&pool->free_head, &head, new_head,
+                                                    memory_order_release, memory_order_relaxed));
+    atomic_fetch_sub_explicit(&pool->in_use, 1, memory_order_relaxed);
+}
+
+bool frame_pool_owns(const FramePool *pool, const uint8_t *buffer)
+{
+    return (buffer >= pool->memory) && (buffer < (pool->memory + (pool->buffer_stride * pool->buffer_count)));
+}
+
+int frame_pool_buffer_index(const FramePool *pool, const uint8_t *buffer)
+{
+    return (buffer - pool->memory) / pool->buffer_stride;
+}
+
+int frame_pool_buffer_count(const FramePool *pool)
+{
+    return pool->buffer_count;
+}
+
+size_t frame_pool_buffer_size(const FramePool *pool)
+{
+    return pool->buffer_size;
+}
+
+void frame_pool_get_stats(const FramePool *pool, FramePoolStats *stats)
+{
+    // The atomics are only read here, but the accessors need non-const pointers.
+    FramePool *mutable_pool = (FramePool *)(pool);
+    stats->buffer_count = pool->buffer_count;
+    stats->buffer_size = pool->buffer_size;
+    stats->in_use = atomic_load_explicit(&mutable_pool->in_use, memory_order_relaxed);
+    stats->high_water_mark = atomic_load_explicit(&mutable_pool->high_water_mark, memory_order_relaxed);
+    stats->exhausted_count = atomic_load_explicit(&mutable_pool->exhausted_count, memory_order_relaxed);
+}
+
+void frame_pool_log_stats(const FramePool *pool, const char *name)
+{
+    FramePoolStats stats;
+    frame_pool_get_stats(pool, &stats);
+    fprintf(stderr, "%s pool: %d x %zu bytes, %d in use, high water mark %d, exhausted %llu times\n",
+            name, stats.buffer_count, stats.buffer_size, stats.in_use, stats.high_water_mark,
+            (unsigned long long)(stats.exhausted_count));
+}
@@ -0,0 +1,54 @@
+#ifndef INCLUDE_FRAME_POOL_H
+#define INCLUDE_FRAME_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    // A fixed set of equally-sized frame buffers, allocated once up front and
+    // recycled through a lock-free free list, so that the capture loop never
+    // touches the heap. Every buffer starts on a cache line boundary, and the
+    // memory is touched at creation time so there are no page faults later.
+    typedef struct FramePoolStruct FramePool;
+
+    typedef struct
+    {
+        int buffer_count;
+        size_t buffer_size;
+        // How many buffers are currently handed out.
+        int in_use;
+        // The most buffers that have ever been handed out at the same time.
+        int high_water_mark;
+        // How many times a buffer was asked for when none were free.
+        uint64_t exhausted_count;
+    } FramePoolStats;
+
+    FramePool *frame_pool_alloc(int buffer_count, size_t buffer_size);
+    void frame_pool_free(FramePool *pool);
+
+    // Returns NULL if every buffer is in use. Safe to call from any thread.
+    uint8_t *frame_pool_acquire(FramePool *pool);
+    // Hands a buffer back to the pool. Safe to call from any thread.
+    void frame_pool_release(FramePool *pool, uint8_t *buffer);
+
+    // Whether a pointer is one of the pool's buffers.
+    bool frame_pool_owns(const FramePool *pool, const uint8_t *buffer);
+    // Where a buffer sits in the pool, from zero up to the buffer count, so
+    // callers can keep their own per-buffer bookkeeping in a plain array.
+    int frame_pool_buffer_index(const FramePool *pool, const uint8_t *buffer);
+
+    int frame_pool_buffer_count(const FramePool *pool);
+    size_t frame_pool_buffer_size(const FramePool *pool);
+    void frame_pool_get_stats(const FramePool *pool, FramePoolStats *stats);
+    void frame_pool_log_stats(const FramePool *pool, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // INCLUDE_FRAME_POOL_H
@@ -0,0 +1,118 @@
+#include "acutest.h"
+
+#include "frame_pool.c"
+
+#include <pthread.h>
+
+void test_frame_pool_alignment() {
+  // An odd size makes sure every buffer, not just the first, is aligned.
+  FramePool* pool = frame_pool_alloc(4, 1000);
+  TEST_CHECK(pool != NULL);
+  TEST_CHECK(frame_pool_buffer_size(pool) == 1000);
+  TEST_CHECK(frame_pool_buffer_count(pool) == 4);
+  uint8_t* buffers[4];
+  for (int i = 0; i < 4; ++i) {
+    buffers[i] = frame_pool_acquire(pool);
+    TEST_CHECK(buffers[i] != NULL);
+    TEST_CHECK(((uintptr_t)(buffers[i]) % 64) == 0);
+    TEST_CHECK(frame_pool_owns(pool, buffers[i]));
+    TEST_CHECK(frame_pool_buffer_index(pool, buffers[i]) == i);
+    for (int j = 0; j < i; ++j) {
+      TEST_CHECK(buffers[i] != buffers[j]);
+    }
+  }
+  uint8_t not_pooled;
+  TEST_CHECK(!frame_pool_owns(pool, &not_pooled));
+  for (int i = 0; i < 4; ++i) {
+    frame_pool_release(pool, buffers[i]);
+  }
+  frame_pool_free(pool);
+}
+
+void test_frame_pool_exhaustion() {
+  FramePool* pool = frame_pool_alloc(2, 16);
+  uint8_t* first = frame_pool_acquire(pool);
+  uint8_t* second = frame_pool_acquire(pool);
+  TEST_CHECK(frame_pool_acquire(pool) == NULL);
+  TEST_CHECK(frame_pool_acquire(pool) == NULL);
+
+  FramePoolStats stats;
+  frame_pool_get_stats(pool, &stats);
+  TEST_CHECK(stats.buffer_count == 2);
+  TEST_CHECK(stats.in_use == 2);
+  TEST_CHECK(stats.high_water_mark == 2);
+  TEST_CHECK(stats.exhausted_count == 2);
+  TEST_MSG("%llu", (unsigned long long)(stats.exhausted_count));
+
+  // Buffers are recycled, so releasing one makes it available again.
+  frame_pool_release(pool, second);
+  uint8_t* recycled = frame_pool_acquire(pool);
+  TEST_CHECK(recycled == second);
+
+  frame_pool_release(pool, first);
+  frame_pool_release(pool, recycled);
+  frame_pool_get_stats(pool, &stats);
+  TEST_CHECK(stats.in_use == 0);
+  TEST_CHECK(stats.high_water_mark == 2);
+  frame_pool_free(pool);
+}
+
+typedef struct {
+  FramePool* pool;
+  uint8_t tag;
+  int iterations;
+  int collisions;
+} WorkerArgs;
+
+static void* frame_pool_worker(void* cookie) {
+  WorkerArgs* args = (WorkerArgs*)(cookie);
+  const uint8_t tag = args->tag;
+  for (int i = 0; i < args->iterations; ++i) {
+    uint8_t* buffer = frame_pool_acquire(args->pool);
+    if (buffer == NULL) {
+      continue;
+    }
+    // If two threads are ever handed the same buffer, one of them will see the
+    // other's tag.
+    memset(buffer, tag, 64);
+    for (int j = 0; j < 64; ++j) {
+      if (buffer[j] != tag) {
+        args->collisions += 1;
+        break;
+      }
+    }
+    frame_pool_release(args->pool, buffer);
+  }
+  return NULL;
+}
+
+void test_frame_pool_threaded() {
+  const int thread_count = 4;
+  FramePool* pool = frame_pool_alloc(3, 64);
+  pthread_t threads[4];
+  WorkerArgs args[4];
+  for (int i = 0; i < thread_count; ++i) {
+    args[i] = (WorkerArgs){pool, (uint8_t)(i + 1), 20000, 0};
+    pthread_create(&threads[i], NULL, frame_pool_worker, &args[i]);
+  }
+  int collisions = 0;
+  for (int i = 0; i < thread_count; ++i) {
+    pthread_join(threads[i], NULL);
+    collisions += args[i].collisions;
+  }
+  TEST_CHECK(collisions == 0);
+  TEST_MSG("%d", collisions);
+
+  FramePoolStats stats;
+  frame_pool_get_stats(pool, &stats);
+  TEST_CHECK(stats.in_use == 0);
+  TEST_CHECK(stats.high_water_mark <= 3);
+  frame_pool_free(pool);
+}
+
+TEST_LIST = {
+  {"frame_pool_alignment", test_frame_pool_alignment},
+  {"frame_pool_exhaustion", test_frame_pool_exhaustion},
+  {"frame_pool_threaded", test_frame_pool_threaded},
+  {NULL, NULL},
+};
@@ -0,0 +1,262 @@
+#include "frame_store.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+// Frames are reference counted with a split count, so that a consumer can find
+// the newest frame and take a reference to it in a single atomic step, without
+// the producer being able to recycle it in between.
+//
+// The latest field packs the slot index of the newest frame (plus one, so zero
+// means nothing has been published) into the high 32 bits, and the number of
+// references consumers have taken through it into the low 32 bits. While a
+// frame is the newest, its own count holds a large bias standing in for those
+// references. When the producer replaces it, the references taken through
+// latest are moved across and the bias is removed, so the count only reaches
+// zero once every consumer has released it.
+#define FRAME_STORE_INDEX_SHIFT 32
+#define FRAME_STORE_COUNT_MASK 0xffffffffull
+#define FRAME_STORE_BIAS (1ll << 40)
+
+typedef struct
+{
+    // Must come first, so a Frame pointer can be turned back into its slot.
+    Frame frame;
+    FrameStore *store;
+    uint8_t *buffer;
+    // Minus one unless the pixels are in a leased buffer.
+    int lease_index;
+    _Atomic int64_t refs;
+} FrameStoreSlot;
+
+// Frames in the pool's buffers use the slot with the same index as their
+// buffer, and leased frames have the slots after those.
+struct FrameStoreStruct
+{
+    FramePool *pool;
+    FrameStoreSlot *slots;
+    int pool_slot_count;
+    int lease_count;
+    FrameStoreReturnLeaseFunc return_lease;
+    void *lease_context;
+    _Atomic uint64_t latest;
+    // Only ever touched by the producer.
+    uint64_t next_sequence;
+};
+
+static FrameStoreSlot *slot_for_frame(const Frame *frame)
+{
+    return (FrameStoreSlot *)(frame);
+}
+
+static void recycle_slot(FrameStoreSlot *slot)
+{
+    FrameStore *store = slot->store;
+    if (slot->lease_index >= 0)
+    {
+        store->return_lease(store->lease_context, slot->lease_index);
+    }
+    else
+    {
+        frame_pool_release(store->pool, slot->buffer);
+    }
+}
+
+static void release_latest(FrameStore *store, uint64_t latest)
+{
+    const uint64_t index = latest >> FRAME_STORE_INDEX_SHIFT;
+    if (index == 0)
+    {
+        return;
+    }
+    FrameStoreSlot *slot = &store->slots[index - 1];
+    const int64_t delta = (int64_t)(latest & FRAME_STORE_COUNT_MASK) - FRAME_STORE_BIAS;
+    const int64_t remaining = atomic_fetch_add_explicit(&slot->refs, delta, memory_order_acq_rel) + delta;
+    if (remaining == 0)
+    {
+        recycle_slot(slot);
+    }
+}
+
+FrameStore *frame_store_alloc(FramePool *pool)
+{
+    return frame_store_alloc_with_leases(pool, 0, NULL, NULL);
+}
+
+FrameStore *frame_store_alloc_with_leases(FramePool *pool, int lease_count, FrameStoreReturnLeaseFunc return_lease,
+                                          void *context)
+{
+    FrameStore *store = calloc(1, sizeof(FrameStore));
+    if (store == NULL)
+    {
+        return NULL;
+    }
+    store->pool = pool;
+    store->pool_slot_count = frame_pool_buffer_count(pool);
+    store->lease_count = lease_count;
+    store->return_lease = return_lease;
+    store->lease_context = context;
+    const int slot_count = store->pool_slot_count + lease_count;
+    store->slots = calloc(slot_count, sizeof(FrameStoreSlot));
+    if (store->slots == NULL)
+    {
+        free(store);
+        return NULL;
+    }
+    for (int i = 0; i < slot_count; ++i)
+    {
+        store->slots[i].store = store;
+        atomic_init(&store->slots[i].refs, 0);
+    }
+    atomic_init(&store->latest, 0);
+    store->next_sequence = 1;
+    return store;
+}
+
+void frame_store_free(FrameStore *store)
+{
+    if (store == NULL)
+    {
+        return;
+    }
+    release_latest(store, atomic_exchange_explicit(&store->latest, 0, memory_order_acq_rel));
+    free(store->slots);
+    free(store);
+}
+
+uint8_t *frame_store_begin(FrameStore *store, Frame **frame)
+{
+    uint8_t *buffer = frame_pool_acquire(store->pool);
+    if (buffer == NULL)
+    {
+        *frame = NULL;
+        return NULL;
+    }
+    FrameStoreSlot *slot = &store->slots[frame_pool_buffer_index(store->pool, buffer)];
+    slot->buffer = buffer;
+    slot->lease_index = -1;
+    slot->frame = (Frame){.data = buffer};
+    atomic_store_explicit(&slot->refs, FRAME_STORE_BIAS, memory_order_relaxed);
+    *frame = &slot->frame;
+    return buffer;
+}
+
+Frame *frame_store_begin_lease(FrameStore *store, int lease_index, const uint8_t *data)
+{
+    FrameStoreSlot *slot = &store->slots[store->pool_slot_count + lease_index];
+    slot->buffer = NULL;
+    slot->lease_index = lease_index;
+    slot->frame = (Frame){.data = data};
+    atomic_store_explicit(&slot->refs, FRAME_STORE_BIAS, memory_order_relaxed);
+    return &slot->frame;
+}
+
+void frame_store_publish(FrameStore *store, Frame *frame)
+{
+    frame_store_publish_sequence(store, frame, store->next_sequence);
+}
+
+void frame_store_publish_sequence(FrameStore *store, Frame *frame, uint64_t sequence)
+{
+    frame->sequence = sequence;
+    store->next_sequence = sequence + 1;
+    const uint64_t index = (slot_for_frame(frame) - store->slots) + 1;
+    // Release makes the pixels and the frame's fields visible to consumers.
+    const uint64_t previous = atomic_exchange_explicit(
+        &store->latest, index << FRAME_STORE_INDEX_SHIFT, memory_order_acq_rel);
+    release_latest(store, previous);
+}
+
+void frame_store_discard(FrameStore *store, Frame *frame)
+{
+    recycle_slot(slot_for_frame(frame));
+}
+
+void frame_store_withdraw_latest(FrameStore *store)
+{
+    release_latest(store, atomic_exchange_explicit(&store->latest, 0, memory_order_acq_rel));
+}
+
+const Frame *frame_store_acquire_latest(FrameStore *store)
+{
+    if ((atomic_load_explicit(&store->latest, memory_order_relaxed) >> FRAME_STORE_INDEX_SHIFT) == 0)
+    {
+        return NULL;
+    }
+    // The newest frame can only have been withdrawn since the check above, in
+    // which case the reference lands on nothing, and is thrown away along
+    // with it when the next frame is published.
+    const uint64_t latest = atomic_fetch_add_explicit(&store->latest, 1, memory_order_acq_rel);
+    const uint64_t index = latest >> FRAME_STORE_INDEX_SHIFT;
+    if (index == 0)
+    {
+        return NULL;
+    }
+    return &store->slots[index - 1].frame;
+}
+
+const Frame *frame_store_frame_for_data(FrameStore *store, const uint8_t *data)
+{
+    if (frame_pool_owns(store->pool, data))
+    {
+        return &store->slots[frame_pool_buffer_index(store->pool, data)].frame;
+    }
+    for (int i = 0; i < store->lease_count; ++i)
+    {
+        const Frame *frame = &store->slots[store->pool_slot_count + i].frame;
+        if (frame->data == data)
+        {
+            return frame;
+        }
+    }
+    return NULL;
+}
+
+void frame_retain(const Frame *frame)
+{
+    atomic_fetch_add_explicit(&slot_for_frame(frame)->refs, 1, memory_order_relaxed);
+}
+
+void frame_release(const Frame *frame)
+{
+    if (frame == NULL)
+    {
+        return;
+    }
+    FrameStoreSlot *slot = slot_for_frame(frame);
+    if (atomic_fetch_sub_explicit(&slot->refs, 1, memory_order_acq_rel) == 1)
+    {
+        recycle_slot(slot);
+    }
+}
+
+const char *frame_format_name(FrameFormat format)
+{
+    switch (format)
+    {
+    case FRAME_FORMAT_RGBA:
+        return "RGBA";
+    case FRAME_FORMAT_BGRA:
+        return "BGRA";
+    case FRAME_FORMAT_YUYV:
+        return "YUYV";
+    case FRAME_FORMAT_NV12:
+        return "NV12";
+    case FRAME_FORMAT_I420:
+        return "YUV420";
+    }
+    return "unknown";
+}
+
+size_t frame_byte_count(const Frame *frame)
+{
+    const size_t first_plane_bytes = (size_t)(frame->stride) * frame->height;
+    switch (frame->format)
+    {
+    case FRAME_FORMAT_NV12:
+    case FRAME_FORMAT_I420:
+        return first_plane_bytes + ((size_t)(frame->stride) * ((frame->height + 1) / 2));
+    default:
+        return first_plane_bytes;
+    }
+}
@@ -0,0 +1,116 @@
+#ifndef INCLUDE_FRAME_STORE_H
+#define INCLUDE_FRAME_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frame_pool.h"
+#include "yuv_convert.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    typedef enum
+    {
+        FRAME_FORMAT_RGBA,
+        // RGBA with red and blue swapped, which is what most GPUs store
+        // textures as.
+        FRAME_FORMAT_BGRA,
+        // Packed Y0 U Y1 V.
+        FRAME_FORMAT_YUYV,
+        // A Y plane, then a half-size plane of interleaved U and V.
+        FRAME_FORMAT_NV12,
+        // A Y plane, then half-size U and V planes.
+        FRAME_FORMAT_I420,
+    } FrameFormat;
+
+    // A captured image and what we know about it. Consumers only ever see
+    // const handles, and the pixels never change while any handle is held, so
+    // any number of threads can read the same frame without copying it.
+    typedef struct
+    {
+        const uint8_t *data;
+        int width;
+        int height;
+        // Bytes from the start of one row to the start of the next.
+        int stride;
+        FrameFormat format;
+        // How the YUV formats were encoded. Ignored for RGBA and BGRA.
+        YuvMatrix yuv_matrix;
+        YuvRange yuv_range;
+        // Starts at one and goes up by one for every frame published.
+        uint64_t sequence;
+        // When the frame was captured, in CLOCK_MONOTONIC nanoseconds.
+        int64_t timestamp_ns;
+        // The driver's own count, which skips any frames it dropped.
+        uint32_t driver_sequence;
+        // When the capture thread dequeued the frame, and when the workers had
+        // it ready to publish, in the same clock.
+        int64_t dequeued_ns;
+        int64_t prepared_ns;
+    } Frame;
+
+    // Publishes frames from one producer thread to any number of consumer
+    // threads. Consumers always get the newest frame, and hold on to it for as
+    // long as they like by keeping a reference. Every frame lives in one of the
+    // pool's buffers, which goes back to the pool once the last reference is
+    // released. Nothing here takes a lock or touches the heap.
+    typedef struct FrameStoreStruct FrameStore;
+
+    // Called once the last reference to a leased frame has been released, from
+    // whichever thread released it, so the buffer can go back to its owner.
+    typedef void (*FrameStoreReturnLeaseFunc)(void *context, int lease_index);
+
+    FrameStore *frame_store_alloc(FramePool *pool);
+    // Also lets the producer publish frames whose pixels stay in up to
+    // lease_count buffers it doesn't own, like a driver's capture buffers, so
+    // consumers can read them without a copy.
+    FrameStore *frame_store_alloc_with_leases(FramePool *pool, int lease_count, FrameStoreReturnLeaseFunc return_lease,
+                                              void *context);
+    // Any frames consumers are still holding must be released first.
+    void frame_store_free(FrameStore *store);
+
+    // Producer side. Returns a frame to fill in along with the buffer to write
+    // its pixels to, or NULL if the pool has run out because consumers are
+    // holding on to too many frames. The frame must then either be published or
+    // discarded. Publishing fills in the sequence number.
+    uint8_t *frame_store_begin(FrameStore *store, Frame **frame);
+    void frame_store_publish(FrameStore *store, Frame *frame);
+    // Publishes with a given sequence number instead, for stores holding
+    // frames derived from another store's, so both agree on which is which.
+    void frame_store_publish_sequence(FrameStore *store, Frame *frame, uint64_t sequence);
+    void frame_store_discard(FrameStore *store, Frame *frame);
+    // Like frame_store_begin(), but the frame's pixels are left where they are,
+    // in the leased buffer, until the frame is done with. Each lease index
+    // must be returned before it's used again.
+    Frame *frame_store_begin_lease(FrameStore *store, int lease_index, const uint8_t *data);
+    // Stops handing out the newest frame and drops the store's reference to
+    // it, so once consumers have released theirs nothing is left holding any
+    // frame. Publishing again brings it back.
+    void frame_store_withdraw_latest(FrameStore *store);
+
+    // Consumer side. Returns a new reference to the newest frame, or NULL if
+    // nothing has been published yet. Safe to call from any thread.
+    const Frame *frame_store_acquire_latest(FrameStore *store);
+    // Looks up the frame whose pixels start at data, without adding a reference.
+    const Frame *frame_store_frame_for_data(FrameStore *store, const uint8_t *data);
+
+    // Adds another reference to a frame, so it can be handed to another owner.
+    void frame_retain(const Frame *frame);
+    // Drops a reference. The frame must not be touched afterwards.
+    void frame_release(const Frame *frame);
+
+    const char *frame_format_name(FrameFormat format);
+    // How many bytes the frame's pixels take up, including any chroma planes,
+    // which follow the first plane directly with rows half as long (or the
+    // same length for NV12's interleaved plane).
+    size_t frame_byte_count(const Frame *frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // INCLUDE_FRAME_STORE_H
@@ -0,0 +1,332 @@
+#include "acutest.h"
+
+#include "frame_store.c"
+
+#include <pthread.h>
+#include <string.h>
+
+static void publish_filled(FrameStore* store, int byte_count, uint8_t value) {
+  Frame* frame;
+  uint8_t* buffer = frame_store_begin(store, &frame);
+  TEST_ASSERT(buffer != NULL);
+  memset(buffer, value, byte_count);
+  frame->width = byte_count / 4;
+  frame->height = 1;
+  frame->stride = byte_count;
+  frame->format = FRAME_FORMAT_RGBA;
+  frame->timestamp_ns = value;
+  frame_store_publish(store, frame);
+}
+
+static int buffers_in_use(FramePool* pool) {
+  FramePoolStats stats;
+  frame_pool_get_stats(pool, &stats);
+  return stats.in_use;
+}
+
+void test_frame_store_empty() {
+  FramePool* pool = frame_pool_alloc(4, 16);
+  FrameStore* store = frame_store_alloc(pool);
+  TEST_CHECK(store != NULL);
+  TEST_CHECK(frame_store_acquire_latest(store) == NULL);
+  frame_store_free(store);
+  TEST_CHECK(buffers_in_use(pool) == 0);
+  frame_pool_free(pool);
+}
+
+void test_frame_store_newest_wins() {
+  FramePool* pool = frame_pool_alloc(4, 16);
+  FrameStore* store = frame_store_alloc(pool);
+
+  publish_filled(store, 16, 1);
+  publish_filled(store, 16, 2);
+  // Only the newest frame is kept alive by the store itself.
+  TEST_CHECK(buffers_in_use(pool) == 1);
+
+  const Frame* frame = frame_store_acquire_latest(store);
+  TEST_ASSERT(frame != NULL);
+  TEST_CHECK(frame->data[0] == 2);
+  TEST_CHECK(frame->sequence == 2);
+  TEST_CHECK(frame->width == 4);
+  TEST_CHECK(frame->stride == 16);
+  TEST_CHECK(frame->format == FRAME_FORMAT_RGBA);
+  TEST_CHECK(frame->timestamp_ns == 2);
+  TEST_CHECK(frame_store_frame_for_data(store, frame->data) == frame);
+  uint8_t not_pooled[16];
+  TEST_CHECK(frame_store_frame_for_data(store, not_pooled) == NULL);
+
+  // A held frame is never written to, however many newer ones arrive.
+  for (int i = 0; i < 5; ++i) {
+    publish_filled(store, 16, 3 + i);
+  }
+  TEST_CHECK(frame->data[0] == 2);
+  TEST_CHECK(frame->sequence == 2);
+
+  const Frame* newest = frame_store_acquire_latest(store);
+  TEST_CHECK(newest->data[0] == 7);
+  TEST_CHECK(newest->sequence == 7);
+  TEST_CHECK(buffers_in_use(pool) == 2);
+
+  frame_release(frame);
+  TEST_CHECK(buffers_in_use(pool) == 1);
+  frame_release(newest);
+  TEST_CHECK(buffers_in_use(pool) == 1);
+
+  frame_store_free(store);
+  TEST_CHECK(buffers_in_use(pool) == 0);
+  frame_pool_free(pool);
+}
+
+void test_frame_store_retain() {
+  FramePool* pool = frame_pool_alloc(4, 16);
+  FrameStore* store = frame_store_alloc(pool);
+  publish_filled(store, 16, 1);
+
+  const Frame* frame = frame_store_acquire_latest(store);
+  frame_retain(frame);
+  publish_filled(store, 16, 2);
+  TEST_CHECK(buffers_in_use(pool) == 2);
+  frame_release(frame);
+  TEST_CHECK(buffers_in_use(pool) == 2);
+  TEST_CHECK(frame->data[0] == 1);
+  frame_release(frame);
+  TEST_CHECK(buffers_in_use(pool) == 1);
+
+  frame_store_free(store);
+  frame_pool_free(pool);
+}
+
+void test_frame_store_exhaustion() {
+  FramePool* pool = frame_pool_alloc(2, 16);
+  FrameStore* store = frame_store_alloc(pool);
+
+  publish_filled(store, 16, 1);
+  const Frame* held = frame_store_acquire_latest(store);
+  publish_filled(store, 16, 2);
+
+  // One buffer is held by a consumer and the other is the newest frame, so
+  // there's nothing left to capture into.
+  Frame* frame;
+  TEST_CHECK(frame_store_begin(store, &frame) == NULL);
+  TEST_CHECK(frame == NULL);
+
+  frame_release(held);
+  TEST_CHECK(frame_store_begin(store, &frame) != NULL);
+  frame_store_discard(store, frame);
+  TEST_CHECK(buffers_in_use(pool) == 1);
+
+  frame_store_free(store);
+  frame_pool_free(pool);
+}
+
+typedef struct {
+  FrameStore* store;
+  int frame_count;
+  int byte_count;
+} ProducerArgs;
+
+static void* frame_store_producer(void* cookie) {
+  ProducerArgs* args = (ProducerArgs*)(cookie);
+  int published = 0;
+  while (published < args->frame_count) {
+    Frame* frame;
+    uint8_t* buffer = frame_store_begin(args->store, &frame);
+    if (buffer == NULL) {
+      continue;
+    }
+    published += 1;
+    memset(buffer, published & 0xff, args->byte_count);
+    frame_store_publish(args->store, frame);
+  }
+  return NULL;
+}
+
+typedef struct {
+  FrameStore* store;
+  int frame_count;
+  int byte_count;
+  int torn_frames;
+  int backwards_frames;
+} ConsumerArgs;
+
+static void* frame_store_consumer(void* cookie) {
+  ConsumerArgs* args = (ConsumerArgs*)(cookie);
+  uint64_t last_sequence = 0;
+  while (last_sequence < (uint64_t)(args->frame_count)) {
+    const Frame* frame = frame_store_acquire_latest(args->store);
+    if (frame == NULL) {
+      continue;
+    }
+    if (frame->sequence < last_sequence) {
+      args->backwards_frames += 1;
+    }
+    last_sequence = frame->sequence;
+    for (int i = 0; i < args->byte_count; ++i) {
+      if (frame->data[i] != (frame->sequence & 0xff)) {
+        args->torn_frames += 1;
+        break;
+      }
+    }
+    frame_release(frame);
+  }
+  return NULL;
+}
+
+void test_frame_store_threaded() {
+  // Every frame is filled with a value derived from its sequence number, so a
+  // torn frame, a recycled one, or one that goes backwards in time shows up
+  // immediately in any of the consumers.
+  const int byte_count = 4096;
+  const int frame_count = 20000;
+  const int consumer_count = 3;
+  FramePool* pool = frame_pool_alloc(6, byte_count);
+  FrameStore* store = frame_store_alloc(pool);
+
+  ProducerArgs producer_args = {store, frame_count, byte_count};
+  pthread_t producer;
+  pthread_create(&producer, NULL, frame_store_producer, &producer_args);
+  ConsumerArgs consumer_args[3];
+  pthread_t consumers[3];
+  for (int i = 0; i < consumer_count; ++i) {
+    consumer_args[i] = (ConsumerArgs){store, frame_count, byte_count, 0, 0};
+    pthread_create(&consumers[i], NULL, frame_store_consumer, &consumer_args[i]);
+  }
+
+  pthread_join(producer, NULL);
+  for (int i = 0; i < consumer_count; ++i) {
+    pthread_join(consumers[i], NULL);
+    TEST_CHECK(consumer_args[i].torn_frames == 0);
+    TEST_MSG("%d", consumer_args[i].torn_frames);
+    TEST_CHECK(consumer_args[i].backwards_frames == 0);
+    TEST_MSG("%d", consumer_args[i].backwards_frames);
+  }
+  TEST_CHECK(buffers_in_use(pool) == 1);
+
+  frame_store_free(store);
+  TEST_CHECK(buffers_in_use(pool) == 0);
+  frame_pool_free(pool);
+}
+
+void test_frame_store_publish_sequence() {
+  FramePool* pool = frame_pool_alloc(4, 16);
+  FrameStore* store = frame_store_alloc(pool);
+
+  Frame* frame;
+  TEST_ASSERT(frame_store_begin(store, &frame) != NULL);
+  frame_store_publish_sequence(store, frame, 42);
+  const Frame* latest = frame_store_acquire_latest(store);
+  TEST_CHECK(latest->sequence == 42);
+  frame_release(latest);
+  // Plain publishing carries on from there.
+  publish_filled(store, 16, 1);
+  latest = frame_store_acquire_latest(store);
+  TEST_CHECK(latest->sequence == 43);
+  frame_release(latest);
+
+  frame_store_free(store);
+  frame_pool_free(pool);
+}
+
+typedef struct {
+  int returned[2];
+} LeaseReturns;
+
+static void count_return(void* context, int lease_index) {
+  LeaseReturns* returns = (LeaseReturns*)(context);
+  returns->returned[lease_index] += 1;
+}
+
+void test_frame_store_leases() {
+  FramePool* pool = frame_pool_alloc(2, 16);
+  LeaseReturns returns = {{0, 0}};
+  FrameStore* store = frame_store_alloc_with_leases(pool, 2, count_return, &returns);
+  TEST_ASSERT(store != NULL);
+  uint8_t leased[2][16];
+
+  Frame* frame = frame_store_begin_lease(store, 1, leased[1]);
+  TEST_CHECK(frame->data == leased[1]);
+  frame->width = 4;
+  frame_store_publish(store, frame);
+  const Frame* held = frame_store_acquire_latest(store);
+  TEST_CHECK(held->data == leased[1]);
+  TEST_CHECK(frame_store_frame_for_data(store, leased[1]) == held);
+  TEST_CHECK(buffers_in_use(pool) == 0);
+
+  // Leased and pooled frames take turns without getting mixed up.
+  publish_filled(store, 16, 7);
+  TEST_CHECK(returns.returned[1] == 0);
+  frame_release(held);
+  TEST_CHECK(returns.returned[1] == 1);
+
+  frame = frame_store_begin_lease(store, 0, leased[0]);
+  frame_store_publish(store, frame);
+  TEST_CHECK(buffers_in_use(pool) == 0);
+  frame = frame_store_begin_lease(store, 1, leased[1]);
+  frame_store_discard(store, frame);
+  TEST_CHECK(returns.returned[1] == 2);
+
+  frame_store_free(store);
+  TEST_CHECK(returns.returned[0] == 1);
+  frame_pool_free(pool);
+}
+
+void test_frame_store_withdraw_latest() {
+  FramePool* pool = frame_pool_alloc(2, 16);
+  LeaseReturns returns = {{0, 0}};
+  FrameStore* store = frame_store_alloc_with_leases(pool, 2, count_return, &returns);
+  TEST_ASSERT(store != NULL);
+  uint8_t leased[16];
+
+  frame_store_publish(store, frame_store_begin_lease(store, 0, leased));
+  const Frame* held = frame_store_acquire_latest(store);
+  TEST_ASSERT(held != NULL);
+  frame_store_withdraw_latest(store);
+  TEST_CHECK(frame_store_acquire_latest(store) == NULL);
+  // The consumer's reference is all that's left.
+  TEST_CHECK(returns.returned[0] == 0);
+  frame_release(held);
+  TEST_CHECK(returns.returned[0] == 1);
+
+  // A consumer that raced with the withdrawal leaves a stray reference that
+  // mustn't land on anything when the next frame replaces it.
+  atomic_fetch_add(&store->latest, 1);
+  publish_filled(store, 16, 3);
+  TEST_CHECK(buffers_in_use(pool) == 1);
+  held = frame_store_acquire_latest(store);
+  TEST_CHECK(held->data[0] == 3);
+  frame_release(held);
+  frame_store_withdraw_latest(store);
+  TEST_CHECK(buffers_in_use(pool) == 0);
+
+  frame_store_free(store);
+  frame_pool_free(pool);
+}
+
+void test_frame_byte_count() {
+  Frame frame = {0};
+  frame.width = 6;
+  frame.height = 5;
+  frame.stride = 8;
+  frame.format = FRAME_FORMAT_BGRA;
+  TEST_CHECK(frame_byte_count(&frame) == 40);
+  frame.format = FRAME_FORMAT_YUYV;
+  TEST_CHECK(frame_byte_count(&frame) == 40);
+  // Odd heights still get a chroma row for the last luma row.
+  frame.format = FRAME_FORMAT_NV12;
+  TEST_CHECK(frame_byte_count(&frame) == 64);
+  frame.format = FRAME_FORMAT_I420;
+  TEST_CHECK(frame_byte_count(&frame) == 64);
+}
+
+TEST_LIST = {
+  {"frame_store_empty", test_frame_store_empty},
+  {"frame_store_newest_wins", test_frame_store_newest_wins},
+  {"frame_store_retain", test_frame_store_retain},
+  {"frame_store_exhaustion", test_frame_store_exhaustion},
+  {"frame_store_threaded", test_frame_store_threaded},
+  {"frame_store_publish_sequence", test_frame_store_publish_sequence},
+  {"frame_store_leases", test_frame_store_leases},
+  {"frame_store_withdraw_latest", test_frame_store_withdraw_latest},
+  {"frame_byte_count", test_frame_byte_count},
+  {NULL, NULL},
+};
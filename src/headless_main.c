@@ -0,0 +1,206 @@
+#include "headless_main.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "app_main.h"
+#include "capture_main.h"
+#include "frame_latency.h"
+#include "metrics.h"
+#include "time_utils.h"
+#include "trace.h"
+
+// As many as the other displays show.
+#define MAX_FEEDS 16
+
+typedef struct
+{
+    // The sequence number of the last frame consumed, zero if there hasn't
+    // been one yet.
+    uint64_t consumed_sequence;
+    // Stands in for the texture each frame would be uploaded to.
+    uint8_t *texture;
+    size_t texture_size;
+} Feed;
+
+static Feed g_feeds[MAX_FEEDS];
+
+static pthread_mutex_t g_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static HeadlessStats g_stats;
+
+static Metric *g_frames_consumed_metric;
+static Metric *g_frames_dropped_display_metric;
+static Metric *g_frames_dequeued_metric;
+
+static int64_t process_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ((int64_t)(ts.tv_sec) * 1000000000) + ts.tv_nsec;
+}
+
+// Copies the frame the way glTexSubImage2D() would, so the benchmark pays
+// for reading every pixel as a real display does.
+static void UploadFrame(Feed *feed, const Frame *frame)
+{
+    TRACE_SCOPE("upload");
+    const size_t byte_count = frame_byte_count(frame);
+    if (feed->texture_size < byte_count)
+    {
+        free(feed->texture);
+        feed->texture = malloc(byte_count);
+        if (feed->texture == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        feed->texture_size = byte_count;
+    }
+    memcpy(feed->texture, frame->data, byte_count);
+}
+
+static void RecordConsumed(uint64_t skipped, int64_t now_ns)
+{
+    const HeadlessSample sample = {now_ns, process_cpu_ns(), metrics_value(g_frames_dequeued_metric)};
+    pthread_mutex_lock(&g_stats_mutex);
+    if (g_stats.frames_consumed == 0)
+    {
+        g_stats.first = sample;
+        // The first frame waited on startup, so latencies are counted from
+        // here too. Only this thread records consumed frames.
+        frame_latency_reset_stage(FRAME_LATENCY_CONSUMED);
+    }
+    g_stats.last = sample;
+    g_stats.frames_consumed += 1;
+    g_stats.frames_skipped += skipped;
+    pthread_mutex_unlock(&g_stats_mutex);
+}
+
+static void ConsumeLatestFrames()
+{
+    TRACE_SCOPE("consume frames");
+    int feed_count = get_capture_device_count();
+    if (feed_count > MAX_FEEDS)
+    {
+        feed_count = MAX_FEEDS;
+    }
+    for (int i = 0; i < feed_count; ++i)
+    {
+        Feed *feed = &g_feeds[i];
+        // Frames are converted here on first use, as they are for the shared
+        // memory display.
+        const Frame *frame = get_latest_device_rgb_frame(i);
+        if (frame == NULL)
+        {
+            // Camera capture is not yet ready, or has stopped.
+            continue;
+        }
+        if (frame->sequence > feed->consumed_sequence)
+        {
+            UploadFrame(feed, frame);
+            const int64_t now_ns = time_monotonic_ns();
+            frame_latency_record(FRAME_LATENCY_CONSUMED, frame->timestamp_ns, now_ns);
+            metrics_add(g_frames_consumed_metric, 1);
+            uint64_t skipped = 0;
+            if ((feed->consumed_sequence != 0) && (frame->sequence > (feed->consumed_sequence + 1)))
+            {
+                skipped = frame->sequence - feed->consumed_sequence - 1;
+                metrics_add(g_frames_dropped_display_metric, skipped);
+            }
+            feed->consumed_sequence = frame->sequence;
+            RecordConsumed(skipped, now_ns);
+        }
+        frame_release(frame);
+    }
+}
+
+// Sleeps until the capture event fd says there's a new frame, giving up now
+// and again in case the devices haven't been set up yet.
+static void WaitForFrame(int capture_fd)
+{
+    struct pollfd fd = {.fd = capture_fd, .events = POLLIN};
+    const int ready_count = poll(&fd, 1, 100);
+    if ((ready_count == -1) && (errno != EINTR))
+    {
+        fprintf(stderr, "poll error %d, %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (ready_count > 0)
+    {
+        uint64_t count;
+        const ssize_t bytes_read = read(capture_fd, &count, sizeof(count));
+        (void)(bytes_read);
+    }
+}
+
+// Sleeps until the next tick of a loop running at a fixed rate. A loop that
+// has fallen behind starts again from now, rather than rushing to catch up.
+static void WaitForTick(int64_t period_ns, int64_t *next_tick_ns)
+{
+    const int64_t now_ns = time_monotonic_ns();
+    *next_tick_ns += period_ns;
+    if (*next_tick_ns < now_ns)
+    {
+        *next_tick_ns = now_ns;
+    }
+    const struct timespec deadline = {*next_tick_ns / 1000000000, *next_tick_ns % 1000000000};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+    {
+    }
+}
+
+void *headless_main(void *cookie)
+{
+    const Args *args = (const Args *)(cookie);
+    TRACE_THREAD_NAME("display");
+    metrics_register_thread("display");
+    g_frames_consumed_metric = metrics_counter("frames_consumed");
+    g_frames_dropped_display_metric = metrics_counter("frames_dropped_display");
+    g_frames_dequeued_metric = metrics_counter("frames_dequeued");
+
+    const int capture_fd = get_capture_event_fd();
+    if (capture_fd == -1)
+    {
+        fprintf(stderr, "Couldn't create the capture event fd, error %d, %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    const double fps = args->display.headless_fps;
+    const int64_t period_ns = (fps > 0.0) ? (int64_t)(1e9 / fps) : 0;
+    if (period_ns > 0)
+    {
+        fprintf(stderr, "Consuming frames without a display at %g fps\n", fps);
+    }
+    else
+    {
+        fprintf(stderr, "Consuming every frame without a display\n");
+    }
+
+    int64_t next_tick_ns = time_monotonic_ns();
+    while (1)
+    {
+        if (period_ns > 0)
+        {
+            WaitForTick(period_ns, &next_tick_ns);
+        }
+        else
+        {
+            WaitForFrame(capture_fd);
+        }
+        ConsumeLatestFrames();
+    }
+    return NULL;
+}
+
+void headless_main_get_stats(HeadlessStats *stats)
+{
+    pthread_mutex_lock(&g_stats_mutex);
+    *stats = g_stats;
+    pthread_mutex_unlock(&g_stats_mutex);
+}
@@ -0,0 +1,41 @@
+#ifndef INCLUDE_HEADLESS_MAIN_H
+#define INCLUDE_HEADLESS_MAIN_H
+
+#include <stdint.h>
+
+// Consumes frames the way the displays do, but without showing them, for
+// benchmarks and machines with no X server. At a fixed rate, like a render
+// loop tied to the refresh, it takes the newest RGB frame from every device
+// and copies it as a texture upload would. With a rate of zero, it takes each
+// frame as soon as it's published instead. The consumed latency histogram is
+// cleared when the first frame arrives, so it leaves out startup too.
+void *headless_main(void *cookie);
+
+// Taken whenever the headless display consumes a new frame.
+typedef struct
+{
+    // CLOCK_MONOTONIC.
+    int64_t time_ns;
+    // The whole process's CPU time.
+    int64_t cpu_ns;
+    // Frames dequeued from every device so far.
+    int64_t frames_captured;
+} HeadlessSample;
+
+typedef struct
+{
+    uint64_t frames_consumed;
+    // Frames published that were never consumed, because newer ones had
+    // replaced them by the time it looked.
+    uint64_t frames_skipped;
+    // From the first and the latest frames consumed, so rates worked out
+    // between them leave out startup.
+    HeadlessSample first;
+    HeadlessSample last;
+} HeadlessStats;
+
+// Safe to call from any thread, while the headless display is running or
+// after capture has stopped.
+void headless_main_get_stats(HeadlessStats *stats);
+
+#endif // INCLUDE_HEADLESS_MAIN_H
@@ -0,0 +1,368 @@
+#include "metrics.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define METRICS_NAME_SIZE 48
+#define METRICS_UNIX_PREFIX "unix:"
+// Room for every metric and thread with a long name and a big value.
+#define METRICS_SNAPSHOT_SIZE ((METRICS_MAX_COUNT + METRICS_MAX_THREADS) * (METRICS_NAME_SIZE + 64))
+
+typedef enum
+{
+    METRIC_COUNTER = 0,
+    METRIC_GAUGE,
+} MetricKind;
+
+// Each one gets its own cache line, so threads updating different metrics
+// never slow each other down.
+struct MetricStruct
+{
+    _Alignas(64) _Atomic int64_t value;
+    MetricKind kind;
+    char name[METRICS_NAME_SIZE];
+};
+
+typedef struct
+{
+    char name[METRICS_NAME_SIZE];
+    clockid_t clock;
+    bool is_alive;
+} MetricsThread;
+
+// Slots are filled under the lock, then published by bumping the count, so
+// the writer can read everything below the count without taking it.
+static Metric g_metrics[METRICS_MAX_COUNT];
+static _Atomic int g_metric_count = 0;
+static MetricsThread g_threads[METRICS_MAX_THREADS];
+static _Atomic int g_thread_count = 0;
+static pthread_mutex_t g_registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Handed out once the registry is full.
+static Metric g_overflow_metric;
+
+static pthread_t g_writer_thread;
+static pthread_mutex_t g_writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_writer_cond = PTHREAD_COND_INITIALIZER;
+static bool g_is_started = false;
+static bool g_stop_requested = false;
+static int g_interval_ms = 1000;
+// Where snapshots go, either a file or a socket path.
+static FILE *g_file = NULL;
+static char g_socket_path[sizeof(((struct sockaddr_un *)(NULL))->sun_path)];
+static int g_socket_fd = -1;
+
+static Metric *register_metric(const char *name, MetricKind kind)
+{
+    pthread_mutex_lock(&g_registry_mutex);
+    const int count = atomic_load(&g_metric_count);
+    Metric *metric = NULL;
+    for (int i = 0; i < count; ++i)
+    {
+        if (strcmp(g_metrics[i].name, name) == 0)
+        {
+            metric = &g_metrics[i];
+            break;
+        }
+    }
+    if ((metric == NULL) && (count < METRICS_MAX_COUNT))
+    {
+        metric = &g_metrics[count];
+        snprintf(metric->name, METRICS_NAME_SIZE, "%s", name);
+        metric->kind = kind;
+        atomic_init(&metric->value, 0);
+        atomic_store_explicit(&g_metric_count, count + 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&g_registry_mutex);
+    if (metric == NULL)
+    {
+        fprintf(stderr, "No room for metric %s, so it won't be reported\n", name);
+        return &g_overflow_metric;
+    }
+    return metric;
+}
+
+Metric *metrics_counter(const char *name)
+{
+    return register_metric(name, METRIC_COUNTER);
+}
+
+Metric *metrics_gauge(const char *name)
+{
+    return register_metric(name, METRIC_GAUGE);
+}
+
+void metrics_add(Metric *metric, int64_t delta)
+{
+    atomic_fetch_add_explicit(&metric->value, delta, memory_order_relaxed);
+}
+
+void metrics_set(Metric *metric, int64_t value)
+{
+    atomic_store_explicit(&metric->value, value, memory_order_relaxed);
+}
+
+int64_t metrics_value(const Metric *metric)
+{
+    return atomic_load_explicit(&((Metric *)(metric))->value, memory_order_relaxed);
+}
+
+void metrics_register_thread(const char *name)
+{
+    // CLOCK_THREAD_CPUTIME_ID only ever reads the calling thread's time, so
+    // the writer needs the thread's own CPU clock instead.
+    clockid_t clock;
+    if (pthread_getcpuclockid(pthread_self(), &clock) != 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&g_registry_mutex);
+    const int count = atomic_load(&g_thread_count);
+    if (count < METRICS_MAX_THREADS)
+    {
+        MetricsThread *thread = &g_threads[count];
+        snprintf(thread->name, METRICS_NAME_SIZE, "%s", name);
+        thread->clock = clock;
+        thread->is_alive = true;
+        atomic_store_explicit(&g_thread_count, count + 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&g_registry_mutex);
+}
+
+static int64_t clock_ns(clockid_t clock, bool *ok)
+{
+    struct timespec ts;
+    *ok = (clock_gettime(clock, &ts) == 0);
+    return ((int64_t)(ts.tv_sec) * 1000000000) + ts.tv_nsec;
+}
+
+// Appends to the buffer like snprintf(), keeping count of the length it
+// would have needed if it's too small.
+static void append(char *buffer, size_t size, size_t *length, const char *format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static void append(char *buffer, size_t size, size_t *length, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    const size_t remaining = (*length < size) ? (size - *length) : 0;
+    const int written = vsnprintf((remaining > 0) ? (buffer + *length) : NULL, remaining, format, args);
+    va_end(args);
+    if (written > 0)
+    {
+        *length += written;
+    }
+}
+
+static void append_metrics(char *buffer, size_t size, size_t *length, MetricKind kind, const char *measurement,
+                           int64_t timestamp_ns)
+{
+    const int count = atomic_load_explicit(&g_metric_count, memory_order_acquire);
+    bool any = false;
+    for (int i = 0; i < count; ++i)
+    {
+        const Metric *metric = &g_metrics[i];
+        if (metric->kind != kind)
+        {
+            continue;
+        }
+        append(buffer, size, length, "%s%s=%lldi", any ? "," : measurement, metric->name,
+               (long long)(metrics_value(metric)));
+        any = true;
+    }
+    if (any)
+    {
+        append(buffer, size, length, " %lld\n", (long long)(timestamp_ns));
+    }
+}
+
+size_t metrics_format_snapshot(char *buffer, size_t size)
+{
+    bool ok;
+    const int64_t timestamp_ns = clock_ns(CLOCK_REALTIME, &ok);
+    size_t length = 0;
+    if (size > 0)
+    {
+        buffer[0] = '\0';
+    }
+    append_metrics(buffer, size, &length, METRIC_COUNTER, "v4l2_opengl_counters ", timestamp_ns);
+    append_metrics(buffer, size, &length, METRIC_GAUGE, "v4l2_opengl_gauges ", timestamp_ns);
+
+    const int64_t process_ns = clock_ns(CLOCK_PROCESS_CPUTIME_ID, &ok);
+    append(buffer, size, &length, "v4l2_opengl_cpu,thread=process cpu_ns=%lldi %lld\n", (long long)(process_ns),
+           (long long)(timestamp_ns));
+    const int thread_count = atomic_load_explicit(&g_thread_count, memory_order_acquire);
+    for (int i = 0; i < thread_count; ++i)
+    {
+        MetricsThread *thread = &g_threads[i];
+        if (!thread->is_alive)
+        {
+            continue;
+        }
+        const int64_t cpu_ns = clock_ns(thread->clock, &ok);
+        if (!ok)
+        {
+            // The thread has exited, so its clock has gone with it.
+            thread->is_alive = false;
+            continue;
+        }
+        append(buffer, size, &length, "v4l2_opengl_cpu,thread=%s cpu_ns=%lldi %lld\n", thread->name,
+               (long long)(cpu_ns), (long long)(timestamp_ns));
+    }
+    return length;
+}
+
+static void connect_socket(void)
+{
+    g_socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (g_socket_fd == -1)
+    {
+        return;
+    }
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, g_socket_path, sizeof(address.sun_path));
+    if (connect(g_socket_fd, (struct sockaddr *)(&address), sizeof(address)) == -1)
+    {
+        close(g_socket_fd);
+        g_socket_fd = -1;
+    }
+}
+
+static void write_snapshot(void)
+{
+    static char snapshot[METRICS_SNAPSHOT_SIZE];
+    size_t length = metrics_format_snapshot(snapshot, sizeof(snapshot));
+    if (length >= sizeof(snapshot))
+    {
+        length = sizeof(snapshot) - 1;
+    }
+    if (g_file != NULL)
+    {
+        fwrite(snapshot, 1, length, g_file);
+        fflush(g_file);
+        return;
+    }
+    if (g_socket_fd == -1)
+    {
+        connect_socket();
+    }
+    size_t sent = 0;
+    while ((g_socket_fd != -1) && (sent < length))
+    {
+        // Whoever's listening may go away at any time, which mustn't take us
+        // down with a SIGPIPE.
+        const ssize_t result = send(g_socket_fd, snapshot + sent, length - sent, MSG_NOSIGNAL);
+        if (result > 0)
+        {
+            sent += result;
+        }
+        else if ((result == -1) && (errno == EINTR))
+        {
+            continue;
+        }
+        else
+        {
+            close(g_socket_fd);
+            g_socket_fd = -1;
+        }
+    }
+}
+
+static void *writer_main(void *cookie)
+{
+    pthread_mutex_lock(&g_writer_mutex);
+    while (!g_stop_requested)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        const int64_t deadline_ns = deadline.tv_nsec + ((int64_t)(g_interval_ms) * 1000000);
+        deadline.tv_sec += deadline_ns / 1000000000;
+        deadline.tv_nsec = deadline_ns % 1000000000;
+        pthread_cond_timedwait(&g_writer_cond, &g_writer_mutex, &deadline);
+        if (!g_stop_requested)
+        {
+            write_snapshot();
+        }
+    }
+    pthread_mutex_unlock(&g_writer_mutex);
+    return NULL;
+}
+
+bool metrics_start(const char *destination, int interval_ms)
+{
+    if (g_is_started)
+    {
+        return false;
+    }
+    if (strncmp(destination, METRICS_UNIX_PREFIX, strlen(METRICS_UNIX_PREFIX)) == 0)
+    {
+        const char *path = destination + strlen(METRICS_UNIX_PREFIX);
+        if (strlen(path) >= sizeof(g_socket_path))
+        {
+            fprintf(stderr, "Metrics socket path '%s' is too long\n", path);
+            return false;
+        }
+        strcpy(g_socket_path, path);
+        // Nothing may be listening yet, which is fine, since we'll try again
+        // with every snapshot.
+        connect_socket();
+    }
+    else
+    {
+        g_file = fopen(destination, "a");
+        if (g_file == NULL)
+        {
+            fprintf(stderr, "Couldn't open metrics file '%s', error %d, %s\n", destination, errno, strerror(errno));
+            return false;
+        }
+    }
+    g_interval_ms = (interval_ms > 0) ? interval_ms : 1000;
+    g_stop_requested = false;
+    if (pthread_create(&g_writer_thread, NULL, writer_main, NULL) != 0)
+    {
+        if (g_file != NULL)
+        {
+            fclose(g_file);
+            g_file = NULL;
+        }
+        return false;
+    }
+    g_is_started = true;
+    return true;
+}
+
+void metrics_stop(void)
+{
+    if (!g_is_started)
+    {
+        return;
+    }
+    pthread_mutex_lock(&g_writer_mutex);
+    g_stop_requested = true;
+    pthread_cond_signal(&g_writer_cond);
+    pthread_mutex_unlock(&g_writer_mutex);
+    pthread_join(g_writer_thread, NULL);
+
+    write_snapshot();
+    if (g_file != NULL)
+    {
+        fclose(g_file);
+        g_file = NULL;
+    }
+    if (g_socket_fd != -1)
+    {
+        close(g_socket_fd);
+        g_socket_fd = -1;
+    }
+    g_is_started = false;
+}
@@ -0,0 +1,61 @@
+#ifndef INCLUDE_METRICS_H
+#define INCLUDE_METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    // Named counters and gauges for the whole process, so unattended captures
+    // can be watched from outside. Looking a metric up takes a lock, so it's
+    // done once at startup and the pointer kept, but updating one is a single
+    // relaxed atomic, cheap enough for every frame on any thread. Once
+    // started, a background thread writes every metric out at a fixed
+    // interval, along with the CPU time of each registered thread.
+    //
+    // Snapshots use the InfluxDB line protocol, one line per measurement:
+    //   v4l2_opengl_counters frames_dequeued=120i,frames_published=118i 1700000000000000000
+    //   v4l2_opengl_gauges capture_queue_depth=1i 1700000000000000000
+    //   v4l2_opengl_cpu,thread=capture cpu_ns=81234567i 1700000000000000000
+    // with timestamps in CLOCK_REALTIME nanoseconds.
+    typedef struct MetricStruct Metric;
+
+#define METRICS_MAX_COUNT 64
+#define METRICS_MAX_THREADS 64
+
+    // Both return the existing metric if the name is already registered,
+    // so separate modules can share one. Names should be snake_case, since
+    // they're written out as they are. Once every slot is taken, further
+    // metrics still work but aren't reported.
+    Metric *metrics_counter(const char *name);
+    Metric *metrics_gauge(const char *name);
+
+    void metrics_add(Metric *metric, int64_t delta);
+    void metrics_set(Metric *metric, int64_t value);
+    int64_t metrics_value(const Metric *metric);
+
+    // Adds the calling thread's CPU time to the snapshots under the given
+    // name, for as long as the thread's alive.
+    void metrics_register_thread(const char *name);
+
+    // Starts writing snapshots every interval_ms. The destination is either a
+    // file, which is appended to, or "unix:" followed by the path of a stream
+    // socket to connect to, which is retried every interval until something's
+    // listening. Returns false if the file can't be opened.
+    bool metrics_start(const char *destination, int interval_ms);
+    // Writes one last snapshot and stops. Does nothing if not started.
+    void metrics_stop(void);
+
+    // Writes a snapshot into the buffer, returning its length, or the length
+    // it would have been if that's bigger than size, like snprintf().
+    size_t metrics_format_snapshot(char *buffer, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // INCLUDE_METRICS_H
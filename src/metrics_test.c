@@ -0,0 +1,138 @@
+#include "acutest.h"
+
+#include "metrics.c"
+
+#include <pthread.h>
+
+static const char* test_metrics_path = "/tmp/metrics_test.txt";
+static const char* test_socket_path = "/tmp/metrics_test.sock";
+
+void test_metrics_registry() {
+  Metric* dequeued = metrics_counter("test_dequeued");
+  TEST_CHECK(dequeued != NULL);
+  TEST_CHECK(metrics_counter("test_dequeued") == dequeued);
+  metrics_add(dequeued, 2);
+  metrics_add(dequeued, 3);
+  TEST_CHECK(metrics_value(dequeued) == 5);
+
+  Metric* depth = metrics_gauge("test_depth");
+  TEST_CHECK(depth != dequeued);
+  metrics_set(depth, 7);
+  metrics_add(depth, -2);
+  TEST_CHECK(metrics_value(depth) == 5);
+
+  // Every metric sits on its own cache line.
+  TEST_CHECK(((uintptr_t)(dequeued) % 64) == 0);
+  TEST_CHECK(((uintptr_t)(depth) % 64) == 0);
+}
+
+static void* count_many(void* cookie) {
+  Metric* metric = (Metric*)(cookie);
+  for (int i = 0; i < 100000; ++i) {
+    metrics_add(metric, 1);
+  }
+  return NULL;
+}
+
+void test_metrics_threads() {
+  Metric* metric = metrics_counter("test_threaded");
+  pthread_t threads[4];
+  for (int i = 0; i < 4; ++i) {
+    TEST_ASSERT(pthread_create(&threads[i], NULL, count_many, metric) == 0);
+  }
+  for (int i = 0; i < 4; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  TEST_CHECK(metrics_value(metric) == 400000);
+}
+
+void test_metrics_snapshot() {
+  metrics_set(metrics_counter("test_snapshot_count"), 42);
+  metrics_set(metrics_gauge("test_snapshot_level"), -3);
+  metrics_register_thread("tester");
+  char snapshot[METRICS_SNAPSHOT_SIZE];
+  const size_t length = metrics_format_snapshot(snapshot, sizeof(snapshot));
+  TEST_CHECK(length == strlen(snapshot));
+  TEST_CHECK(strncmp(snapshot, "v4l2_opengl_counters ", 21) == 0);
+  TEST_CHECK(strstr(snapshot, "test_snapshot_count=42i") != NULL);
+  TEST_CHECK(strstr(snapshot, "\nv4l2_opengl_gauges ") != NULL);
+  TEST_CHECK(strstr(snapshot, "test_snapshot_level=-3i") != NULL);
+  TEST_CHECK(strstr(snapshot, "v4l2_opengl_cpu,thread=process cpu_ns=") != NULL);
+  TEST_CHECK(strstr(snapshot, "v4l2_opengl_cpu,thread=tester cpu_ns=") != NULL);
+  TEST_MSG("%s", snapshot);
+
+  // Too small a buffer still reports the length needed.
+  char small[8];
+  TEST_CHECK(metrics_format_snapshot(small, sizeof(small)) >= length);
+  TEST_CHECK(strlen(small) == 7);
+}
+
+void test_metrics_file() {
+  unlink(test_metrics_path);
+  metrics_set(metrics_counter("test_file_count"), 9);
+  TEST_CHECK(metrics_start(test_metrics_path, 10));
+  TEST_CHECK(!metrics_start(test_metrics_path, 10));
+  usleep(50000);
+  metrics_stop();
+  metrics_stop();
+
+  FILE* file = fopen(test_metrics_path, "r");
+  TEST_ASSERT(file != NULL);
+  char line[METRICS_SNAPSHOT_SIZE];
+  int counter_lines = 0;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (strncmp(line, "v4l2_opengl_counters ", 21) == 0) {
+      TEST_CHECK(strstr(line, "test_file_count=9i") != NULL);
+      counter_lines += 1;
+    }
+  }
+  fclose(file);
+  // A few on the timer, and one more on stopping.
+  TEST_CHECK(counter_lines >= 2);
+  TEST_MSG("%d snapshots", counter_lines);
+  TEST_CHECK(!metrics_start("/some/very/unlikely/path/metrics.txt", 10));
+}
+
+void test_metrics_socket() {
+  unlink(test_socket_path);
+  const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  TEST_ASSERT(listener != -1);
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, test_socket_path);
+  TEST_ASSERT(bind(listener, (struct sockaddr*)(&address), sizeof(address)) == 0);
+  TEST_ASSERT(listen(listener, 1) == 0);
+
+  metrics_set(metrics_counter("test_socket_count"), 11);
+  char destination[128];
+  snprintf(destination, sizeof(destination), "unix:%s", test_socket_path);
+  TEST_CHECK(metrics_start(destination, 10));
+  const int connection = accept(listener, NULL, NULL);
+  TEST_ASSERT(connection != -1);
+  char received[METRICS_SNAPSHOT_SIZE];
+  size_t length = 0;
+  while ((length < (sizeof(received) - 1)) && (strstr(received, "thread=process") == NULL)) {
+    const ssize_t result = read(connection, received + length, sizeof(received) - 1 - length);
+    TEST_ASSERT(result > 0);
+    length += result;
+    received[length] = '\0';
+  }
+  TEST_CHECK(strstr(received, "test_socket_count=11i") != NULL);
+
+  // The listener going away doesn't bother us.
+  close(connection);
+  close(listener);
+  usleep(30000);
+  metrics_stop();
+  unlink(test_socket_path);
+}
+
+TEST_LIST = {
+  {"metrics_registry", test_metrics_registry},
+  {"metrics_threads", test_metrics_threads},
+  {"metrics_snapshot", test_metrics_snapshot},
+  {"metrics_file", test_metrics_file},
+  {"metrics_socket", test_metrics_socket},
+  {NULL, NULL},
+};
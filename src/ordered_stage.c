@@ -0,0 +1,299 @@
+// For pthread_setaffinity_np().
+#define _GNU_SOURCE
+
+#include "ordered_stage.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "time_utils.h"
+
+typedef enum
+{
+    ORDERED_ENTRY_QUEUED,
+    ORDERED_ENTRY_PROCESSING,
+    ORDERED_ENTRY_PROCESSED,
+} OrderedEntryState;
+
+typedef struct
+{
+    OrderedEntryState state;
+    int64_t submitted_ns;
+    int64_t started_ns;
+    int64_t processed_ns;
+} OrderedEntry;
+
+// Entries live in a ring, with submission numbers counting up forever. Those
+// from finish_next to run_next are being processed or waiting to be
+// finished, and those from run_next to submit_next are waiting for a worker.
+// Everything is guarded by the mutex, apart from the items themselves, which
+// belong to whichever thread is processing or finishing them.
+struct OrderedStageStruct
+{
+    int queue_depth;
+    size_t item_size;
+    OrderedStageProcessFunc process;
+    OrderedStageFinishFunc finish;
+    void *context;
+
+    int worker_count;
+    pthread_t *workers;
+    // Workers report their CPU time as name.index, if there's a name.
+    char name[ORDERED_STAGE_NAME_SIZE];
+    int registered_workers;
+
+    OrderedEntry *entries;
+    uint8_t *items;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t work_ready;
+    pthread_cond_t all_finished;
+    uint64_t submit_next;
+    uint64_t run_next;
+    uint64_t finish_next;
+    // Set while one thread is calling finish, so the others leave it to them.
+    bool finishing;
+    bool quit;
+
+    OrderedStageStats stats;
+};
+
+static void *item_at(OrderedStage *stage, uint64_t number)
+{
+    return stage->items + ((number % stage->queue_depth) * stage->item_size);
+}
+
+static void add_time(int64_t ns, int64_t *total, int64_t *max)
+{
+    *total += ns;
+    if (ns > *max)
+    {
+        *max = ns;
+    }
+}
+
+// Called with the mutex held, and returns with it held, though it's released
+// while each item is finished.
+static void finish_processed(OrderedStage *stage)
+{
+    if (stage->finishing)
+    {
+        return;
+    }
+    stage->finishing = true;
+    while (stage->finish_next < stage->run_next)
+    {
+        OrderedEntry *entry = &stage->entries[stage->finish_next % stage->queue_depth];
+        if (entry->state != ORDERED_ENTRY_PROCESSED)
+        {
+            break;
+        }
+        const int64_t now_ns = time_monotonic_ns();
+        add_time(entry->started_ns - entry->submitted_ns, &stage->stats.queued_ns, &stage->stats.max_queued_ns);
+        add_time(entry->processed_ns - entry->started_ns, &stage->stats.processing_ns,
+                 &stage->stats.max_processing_ns);
+        add_time(now_ns - entry->processed_ns, &stage->stats.reordering_ns, &stage->stats.max_reordering_ns);
+        pthread_mutex_unlock(&stage->mutex);
+
+        stage->finish(stage->context, item_at(stage, stage->finish_next));
+
+        pthread_mutex_lock(&stage->mutex);
+        stage->finish_next += 1;
+        stage->stats.finished += 1;
+    }
+    stage->finishing = false;
+    if (stage->finish_next == stage->submit_next)
+    {
+        pthread_cond_broadcast(&stage->all_finished);
+    }
+}
+
+static void register_worker(OrderedStage *stage)
+{
+    pthread_mutex_lock(&stage->mutex);
+    const int index = stage->registered_workers;
+    stage->registered_workers += 1;
+    pthread_mutex_unlock(&stage->mutex);
+    char name[ORDERED_STAGE_NAME_SIZE + 16];
+    snprintf(name, sizeof(name), "%s.%d", stage->name, index);
+    metrics_register_thread(name);
+}
+
+static void *worker_main(void *cookie)
+{
+    OrderedStage *stage = (OrderedStage *)(cookie);
+    if (stage->name[0] != '\0')
+    {
+        register_worker(stage);
+    }
+
+    pthread_mutex_lock(&stage->mutex);
+    for (;;)
+    {
+        while (!stage->quit && (stage->run_next == stage->submit_next))
+        {
+            pthread_cond_wait(&stage->work_ready, &stage->mutex);
+        }
+        if (stage->run_next == stage->submit_next)
+        {
+            // Only reached when quitting, with nothing left to do.
+            break;
+        }
+        const uint64_t number = stage->run_next;
+        stage->run_next += 1;
+        OrderedEntry *entry = &stage->entries[number % stage->queue_depth];
+        entry->state = ORDERED_ENTRY_PROCESSING;
+        entry->started_ns = time_monotonic_ns();
+        pthread_mutex_unlock(&stage->mutex);
+
+        stage->process(stage->context, item_at(stage, number));
+
+        pthread_mutex_lock(&stage->mutex);
+        entry->state = ORDERED_ENTRY_PROCESSED;
+        entry->processed_ns = time_monotonic_ns();
+        finish_processed(stage);
+    }
+    pthread_mutex_unlock(&stage->mutex);
+    return NULL;
+}
+
+OrderedStage *ordered_stage_alloc(int worker_count, int queue_depth, size_t item_size,
+                                  OrderedStageProcessFunc process, OrderedStageFinishFunc finish, void *context)
+{
+    return ordered_stage_alloc_named(worker_count, queue_depth, item_size, process, finish, context, NULL);
+}
+
+OrderedStage *ordered_stage_alloc_named(int worker_count, int queue_depth, size_t item_size,
+                                        OrderedStageProcessFunc process, OrderedStageFinishFunc finish, void *context,
+                                        const char *name)
+{
+    OrderedStage *stage = calloc(1, sizeof(OrderedStage));
+    if (stage == NULL)
+    {
+        return NULL;
+    }
+    if (name != NULL)
+    {
+        snprintf(stage->name, sizeof(stage->name), "%s", name);
+    }
+    stage->queue_depth = queue_depth;
+    stage->item_size = item_size;
+    stage->process = process;
+    stage->finish = finish;
+    stage->context = context;
+    pthread_mutex_init(&stage->mutex, NULL);
+    pthread_cond_init(&stage->work_ready, NULL);
+    pthread_cond_init(&stage->all_finished, NULL);
+
+    stage->entries = calloc(queue_depth, sizeof(OrderedEntry));
+    stage->items = calloc(queue_depth, item_size);
+    stage->workers = calloc(worker_count, sizeof(pthread_t));
+    if ((stage->entries == NULL) || (stage->items == NULL) || (stage->workers == NULL))
+    {
+        ordered_stage_free(stage);
+        return NULL;
+    }
+    for (int i = 0; i < worker_count; ++i)
+    {
+        if (pthread_create(&stage->workers[i], NULL, worker_main, stage) != 0)
+        {
+            ordered_stage_free(stage);
+            return NULL;
+        }
+        stage->worker_count += 1;
+    }
+    return stage;
+}
+
+void ordered_stage_free(OrderedStage *stage)
+{
+    if (stage == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&stage->mutex);
+    while ((stage->worker_count > 0) && (stage->finish_next != stage->submit_next))
+    {
+        pthread_cond_wait(&stage->all_finished, &stage->mutex);
+    }
+    stage->quit = true;
+    pthread_cond_broadcast(&stage->work_ready);
+    pthread_mutex_unlock(&stage->mutex);
+    for (int i = 0; i < stage->worker_count; ++i)
+    {
+        pthread_join(stage->workers[i], NULL);
+    }
+    free(stage->workers);
+    free(stage->items);
+    free(stage->entries);
+    pthread_cond_destroy(&stage->all_finished);
+    pthread_cond_destroy(&stage->work_ready);
+    pthread_mutex_destroy(&stage->mutex);
+    free(stage);
+}
+
+bool ordered_stage_pin_workers(OrderedStage *stage, int cpu)
+{
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    bool all_pinned = true;
+    for (int i = 0; i < stage->worker_count; ++i)
+    {
+        all_pinned &= (pthread_setaffinity_np(stage->workers[i], sizeof(cpus), &cpus) == 0);
+    }
+    return all_pinned;
+}
+
+bool ordered_stage_submit(OrderedStage *stage, const void *item)
+{
+    const int64_t now_ns = time_monotonic_ns();
+    pthread_mutex_lock(&stage->mutex);
+    const int depth = stage->submit_next - stage->finish_next;
+    if (depth == stage->queue_depth)
+    {
+        stage->stats.rejected += 1;
+        pthread_mutex_unlock(&stage->mutex);
+        return false;
+    }
+    // Nobody else touches an entry outside the in-flight range.
+    memcpy(item_at(stage, stage->submit_next), item, stage->item_size);
+    OrderedEntry *entry = &stage->entries[stage->submit_next % stage->queue_depth];
+    entry->state = ORDERED_ENTRY_QUEUED;
+    entry->submitted_ns = now_ns;
+    stage->submit_next += 1;
+    stage->stats.submitted += 1;
+    if ((depth + 1) > stage->stats.max_depth)
+    {
+        stage->stats.max_depth = depth + 1;
+    }
+    pthread_cond_signal(&stage->work_ready);
+    pthread_mutex_unlock(&stage->mutex);
+    return true;
+}
+
+void ordered_stage_get_stats(OrderedStage *stage, OrderedStageStats *stats)
+{
+    pthread_mutex_lock(&stage->mutex);
+    *stats = stage->stats;
+    stats->depth = stage->submit_next - stage->finish_next;
+    pthread_mutex_unlock(&stage->mutex);
+}
+
+void ordered_stage_log_stats(OrderedStage *stage, const char *name)
+{
+    OrderedStageStats stats;
+    ordered_stage_get_stats(stage, &stats);
+    const double finished = (stats.finished > 0) ? stats.finished : 1;
+    fprintf(stderr,
+            "%s stage: %llu submitted, %llu rejected, depth %d (max %d), queued %.3f ms (max %.3f), "
+            "processing %.3f ms (max %.3f), reordering %.3f ms (max %.3f)\n",
+            name, (unsigned long long)(stats.submitted), (unsigned long long)(stats.rejected), stats.depth,
+            stats.max_depth, (stats.queued_ns / finished) / 1e6, stats.max_queued_ns / 1e6,
+            (stats.processing_ns / finished) / 1e6, stats.max_processing_ns / 1e6,
+            (stats.reordering_ns / finished) / 1e6, stats.max_reordering_ns / 1e6);
+}
@@ -0,0 +1,82 @@
+#ifndef INCLUDE_ORDERED_STAGE_H
+#define INCLUDE_ORDERED_STAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    // A bounded queue feeding a set of worker threads, whose results are
+    // finished one at a time in the order they were submitted, however the
+    // work itself gets shuffled between threads. Submitting never waits, so
+    // the thread feeding the stage keeps its own timing even when the workers
+    // fall behind, and just has to decide what to do with items that don't
+    // fit.
+    typedef struct OrderedStageStruct OrderedStage;
+
+#define ORDERED_STAGE_NAME_SIZE 32
+
+    // Runs on any of the workers, with several items in flight at once.
+    typedef void (*OrderedStageProcessFunc)(void *context, void *item);
+    // Runs once each item has been processed, in submission order, and never
+    // on more than one thread at a time.
+    typedef void (*OrderedStageFinishFunc)(void *context, void *item);
+
+    // Times are totals in nanoseconds, so averages come from dividing by the
+    // number of finished items.
+    typedef struct
+    {
+        uint64_t submitted;
+        // Turned away because the queue was full.
+        uint64_t rejected;
+        uint64_t finished;
+        // Items submitted but not finished yet, and the most there have been.
+        int depth;
+        int max_depth;
+        // From being submitted to a worker picking the item up.
+        int64_t queued_ns;
+        int64_t max_queued_ns;
+        // Inside the process function.
+        int64_t processing_ns;
+        int64_t max_processing_ns;
+        // From being processed to being finished, waiting for earlier items.
+        int64_t reordering_ns;
+        int64_t max_reordering_ns;
+    } OrderedStageStats;
+
+    // Items are copied in, so they only need to be item_size bytes of plain
+    // data. Up to queue_depth of them can be in the stage at once. Returns NULL
+    // if the threads couldn't be started.
+    OrderedStage *ordered_stage_alloc(int worker_count, int queue_depth, size_t item_size,
+                                      OrderedStageProcessFunc process, OrderedStageFinishFunc finish, void *context);
+    // The same, but each worker adds its CPU time to the metrics snapshots as
+    // name.index, counting from zero.
+    OrderedStage *ordered_stage_alloc_named(int worker_count, int queue_depth, size_t item_size,
+                                            OrderedStageProcessFunc process, OrderedStageFinishFunc finish,
+                                            void *context, const char *name);
+    // Waits for everything already submitted to be finished, then stops the
+    // workers.
+    void ordered_stage_free(OrderedStage *stage);
+
+    // Keeps every worker on the given CPU from then on, so a stage can be
+    // kept next to the cache its items are coming from. Returns false if any
+    // of them couldn't be moved, for example because the CPU doesn't exist.
+    bool ordered_stage_pin_workers(OrderedStage *stage, int cpu);
+
+    // Copies the item into the queue, or returns false straight away if the
+    // queue is full. Only one thread may submit to a stage.
+    bool ordered_stage_submit(OrderedStage *stage, const void *item);
+
+    void ordered_stage_get_stats(OrderedStage *stage, OrderedStageStats *stats);
+    // Writes the stats to stderr as one line, prefixed by the name.
+    void ordered_stage_log_stats(OrderedStage *stage, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // INCLUDE_ORDERED_STAGE_H
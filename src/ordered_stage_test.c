@@ -0,0 +1,216 @@
+// For sched_getcpu(), and needed before anything includes the system headers.
+#define _GNU_SOURCE
+
+#include "acutest.h"
+
+#include "ordered_stage.c"
+
+#include <stdatomic.h>
+#include <unistd.h>
+
+#define ITEM_COUNT 500
+
+typedef struct {
+  int number;
+  int doubled;
+} TestItem;
+
+typedef struct {
+  int finished[ITEM_COUNT];
+  int finished_count;
+  _Atomic int finishing_threads;
+  bool overlapped;
+} TestResults;
+
+static void double_item(void* context, void* item) {
+  TestItem* test_item = (TestItem*)(item);
+  // Uneven amounts of work, so items come out of the workers jumbled up.
+  if ((test_item->number % 7) == 0) {
+    usleep(200);
+  }
+  test_item->doubled = test_item->number * 2;
+}
+
+static void record_item(void* context, void* item) {
+  TestResults* results = (TestResults*)(context);
+  if (atomic_fetch_add(&results->finishing_threads, 1) != 0) {
+    results->overlapped = true;
+  }
+  const TestItem* test_item = (const TestItem*)(item);
+  results->finished[results->finished_count] = test_item->doubled;
+  results->finished_count += 1;
+  atomic_fetch_sub(&results->finishing_threads, 1);
+}
+
+void test_ordered_stage_keeps_order() {
+  static TestResults results;
+  memset(&results, 0, sizeof(results));
+  OrderedStage* stage = ordered_stage_alloc(4, 8, sizeof(TestItem), double_item, record_item, &results);
+  TEST_ASSERT(stage != NULL);
+
+  int submitted = 0;
+  while (submitted < ITEM_COUNT) {
+    const TestItem item = {submitted, 0};
+    if (ordered_stage_submit(stage, &item)) {
+      submitted += 1;
+    } else {
+      usleep(50);
+    }
+  }
+  ordered_stage_free(stage);
+
+  TEST_CHECK(results.finished_count == ITEM_COUNT);
+  TEST_CHECK(!results.overlapped);
+  for (int i = 0; i < results.finished_count; ++i) {
+    if (results.finished[i] != (i * 2)) {
+      TEST_CHECK(false);
+      TEST_MSG("item %d came out as %d", i, results.finished[i]);
+      break;
+    }
+  }
+}
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t changed;
+  bool open;
+  int finished_count;
+} Gate;
+
+static void wait_at_gate(void* context, void* item) {
+  Gate* gate = (Gate*)(context);
+  pthread_mutex_lock(&gate->mutex);
+  while (!gate->open) {
+    pthread_cond_wait(&gate->changed, &gate->mutex);
+  }
+  pthread_mutex_unlock(&gate->mutex);
+}
+
+static void count_finished(void* context, void* item) {
+  Gate* gate = (Gate*)(context);
+  pthread_mutex_lock(&gate->mutex);
+  gate->finished_count += 1;
+  pthread_mutex_unlock(&gate->mutex);
+}
+
+void test_ordered_stage_full() {
+  Gate gate;
+  pthread_mutex_init(&gate.mutex, NULL);
+  pthread_cond_init(&gate.changed, NULL);
+  gate.open = false;
+  gate.finished_count = 0;
+  OrderedStage* stage = ordered_stage_alloc(2, 3, sizeof(int), wait_at_gate, count_finished, &gate);
+  TEST_ASSERT(stage != NULL);
+
+  // The workers are stuck, so only the queue's worth fits.
+  for (int i = 0; i < 3; ++i) {
+    TEST_CHECK(ordered_stage_submit(stage, &i));
+  }
+  const int extra = 3;
+  TEST_CHECK(!ordered_stage_submit(stage, &extra));
+  OrderedStageStats stats;
+  ordered_stage_get_stats(stage, &stats);
+  TEST_CHECK(stats.submitted == 3);
+  TEST_CHECK(stats.rejected == 1);
+  TEST_CHECK(stats.depth == 3);
+  TEST_CHECK(stats.max_depth == 3);
+
+  pthread_mutex_lock(&gate.mutex);
+  gate.open = true;
+  pthread_cond_broadcast(&gate.changed);
+  pthread_mutex_unlock(&gate.mutex);
+  // Freeing waits for everything that was accepted.
+  ordered_stage_free(stage);
+  TEST_CHECK(gate.finished_count == 3);
+  pthread_cond_destroy(&gate.changed);
+  pthread_mutex_destroy(&gate.mutex);
+}
+
+void test_ordered_stage_stats() {
+  static TestResults results;
+  memset(&results, 0, sizeof(results));
+  OrderedStage* stage = ordered_stage_alloc(1, 4, sizeof(TestItem), double_item, record_item, &results);
+  TEST_ASSERT(stage != NULL);
+  const TestItem item = {7, 0};
+  TEST_CHECK(ordered_stage_submit(stage, &item));
+  OrderedStageStats stats;
+  do {
+    usleep(100);
+    ordered_stage_get_stats(stage, &stats);
+  } while (stats.finished == 0);
+  TEST_CHECK(stats.depth == 0);
+  // Item seven sleeps for 200us.
+  TEST_CHECK(stats.processing_ns >= 200000);
+  TEST_CHECK(stats.max_processing_ns == stats.processing_ns);
+  TEST_CHECK(stats.queued_ns >= 0);
+  TEST_CHECK(stats.reordering_ns >= 0);
+  ordered_stage_free(stage);
+}
+
+static void record_cpu(void* context, void* item) {
+  TestItem* test_item = (TestItem*)(item);
+  test_item->doubled = sched_getcpu();
+}
+
+static void check_cpu(void* context, void* item) {
+  const int* cpu = (const int*)(context);
+  const TestItem* test_item = (const TestItem*)(item);
+  TEST_CHECK(test_item->doubled == *cpu);
+  TEST_MSG("item %d ran on CPU %d, not %d", test_item->number, test_item->doubled, *cpu);
+}
+
+void test_ordered_stage_pin_workers() {
+  // Whichever CPU we're on now must exist and be allowed for this process.
+  int cpu = sched_getcpu();
+  TEST_ASSERT(cpu >= 0);
+  OrderedStage* stage = ordered_stage_alloc(3, 8, sizeof(TestItem), record_cpu, check_cpu, &cpu);
+  TEST_ASSERT(stage != NULL);
+  TEST_CHECK(ordered_stage_pin_workers(stage, cpu));
+  int submitted = 0;
+  while (submitted < 50) {
+    const TestItem item = {submitted, -1};
+    if (ordered_stage_submit(stage, &item)) {
+      submitted += 1;
+    } else {
+      usleep(50);
+    }
+  }
+  // There aren't this many CPUs, so the workers stay where they are.
+  TEST_CHECK(!ordered_stage_pin_workers(stage, CPU_SETSIZE - 1));
+  ordered_stage_free(stage);
+}
+
+// Workers register as they start, so this waits a while for them to show up.
+static bool snapshot_has_thread(const char* name) {
+  char expected[64];
+  snprintf(expected, sizeof(expected), "thread=%s ", name);
+  static char snapshot[16384];
+  for (int i = 0; i < 1000; ++i) {
+    metrics_format_snapshot(snapshot, sizeof(snapshot));
+    if (strstr(snapshot, expected) != NULL) {
+      return true;
+    }
+    usleep(1000);
+  }
+  return false;
+}
+
+void test_ordered_stage_named_workers() {
+  static TestResults results;
+  memset(&results, 0, sizeof(results));
+  OrderedStage* stage =
+    ordered_stage_alloc_named(2, 8, sizeof(TestItem), double_item, record_item, &results, "stage3");
+  TEST_ASSERT(stage != NULL);
+  TEST_CHECK(snapshot_has_thread("stage3.0"));
+  TEST_CHECK(snapshot_has_thread("stage3.1"));
+  ordered_stage_free(stage);
+}
+
+TEST_LIST = {
+  {"ordered_stage_keeps_order", test_ordered_stage_keeps_order},
+  {"ordered_stage_full", test_ordered_stage_full},
+  {"ordered_stage_stats", test_ordered_stage_stats},
+  {"ordered_stage_pin_workers", test_ordered_stage_pin_workers},
+  {"ordered_stage_named_workers", test_ordered_stage_named_workers},
+  {NULL, NULL},
+};
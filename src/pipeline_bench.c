@@ -0,0 +1,267 @@
+// Runs the whole app on test patterns with a headless display, and reports how
+// the capture, publish and consume chain kept up: the frame rates it
+// sustained, how many frames were dropped along the way, how long frames took
+// from capture to being consumed, and how much CPU each one cost. Rates, CPU
+// and latency are measured from the first frame consumed to the last, so
+// startup, like generating the test patterns, doesn't count.
+//
+// Options of its own set budgets, and the run fails if any is exceeded, so it
+// can gate changes in CI. Everything else goes to the app, after defaults of
+// "-t bars -c 300 --display headless", so for example
+//
+//   pipeline_bench --max-p99-ms 20 -s 1920x1080 -n 2 --headless-fps 0
+//
+// consumes every frame from two 1080p test patterns, and fails if the 99th
+// percentile latency goes over 20 ms.
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "app_main.h"
+#include "capture_main.h"
+#include "frame_latency.h"
+#include "headless_main.h"
+#include "metrics.h"
+
+// Budgets can't be negative, so this marks the ones that weren't given.
+#define NO_BUDGET -1.0
+
+typedef struct
+{
+    double min_fps;
+    double max_dropped;
+    double max_p99_ms;
+    double max_cpu_ms;
+    const char *output_path;
+} BenchOptions;
+
+typedef struct
+{
+    int device_count;
+    double seconds;
+    int64_t frames_captured;
+    uint64_t frames_consumed;
+    double capture_fps;
+    double consume_fps;
+    int64_t dropped_in_capture;
+    uint64_t skipped_by_consumer;
+    FrameLatencyStats latency;
+    double cpu_ms_per_frame;
+} BenchReport;
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [app options]\n\n"
+            "Options:\n"
+            "--min-fps N          Fail if fewer frames than this were consumed each second per device\n"
+            "--max-dropped N      Fail if more frames than this were dropped or skipped\n"
+            "--max-p99-ms N       Fail if the 99th percentile capture to consume latency is higher\n"
+            "--max-cpu-ms N       Fail if each frame captured took more CPU time than this\n"
+            "--output file        Write the results as JSON too\n"
+            "--bench-help         Print this message, and --help prints the app's options\n",
+            name);
+}
+
+static double parse_budget(const char *option, const char *value)
+{
+    char *end;
+    errno = 0;
+    const double budget = strtod(value, &end);
+    if (errno || (*end != '\0') || (budget < 0.0))
+    {
+        fprintf(stderr, "Bad value '%s' for %s\n", value, option);
+        exit(EXIT_FAILURE);
+    }
+    return budget;
+}
+
+// Takes the benchmark's own options out of the arguments, and puts the
+// defaults for the app in front of the rest, where anything given later
+// overrides them.
+static char **take_bench_args(int *argc, char **argv, BenchOptions *options)
+{
+    static char *defaults[] = {"-t", "bars", "-c", "300", "--display", "headless"};
+    const int default_count = sizeof(defaults) / sizeof(defaults[0]);
+    options->min_fps = NO_BUDGET;
+    options->max_dropped = NO_BUDGET;
+    options->max_p99_ms = NO_BUDGET;
+    options->max_cpu_ms = NO_BUDGET;
+    options->output_path = NULL;
+
+    char **app_argv = calloc(*argc + default_count + 1, sizeof(char *));
+    if (app_argv == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    int app_argc = 0;
+    app_argv[app_argc++] = argv[0];
+    for (int i = 0; i < default_count; ++i)
+    {
+        app_argv[app_argc++] = defaults[i];
+    }
+    for (int i = 1; i < *argc; ++i)
+    {
+        const char *value;
+        if (app_main_match_value_option(*argc, argv, &i, "--min-fps", &value))
+        {
+            options->min_fps = parse_budget("--min-fps", value);
+        }
+        else if (app_main_match_value_option(*argc, argv, &i, "--max-dropped", &value))
+        {
+            options->max_dropped = parse_budget("--max-dropped", value);
+        }
+        else if (app_main_match_value_option(*argc, argv, &i, "--max-p99-ms", &value))
+        {
+            options->max_p99_ms = parse_budget("--max-p99-ms", value);
+        }
+        else if (app_main_match_value_option(*argc, argv, &i, "--max-cpu-ms", &value))
+        {
+            options->max_cpu_ms = parse_budget("--max-cpu-ms", value);
+        }
+        else if (app_main_match_value_option(*argc, argv, &i, "--output", &value))
+        {
+            options->output_path = value;
+        }
+        else if (strcmp(argv[i], "--bench-help") == 0)
+        {
+            usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        }
+        else
+        {
+            app_argv[app_argc++] = argv[i];
+        }
+    }
+    app_argv[app_argc] = NULL;
+    *argc = app_argc;
+    return app_argv;
+}
+
+static int64_t counter_value(const char *name)
+{
+    return metrics_value(metrics_counter(name));
+}
+
+// Returns false if too few frames were consumed to measure anything.
+static bool make_report(BenchReport *report)
+{
+    HeadlessStats stats;
+    headless_main_get_stats(&stats);
+    if (stats.frames_consumed < 2)
+    {
+        return false;
+    }
+    report->device_count = get_capture_device_count();
+    report->seconds = (stats.last.time_ns - stats.first.time_ns) / 1e9;
+    report->frames_captured = stats.last.frames_captured - stats.first.frames_captured;
+    report->frames_consumed = stats.frames_consumed;
+    // The first frame consumed starts the clock, so it isn't counted.
+    report->consume_fps = (report->seconds > 0.0)
+                              ? ((stats.frames_consumed - 1) / report->seconds) / report->device_count
+                              : 0.0;
+    report->capture_fps =
+        (report->seconds > 0.0) ? (report->frames_captured / report->seconds) / report->device_count : 0.0;
+    report->dropped_in_capture = counter_value("frames_dropped_driver") + counter_value("frames_dropped_short") +
+                                 counter_value("frames_dropped_no_buffer") + counter_value("frames_dropped_backlog");
+    report->skipped_by_consumer = stats.frames_skipped;
+    frame_latency_get_stats(FRAME_LATENCY_CONSUMED, &report->latency);
+    report->cpu_ms_per_frame = (report->frames_captured > 0)
+                                   ? ((stats.last.cpu_ns - stats.first.cpu_ns) / 1e6) / report->frames_captured
+                                   : 0.0;
+    return true;
+}
+
+static void print_report(const BenchReport *report)
+{
+    printf("%lld frames captured from %d device%s over %.2f seconds\n", (long long)(report->frames_captured),
+           report->device_count, (report->device_count == 1) ? "" : "s", report->seconds);
+    printf("Captured at %.2f fps and consumed at %.2f fps per device\n", report->capture_fps, report->consume_fps);
+    printf("Dropped %lld frames in capture, and %llu were skipped by the consumer\n",
+           (long long)(report->dropped_in_capture), (unsigned long long)(report->skipped_by_consumer));
+    printf("Capture to consume latency p50 %.2f ms, p99 %.2f ms, max %.2f ms\n", report->latency.p50_ns / 1e6,
+           report->latency.p99_ns / 1e6, report->latency.max_ns / 1e6);
+    printf("%.3f ms of CPU time per frame captured\n", report->cpu_ms_per_frame);
+}
+
+static bool write_json(const char *path, const BenchReport *report, bool within_budget)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Couldn't open '%s' for the results, error %d, %s\n", path, errno, strerror(errno));
+        return false;
+    }
+    fprintf(file,
+            "{\n  \"benchmark\": \"pipeline\",\n  \"devices\": %d,\n  \"seconds\": %.3f,\n"
+            "  \"frames_captured\": %lld,\n  \"frames_consumed\": %llu,\n  \"capture_fps\": %.3f,\n"
+            "  \"consume_fps\": %.3f,\n  \"dropped_in_capture\": %lld,\n  \"skipped_by_consumer\": %llu,\n"
+            "  \"latency_p50_ms\": %.3f,\n  \"latency_p99_ms\": %.3f,\n  \"latency_max_ms\": %.3f,\n"
+            "  \"cpu_ms_per_frame\": %.4f,\n  \"within_budget\": %s\n}\n",
+            report->device_count, report->seconds, (long long)(report->frames_captured),
+            (unsigned long long)(report->frames_consumed), report->capture_fps, report->consume_fps,
+            (long long)(report->dropped_in_capture), (unsigned long long)(report->skipped_by_consumer),
+            report->latency.p50_ns / 1e6, report->latency.p99_ns / 1e6, report->latency.max_ns / 1e6,
+            report->cpu_ms_per_frame, within_budget ? "true" : "false");
+    fclose(file);
+    return true;
+}
+
+// Logs every budget that was exceeded, and returns true if none were.
+static bool check_budgets(const BenchOptions *options, const BenchReport *report)
+{
+    bool within_budget = true;
+    if ((options->min_fps != NO_BUDGET) && (report->consume_fps < options->min_fps))
+    {
+        fprintf(stderr, "Over budget: consumed at %.2f fps, below %.2f\n", report->consume_fps, options->min_fps);
+        within_budget = false;
+    }
+    const double dropped = (double)(report->dropped_in_capture) + report->skipped_by_consumer;
+    if ((options->max_dropped != NO_BUDGET) && (dropped > options->max_dropped))
+    {
+        fprintf(stderr, "Over budget: %.0f frames dropped or skipped, more than %.0f\n", dropped,
+                options->max_dropped);
+        within_budget = false;
+    }
+    const double p99_ms = report->latency.p99_ns / 1e6;
+    if ((options->max_p99_ms != NO_BUDGET) && (p99_ms > options->max_p99_ms))
+    {
+        fprintf(stderr, "Over budget: p99 latency of %.2f ms, more than %.2f ms\n", p99_ms, options->max_p99_ms);
+        within_budget = false;
+    }
+    if ((options->max_cpu_ms != NO_BUDGET) && (report->cpu_ms_per_frame > options->max_cpu_ms))
+    {
+        fprintf(stderr, "Over budget: %.3f ms of CPU per frame, more than %.3f ms\n", report->cpu_ms_per_frame,
+                options->max_cpu_ms);
+        within_budget = false;
+    }
+    return within_budget;
+}
+
+int main(int argc, char **argv)
+{
+    BenchOptions options;
+    char **app_argv = take_bench_args(&argc, argv, &options);
+    // Returns once capture has stopped at the frame count, or been
+    // interrupted.
+    app_main(argc, app_argv);
+
+    BenchReport report;
+    if (!make_report(&report))
+    {
+        fprintf(stderr, "Too few frames were consumed to measure anything\n");
+        exit(EXIT_FAILURE);
+    }
+    print_report(&report);
+    const bool within_budget = check_budgets(&options, &report);
+    if ((options.output_path != NULL) && !write_json(options.output_path, &report, within_budget))
+    {
+        exit(EXIT_FAILURE);
+    }
+    free(app_argv);
+    return within_budget ? EXIT_SUCCESS : EXIT_FAILURE;
+}
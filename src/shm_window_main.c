@@ -0,0 +1,420 @@
+#include "shm_window_main.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <unistd.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+
+#include "app_main.h"
+#include "capture_main.h"
+#include "frame_latency.h"
+#include "metrics.h"
+#include "time_utils.h"
+#include "trace.h"
+#include "yuv_convert.h"
+
+// Every camera is shown at once, in a grid of tiles with one per device, as
+// in the GL window.
+#define MAX_FEEDS 16
+
+// Frames are converted straight into an image in a shared memory segment the
+// X server reads from, so there's no copy through the socket and no GL at
+// all. There's no scaling either, so each frame is shown at its own size in
+// the top left of its tile, cropped if the tile is smaller.
+static Display *g_display = NULL;
+static Window g_window;
+static GC g_gc;
+static XImage *g_image = NULL;
+static XShmSegmentInfo g_segment;
+static int g_completion_event_type;
+
+// Kept up to date from ConfigureNotify events, rather than asking the server.
+static int g_window_width = 640;
+static int g_window_height = 480;
+
+// The server reads the image some time after XShmPutImage() returns, so
+// nothing is drawn into it between a put and its completion event.
+static bool g_put_pending = false;
+
+typedef struct
+{
+    // The sequence number of the frame in the feed's tile, zero if there
+    // isn't one.
+    uint64_t shown_sequence;
+    // When that frame was captured.
+    int64_t shown_timestamp_ns;
+    // Drawn into the image, but not put to the window yet.
+    bool is_dirty;
+    // Put to the window, but the server hasn't said it's done yet.
+    bool is_putting;
+} ShmFeed;
+
+static ShmFeed g_feeds[MAX_FEEDS];
+
+// Shared with the GL display, which counts the same things.
+static Metric *g_frames_consumed_metric;
+static Metric *g_frames_displayed_metric;
+static Metric *g_frames_dropped_display_metric;
+static Metric *g_display_convert_ns_metric;
+static int g_feed_count = 0;
+static int g_columns = 1;
+static int g_rows = 1;
+
+static void DestroyImage()
+{
+    if (g_image == NULL)
+    {
+        return;
+    }
+    // Makes sure the server has finished with the segment before it goes.
+    XShmDetach(g_display, &g_segment);
+    XSync(g_display, False);
+    XDestroyImage(g_image);
+    shmdt(g_segment.shmaddr);
+    g_image = NULL;
+    g_put_pending = false;
+}
+
+// Replaces the image with a black one the size of the window, which every
+// feed then has to be drawn into again.
+static void CreateImage()
+{
+    DestroyImage();
+    const int screen = DefaultScreen(g_display);
+    g_image = XShmCreateImage(g_display, DefaultVisual(g_display, screen), DefaultDepth(g_display, screen), ZPixmap,
+                              NULL, &g_segment, g_window_width, g_window_height);
+    if (g_image == NULL)
+    {
+        fprintf(stderr, "Couldn't create a %dx%d shared image\n", g_window_width, g_window_height);
+        exit(EXIT_FAILURE);
+    }
+    // Frames are drawn as BGRA, which is what a little-endian 24-bit visual
+    // keeps in memory.
+    if ((g_image->bits_per_pixel != 32) || (g_image->byte_order != LSBFirst) || (g_image->red_mask != 0xff0000) ||
+        (g_image->green_mask != 0xff00) || (g_image->blue_mask != 0xff))
+    {
+        fprintf(stderr, "The shared image backend needs a 32-bit BGRX visual, not %d bits with masks %lx %lx %lx\n",
+                g_image->bits_per_pixel, g_image->red_mask, g_image->green_mask, g_image->blue_mask);
+        exit(EXIT_FAILURE);
+    }
+    g_segment.shmid = shmget(IPC_PRIVATE, (size_t)(g_image->bytes_per_line) * g_image->height, IPC_CREAT | 0600);
+    if (g_segment.shmid == -1)
+    {
+        fprintf(stderr, "shmget error %d, %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    g_segment.shmaddr = shmat(g_segment.shmid, NULL, 0);
+    g_image->data = g_segment.shmaddr;
+    g_segment.readOnly = True;
+    const bool is_attached = (g_segment.shmaddr != (void *)(-1)) && XShmAttach(g_display, &g_segment);
+    XSync(g_display, False);
+    // Once both sides have it mapped, marking it for removal means it goes
+    // away with us, however we exit.
+    shmctl(g_segment.shmid, IPC_RMID, NULL);
+    if (!is_attached)
+    {
+        fprintf(stderr, "Couldn't share the image's memory with the X server\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(g_image->data, 0, (size_t)(g_image->bytes_per_line) * g_image->height);
+    for (int i = 0; i < g_feed_count; ++i)
+    {
+        g_feeds[i].shown_sequence = 0;
+        g_feeds[i].is_dirty = false;
+        g_feeds[i].is_putting = false;
+    }
+}
+
+static void CellRect(int index, int *x, int *y, int *width, int *height)
+{
+    *width = g_window_width / g_columns;
+    *height = g_window_height / g_rows;
+    *x = (index % g_columns) * *width;
+    *y = (index / g_columns) * *height;
+}
+
+// Picks up any devices that have started since we last looked, returning
+// true if the grid has changed.
+static bool AddFeeds()
+{
+    int feed_count = get_capture_device_count();
+    if (feed_count > MAX_FEEDS)
+    {
+        feed_count = MAX_FEEDS;
+    }
+    if (feed_count == g_feed_count)
+    {
+        return false;
+    }
+    memset(&g_feeds[g_feed_count], 0, (feed_count - g_feed_count) * sizeof(ShmFeed));
+    g_feed_count = feed_count;
+    g_columns = 1;
+    while ((g_columns * g_columns) < g_feed_count)
+    {
+        g_columns += 1;
+    }
+    g_rows = (g_feed_count + g_columns - 1) / g_columns;
+    return true;
+}
+
+// Converts the frame into its tile of the image.
+static void DrawFeed(int index, const Frame *frame)
+{
+    int x;
+    int y;
+    int width;
+    int height;
+    CellRect(index, &x, &y, &width, &height);
+    width = (frame->width < width) ? frame->width : width;
+    height = (frame->height < height) ? frame->height : height;
+    const int stride = g_image->bytes_per_line;
+    uint8_t *bgra = (uint8_t *)(g_image->data) + ((size_t)(y) * stride) + ((size_t)(x) * 4);
+    const uint8_t *data = frame->data;
+    const uint8_t *chroma = data + ((size_t)(frame->stride) * frame->height);
+
+    switch (frame->format)
+    {
+    case FRAME_FORMAT_BGRA:
+        for (int row = 0; row < height; ++row)
+        {
+            memcpy(bgra + ((size_t)(row) * stride), data + ((size_t)(row) * frame->stride), (size_t)(width) * 4);
+        }
+        break;
+
+    case FRAME_FORMAT_RGBA:
+        for (int row = 0; row < height; ++row)
+        {
+            const uint8_t *in = data + ((size_t)(row) * frame->stride);
+            uint8_t *out = bgra + ((size_t)(row) * stride);
+            for (int column = 0; column < width; ++column)
+            {
+                out[(column * 4) + 0] = in[(column * 4) + 2];
+                out[(column * 4) + 1] = in[(column * 4) + 1];
+                out[(column * 4) + 2] = in[(column * 4) + 0];
+                out[(column * 4) + 3] = in[(column * 4) + 3];
+            }
+        }
+        break;
+
+    // Cropped to an even width, so chroma pairs aren't split.
+    case FRAME_FORMAT_YUYV:
+        yuyv_to_bgra(data, frame->stride, bgra, stride, width & ~1, height, frame->yuv_matrix, frame->yuv_range);
+        break;
+
+    case FRAME_FORMAT_NV12:
+        nv12_to_bgra(data, frame->stride, chroma, frame->stride, bgra, stride, width & ~1, height, frame->yuv_matrix,
+                     frame->yuv_range);
+        break;
+
+    case FRAME_FORMAT_I420:
+        i420_to_bgra(data, frame->stride, chroma, chroma + ((size_t)(frame->stride / 2) * ((frame->height + 1) / 2)),
+                     frame->stride / 2, bgra, stride, width & ~1, height, frame->yuv_matrix, frame->yuv_range);
+        break;
+    }
+}
+
+// Draws every feed with a new frame into the image, returning true if any
+// did.
+static bool DrawLatestFrames()
+{
+    TRACE_SCOPE("draw frames");
+    bool any_new = false;
+    for (int i = 0; i < g_feed_count; ++i)
+    {
+        const Frame *frame = get_latest_device_frame(i);
+        if (frame == NULL)
+        {
+            // Camera capture is not yet ready.
+            continue;
+        }
+        if (frame->sequence > g_feeds[i].shown_sequence)
+        {
+            const int64_t start_ns = time_monotonic_ns();
+            DrawFeed(i, frame);
+            const int64_t drawn_ns = time_monotonic_ns();
+            frame_latency_record(FRAME_LATENCY_CONSUMED, frame->timestamp_ns, drawn_ns);
+            metrics_add(g_display_convert_ns_metric, drawn_ns - start_ns);
+            metrics_add(g_frames_consumed_metric, 1);
+            if ((g_feeds[i].shown_sequence != 0) && (frame->sequence > (g_feeds[i].shown_sequence + 1)))
+            {
+                metrics_add(g_frames_dropped_display_metric, frame->sequence - g_feeds[i].shown_sequence - 1);
+            }
+            g_feeds[i].shown_sequence = frame->sequence;
+            g_feeds[i].shown_timestamp_ns = frame->timestamp_ns;
+            g_feeds[i].is_dirty = true;
+            any_new = true;
+        }
+        frame_release(frame);
+    }
+    return any_new;
+}
+
+// Puts either the whole image or just the tiles that have changed. Only the
+// last put asks for a completion event, since the server handles them in
+// order.
+static void PresentImage(bool whole_image)
+{
+    TRACE_SCOPE("put image");
+    int rects[MAX_FEEDS + 1][4];
+    int rect_count = 0;
+    if (whole_image)
+    {
+        rects[0][0] = 0;
+        rects[0][1] = 0;
+        rects[0][2] = g_window_width;
+        rects[0][3] = g_window_height;
+        rect_count = 1;
+    }
+    for (int i = 0; i < g_feed_count; ++i)
+    {
+        if (g_feeds[i].is_dirty && !whole_image)
+        {
+            CellRect(i, &rects[rect_count][0], &rects[rect_count][1], &rects[rect_count][2], &rects[rect_count][3]);
+            rect_count += 1;
+        }
+        g_feeds[i].is_putting = g_feeds[i].is_dirty;
+        g_feeds[i].is_dirty = false;
+    }
+    for (int i = 0; i < rect_count; ++i)
+    {
+        const int x = rects[i][0];
+        const int y = rects[i][1];
+        XShmPutImage(g_display, g_window, g_gc, g_image, x, y, x, y, rects[i][2], rects[i][3],
+                     (i == (rect_count - 1)) ? True : False);
+    }
+    XFlush(g_display);
+    g_put_pending = (rect_count > 0);
+}
+
+void *shm_window_main(void *cookie)
+{
+    TRACE_THREAD_NAME("display");
+    metrics_register_thread("display");
+    g_frames_consumed_metric = metrics_counter("frames_consumed");
+    g_frames_displayed_metric = metrics_counter("frames_displayed");
+    g_frames_dropped_display_metric = metrics_counter("frames_dropped_display");
+    g_display_convert_ns_metric = metrics_counter("display_convert_ns");
+    g_display = XOpenDisplay(NULL);
+    if (g_display == NULL)
+    {
+        fprintf(stderr, "Couldn't connect to the X server\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!XShmQueryExtension(g_display))
+    {
+        fprintf(stderr, "The X server doesn't support MIT-SHM, so try --display gl instead\n");
+        exit(EXIT_FAILURE);
+    }
+    g_completion_event_type = XShmGetEventBase(g_display) + ShmCompletion;
+
+    const int screen = DefaultScreen(g_display);
+    g_window = XCreateSimpleWindow(g_display, RootWindow(g_display, screen), 0, 0, g_window_width, g_window_height, 0,
+                                   BlackPixel(g_display, screen), BlackPixel(g_display, screen));
+    XSelectInput(g_display, g_window, ExposureMask | StructureNotifyMask);
+    XStoreName(g_display, g_window, "V4L2 Shared Memory Example");
+    XMapWindow(g_display, g_window);
+    g_gc = XCreateGC(g_display, g_window, 0, NULL);
+    CreateImage();
+
+    const int capture_fd = get_capture_event_fd();
+    if (capture_fd == -1)
+    {
+        fprintf(stderr, "Couldn't create the capture event fd, error %d, %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // Sleeps until either a camera has a new frame or the X server has
+    // something for us. New frames are left waiting while the server is
+    // still reading the last ones, and drawn together once it's done.
+    bool needs_whole_image = false;
+    bool frames_waiting = true;
+    while (1)
+    {
+        while (XPending(g_display))
+        {
+            XEvent event;
+            XNextEvent(g_display, &event);
+            if (event.type == g_completion_event_type)
+            {
+                g_put_pending = false;
+                // The closest we get to knowing the new frames are on screen.
+                const int64_t now_ns = time_monotonic_ns();
+                for (int i = 0; i < g_feed_count; ++i)
+                {
+                    if (g_feeds[i].is_putting)
+                    {
+                        frame_latency_record(FRAME_LATENCY_PRESENTED, g_feeds[i].shown_timestamp_ns, now_ns);
+                        metrics_add(g_frames_displayed_metric, 1);
+                        TRACE_COUNTER("capture to present us", (now_ns - g_feeds[i].shown_timestamp_ns) / 1000);
+                        g_feeds[i].is_putting = false;
+                    }
+                }
+            }
+            else if (event.type == ConfigureNotify)
+            {
+                if ((event.xconfigure.width != g_window_width) || (event.xconfigure.height != g_window_height))
+                {
+                    g_window_width = event.xconfigure.width;
+                    g_window_height = event.xconfigure.height;
+                    CreateImage();
+                    needs_whole_image = true;
+                    frames_waiting = true;
+                }
+            }
+            else if (event.type == Expose)
+            {
+                needs_whole_image = true;
+            }
+        }
+
+        if (!g_put_pending && (frames_waiting || needs_whole_image))
+        {
+            if (AddFeeds())
+            {
+                CreateImage();
+                needs_whole_image = true;
+            }
+            const bool any_new = DrawLatestFrames();
+            frames_waiting = false;
+            if (any_new || needs_whole_image)
+            {
+                PresentImage(needs_whole_image);
+                needs_whole_image = false;
+            }
+            continue;
+        }
+
+        struct pollfd fds[2] = {
+            {.fd = ConnectionNumber(g_display), .events = POLLIN},
+            {.fd = capture_fd, .events = POLLIN},
+        };
+        // The capture fd stays readable until it's read, so it's only
+        // listened to when we'd do something about it.
+        if (poll(fds, frames_waiting ? 1 : 2, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "poll error %d, %s\n", errno, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (!frames_waiting && (fds[1].revents & POLLIN))
+        {
+            uint64_t frame_count;
+            const ssize_t bytes_read = read(capture_fd, &frame_count, sizeof(frame_count));
+            (void)(bytes_read);
+            frames_waiting = true;
+        }
+        // Any X events get handled at the top of the loop.
+    }
+    return NULL;
+}
@@ -0,0 +1,10 @@
+#ifndef INCLUDE_SHM_WINDOW_MAIN_H
+#define INCLUDE_SHM_WINDOW_MAIN_H
+
+// Shows the same grid of camera feeds as window_main(), but draws with plain
+// X11 through a MIT-SHM shared image instead of OpenGL. On machines without a
+// GPU, where GL falls back to software rendering, this costs a fraction as
+// much.
+void *shm_window_main(void *cookie);
+
+#endif // INCLUDE_SHM_WINDOW_MAIN_H
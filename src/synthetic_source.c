@@ -0,0 +1,409 @@
+#include "synthetic_source.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "time_utils.h"
+
+// Enough frames that scrolling bars loop once a second at 30fps, and that
+// noise doesn't visibly repeat, without eating too much memory at 4K.
+#define SYNTHETIC_BARS_FRAME_COUNT 30
+#define SYNTHETIC_NOISE_FRAME_COUNT 8
+#define SYNTHETIC_MAX_BYTES (256 * 1024 * 1024)
+
+#define SYNTHETIC_BAR_COUNT 8
+
+typedef struct
+{
+    uint8_t y;
+    uint8_t u;
+    uint8_t v;
+} SyntheticColor;
+
+// 75% BT.601 limited-range colour bars, in the usual order.
+static const SyntheticColor bar_colors[SYNTHETIC_BAR_COUNT] = {
+    {180, 128, 128}, // White
+    {162, 44, 142},  // Yellow
+    {131, 156, 44},  // Cyan
+    {112, 72, 58},   // Green
+    {84, 184, 198},  // Magenta
+    {65, 100, 212},  // Red
+    {35, 212, 114},  // Blue
+    {16, 128, 128},  // Black
+};
+
+typedef struct
+{
+    CaptureSource base;
+    SyntheticPattern pattern;
+    CaptureFormat format;
+    uint8_t *frames;
+    int frame_count;
+    size_t frame_stride;
+    int64_t frame_interval_ns;
+    int64_t next_frame_ns;
+    uint32_t sequence;
+    // Polls as readable once the next frame is due, like a camera's fd. A
+    // timer when there's a frame rate, or an eventfd that's always set when
+    // frames come as fast as they're dequeued.
+    int ready_fd;
+} SyntheticSource;
+
+static void sleep_until_ns(int64_t deadline_ns)
+{
+    struct timespec ts;
+    ts.tv_sec = deadline_ns / 1000000000;
+    ts.tv_nsec = deadline_ns % 1000000000;
+    while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+    {
+    }
+}
+
+static uint32_t hash_pixel(uint32_t x, uint32_t y, uint32_t frame)
+{
+    uint32_t h = (x * 0x9e3779b1u) ^ (y * 0x85ebca77u) ^ (frame * 0xc2b2ae3du);
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h;
+}
+
+static SyntheticColor pattern_color(const SyntheticSource *source, int x, int y, int frame)
+{
+    const int width = source->format.width;
+    const int height = source->format.height;
+    SyntheticColor color;
+    switch (source->pattern)
+    {
+    case SYNTHETIC_PATTERN_BARS:
+    {
+        // Moves one whole width over the course of the frames, so it loops
+        // without a jump.
+        const int scrolled_x = (x + ((int64_t)(frame) * width / source->frame_count)) % width;
+        return bar_colors[(scrolled_x * SYNTHETIC_BAR_COUNT) / width];
+    }
+
+    case SYNTHETIC_PATTERN_NOISE:
+    {
+        const uint32_t h = hash_pixel(x, y, frame);
+        color.y = 16 + ((h & 0xff) * 219) / 255;
+        color.u = 16 + (((h >> 8) & 0xff) * 224) / 255;
+        color.v = 16 + (((h >> 16) & 0xff) * 224) / 255;
+        return color;
+    }
+
+    case SYNTHETIC_PATTERN_STATIC:
+    default:
+        color.y = 16 + ((int64_t)(x) * 219) / width;
+        color.u = 16 + ((int64_t)(y) * 224) / height;
+        color.v = 240 - ((int64_t)(x) * 224) / width;
+        return color;
+    }
+}
+
+static void generate_frame(const SyntheticSource *source, int frame, uint8_t *data)
+{
+    const int width = source->format.width;
+    const int height = source->format.height;
+    const int stride = source->format.stride;
+
+    switch (source->format.format)
+    {
+    case FRAME_FORMAT_YUYV:
+        for (int y = 0; y < height; ++y)
+        {
+            uint8_t *row = data + ((size_t)(y) * stride);
+            for (int x = 0; x < width; x += 2)
+            {
+                // Chroma is shared by each pair of pixels, and taken from the
+                // left one.
+                const SyntheticColor left = pattern_color(source, x, y, frame);
+                const SyntheticColor right = pattern_color(source, x + 1, y, frame);
+                row[(x * 2) + 0] = left.y;
+                row[(x * 2) + 1] = left.u;
+                row[(x * 2) + 2] = right.y;
+                row[(x * 2) + 3] = left.v;
+            }
+        }
+        break;
+
+    case FRAME_FORMAT_NV12:
+    case FRAME_FORMAT_I420:
+    {
+        uint8_t *chroma = data + ((size_t)(stride) * height);
+        const int chroma_stride = (source->format.format == FRAME_FORMAT_NV12) ? stride : (stride / 2);
+        uint8_t *v_plane = chroma + ((size_t)(chroma_stride) * (height / 2));
+        for (int y = 0; y < height; ++y)
+        {
+            uint8_t *row = data + ((size_t)(y) * stride);
+            for (int x = 0; x < width; ++x)
+            {
+                const SyntheticColor color = pattern_color(source, x, y, frame);
+                row[x] = color.y;
+                // Chroma comes from the top-left pixel of each 2x2 block.
+                if (((x | y) & 1) == 0)
+                {
+                    const size_t chroma_row = (size_t)(y / 2) * chroma_stride;
+                    if (source->format.format == FRAME_FORMAT_NV12)
+                    {
+                        chroma[chroma_row + x + 0] = color.u;
+                        chroma[chroma_row + x + 1] = color.v;
+                    }
+                    else
+                    {
+                        chroma[chroma_row + (x / 2)] = color.u;
+                        v_plane[chroma_row + (x / 2)] = color.v;
+                    }
+                }
+            }
+        }
+        break;
+    }
+
+    default:
+        fprintf(stderr, "The synthetic source can't generate %s frames\n", frame_format_name(source->format.format));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void synthetic_source_open(CaptureSource *base)
+{
+    /* Nothing to do. */
+}
+
+static void synthetic_source_configure(CaptureSource *base, const CaptureRequest *request, CaptureFormat *format)
+{
+    SyntheticSource *source = (SyntheticSource *)(base);
+
+    if ((request->width < 2) || (request->height < 2))
+    {
+        fprintf(stderr, "The synthetic source needs a frame size of at least 2x2, not %dx%d\n", request->width,
+                request->height);
+        exit(EXIT_FAILURE);
+    }
+
+    // Chroma is subsampled in pairs, so keep both dimensions even.
+    source->format.width = request->width & ~1;
+    source->format.height = request->height & ~1;
+    source->format.stride = source->format.width * ((source->format.format == FRAME_FORMAT_YUYV) ? 2 : 1);
+    source->format.byte_count =
+        capture_image_byte_count(source->format.format, source->format.stride, source->format.height);
+    source->format.fps = request->fps;
+    source->frame_interval_ns = (request->fps > 0.0) ? (int64_t)(1000000000.0 / request->fps) : 0;
+
+    switch (source->pattern)
+    {
+    case SYNTHETIC_PATTERN_BARS:
+        source->frame_count = SYNTHETIC_BARS_FRAME_COUNT;
+        break;
+    case SYNTHETIC_PATTERN_NOISE:
+        source->frame_count = SYNTHETIC_NOISE_FRAME_COUNT;
+        break;
+    case SYNTHETIC_PATTERN_STATIC:
+    default:
+        source->frame_count = 1;
+        break;
+    }
+
+    // Cache-line aligned, like the frame pool, so the converters get the same
+    // alignment they would from a driver.
+    source->frame_stride = ((size_t)(source->format.byte_count) + 63) & ~(size_t)(63);
+    if (((size_t)(source->frame_count) * source->frame_stride) > SYNTHETIC_MAX_BYTES)
+    {
+        source->frame_count = SYNTHETIC_MAX_BYTES / source->frame_stride;
+        if (source->frame_count < 1)
+            source->frame_count = 1;
+    }
+
+    free(source->frames);
+    source->frames = NULL;
+    if (0 != posix_memalign((void **)(&source->frames), 64, source->frame_count * source->frame_stride))
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < source->frame_count; ++i)
+    {
+        generate_frame(source, i, source->frames + (i * source->frame_stride));
+    }
+
+    *format = source->format;
+}
+
+static void arm_ready_timer(SyntheticSource *source)
+{
+    if (source->frame_interval_ns <= 0)
+        return;
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = source->next_frame_ns / 1000000000;
+    spec.it_value.tv_nsec = source->next_frame_ns % 1000000000;
+    // Setting the time also resets the timer, so it stops polling as
+    // readable until the new frame is due.
+    timerfd_settime(source->ready_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+static void synthetic_source_start(CaptureSource *base)
+{
+    SyntheticSource *source = (SyntheticSource *)(base);
+
+    if (-1 != source->ready_fd)
+        close(source->ready_fd);
+    if (source->frame_interval_ns > 0)
+        source->ready_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    else
+        source->ready_fd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (-1 == source->ready_fd)
+    {
+        fprintf(stderr, "Couldn't create the synthetic source's fd, error %d, %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    source->sequence = 0;
+    source->next_frame_ns = time_monotonic_ns();
+    arm_ready_timer(source);
+}
+
+static bool synthetic_source_dequeue(CaptureSource *base, CaptureBuffer *buffer, int timeout_ms)
+{
+    SyntheticSource *source = (SyntheticSource *)(base);
+
+    if (source->frame_interval_ns > 0)
+    {
+        const int64_t now_ns = time_monotonic_ns();
+        const int64_t timeout_ns = (int64_t)(timeout_ms) * 1000000;
+        if ((source->next_frame_ns - now_ns) > timeout_ns)
+        {
+            sleep_until_ns(now_ns + timeout_ns);
+            return false;
+        }
+        sleep_until_ns(source->next_frame_ns);
+
+        // A real camera doesn't wait for a slow reader, it just delivers the
+        // frames it has on its own schedule. If we've fallen more than a frame
+        // behind, start again from now rather than bursting to catch up.
+        const int64_t woke_ns = time_monotonic_ns();
+        source->next_frame_ns += source->frame_interval_ns;
+        if (source->next_frame_ns < (woke_ns - source->frame_interval_ns))
+            source->next_frame_ns = woke_ns + source->frame_interval_ns;
+        arm_ready_timer(source);
+    }
+
+    const int index = source->sequence % source->frame_count;
+    buffer->data = source->frames + (index * source->frame_stride);
+    buffer->bytes_used = source->format.byte_count;
+    buffer->timestamp_ns = time_monotonic_ns();
+    buffer->sequence = source->sequence;
+    buffer->index = index;
+    source->sequence += 1;
+    return true;
+}
+
+static void synthetic_source_requeue(CaptureSource *base, const CaptureBuffer *buffer)
+{
+    /* Nothing to do, the frames never change. */
+}
+
+static int synthetic_source_lease_count(CaptureSource *base)
+{
+    // Buffers are picked by sequence number, so the same one comes round
+    // again whether or not it's been requeued.
+    return 0;
+}
+
+static int synthetic_source_poll_fd(CaptureSource *base)
+{
+    SyntheticSource *source = (SyntheticSource *)(base);
+    return source->ready_fd;
+}
+
+static bool synthetic_source_has_failed(CaptureSource *base)
+{
+    return false;
+}
+
+static bool synthetic_source_restart(CaptureSource *base)
+{
+    // Carries on from now, with the sequence numbers carrying on too, the
+    // way a camera's would after a hiccup.
+    SyntheticSource *source = (SyntheticSource *)(base);
+    source->next_frame_ns = time_monotonic_ns();
+    arm_ready_timer(source);
+    return true;
+}
+
+static void synthetic_source_stop(CaptureSource *base)
+{
+    /* Nothing to do. */
+}
+
+static void synthetic_source_free(CaptureSource *base)
+{
+    SyntheticSource *source = (SyntheticSource *)(base);
+    if (-1 != source->ready_fd)
+        close(source->ready_fd);
+    free(source->frames);
+    free(source);
+}
+
+static const CaptureSourceOps synthetic_source_ops = {
+    .name = "synthetic",
+    .open = synthetic_source_open,
+    .configure = synthetic_source_configure,
+    .start = synthetic_source_start,
+    .dequeue = synthetic_source_dequeue,
+    .requeue = synthetic_source_requeue,
+    .lease_count = synthetic_source_lease_count,
+    .poll_fd = synthetic_source_poll_fd,
+    .has_failed = synthetic_source_has_failed,
+    .restart = synthetic_source_restart,
+    .stop = synthetic_source_stop,
+    .free = synthetic_source_free,
+};
+
+CaptureSource *synthetic_source_alloc(SyntheticPattern pattern, FrameFormat format)
+{
+    SyntheticSource *source = calloc(1, sizeof(SyntheticSource));
+    if (!source)
+        return NULL;
+    source->base.ops = &synthetic_source_ops;
+    source->pattern = pattern;
+    source->format.format = format;
+    source->ready_fd = -1;
+    return &source->base;
+}
+
+const char *synthetic_pattern_name(SyntheticPattern pattern)
+{
+    switch (pattern)
+    {
+    case SYNTHETIC_PATTERN_BARS:
+        return "bars";
+    case SYNTHETIC_PATTERN_NOISE:
+        return "noise";
+    case SYNTHETIC_PATTERN_STATIC:
+        return "static";
+    }
+    return "unknown";
+}
+
+bool synthetic_pattern_from_name(const char *name, SyntheticPattern *pattern)
+{
+    const SyntheticPattern patterns[] = {SYNTHETIC_PATTERN_BARS, SYNTHETIC_PATTERN_NOISE, SYNTHETIC_PATTERN_STATIC};
+    for (size_t i = 0; i < (sizeof(patterns) / sizeof(patterns[0])); ++i)
+    {
+        if (0 == strcmp(name, synthetic_pattern_name(patterns[i])))
+        {
+            *pattern = patterns[i];
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,38 @@
+#ifndef INCLUDE_SYNTHETIC_SOURCE_H
+#define INCLUDE_SYNTHETIC_SOURCE_H
+
+#include <stdbool.h>
+
+#include "capture_source.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    typedef enum
+    {
+        // Colour bars that scroll sideways, so every frame is different.
+        SYNTHETIC_PATTERN_BARS,
+        // Random pixels, which are the worst case for anything that compresses.
+        SYNTHETIC_PATTERN_NOISE,
+        // The same gradient in every frame.
+        SYNTHETIC_PATTERN_STATIC,
+    } SyntheticPattern;
+
+    // A fake camera for testing and benchmarking without any hardware. Frames
+    // are generated up front in whichever YUV layout is asked for, at the
+    // requested size, and handed out at the requested rate (or as fast as
+    // they're dequeued if the rate is zero), so the cost of making them never
+    // shows up in measurements.
+    CaptureSource *synthetic_source_alloc(SyntheticPattern pattern, FrameFormat format);
+
+    const char *synthetic_pattern_name(SyntheticPattern pattern);
+    // Returns false if the name isn't one of "bars", "noise" or "static".
+    bool synthetic_pattern_from_name(const char *name, SyntheticPattern *pattern);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // INCLUDE_SYNTHETIC_SOURCE_H
@@ -0,0 +1,204 @@
+#include "acutest.h"
+
+#include "synthetic_source.c"
+
+#include <poll.h>
+
+#include "yuv_convert.h"
+
+static CaptureSource* start_source(SyntheticPattern pattern, FrameFormat frame_format, int width, int height,
+  double fps, CaptureFormat* format) {
+  CaptureSource* source = synthetic_source_alloc(pattern, frame_format);
+  TEST_ASSERT(source != NULL);
+  const CaptureRequest request = {width, height, fps};
+  capture_source_open(source);
+  capture_source_configure(source, &request, format);
+  capture_source_start(source);
+  return source;
+}
+
+static void stop_source(CaptureSource* source) {
+  capture_source_stop(source);
+  capture_source_free(source);
+}
+
+static void convert_to_rgba(const CaptureFormat* format, const uint8_t* data, uint8_t* rgba) {
+  const int rgba_stride = format->width * 4;
+  const uint8_t* chroma = data + (format->stride * format->height);
+  switch (format->format) {
+  case FRAME_FORMAT_YUYV:
+    yuyv_to_rgba(data, format->stride, rgba, rgba_stride, format->width, format->height, YUV_MATRIX_BT601,
+      YUV_RANGE_LIMITED);
+    break;
+  case FRAME_FORMAT_NV12:
+    nv12_to_rgba(data, format->stride, chroma, format->stride, rgba, rgba_stride, format->width, format->height,
+      YUV_MATRIX_BT601, YUV_RANGE_LIMITED);
+    break;
+  case FRAME_FORMAT_I420:
+    i420_to_rgba(data, format->stride, chroma, chroma + ((format->stride / 2) * (format->height / 2)),
+      format->stride / 2, rgba, rgba_stride, format->width, format->height, YUV_MATRIX_BT601, YUV_RANGE_LIMITED);
+    break;
+  default:
+    TEST_CHECK(false);
+  }
+}
+
+void test_synthetic_source_formats() {
+  const FrameFormat formats[] = {FRAME_FORMAT_YUYV, FRAME_FORMAT_NV12, FRAME_FORMAT_I420};
+  const int expected_strides[] = {640, 320, 320};
+  const int expected_byte_counts[] = {640 * 240, (320 * 240) + (320 * 120), (320 * 240) + (320 * 120)};
+  for (int i = 0; i < 3; ++i) {
+    CaptureFormat format;
+    // Odd sizes are rounded down, to keep chroma subsampling simple.
+    CaptureSource* source = start_source(SYNTHETIC_PATTERN_STATIC, formats[i], 321, 241, 0.0, &format);
+    TEST_CHECK(format.format == formats[i]);
+    TEST_CHECK(format.width == 320);
+    TEST_CHECK(format.height == 240);
+    TEST_CHECK(format.stride == expected_strides[i]);
+    TEST_CHECK(format.byte_count == expected_byte_counts[i]);
+    TEST_MSG("%s: %d bytes", frame_format_name(formats[i]), format.byte_count);
+
+    CaptureBuffer buffer;
+    TEST_CHECK(capture_source_dequeue(source, &buffer, 0));
+    TEST_CHECK(buffer.bytes_used == format.byte_count);
+    TEST_CHECK(buffer.sequence == 0);
+    TEST_CHECK(((uintptr_t)(buffer.data) % 64) == 0);
+    capture_source_requeue(source, &buffer);
+    stop_source(source);
+  }
+}
+
+void test_synthetic_source_patterns() {
+  CaptureFormat format;
+  CaptureSource* source = start_source(SYNTHETIC_PATTERN_BARS, FRAME_FORMAT_YUYV, 64, 16, 0.0, &format);
+  CaptureBuffer first;
+  CaptureBuffer second;
+  TEST_CHECK(capture_source_dequeue(source, &first, 0));
+  TEST_CHECK(capture_source_dequeue(source, &second, 0));
+  TEST_CHECK(second.sequence == (first.sequence + 1));
+  TEST_CHECK(0 != memcmp(first.data, second.data, format.byte_count));
+  stop_source(source);
+
+  source = start_source(SYNTHETIC_PATTERN_NOISE, FRAME_FORMAT_NV12, 64, 16, 0.0, &format);
+  TEST_CHECK(capture_source_dequeue(source, &first, 0));
+  TEST_CHECK(capture_source_dequeue(source, &second, 0));
+  TEST_CHECK(0 != memcmp(first.data, second.data, format.byte_count));
+  stop_source(source);
+
+  source = start_source(SYNTHETIC_PATTERN_STATIC, FRAME_FORMAT_I420, 64, 16, 0.0, &format);
+  TEST_CHECK(capture_source_dequeue(source, &first, 0));
+  TEST_CHECK(capture_source_dequeue(source, &second, 0));
+  TEST_CHECK(0 == memcmp(first.data, second.data, format.byte_count));
+  stop_source(source);
+}
+
+void test_synthetic_source_same_image_in_every_format() {
+  // Bars have no vertical detail and change color on even columns, so the
+  // chroma subsampling shouldn't lose anything and every layout should
+  // convert to exactly the same pixels.
+  const int width = 256;
+  const int height = 8;
+  uint8_t* expected = malloc(width * height * 4);
+  uint8_t* actual = malloc(width * height * 4);
+
+  const FrameFormat formats[] = {FRAME_FORMAT_YUYV, FRAME_FORMAT_NV12, FRAME_FORMAT_I420};
+  for (int i = 0; i < 3; ++i) {
+    CaptureFormat format;
+    CaptureSource* source = start_source(SYNTHETIC_PATTERN_BARS, formats[i], width, height, 0.0, &format);
+    CaptureBuffer buffer;
+    TEST_CHECK(capture_source_dequeue(source, &buffer, 0));
+    convert_to_rgba(&format, buffer.data, (i == 0) ? expected : actual);
+    if (i > 0) {
+      TEST_CHECK(0 == memcmp(expected, actual, width * height * 4));
+      TEST_MSG("%s differs from YUYV", frame_format_name(formats[i]));
+    }
+    stop_source(source);
+  }
+
+  // The first bar is 75% white.
+  TEST_CHECK(expected[0] == expected[1] && expected[1] == expected[2]);
+  TEST_CHECK(expected[0] > 180 && expected[0] < 200);
+
+  free(actual);
+  free(expected);
+}
+
+void test_synthetic_source_pacing() {
+  const int frame_count = 10;
+  const double fps = 200.0;
+  CaptureFormat format;
+  CaptureSource* source = start_source(SYNTHETIC_PATTERN_STATIC, FRAME_FORMAT_YUYV, 32, 32, fps, &format);
+  TEST_CHECK(format.fps == fps);
+
+  const int64_t start_ns = time_monotonic_ns();
+  for (int i = 0; i < frame_count; ++i) {
+    CaptureBuffer buffer;
+    TEST_CHECK(capture_source_dequeue(source, &buffer, 1000));
+    capture_source_requeue(source, &buffer);
+  }
+  const int64_t elapsed_ns = time_monotonic_ns() - start_ns;
+  // The first frame is due straight away.
+  const int64_t expected_ns = (int64_t)((frame_count - 1) * (1000000000.0 / fps));
+  TEST_CHECK(elapsed_ns >= expected_ns);
+  TEST_MSG("%d frames at %g fps took %lld ns", frame_count, fps, (long long)(elapsed_ns));
+
+  // Nothing is due within a zero timeout, so it should give up.
+  CaptureBuffer buffer;
+  TEST_CHECK(!capture_source_dequeue(source, &buffer, 0));
+  stop_source(source);
+}
+
+static bool is_readable(int fd, int timeout_ms) {
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  return (poll(&pfd, 1, timeout_ms) == 1) && (pfd.revents & POLLIN);
+}
+
+void test_synthetic_source_poll_fd() {
+  CaptureFormat format;
+  CaptureSource* source = start_source(SYNTHETIC_PATTERN_STATIC, FRAME_FORMAT_YUYV, 32, 32, 50.0, &format);
+  const int fd = capture_source_poll_fd(source);
+  TEST_ASSERT(fd != -1);
+  TEST_CHECK(!capture_source_has_failed(source));
+
+  // The first frame is due straight away, and the next one a frame later.
+  CaptureBuffer buffer;
+  TEST_CHECK(is_readable(fd, 1000));
+  TEST_CHECK(capture_source_dequeue(source, &buffer, 0));
+  TEST_CHECK(!is_readable(fd, 0));
+  TEST_CHECK(is_readable(fd, 1000));
+  TEST_CHECK(capture_source_dequeue(source, &buffer, 0));
+  TEST_CHECK(buffer.sequence == 1);
+
+  // Restarting makes a frame due now, without starting the count again.
+  TEST_CHECK(!is_readable(fd, 0));
+  TEST_CHECK(capture_source_restart(source));
+  TEST_CHECK(is_readable(fd, 1000));
+  TEST_CHECK(capture_source_dequeue(source, &buffer, 0));
+  TEST_CHECK(buffer.sequence == 2);
+  stop_source(source);
+
+  // Without a frame rate there's always a frame ready.
+  source = start_source(SYNTHETIC_PATTERN_STATIC, FRAME_FORMAT_YUYV, 32, 32, 0.0, &format);
+  TEST_CHECK(is_readable(capture_source_poll_fd(source), 0));
+  TEST_CHECK(capture_source_dequeue(source, &buffer, 0));
+  TEST_CHECK(is_readable(capture_source_poll_fd(source), 0));
+  stop_source(source);
+}
+
+void test_synthetic_pattern_names() {
+  SyntheticPattern pattern;
+  TEST_CHECK(synthetic_pattern_from_name("noise", &pattern));
+  TEST_CHECK(pattern == SYNTHETIC_PATTERN_NOISE);
+  TEST_CHECK(0 == strcmp(synthetic_pattern_name(pattern), "noise"));
+  TEST_CHECK(!synthetic_pattern_from_name("plaid", &pattern));
+}
+
+TEST_LIST = {
+  {"synthetic_source_formats", test_synthetic_source_formats},
+  {"synthetic_source_patterns", test_synthetic_source_patterns},
+  {"synthetic_source_same_image_in_every_format", test_synthetic_source_same_image_in_every_format},
+  {"synthetic_source_pacing", test_synthetic_source_pacing},
+  {"synthetic_source_poll_fd", test_synthetic_source_poll_fd},
+  {"synthetic_pattern_names", test_synthetic_pattern_names},
+  {NULL, NULL},
+};
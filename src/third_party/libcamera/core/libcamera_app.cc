@@ -118,6 +118,13 @@ void LibcameraApp::OpenCamera()
 
 	if (!options_->post_process_file.empty())
 		post_processor_.Read(options_->post_process_file);
+	const PostProcessor::OverflowPolicy overflow_policy =
+		PostProcessor::OverflowPolicyFromString(options_->post_process_overflow);
+	post_processor_.SetWorkers(options_->post_process_threads, options_->post_process_queue, overflow_policy);
+	if (options_->verbose && !options_->post_process_file.empty())
+		std::cerr << "Post-processing on " << options_->post_process_threads << " threads (0 for one per CPU), "
+				  << options_->post_process_queue << " requests queued at most, "
+				  << PostProcessor::OverflowPolicyName(overflow_policy) << " when full" << std::endl;
 	// The queue takes over ownership from the post-processor.
 	post_processor_.SetCallback(
 		[this](CompletedRequestPtr &r)
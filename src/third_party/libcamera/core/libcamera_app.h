@@ -90,6 +90,7 @@ public:
 	virtual ~LibcameraApp();
 
 	Options *GetOptions() const { return options_.get(); }
+	PostProcessor::Stats GetPostProcessorStats() { return post_processor_.GetStats(); }
 
 	std::string const &CameraId() const;
 	void OpenCamera();
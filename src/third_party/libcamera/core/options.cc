@@ -205,6 +205,9 @@ void Options::Print() const
 	std::cerr << "    height: " << height << std::endl;
 	std::cerr << "    output: " << output << std::endl;
 	std::cerr << "    post_process_file: " << post_process_file << std::endl;
+	std::cerr << "    post_process_threads: " << post_process_threads << std::endl;
+	std::cerr << "    post_process_queue: " << post_process_queue << std::endl;
+	std::cerr << "    post_process_overflow: " << post_process_overflow << std::endl;
 	std::cerr << "    rawfull: " << rawfull << std::endl;
 	if (nopreview)
 		std::cerr << "    preview: none" << std::endl;
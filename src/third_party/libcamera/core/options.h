@@ -69,6 +69,12 @@ struct Options
 			 "Set the output file name")
 			("post-process-file", value<std::string>(&post_process_file),
 			 "Set the file name for configuring the post-processing")
+			("post-process-threads", value<unsigned int>(&post_process_threads)->default_value(0),
+			 "Number of post-processing threads (use 0 for one per CPU)")
+			("post-process-queue", value<unsigned int>(&post_process_queue)->default_value(4),
+			 "Number of requests that can wait for a post-processing thread")
+			("post-process-overflow", value<std::string>(&post_process_overflow)->default_value("drop-oldest"),
+			 "What to do when the post-processing queue is full, drop-oldest, drop-newest or block")
 			("rawfull", value<bool>(&rawfull)->default_value(false)->implicit_value(true),
 			 "Force use of full resolution raw frames")
 			("nopreview,n", value<bool>(&nopreview)->default_value(false)->implicit_value(true),
@@ -143,6 +149,9 @@ struct Options
 	std::string config_file;
 	std::string output;
 	std::string post_process_file;
+	unsigned int post_process_threads;
+	unsigned int post_process_queue;
+	std::string post_process_overflow;
 	unsigned int width;
 	unsigned int height;
 	bool rawfull;
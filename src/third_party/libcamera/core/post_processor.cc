@@ -5,6 +5,7 @@
  * post_processor.cpp - Post processor implementation.
  */
 
+#include <algorithm>
 #include <iostream>
 
 #include "core/libcamera_app.h"
@@ -15,7 +16,9 @@
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/property_tree/ptree.hpp>
 
-PostProcessor::PostProcessor(LibcameraApp *app) : app_(app)
+PostProcessor::PostProcessor(LibcameraApp *app)
+	: app_(app), thread_count_(0), queue_size_(4), overflow_policy_(OverflowPolicy::DropOldest), quit_(false),
+	  stats_()
 {
 }
 
@@ -52,6 +55,48 @@ void PostProcessor::SetCallback(PostProcessorCallback callback)
 	callback_ = callback;
 }
 
+PostProcessor::OverflowPolicy PostProcessor::OverflowPolicyFromString(std::string const &name)
+{
+	if (name == "drop-oldest")
+		return OverflowPolicy::DropOldest;
+	else if (name == "drop-newest")
+		return OverflowPolicy::DropNewest;
+	else if (name == "block")
+		return OverflowPolicy::Block;
+	throw std::runtime_error("unknown post-processing overflow policy " + name);
+}
+
+char const *PostProcessor::OverflowPolicyName(OverflowPolicy policy)
+{
+	switch (policy)
+	{
+	case OverflowPolicy::DropOldest:
+		return "drop-oldest";
+	case OverflowPolicy::DropNewest:
+		return "drop-newest";
+	case OverflowPolicy::Block:
+		return "block";
+	}
+	return "unknown";
+}
+
+void PostProcessor::SetWorkers(unsigned int thread_count, unsigned int queue_size, OverflowPolicy policy)
+{
+	if (queue_size == 0)
+		throw std::runtime_error("post-processing queue must hold at least one request");
+	thread_count_ = thread_count;
+	queue_size_ = queue_size;
+	overflow_policy_ = policy;
+}
+
+PostProcessor::Stats PostProcessor::GetStats()
+{
+	std::unique_lock<std::mutex> l(mutex_);
+	Stats stats = stats_;
+	stats.queue_depth = pending_.size();
+	return stats;
+}
+
 void PostProcessor::AdjustConfig(std::string const &use_case, StreamConfiguration *config)
 {
 	for (auto &stage : stages_)
@@ -71,8 +116,18 @@ void PostProcessor::Configure()
 void PostProcessor::Start()
 {
 	quit_ = false;
+	stats_ = Stats();
 	output_thread_ = std::thread(&PostProcessor::outputThread, this);
 
+	if (!stages_.empty())
+	{
+		unsigned int thread_count = thread_count_;
+		if (thread_count == 0)
+			thread_count = std::max(1u, std::thread::hardware_concurrency());
+		for (unsigned int i = 0; i < thread_count; i++)
+			workers_.emplace_back(&PostProcessor::workerThread, this);
+	}
+
 	for (auto &stage : stages_)
 	{
 		stage->Start();
@@ -87,29 +142,86 @@ void PostProcessor::Process(CompletedRequestPtr &request)
 		return;
 	}
 
-	std::unique_lock<std::mutex> l(mutex_);
-	requests_.push(std::move(request)); // caller has given us ownership of this reference
+	// Dropped requests are only released once the lock is gone, as that hands
+	// their buffers straight back to the camera.
+	CompletedRequestPtr dropped;
+	{
+		std::unique_lock<std::mutex> l(mutex_);
+
+		if (pending_.size() >= queue_size_)
+		{
+			switch (overflow_policy_)
+			{
+			case OverflowPolicy::DropNewest:
+				stats_.dropped_newest++;
+				dropped = std::move(request);
+				return;
+
+			case OverflowPolicy::DropOldest:
+				stats_.dropped_oldest++;
+				dropped = std::move(pending_.front()->request);
+				jobs_.erase(pending_.front());
+				pending_.pop_front();
+				break;
+
+			case OverflowPolicy::Block:
+				stats_.blocked++;
+				space_cv_.wait(l, [this] { return quit_ || pending_.size() < queue_size_; });
+				if (quit_)
+				{
+					dropped = std::move(request);
+					return;
+				}
+				break;
+			}
+		}
 
-	std::promise<bool> promise;
-	auto process_fn = [this](CompletedRequestPtr &request, std::promise<bool> promise)
+		// Jobs are queued for the output thread in arrival order, so the callbacks
+		// happen in the same order however long each one takes to process.
+		jobs_.push_back(Job { std::move(request), false, false }); // caller has given us ownership of this reference
+		pending_.push_back(std::prev(jobs_.end()));
+		stats_.max_queue_depth = std::max<unsigned int>(stats_.max_queue_depth, pending_.size());
+	}
+	work_cv_.notify_one();
+}
+
+void PostProcessor::workerThread()
+{
+	while (true)
 	{
+		JobList::iterator job;
+		{
+			std::unique_lock<std::mutex> l(mutex_);
+			work_cv_.wait(l, [this] { return quit_ || !pending_.empty(); });
+
+			// Anything still queued gets finished before we quit.
+			if (pending_.empty())
+				break;
+
+			job = pending_.front();
+			pending_.pop_front();
+		}
+		space_cv_.notify_one();
+
+		// Nothing else touches a job once a worker has taken it, until it's marked done.
 		bool drop_request = false;
 		for (auto &stage : stages_)
 		{
-			if (stage->Process(request))
+			if (stage->Process(job->request))
 			{
 				drop_request = true;
 				break;
 			}
 		}
-		promise.set_value(drop_request);
-		cv_.notify_one();
-	};
 
-	// Queue the futures to ensure we have correct ordering in the output thread. The promise/future return value
-	// tells us when all the streams for this request have been processed and output_ready_callback_ can be called.
-	futures_.push(promise.get_future());
-	std::thread{process_fn, std::ref(requests_.back()), std::move(promise)}.detach();
+		{
+			std::unique_lock<std::mutex> l(mutex_);
+			job->drop_request = drop_request;
+			job->done = true;
+			stats_.processed++;
+		}
+		output_cv_.notify_one();
+	}
 }
 
 void PostProcessor::outputThread()
@@ -122,18 +234,16 @@ void PostProcessor::outputThread()
 		{
 			std::unique_lock<std::mutex> l(mutex_);
 
-			cv_.wait(l, [this]
-					 { return (quit_ && futures_.empty()) ||
-							  (!futures_.empty() && futures_.front().wait_for(0s) == std::future_status::ready); });
+			output_cv_.wait(l, [this]
+							{ return (quit_ && jobs_.empty()) || (!jobs_.empty() && jobs_.front().done); });
 
-			// Only quit when the futures_ queue is empty.
-			if (quit_ && futures_.empty())
+			// Only quit when every job has been delivered.
+			if (quit_ && jobs_.empty())
 				break;
 
-			drop_request = futures_.front().get();
-			futures_.pop();
-			request = std::move(requests_.front()); // reuse as it's being dropped from the queue
-			requests_.pop();
+			drop_request = jobs_.front().drop_request;
+			request = std::move(jobs_.front().request); // reuse as it's being dropped from the queue
+			jobs_.pop_front();
 		}
 
 		if (!drop_request)
@@ -143,18 +253,25 @@ void PostProcessor::outputThread()
 
 void PostProcessor::Stop()
 {
-	for (auto &stage : stages_)
-	{
-		stage->Stop();
-	}
-
 	{
 		std::unique_lock<std::mutex> l(mutex_);
 		quit_ = true;
-		cv_.notify_one();
 	}
+	work_cv_.notify_all();
+	space_cv_.notify_all();
+	output_cv_.notify_all();
 
+	// The workers finish whatever is still queued before they quit, so the
+	// stages can't be stopped until they have.
+	for (auto &worker : workers_)
+		worker.join();
+	workers_.clear();
 	output_thread_.join();
+
+	for (auto &stage : stages_)
+	{
+		stage->Stop();
+	}
 }
 
 void PostProcessor::Teardown()
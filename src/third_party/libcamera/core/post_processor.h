@@ -9,9 +9,13 @@
 
 #include <chrono>
 #include <condition_variable>
-#include <future>
+#include <cstdint>
+#include <deque>
+#include <list>
 #include <mutex>
-#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "core/completed_request.h"
 
@@ -31,6 +35,27 @@ typedef std::unique_ptr<PostProcessingStage> StagePtr;
 class PostProcessor
 {
 public:
+	// What to do with a new request when every slot in the input queue is taken.
+	enum class OverflowPolicy
+	{
+		DropOldest, // Throw away the request that has been waiting longest.
+		DropNewest, // Throw away the new request.
+		Block, // Wait for a worker to free up a slot.
+	};
+
+	static OverflowPolicy OverflowPolicyFromString(std::string const &name);
+	static char const *OverflowPolicyName(OverflowPolicy policy);
+
+	struct Stats
+	{
+		unsigned int queue_depth; // Requests waiting for a worker right now.
+		unsigned int max_queue_depth;
+		uint64_t processed;
+		uint64_t dropped_oldest;
+		uint64_t dropped_newest;
+		uint64_t blocked; // Requests that had to wait for space in the queue.
+	};
+
 	PostProcessor(LibcameraApp *app);
 
 	~PostProcessor();
@@ -39,6 +64,11 @@ public:
 
 	void SetCallback(PostProcessorCallback callback);
 
+	// Must be called before Start(). Zero threads means one per CPU.
+	void SetWorkers(unsigned int thread_count, unsigned int queue_size, OverflowPolicy policy);
+
+	Stats GetStats();
+
 	void AdjustConfig(std::string const &use_case, StreamConfiguration *config);
 
 	void Configure();
@@ -54,15 +84,35 @@ public:
 private:
 	PostProcessingStage *createPostProcessingStage(char const *name);
 
+	// Every request from the time it's handed to Process() until its callback
+	// has been made, in the order they arrived.
+	struct Job
+	{
+		CompletedRequestPtr request;
+		bool done;
+		bool drop_request;
+	};
+	using JobList = std::list<Job>;
+
 	LibcameraApp *app_;
 	std::vector<StagePtr> stages_;
+	void workerThread();
 	void outputThread();
 
-	std::queue<CompletedRequestPtr> requests_;
-	std::queue<std::future<bool>> futures_;
+	unsigned int thread_count_;
+	unsigned int queue_size_;
+	OverflowPolicy overflow_policy_;
+
+	JobList jobs_;
+	// Jobs no worker has picked up yet, oldest first.
+	std::deque<JobList::iterator> pending_;
+	std::vector<std::thread> workers_;
 	std::thread output_thread_;
 	bool quit_;
 	PostProcessorCallback callback_;
 	std::mutex mutex_;
-	std::condition_variable cv_;
+	std::condition_variable work_cv_;
+	std::condition_variable space_cv_;
+	std::condition_variable output_cv_;
+	Stats stats_;
 };
@@ -11,6 +11,8 @@
 #include <libcamera/color_space.h>
 #include <libcamera/pixel_format.h>
 
+#include "yuv_convert.h"
+
 struct StreamInfo
 {
 	StreamInfo() : width(0), height(0), stride(0) {}
@@ -20,3 +22,17 @@ struct StreamInfo
 	libcamera::PixelFormat pixel_format;
 	std::optional<libcamera::ColorSpace> colour_space;
 };
+
+// Works out which conversion matrix and range to use for a YUV stream. Streams
+// without a colour space are treated as JPEG, which is full-range BT.601.
+inline void GetYuvColourSpace(StreamInfo const &info, YuvMatrix &matrix, YuvRange &range)
+{
+	matrix = YUV_MATRIX_BT601;
+	range = YUV_RANGE_FULL;
+	if (!info.colour_space)
+		return;
+	if (info.colour_space->ycbcrEncoding == libcamera::ColorSpace::YcbcrEncoding::Rec709)
+		matrix = YUV_MATRIX_BT709;
+	if (info.colour_space->range == libcamera::ColorSpace::Range::Limited)
+		range = YUV_RANGE_LIMITED;
+}
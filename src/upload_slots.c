@@ -0,0 +1,149 @@
+#include "upload_slots.h"
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+// Only the side that owns a slot ever changes its state, apart from the
+// producer claiming an offered slot, which is a compare-and-swap so that it
+// can't race with the consumer withdrawing it.
+typedef enum
+{
+    // Belongs to the consumer, and may not be mapped.
+    UPLOAD_SLOT_IDLE,
+    // Mapped and waiting for the producer.
+    UPLOAD_SLOT_OFFERED,
+    // Being written by the producer.
+    UPLOAD_SLOT_FILLING,
+    // Holds a whole frame, waiting for the consumer.
+    UPLOAD_SLOT_FILLED,
+} UploadSlotState;
+
+typedef struct
+{
+    _Atomic int state;
+    uint8_t *data;
+    size_t byte_count;
+    // Written by the producer before the slot is marked as filled.
+    Frame frame;
+} UploadSlot;
+
+struct UploadSlotsStruct
+{
+    UploadSlot slots[UPLOAD_SLOT_COUNT];
+};
+
+UploadSlots *upload_slots_alloc(void)
+{
+    UploadSlots *slots = calloc(1, sizeof(UploadSlots));
+    if (slots == NULL)
+    {
+        return NULL;
+    }
+    for (int i = 0; i < UPLOAD_SLOT_COUNT; ++i)
+    {
+        atomic_init(&slots->slots[i].state, UPLOAD_SLOT_IDLE);
+    }
+    return slots;
+}
+
+void upload_slots_free(UploadSlots *slots)
+{
+    free(slots);
+}
+
+void upload_slots_offer(UploadSlots *slots, int index, uint8_t *data, size_t byte_count)
+{
+    UploadSlot *slot = &slots->slots[index];
+    slot->data = data;
+    slot->byte_count = byte_count;
+    atomic_store_explicit(&slot->state, UPLOAD_SLOT_OFFERED, memory_order_release);
+}
+
+int upload_slots_take_newest(UploadSlots *slots, Frame *frame)
+{
+    int newest = -1;
+    for (int i = 0; i < UPLOAD_SLOT_COUNT; ++i)
+    {
+        UploadSlot *slot = &slots->slots[i];
+        if (atomic_load_explicit(&slot->state, memory_order_acquire) != UPLOAD_SLOT_FILLED)
+        {
+            continue;
+        }
+        if (newest == -1)
+        {
+            newest = i;
+        }
+        else if (slot->frame.sequence > slots->slots[newest].frame.sequence)
+        {
+            upload_slots_offer(slots, newest, slots->slots[newest].data, slots->slots[newest].byte_count);
+            newest = i;
+        }
+        else
+        {
+            upload_slots_offer(slots, i, slot->data, slot->byte_count);
+        }
+    }
+    if (newest == -1)
+    {
+        return -1;
+    }
+    UploadSlot *slot = &slots->slots[newest];
+    atomic_store_explicit(&slot->state, UPLOAD_SLOT_IDLE, memory_order_relaxed);
+    *frame = slot->frame;
+    frame->data = slot->data;
+    return newest;
+}
+
+void upload_slots_withdraw(UploadSlots *slots, int index)
+{
+    UploadSlot *slot = &slots->slots[index];
+    for (;;)
+    {
+        int state = UPLOAD_SLOT_OFFERED;
+        if (atomic_compare_exchange_strong_explicit(&slot->state, &state, UPLOAD_SLOT_IDLE, memory_order_acquire,
+                                                    memory_order_acquire))
+        {
+            return;
+        }
+        if (state != UPLOAD_SLOT_FILLING)
+        {
+            // Idle or filled, so it's ours already.
+            atomic_store_explicit(&slot->state, UPLOAD_SLOT_IDLE, memory_order_relaxed);
+            return;
+        }
+        // Only as long as one frame copy takes, and only when the buffers
+        // change size or the renderer shuts down.
+        sched_yield();
+    }
+}
+
+uint8_t *upload_slots_begin_fill(UploadSlots *slots, size_t byte_count, int *index)
+{
+    for (int i = 0; i < UPLOAD_SLOT_COUNT; ++i)
+    {
+        UploadSlot *slot = &slots->slots[i];
+        int state = UPLOAD_SLOT_OFFERED;
+        if (!atomic_compare_exchange_strong_explicit(&slot->state, &state, UPLOAD_SLOT_FILLING, memory_order_acquire,
+                                                     memory_order_relaxed))
+        {
+            continue;
+        }
+        if (slot->byte_count < byte_count)
+        {
+            // The consumer will notice the new size and offer bigger buffers.
+            atomic_store_explicit(&slot->state, UPLOAD_SLOT_OFFERED, memory_order_release);
+            continue;
+        }
+        *index = i;
+        return slot->data;
+    }
+    return NULL;
+}
+
+void upload_slots_end_fill(UploadSlots *slots, int index, const Frame *frame)
+{
+    UploadSlot *slot = &slots->slots[index];
+    slot->frame = *frame;
+    atomic_store_explicit(&slot->state, UPLOAD_SLOT_FILLED, memory_order_release);
+}
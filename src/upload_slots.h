@@ -0,0 +1,55 @@
+#ifndef INCLUDE_UPLOAD_SLOTS_H
+#define INCLUDE_UPLOAD_SLOTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frame_store.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define UPLOAD_SLOT_COUNT 2
+
+    // Lets a renderer lend the capture thread buffers it has mapped from the
+    // GPU, like pixel buffer objects, so each frame gets written straight into
+    // memory the driver can upload from instead of the render thread copying
+    // it there. There's one consumer, and producers may fill slots from
+    // several threads at once, since each claims its slot before writing.
+    // Nobody ever waits for anyone else in normal use.
+    //
+    // Each slot belongs to one side at a time. The consumer offers a slot with
+    // a mapped buffer, the producer claims and fills it, and the consumer
+    // takes it back once it's full.
+    typedef struct UploadSlotsStruct UploadSlots;
+
+    UploadSlots *upload_slots_alloc(void);
+    void upload_slots_free(UploadSlots *slots);
+
+    // Consumer side. The slot must belong to the consumer, either because it
+    // has never been offered, or it was taken or withdrawn since.
+    void upload_slots_offer(UploadSlots *slots, int index, uint8_t *data, size_t byte_count);
+    // Returns the index of the filled slot holding the newest frame, or -1 if
+    // none are filled. The frame's data points into the slot's buffer, and the
+    // slot belongs to the consumer again. Any older filled slots are offered
+    // again as they are, since nobody wants their frames any more.
+    int upload_slots_take_newest(UploadSlots *slots, Frame *frame);
+    // Takes back a slot whatever state it's in, waiting if the producer is in
+    // the middle of filling it. For when the buffers have to be unmapped.
+    void upload_slots_withdraw(UploadSlots *slots, int index);
+
+    // Producer side. Claims an offered slot with room for byte_count bytes and
+    // returns its buffer, or NULL if there isn't one. The slot must then be
+    // handed back with upload_slots_end_fill().
+    uint8_t *upload_slots_begin_fill(UploadSlots *slots, size_t byte_count, int *index);
+    // Marks a claimed slot as holding the given frame. The frame's data pointer
+    // is ignored, since the pixels are in the slot.
+    void upload_slots_end_fill(UploadSlots *slots, int index, const Frame *frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // INCLUDE_UPLOAD_SLOTS_H
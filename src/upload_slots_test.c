@@ -0,0 +1,157 @@
+#include "acutest.h"
+
+#include "upload_slots.c"
+
+#include <pthread.h>
+#include <string.h>
+
+static Frame make_frame(uint64_t sequence) {
+  Frame frame;
+  memset(&frame, 0, sizeof(frame));
+  frame.width = 4;
+  frame.height = 2;
+  frame.stride = 16;
+  frame.format = FRAME_FORMAT_BGRA;
+  frame.sequence = sequence;
+  return frame;
+}
+
+void test_upload_slots_hand_off() {
+  UploadSlots* slots = upload_slots_alloc();
+  TEST_ASSERT(slots != NULL);
+  uint8_t buffers[UPLOAD_SLOT_COUNT][32];
+  int index;
+  Frame frame;
+
+  // Nothing offered, so nothing to fill or take.
+  TEST_CHECK(upload_slots_begin_fill(slots, 32, &index) == NULL);
+  TEST_CHECK(upload_slots_take_newest(slots, &frame) == -1);
+
+  upload_slots_offer(slots, 0, buffers[0], 32);
+  upload_slots_offer(slots, 1, buffers[1], 16);
+  // Too big for the second slot.
+  uint8_t* data = upload_slots_begin_fill(slots, 32, &index);
+  TEST_CHECK(data == buffers[0]);
+  TEST_CHECK(index == 0);
+  TEST_CHECK(upload_slots_begin_fill(slots, 32, &index) == NULL);
+  memset(data, 7, 32);
+  TEST_CHECK(upload_slots_take_newest(slots, &frame) == -1);
+  const Frame filled = make_frame(1);
+  upload_slots_end_fill(slots, 0, &filled);
+
+  TEST_CHECK(upload_slots_take_newest(slots, &frame) == 0);
+  TEST_CHECK(frame.sequence == 1);
+  TEST_CHECK(frame.data == buffers[0]);
+  TEST_CHECK(frame.format == FRAME_FORMAT_BGRA);
+  // Taken slots aren't offered again until the consumer says so.
+  TEST_CHECK(upload_slots_take_newest(slots, &frame) == -1);
+  TEST_CHECK(upload_slots_begin_fill(slots, 16, &index) == buffers[1]);
+  upload_slots_end_fill(slots, index, &filled);
+  upload_slots_withdraw(slots, 1);
+  TEST_CHECK(upload_slots_take_newest(slots, &frame) == -1);
+  upload_slots_free(slots);
+}
+
+void test_upload_slots_newest_wins() {
+  UploadSlots* slots = upload_slots_alloc();
+  TEST_ASSERT(slots != NULL);
+  uint8_t buffers[UPLOAD_SLOT_COUNT][16];
+  for (int i = 0; i < UPLOAD_SLOT_COUNT; ++i) {
+    upload_slots_offer(slots, i, buffers[i], 16);
+  }
+
+  int older;
+  int newer;
+  TEST_ASSERT(upload_slots_begin_fill(slots, 16, &older) != NULL);
+  TEST_ASSERT(upload_slots_begin_fill(slots, 16, &newer) != NULL);
+  const Frame older_frame = make_frame(5);
+  const Frame newer_frame = make_frame(6);
+  // Finishing out of order shouldn't matter.
+  upload_slots_end_fill(slots, newer, &newer_frame);
+  upload_slots_end_fill(slots, older, &older_frame);
+
+  Frame frame;
+  TEST_CHECK(upload_slots_take_newest(slots, &frame) == newer);
+  TEST_CHECK(frame.sequence == 6);
+  // The stale one went straight back on offer.
+  int index;
+  TEST_CHECK(upload_slots_begin_fill(slots, 16, &index) == buffers[older]);
+  TEST_CHECK(index == older);
+  upload_slots_free(slots);
+}
+
+#define STRESS_FRAME_COUNT 20000
+#define STRESS_BYTE_COUNT 256
+
+typedef struct {
+  UploadSlots* slots;
+  _Atomic bool done;
+} StressState;
+
+static void* stress_producer(void* cookie) {
+  StressState* state = (StressState*)(cookie);
+  for (uint64_t sequence = 1; sequence <= STRESS_FRAME_COUNT; ++sequence) {
+    int index;
+    uint8_t* data = upload_slots_begin_fill(state->slots, STRESS_BYTE_COUNT, &index);
+    if (data == NULL) {
+      continue;
+    }
+    memset(data, (int)(sequence & 0xff), STRESS_BYTE_COUNT);
+    const Frame frame = make_frame(sequence);
+    upload_slots_end_fill(state->slots, index, &frame);
+  }
+  atomic_store(&state->done, true);
+  return NULL;
+}
+
+void test_upload_slots_threads() {
+  StressState state;
+  state.slots = upload_slots_alloc();
+  TEST_ASSERT(state.slots != NULL);
+  atomic_init(&state.done, false);
+  static uint8_t buffers[UPLOAD_SLOT_COUNT][STRESS_BYTE_COUNT];
+  for (int i = 0; i < UPLOAD_SLOT_COUNT; ++i) {
+    upload_slots_offer(state.slots, i, buffers[i], STRESS_BYTE_COUNT);
+  }
+
+  pthread_t producer;
+  TEST_ASSERT(pthread_create(&producer, NULL, stress_producer, &state) == 0);
+  uint64_t last_sequence = 0;
+  int taken_count = 0;
+  bool torn = false;
+  while (!atomic_load(&state.done) || (last_sequence == 0)) {
+    Frame frame;
+    const int index = upload_slots_take_newest(state.slots, &frame);
+    if (index == -1) {
+      if (atomic_load(&state.done)) {
+        break;
+      }
+      sched_yield();
+      continue;
+    }
+    // The producer must never touch a slot once it's been handed over.
+    for (int i = 0; i < STRESS_BYTE_COUNT; ++i) {
+      torn |= (frame.data[i] != (uint8_t)(frame.sequence & 0xff));
+    }
+    TEST_CHECK(frame.sequence > last_sequence);
+    last_sequence = frame.sequence;
+    taken_count += 1;
+    upload_slots_offer(state.slots, index, buffers[index], STRESS_BYTE_COUNT);
+  }
+  pthread_join(producer, NULL);
+  TEST_CHECK(!torn);
+  TEST_CHECK(taken_count > 0);
+  TEST_MSG("took %d frames, last %llu", taken_count, (unsigned long long)(last_sequence));
+
+  for (int i = 0; i < UPLOAD_SLOT_COUNT; ++i) {
+    upload_slots_withdraw(state.slots, i);
+  }
+  upload_slots_free(state.slots);
+}
+
+TEST_LIST = {
+  {"upload_slots_hand_off", test_upload_slots_hand_off},
+  {"upload_slots_newest_wins", test_upload_slots_newest_wins},
+  {"upload_slots_threads", test_upload_slots_threads},
+  {NULL, NULL},
+};
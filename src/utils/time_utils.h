@@ -0,0 +1,17 @@
+#ifndef INCLUDE_UTILS_TIME_UTILS_H
+#define INCLUDE_UTILS_TIME_UTILS_H
+
+#include <stdint.h>
+#include <time.h>
+
+// The current CLOCK_MONOTONIC time in nanoseconds, which is the clock V4L2
+// and libcamera stamp frames with, so every timestamp in the pipeline can be
+// compared with it. It's inline since it's read several times a frame, and
+// clock_gettime() itself goes through the vDSO without a system call.
+static inline int64_t time_monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((int64_t)(ts.tv_sec) * 1000000000) + ts.tv_nsec;
+}
+
+#endif  // INCLUDE_UTILS_TIME_UTILS_H
@@ -0,0 +1,278 @@
+#include "trace.h"
+
+#ifdef ENABLE_TRACING
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Each ring holds this many events, half a megabyte, which is a few
+// seconds of even the busiest thread if the writer falls behind.
+#define TRACE_RING_SIZE 16384
+#define TRACE_RING_MASK (TRACE_RING_SIZE - 1)
+#define TRACE_THREAD_NAME_SIZE 32
+// How often the writer drains the rings.
+#define TRACE_FLUSH_INTERVAL_NS 100000000
+
+typedef enum {
+  TRACE_EVENT_COMPLETE,
+  TRACE_EVENT_BEGIN,
+  TRACE_EVENT_END,
+  TRACE_EVENT_COUNTER,
+} TraceEventType;
+
+typedef struct {
+  const char* name;
+  uint64_t timestamp_ns;
+  // The duration for complete events, or the value for counters.
+  int64_t value;
+  TraceEventType type;
+} TraceEvent;
+
+// Written by one thread and read by the writer. The owner only moves head,
+// and the writer only moves tail, so neither ever waits for the other.
+typedef struct TraceRingStruct {
+  TraceEvent events[TRACE_RING_SIZE];
+  _Atomic uint64_t head;
+  _Atomic uint64_t tail;
+  _Atomic uint64_t dropped;
+  pid_t thread_id;
+  char thread_name[TRACE_THREAD_NAME_SIZE];
+  _Atomic bool thread_name_changed;
+  // Rings are never freed, since the writer may still be reading one after
+  // its thread has exited, so they're just kept on a list.
+  struct TraceRingStruct* next;
+} TraceRing;
+
+static _Atomic(TraceRing*) g_rings = NULL;
+static __thread TraceRing* t_ring = NULL;
+
+static _Atomic bool g_is_recording = false;
+static FILE* g_file = NULL;
+static bool g_has_written_event = false;
+static pthread_t g_writer_thread;
+static pthread_mutex_t g_writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_writer_cond = PTHREAD_COND_INITIALIZER;
+static bool g_stop_requested = false;
+
+// The raw clock isn't slewed by NTP, so short intervals are exact, and it's
+// read through the vDSO without a system call.
+static uint64_t trace_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return ((uint64_t)(ts.tv_sec) * 1000000000) + ts.tv_nsec;
+}
+
+static TraceRing* trace_thread_ring(void) {
+  if (t_ring != NULL) {
+    return t_ring;
+  }
+  TraceRing* ring = calloc(1, sizeof(TraceRing));
+  if (ring == NULL) {
+    return NULL;
+  }
+  ring->thread_id = (pid_t)(syscall(SYS_gettid));
+  TraceRing* next = atomic_load(&g_rings);
+  do {
+    ring->next = next;
+  } while (!atomic_compare_exchange_weak(&g_rings, &next, ring));
+  t_ring = ring;
+  return ring;
+}
+
+static void trace_record(const char* name, uint64_t timestamp_ns, int64_t value,
+  TraceEventType type) {
+  TraceRing* ring = trace_thread_ring();
+  if (ring == NULL) {
+    return;
+  }
+  const uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  const uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if ((head - tail) == TRACE_RING_SIZE) {
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    return;
+  }
+  TraceEvent* event = &ring->events[head & TRACE_RING_MASK];
+  event->name = name;
+  event->timestamp_ns = timestamp_ns;
+  event->value = value;
+  event->type = type;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static bool trace_is_recording(void) {
+  return atomic_load_explicit(&g_is_recording, memory_order_relaxed);
+}
+
+TraceScope trace_begin_scope(const char* name) {
+  TraceScope scope = {name, trace_is_recording() ? trace_now_ns() : 0};
+  return scope;
+}
+
+void trace_end_scope(TraceScope* scope) {
+  if ((scope->start_ns == 0) || !trace_is_recording()) {
+    return;
+  }
+  trace_record(scope->name, scope->start_ns, trace_now_ns() - scope->start_ns,
+    TRACE_EVENT_COMPLETE);
+}
+
+void trace_begin(const char* name) {
+  if (trace_is_recording()) {
+    trace_record(name, trace_now_ns(), 0, TRACE_EVENT_BEGIN);
+  }
+}
+
+void trace_end(const char* name) {
+  if (trace_is_recording()) {
+    trace_record(name, trace_now_ns(), 0, TRACE_EVENT_END);
+  }
+}
+
+void trace_counter(const char* name, int64_t value) {
+  if (trace_is_recording()) {
+    trace_record(name, trace_now_ns(), value, TRACE_EVENT_COUNTER);
+  }
+}
+
+// Names are kept whether or not we're recording, since threads usually name
+// themselves once when they start.
+void trace_set_thread_name(const char* name) {
+  TraceRing* ring = trace_thread_ring();
+  if (ring == NULL) {
+    return;
+  }
+  strncpy(ring->thread_name, name, TRACE_THREAD_NAME_SIZE - 1);
+  atomic_store_explicit(&ring->thread_name_changed, true, memory_order_release);
+}
+
+static void trace_write_separator(void) {
+  if (g_has_written_event) {
+    fputs(",\n", g_file);
+  }
+  g_has_written_event = true;
+}
+
+static void trace_write_event(const TraceRing* ring, const TraceEvent* event) {
+  static const char* phases[] = {"X", "B", "E", "C"};
+  trace_write_separator();
+  fprintf(g_file, "{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d",
+    event->name, phases[event->type], event->timestamp_ns / 1000.0, (int)(getpid()),
+    (int)(ring->thread_id));
+  if (event->type == TRACE_EVENT_COMPLETE) {
+    fprintf(g_file, ",\"dur\":%.3f", event->value / 1000.0);
+  } else if (event->type == TRACE_EVENT_COUNTER) {
+    fprintf(g_file, ",\"args\":{\"value\":%lld}", (long long)(event->value));
+  }
+  fputs("}", g_file);
+}
+
+// Only ever called by one thread at a time, either the writer or whoever
+// stops it once it's gone.
+static void trace_drain_rings(void) {
+  for (TraceRing* ring = atomic_load(&g_rings); ring != NULL; ring = ring->next) {
+    if (atomic_exchange_explicit(&ring->thread_name_changed, false, memory_order_acquire)) {
+      trace_write_separator();
+      fprintf(g_file,
+        "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+        (int)(getpid()), (int)(ring->thread_id), ring->thread_name);
+    }
+    const uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    for (; tail != head; ++tail) {
+      trace_write_event(ring, &ring->events[tail & TRACE_RING_MASK]);
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+  }
+  fflush(g_file);
+}
+
+static void* trace_writer_main(void* cookie) {
+  TRACE_THREAD_NAME("trace writer");
+  pthread_mutex_lock(&g_writer_mutex);
+  while (!g_stop_requested) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += TRACE_FLUSH_INTERVAL_NS;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&g_writer_cond, &g_writer_mutex, &deadline);
+    if (!g_stop_requested) {
+      trace_drain_rings();
+    }
+  }
+  pthread_mutex_unlock(&g_writer_mutex);
+  return NULL;
+}
+
+bool trace_start(const char* path) {
+  if (g_file != NULL) {
+    return false;
+  }
+  g_file = fopen(path, "w");
+  if (g_file == NULL) {
+    fprintf(stderr, "Couldn't open trace file '%s'\n", path);
+    return false;
+  }
+  fputs("{\"traceEvents\":[\n", g_file);
+  g_has_written_event = false;
+  g_stop_requested = false;
+  // Anything left over from an earlier trace is thrown away.
+  for (TraceRing* ring = atomic_load(&g_rings); ring != NULL; ring = ring->next) {
+    atomic_store(&ring->tail, atomic_load(&ring->head));
+    atomic_store(&ring->dropped, 0);
+    if (ring->thread_name[0] != '\0') {
+      atomic_store(&ring->thread_name_changed, true);
+    }
+  }
+  if (pthread_create(&g_writer_thread, NULL, trace_writer_main, NULL) != 0) {
+    fclose(g_file);
+    g_file = NULL;
+    return false;
+  }
+  atomic_store(&g_is_recording, true);
+  return true;
+}
+
+void trace_stop(void) {
+  if (g_file == NULL) {
+    return;
+  }
+  atomic_store(&g_is_recording, false);
+  pthread_mutex_lock(&g_writer_mutex);
+  g_stop_requested = true;
+  pthread_cond_signal(&g_writer_cond);
+  pthread_mutex_unlock(&g_writer_mutex);
+  pthread_join(g_writer_thread, NULL);
+
+  trace_drain_rings();
+  uint64_t dropped = 0;
+  for (TraceRing* ring = atomic_load(&g_rings); ring != NULL; ring = ring->next) {
+    dropped += atomic_load(&ring->dropped);
+  }
+  fputs("\n]}\n", g_file);
+  fclose(g_file);
+  g_file = NULL;
+  if (dropped > 0) {
+    fprintf(stderr, "Dropped %llu trace events because the rings were full\n",
+      (unsigned long long)(dropped));
+  }
+}
+
+#else  // ENABLE_TRACING
+
+bool trace_start(const char* path) {
+  fprintf(stderr, "Tracing isn't compiled in, so rebuild with `make TRACE=1` to use it\n");
+  return false;
+}
+
+void trace_stop(void) {
+}
+
+#endif  // ENABLE_TRACING
@@ -1,6 +1,7 @@
 #ifndef INCLUDE_UTILS_TRACE_H
 #define INCLUDE_UTILS_TRACE_H
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 
@@ -9,4 +10,74 @@
 #define TRACE_PTR(variable) do { fprintf(stderr, __FILE__":%d "#variable"=0x%016lx\n", __LINE__, (uint64_t)(variable)); } while (0)
 #define TRACE_SIZ(variable) do { fprintf(stderr, __FILE__":%d "#variable"=%zu\n", __LINE__, variable); } while (0)
 
+// Timeline tracing, cheap enough to leave in the frame loops. Events go into
+// a lock-free ring buffer owned by the thread that records them, and a
+// background thread drains the rings into a Chrome trace file, which
+// chrome://tracing and ui.perfetto.dev both open. A full ring drops events
+// rather than making anyone wait.
+//
+// It's only compiled in when ENABLE_TRACING is defined, which `make TRACE=1`
+// does. Otherwise the macros below are empty, and trace_start() just says
+// tracing isn't available. Even when compiled in, nothing is recorded until
+// trace_start() is called.
+//
+// Event names must be string literals, since only the pointer is kept, and
+// they go into the JSON as they are.
+//
+//   TRACE_SCOPE("upload");            // From here to the end of the block.
+//   TRACE_BEGIN("wait"); ... TRACE_END("wait");
+//   TRACE_COUNTER("backlog", depth);
+//   TRACE_THREAD_NAME("capture");     // Labels the thread's track.
+
+#ifdef __cplusplus
+extern "C" {
+#endif  // __cplusplus
+
+  // Starts recording, with events written to the given file from a
+  // background thread. Returns false if the file can't be opened, or tracing
+  // wasn't compiled in.
+  bool trace_start(const char* path);
+  // Stops recording, writes out everything recorded so far, and closes the
+  // file. Does nothing if tracing hasn't been started.
+  void trace_stop(void);
+
+#ifdef ENABLE_TRACING
+
+  typedef struct {
+    const char* name;
+    // Zero if tracing wasn't recording when the scope began.
+    uint64_t start_ns;
+  } TraceScope;
+
+  TraceScope trace_begin_scope(const char* name);
+  void trace_end_scope(TraceScope* scope);
+  void trace_begin(const char* name);
+  void trace_end(const char* name);
+  void trace_counter(const char* name, int64_t value);
+  void trace_set_thread_name(const char* name);
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) \
+  TraceScope TRACE_CONCAT(trace_scope_, __LINE__) __attribute__((cleanup(trace_end_scope))) = \
+    trace_begin_scope(name)
+#define TRACE_BEGIN(name) trace_begin(name)
+#define TRACE_END(name) trace_end(name)
+#define TRACE_COUNTER(name, value) trace_counter(name, (int64_t)(value))
+#define TRACE_THREAD_NAME(name) trace_set_thread_name(name)
+
+#else  // ENABLE_TRACING
+
+#define TRACE_SCOPE(name) do {} while (0)
+#define TRACE_BEGIN(name) do {} while (0)
+#define TRACE_END(name) do {} while (0)
+#define TRACE_COUNTER(name, value) do {} while (0)
+#define TRACE_THREAD_NAME(name) do {} while (0)
+
+#endif  // ENABLE_TRACING
+
+#ifdef __cplusplus
+}
+#endif  // __cplusplus
+
 #endif  // INCLUDE_UTILS_TRACE_H
@@ -0,0 +1,110 @@
+// The tracer is always tested, whether or not the rest of the build has it.
+#ifndef ENABLE_TRACING
+#define ENABLE_TRACING
+#endif
+
+#include "acutest.h"
+
+#include "trace.c"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+static const char* test_trace_path = "/tmp/trace_test.json";
+
+static char* read_trace() {
+  FILE* file = fopen(test_trace_path, "r");
+  TEST_ASSERT(file != NULL);
+  fseek(file, 0, SEEK_END);
+  const long length = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char* contents = calloc(length + 1, 1);
+  TEST_ASSERT(fread(contents, 1, length, file) == (size_t)(length));
+  fclose(file);
+  return contents;
+}
+
+static int count_matches(const char* text, const char* pattern) {
+  int count = 0;
+  for (const char* found = strstr(text, pattern); found != NULL; found = strstr(found + 1, pattern)) {
+    count += 1;
+  }
+  return count;
+}
+
+void test_trace_not_recording() {
+  // Nothing is kept until tracing starts.
+  TRACE_COUNTER("ignored", 1);
+  { TRACE_SCOPE("ignored"); }
+  TEST_CHECK(trace_start(test_trace_path));
+  trace_stop();
+  char* contents = read_trace();
+  TEST_CHECK(strstr(contents, "ignored") == NULL);
+  TEST_CHECK(strncmp(contents, "{\"traceEvents\":[", 16) == 0);
+  TEST_CHECK(strstr(contents, "]}") != NULL);
+  free(contents);
+  // Stopping again does nothing.
+  trace_stop();
+}
+
+static void* record_events(void* cookie) {
+  TRACE_THREAD_NAME("recorder");
+  for (int i = 0; i < 1000; ++i) {
+    TRACE_SCOPE("work");
+    TRACE_COUNTER("progress", i);
+  }
+  return NULL;
+}
+
+void test_trace_events() {
+  TEST_CHECK(trace_start(test_trace_path));
+  // Can't start twice.
+  TEST_CHECK(!trace_start(test_trace_path));
+  TRACE_THREAD_NAME("main");
+  TRACE_BEGIN("waiting");
+  pthread_t threads[2];
+  for (int i = 0; i < 2; ++i) {
+    TEST_ASSERT(pthread_create(&threads[i], NULL, record_events, NULL) == 0);
+  }
+  for (int i = 0; i < 2; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  TRACE_END("waiting");
+  trace_stop();
+
+  char* contents = read_trace();
+  TEST_CHECK(count_matches(contents, "\"name\":\"work\",\"ph\":\"X\"") == 2000);
+  TEST_CHECK(count_matches(contents, "\"name\":\"progress\",\"ph\":\"C\"") == 2000);
+  TEST_CHECK(count_matches(contents, "\"name\":\"waiting\",\"ph\":\"B\"") == 1);
+  TEST_CHECK(count_matches(contents, "\"name\":\"waiting\",\"ph\":\"E\"") == 1);
+  TEST_CHECK(count_matches(contents, "\"args\":{\"name\":\"recorder\"}") == 2);
+  TEST_CHECK(count_matches(contents, "\"args\":{\"name\":\"main\"}") == 1);
+  TEST_CHECK(strstr(contents, "\"args\":{\"value\":999}") != NULL);
+  free(contents);
+}
+
+void test_trace_full_ring() {
+  // A thread that records more than its ring holds between flushes loses the
+  // rest, rather than waiting for the writer.
+  // Holding the writer's mutex keeps it from draining in the meantime.
+  TEST_CHECK(trace_start(test_trace_path));
+  pthread_mutex_lock(&g_writer_mutex);
+  for (int i = 0; i < (TRACE_RING_SIZE + 100); ++i) {
+    TRACE_COUNTER("flood", i);
+  }
+  pthread_mutex_unlock(&g_writer_mutex);
+  TEST_CHECK(atomic_load(&t_ring->dropped) >= 1);
+  trace_stop();
+  char* contents = read_trace();
+  const int written = count_matches(contents, "\"name\":\"flood\"");
+  TEST_CHECK(written == TRACE_RING_SIZE);
+  TEST_MSG("%d events written", written);
+  free(contents);
+}
+
+TEST_LIST = {
+  {"trace_not_recording", test_trace_not_recording},
+  {"trace_events", test_trace_events},
+  {"trace_full_ring", test_trace_full_ring},
+  {NULL, NULL},
+};
@@ -0,0 +1,1027 @@
+#include "v4l2_source.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h> /* low-level i/o */
+#include <linux/videodev2.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture_mode.h"
+#include "time_utils.h"
+
+#define CLEAR(x) memset(&(x), 0, sizeof(x))
+
+// Consumers can hold on to captured buffers, so there need to be enough for
+// the driver to keep filling while they do: one being captured into, one
+// queued behind it, the newest frame, and a few older ones still being read.
+#define V4L2_SOURCE_BUFFER_COUNT 8
+
+struct buffer
+{
+    void *start;
+    size_t length;
+    // Dequeued and not handed back yet, so it mustn't be queued again when
+    // streaming restarts.
+    bool held;
+};
+
+typedef struct
+{
+    CaptureSource base;
+    const char *dev_name;
+    V4l2SourceIo io;
+    bool negotiate_format;
+    int fd;
+    struct buffer *buffers;
+    unsigned int n_buffers;
+    // read() doesn't give us sequence numbers, so we count frames ourselves.
+    uint32_t read_sequence;
+    // Buffers can be requeued from any thread, so this keeps them from being
+    // queued while streaming is being restarted.
+    pthread_mutex_t lock;
+    _Atomic bool failed;
+} V4l2Source;
+
+static void errno_exit(const char *s)
+{
+    fprintf(stderr, "%s error %d, %s\n", s, errno, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+static int xioctl(int fh, int request, void *arg)
+{
+    int r;
+
+    do
+    {
+        r = ioctl(fh, request, arg);
+    } while (-1 == r && EINTR == errno);
+
+    return r;
+}
+
+// For the calls made while capturing, where an error is worth reporting but
+// exiting would take every other camera down too.
+static bool try_ioctl(V4l2Source *source, int request, void *arg, const char *name)
+{
+    if (-1 != xioctl(source->fd, request, arg))
+        return true;
+    fprintf(stderr, "%s on %s error %d, %s\n", name, source->dev_name, errno, strerror(errno));
+    return false;
+}
+
+// Once the driver has given up on the stream every dequeue fails the same
+// way, so only the first error is reported.
+static void mark_failed(V4l2Source *source, const char *name)
+{
+    if (!atomic_exchange(&source->failed, true))
+        fprintf(stderr, "%s on %s error %d, %s\n", name, source->dev_name, errno, strerror(errno));
+}
+
+static int64_t timeval_to_ns(const struct timeval *tv)
+{
+    return ((int64_t)(tv->tv_sec) * 1000000000) + ((int64_t)(tv->tv_usec) * 1000);
+}
+
+static bool frame_format_for_pixel_format(uint32_t pixel_format, FrameFormat *format)
+{
+    switch (pixel_format)
+    {
+    case V4L2_PIX_FMT_YUYV:
+        *format = FRAME_FORMAT_YUYV;
+        return true;
+    case V4L2_PIX_FMT_NV12:
+        *format = FRAME_FORMAT_NV12;
+        return true;
+    case V4L2_PIX_FMT_YUV420:
+        *format = FRAME_FORMAT_I420;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool is_supported_pixel_format(uint32_t pixel_format)
+{
+    FrameFormat format;
+    return frame_format_for_pixel_format(pixel_format, &format);
+}
+
+static int read_frame(V4l2Source *source, CaptureBuffer *capture_buffer)
+{
+    struct v4l2_buffer buf;
+    unsigned int i;
+    ssize_t bytes_read;
+
+    switch (source->io)
+    {
+    case V4L2_SOURCE_IO_READ:
+        bytes_read = read(source->fd, source->buffers[0].start, source->buffers[0].length);
+        if (-1 == bytes_read)
+        {
+            switch (errno)
+            {
+            /* A stop signal can land mid-read, and the reactor will try again
+             * if it's still running. */
+            case EINTR:
+            case EAGAIN:
+                return 0;
+
+            default:
+                mark_failed(source, "read");
+                return 0;
+            }
+        }
+
+        capture_buffer->data = source->buffers[0].start;
+        capture_buffer->bytes_used = bytes_read;
+        capture_buffer->timestamp_ns = time_monotonic_ns();
+        capture_buffer->sequence = source->read_sequence++;
+        capture_buffer->index = 0;
+        break;
+
+    case V4L2_SOURCE_IO_MMAP:
+        CLEAR(buf);
+
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+
+        if (-1 == xioctl(source->fd, VIDIOC_DQBUF, &buf))
+        {
+            switch (errno)
+            {
+            case EAGAIN:
+                return 0;
+
+            default:
+                /* EIO means the driver has given up on the stream until it's
+                 * restarted, and anything else is a lost device. */
+                mark_failed(source, "VIDIOC_DQBUF");
+                return 0;
+            }
+        }
+
+        assert(buf.index < source->n_buffers);
+        source->buffers[buf.index].held = true;
+
+        capture_buffer->data = source->buffers[buf.index].start;
+        capture_buffer->bytes_used = buf.bytesused;
+        capture_buffer->timestamp_ns = timeval_to_ns(&buf.timestamp);
+        capture_buffer->sequence = buf.sequence;
+        capture_buffer->index = buf.index;
+        break;
+
+    case V4L2_SOURCE_IO_USERPTR:
+        CLEAR(buf);
+
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_USERPTR;
+
+        if (-1 == xioctl(source->fd, VIDIOC_DQBUF, &buf))
+        {
+            switch (errno)
+            {
+            case EAGAIN:
+                return 0;
+
+            default:
+                /* EIO means the driver has given up on the stream until it's
+                 * restarted, and anything else is a lost device. */
+                mark_failed(source, "VIDIOC_DQBUF");
+                return 0;
+            }
+        }
+
+        for (i = 0; i < source->n_buffers; ++i)
+            if (buf.m.userptr == (unsigned long)source->buffers[i].start &&
+                buf.length == source->buffers[i].length)
+                break;
+
+        assert(i < source->n_buffers);
+        source->buffers[i].held = true;
+
+        capture_buffer->data = (const uint8_t *)buf.m.userptr;
+        capture_buffer->bytes_used = buf.bytesused;
+        capture_buffer->timestamp_ns = timeval_to_ns(&buf.timestamp);
+        capture_buffer->sequence = buf.sequence;
+        capture_buffer->index = i;
+        break;
+    }
+
+    return 1;
+}
+
+static bool v4l2_source_dequeue(CaptureSource *base, CaptureBuffer *buffer, int timeout_ms)
+{
+    V4l2Source *source = (V4l2Source *)(base);
+
+    for (;;)
+    {
+        fd_set fds;
+        struct timeval tv;
+        int r;
+
+        FD_ZERO(&fds);
+        FD_SET(source->fd, &fds);
+
+        /* Timeout. */
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+        r = select(source->fd + 1, &fds, NULL, NULL, &tv);
+
+        if (-1 == r)
+        {
+            if (EINTR == errno)
+                continue;
+            errno_exit("select");
+        }
+
+        if (0 == r)
+            return false;
+
+        if (read_frame(source, buffer))
+            return true;
+        if (atomic_load(&source->failed))
+            return false;
+        /* EAGAIN - continue select loop. */
+    }
+}
+
+// Hands a buffer to the driver. If that fails it's still marked as not held,
+// so it'll be queued again when streaming restarts.
+static bool queue_buffer(V4l2Source *source, unsigned int index)
+{
+    struct v4l2_buffer buf;
+
+    CLEAR(buf);
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.index = index;
+    if (V4L2_SOURCE_IO_MMAP == source->io)
+    {
+        buf.memory = V4L2_MEMORY_MMAP;
+    }
+    else
+    {
+        buf.memory = V4L2_MEMORY_USERPTR;
+        buf.m.userptr = (unsigned long)source->buffers[index].start;
+        buf.length = source->buffers[index].length;
+    }
+
+    source->buffers[index].held = false;
+    return try_ioctl(source, VIDIOC_QBUF, &buf, "VIDIOC_QBUF");
+}
+
+static void v4l2_source_requeue(CaptureSource *base, const CaptureBuffer *capture_buffer)
+{
+    V4l2Source *source = (V4l2Source *)(base);
+
+    /* read() has nothing to hand back. */
+    if (V4L2_SOURCE_IO_READ == source->io)
+        return;
+
+    pthread_mutex_lock(&source->lock);
+    if (!queue_buffer(source, capture_buffer->index))
+        atomic_store(&source->failed, true);
+    pthread_mutex_unlock(&source->lock);
+}
+
+static int v4l2_source_lease_count(CaptureSource *base)
+{
+    V4l2Source *source = (V4l2Source *)(base);
+    // read() always fills the same buffer.
+    return (source->io == V4L2_SOURCE_IO_READ) ? 0 : (int)(source->n_buffers);
+}
+
+static void v4l2_source_stop(CaptureSource *base)
+{
+    V4l2Source *source = (V4l2Source *)(base);
+    enum v4l2_buf_type type;
+
+    switch (source->io)
+    {
+    case V4L2_SOURCE_IO_READ:
+        /* Nothing to do. */
+        break;
+
+    case V4L2_SOURCE_IO_MMAP:
+    case V4L2_SOURCE_IO_USERPTR:
+        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        try_ioctl(source, VIDIOC_STREAMOFF, &type, "VIDIOC_STREAMOFF");
+        break;
+    }
+}
+
+static void v4l2_source_start(CaptureSource *base)
+{
+    V4l2Source *source = (V4l2Source *)(base);
+    unsigned int i;
+    enum v4l2_buf_type type;
+
+    switch (source->io)
+    {
+    case V4L2_SOURCE_IO_READ:
+        /* Nothing to do. */
+        break;
+
+    case V4L2_SOURCE_IO_MMAP:
+    case V4L2_SOURCE_IO_USERPTR:
+        for (i = 0; i < source->n_buffers; ++i)
+            if (!queue_buffer(source, i))
+                exit(EXIT_FAILURE);
+        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        if (-1 == xioctl(source->fd, VIDIOC_STREAMON, &type))
+            errno_exit("VIDIOC_STREAMON");
+        break;
+    }
+}
+
+static void uninit_device(V4l2Source *source)
+{
+    unsigned int i;
+
+    if (!source->buffers)
+        return;
+
+    switch (source->io)
+    {
+    case V4L2_SOURCE_IO_READ:
+        free(source->buffers[0].start);
+        break;
+
+    case V4L2_SOURCE_IO_MMAP:
+        for (i = 0; i < source->n_buffers; ++i)
+            if ((MAP_FAILED != source->buffers[i].start) &&
+                (-1 == munmap(source->buffers[i].start, source->buffers[i].length)))
+                errno_exit("munmap");
+        break;
+
+    case V4L2_SOURCE_IO_USERPTR:
+        for (i = 0; i < source->n_buffers; ++i)
+            free(source->buffers[i].start);
+        break;
+    }
+
+    free(source->buffers);
+    source->buffers = NULL;
+}
+
+static void init_read(V4l2Source *source, unsigned int buffer_size)
+{
+    source->buffers = calloc(1, sizeof(*source->buffers));
+
+    if (!source->buffers)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    source->buffers[0].length = buffer_size;
+    source->buffers[0].start = malloc(buffer_size);
+
+    if (!source->buffers[0].start)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void init_mmap(V4l2Source *source)
+{
+    struct v4l2_requestbuffers req;
+
+    CLEAR(req);
+
+    req.count = V4L2_SOURCE_BUFFER_COUNT;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+
+    if (-1 == xioctl(source->fd, VIDIOC_REQBUFS, &req))
+    {
+        if (EINVAL == errno)
+        {
+            fprintf(stderr,
+                    "%s does not support "
+                    "memory mapping\n",
+                    source->dev_name);
+            exit(EXIT_FAILURE);
+        }
+        else
+        {
+            errno_exit("VIDIOC_REQBUFS");
+        }
+    }
+
+    if (req.count < 2)
+    {
+        fprintf(stderr, "Insufficient buffer memory on %s\n", source->dev_name);
+        exit(EXIT_FAILURE);
+    }
+
+    source->buffers = calloc(req.count, sizeof(*source->buffers));
+
+    if (!source->buffers)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (source->n_buffers = 0; source->n_buffers < req.count; ++source->n_buffers)
+    {
+        struct v4l2_buffer buf;
+
+        CLEAR(buf);
+
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = source->n_buffers;
+
+        if (-1 == xioctl(source->fd, VIDIOC_QUERYBUF, &buf))
+            errno_exit("VIDIOC_QUERYBUF");
+
+        source->buffers[source->n_buffers].length = buf.length;
+        source->buffers[source->n_buffers].start =
+            mmap(NULL /* start anywhere */, buf.length,
+                 PROT_READ | PROT_WRITE /* required */,
+                 MAP_SHARED /* recommended */, source->fd, buf.m.offset);
+
+        if (MAP_FAILED == source->buffers[source->n_buffers].start)
+            errno_exit("mmap");
+    }
+}
+
+static void init_userp(V4l2Source *source, unsigned int buffer_size)
+{
+    struct v4l2_requestbuffers req;
+
+    CLEAR(req);
+
+    req.count = V4L2_SOURCE_BUFFER_COUNT;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_USERPTR;
+
+    if (-1 == xioctl(source->fd, VIDIOC_REQBUFS, &req))
+    {
+        if (EINVAL == errno)
+        {
+            fprintf(stderr,
+                    "%s does not support "
+                    "user pointer i/o\n",
+                    source->dev_name);
+            exit(EXIT_FAILURE);
+        }
+        else
+        {
+            errno_exit("VIDIOC_REQBUFS");
+        }
+    }
+
+    source->buffers = calloc(V4L2_SOURCE_BUFFER_COUNT, sizeof(*source->buffers));
+
+    if (!source->buffers)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (source->n_buffers = 0; source->n_buffers < V4L2_SOURCE_BUFFER_COUNT; ++source->n_buffers)
+    {
+        source->buffers[source->n_buffers].length = buffer_size;
+        source->buffers[source->n_buffers].start = malloc(buffer_size);
+
+        if (!source->buffers[source->n_buffers].start)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Asks the driver for a fresh set of the same number of buffers, which it only
+// allows once none of the old ones are mapped.
+static bool reallocate_buffers(V4l2Source *source)
+{
+    struct v4l2_requestbuffers req;
+    unsigned int i;
+
+    if (V4L2_SOURCE_IO_MMAP == source->io)
+    {
+        for (i = 0; i < source->n_buffers; ++i)
+        {
+            if (MAP_FAILED != source->buffers[i].start)
+                munmap(source->buffers[i].start, source->buffers[i].length);
+            source->buffers[i].start = MAP_FAILED;
+        }
+    }
+
+    CLEAR(req);
+    req.count = source->n_buffers;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = (V4L2_SOURCE_IO_MMAP == source->io) ? V4L2_MEMORY_MMAP : V4L2_MEMORY_USERPTR;
+    if (!try_ioctl(source, VIDIOC_REQBUFS, &req, "VIDIOC_REQBUFS"))
+        return false;
+
+    /* Consumers and the frame store were told how many there are. */
+    if (req.count != source->n_buffers)
+    {
+        fprintf(stderr, "%s gave us %u buffers instead of %u when restarting\n", source->dev_name, req.count,
+                source->n_buffers);
+        return false;
+    }
+
+    if (V4L2_SOURCE_IO_USERPTR == source->io)
+        return true;
+
+    for (i = 0; i < source->n_buffers; ++i)
+    {
+        struct v4l2_buffer buf;
+
+        CLEAR(buf);
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = i;
+
+        if (!try_ioctl(source, VIDIOC_QUERYBUF, &buf, "VIDIOC_QUERYBUF"))
+            return false;
+
+        source->buffers[i].length = buf.length;
+        source->buffers[i].start =
+            mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, source->fd, buf.m.offset);
+        if (MAP_FAILED == source->buffers[i].start)
+        {
+            fprintf(stderr, "mmap on %s error %d, %s\n", source->dev_name, errno, strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool any_buffer_held(const V4l2Source *source)
+{
+    for (unsigned int i = 0; i < source->n_buffers; ++i)
+        if (source->buffers[i].held)
+            return true;
+    return false;
+}
+
+// STREAMOFF takes every buffer back from the driver, so the ones that weren't
+// held are queued again before STREAMON. Held ones go back when they're
+// requeued, as usual. While consumers hold any, they're still reading the
+// mapped memory, so the buffers are only reallocated when none are held.
+static bool v4l2_source_restart(CaptureSource *base)
+{
+    V4l2Source *source = (V4l2Source *)(base);
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    bool ok;
+
+    /* read() picks up again by itself. */
+    if (V4L2_SOURCE_IO_READ == source->io)
+    {
+        atomic_store(&source->failed, false);
+        return true;
+    }
+
+    pthread_mutex_lock(&source->lock);
+    ok = try_ioctl(source, VIDIOC_STREAMOFF, &type, "VIDIOC_STREAMOFF");
+    if (ok && !any_buffer_held(source))
+        ok = reallocate_buffers(source);
+    for (unsigned int i = 0; ok && (i < source->n_buffers); ++i)
+        if (!source->buffers[i].held)
+            ok = queue_buffer(source, i);
+    if (ok)
+        ok = try_ioctl(source, VIDIOC_STREAMON, &type, "VIDIOC_STREAMON");
+    if (ok)
+        atomic_store(&source->failed, false);
+    pthread_mutex_unlock(&source->lock);
+    return ok;
+}
+
+static int v4l2_source_poll_fd(CaptureSource *base)
+{
+    V4l2Source *source = (V4l2Source *)(base);
+    return source->fd;
+}
+
+static bool v4l2_source_has_failed(CaptureSource *base)
+{
+    V4l2Source *source = (V4l2Source *)(base);
+    return atomic_load(&source->failed);
+}
+
+static void add_capture_mode(CaptureMode **modes, int *mode_count, int *mode_capacity, const CaptureMode *mode)
+{
+    if (*mode_count == *mode_capacity)
+    {
+        *mode_capacity = (*mode_capacity == 0) ? 16 : (*mode_capacity * 2);
+        *modes = realloc(*modes, *mode_capacity * sizeof(CaptureMode));
+        if (!*modes)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*modes)[*mode_count] = *mode;
+    *mode_count += 1;
+}
+
+static double fract_to_seconds(const struct v4l2_fract *fract)
+{
+    return (double)(fract->numerator) / fract->denominator;
+}
+
+static void add_frame_size_modes(V4l2Source *source, const CaptureRequest *request, uint32_t pixel_format,
+                                 int width, int height, CaptureMode **modes, int *mode_count, int *mode_capacity)
+{
+    struct v4l2_frmivalenum interval;
+    CaptureMode mode = {pixel_format, width, height, 0, 0};
+
+    CLEAR(interval);
+    interval.pixel_format = pixel_format;
+    interval.width = width;
+    interval.height = height;
+
+    if (-1 == xioctl(source->fd, VIDIOC_ENUM_FRAMEINTERVALS, &interval))
+    {
+        /* The driver doesn't list frame rates, so we'll take what we get. */
+        add_capture_mode(modes, mode_count, mode_capacity, &mode);
+        return;
+    }
+
+    if (V4L2_FRMIVAL_TYPE_DISCRETE == interval.type)
+    {
+        do
+        {
+            mode.interval_numerator = interval.discrete.numerator;
+            mode.interval_denominator = interval.discrete.denominator;
+            add_capture_mode(modes, mode_count, mode_capacity, &mode);
+            interval.index += 1;
+        } while (0 == xioctl(source->fd, VIDIOC_ENUM_FRAMEINTERVALS, &interval));
+        return;
+    }
+
+    /* A continuous or stepwise range, so ask for the requested rate if it's
+     * in range, and the nearest end otherwise. The driver rounds to a step. */
+    const struct v4l2_fract *shortest = &interval.stepwise.min;
+    const struct v4l2_fract *longest = &interval.stepwise.max;
+    if ((request->fps <= 0.0) || ((1.0 / request->fps) <= fract_to_seconds(shortest)))
+    {
+        mode.interval_numerator = shortest->numerator;
+        mode.interval_denominator = shortest->denominator;
+    }
+    else if ((1.0 / request->fps) >= fract_to_seconds(longest))
+    {
+        mode.interval_numerator = longest->numerator;
+        mode.interval_denominator = longest->denominator;
+    }
+    else
+    {
+        mode.interval_numerator = 1000;
+        mode.interval_denominator = (uint32_t)(request->fps * 1000.0 + 0.5);
+    }
+    add_capture_mode(modes, mode_count, mode_capacity, &mode);
+}
+
+static int clamp_to_step(int value, int min, int max, int step)
+{
+    if (value < min)
+        return min;
+    if (value > max)
+        return max;
+    if (step > 1)
+        value = min + (((value - min) / step) * step);
+    return value;
+}
+
+static CaptureMode *enumerate_capture_modes(V4l2Source *source, const CaptureRequest *request, int *mode_count)
+{
+    CaptureMode *modes = NULL;
+    int mode_capacity = 0;
+    struct v4l2_fmtdesc format;
+
+    *mode_count = 0;
+    CLEAR(format);
+    format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    for (format.index = 0; 0 == xioctl(source->fd, VIDIOC_ENUM_FMT, &format); ++format.index)
+    {
+        if (!is_supported_pixel_format(format.pixelformat))
+            continue;
+
+        struct v4l2_frmsizeenum size;
+        CLEAR(size);
+        size.pixel_format = format.pixelformat;
+
+        if (-1 == xioctl(source->fd, VIDIOC_ENUM_FRAMESIZES, &size))
+        {
+            /* No list of sizes, so ask for what we want and let S_FMT adjust. */
+            add_frame_size_modes(source, request, format.pixelformat, request->width, request->height, &modes,
+                                 mode_count, &mode_capacity);
+        }
+        else if (V4L2_FRMSIZE_TYPE_DISCRETE == size.type)
+        {
+            do
+            {
+                add_frame_size_modes(source, request, format.pixelformat, size.discrete.width,
+                                     size.discrete.height, &modes, mode_count, &mode_capacity);
+                size.index += 1;
+            } while (0 == xioctl(source->fd, VIDIOC_ENUM_FRAMESIZES, &size));
+        }
+        else
+        {
+            const int width = clamp_to_step(request->width, size.stepwise.min_width, size.stepwise.max_width,
+                                            size.stepwise.step_width);
+            const int height = clamp_to_step(request->height, size.stepwise.min_height,
+                                             size.stepwise.max_height, size.stepwise.step_height);
+            add_frame_size_modes(source, request, format.pixelformat, width, height, &modes, mode_count,
+                                 &mode_capacity);
+        }
+    }
+
+    return modes;
+}
+
+static bool choose_capture_mode(V4l2Source *source, const CaptureRequest *request, CaptureMode *mode)
+{
+    int mode_count;
+    CaptureMode *modes = enumerate_capture_modes(source, request, &mode_count);
+    const int index = capture_mode_choose(modes, mode_count, request->width, request->height, request->fps);
+    if (index >= 0)
+        *mode = modes[index];
+    free(modes);
+    return (index >= 0);
+}
+
+static void get_frame_interval(V4l2Source *source, struct v4l2_fract *frame_interval)
+{
+    struct v4l2_streamparm parm;
+
+    CLEAR(parm);
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (0 == xioctl(source->fd, VIDIOC_G_PARM, &parm))
+        *frame_interval = parm.parm.capture.timeperframe;
+}
+
+static void set_frame_interval(V4l2Source *source, const CaptureMode *mode, struct v4l2_fract *frame_interval)
+{
+    struct v4l2_streamparm parm;
+
+    CLEAR(parm);
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (-1 == xioctl(source->fd, VIDIOC_G_PARM, &parm))
+    {
+        /* Frame rate control not supported. */
+        return;
+    }
+
+    if ((parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME) && (mode->interval_numerator != 0))
+    {
+        parm.parm.capture.timeperframe.numerator = mode->interval_numerator;
+        parm.parm.capture.timeperframe.denominator = mode->interval_denominator;
+
+        if (-1 == xioctl(source->fd, VIDIOC_S_PARM, &parm))
+            errno_exit("VIDIOC_S_PARM");
+
+        /* Note VIDIOC_S_PARM may change the interval. */
+    }
+
+    *frame_interval = parm.parm.capture.timeperframe;
+}
+
+static void v4l2_source_configure(CaptureSource *base, const CaptureRequest *request, CaptureFormat *format)
+{
+    V4l2Source *source = (V4l2Source *)(base);
+    struct v4l2_capability cap;
+    struct v4l2_cropcap cropcap;
+    struct v4l2_crop crop;
+    struct v4l2_format fmt;
+    struct v4l2_fract frame_interval = {0, 0};
+    unsigned int min;
+
+    if (-1 == xioctl(source->fd, VIDIOC_QUERYCAP, &cap))
+    {
+        if (EINVAL == errno)
+        {
+            fprintf(stderr, "%s is no V4L2 device\n", source->dev_name);
+            exit(EXIT_FAILURE);
+        }
+        else
+        {
+            errno_exit("VIDIOC_QUERYCAP");
+        }
+    }
+
+    if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE))
+    {
+        fprintf(stderr, "%s is no video capture device\n", source->dev_name);
+        exit(EXIT_FAILURE);
+    }
+
+    switch (source->io)
+    {
+    case V4L2_SOURCE_IO_READ:
+        if (!(cap.capabilities & V4L2_CAP_READWRITE))
+        {
+            fprintf(stderr, "%s does not support read i/o\n", source->dev_name);
+            exit(EXIT_FAILURE);
+        }
+        break;
+
+    case V4L2_SOURCE_IO_MMAP:
+    case V4L2_SOURCE_IO_USERPTR:
+        if (!(cap.capabilities & V4L2_CAP_STREAMING))
+        {
+            fprintf(stderr, "%s does not support streaming i/o\n", source->dev_name);
+            exit(EXIT_FAILURE);
+        }
+        break;
+    }
+
+    /* Select video input, video standard and tune here. */
+
+    CLEAR(cropcap);
+
+    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (0 == xioctl(source->fd, VIDIOC_CROPCAP, &cropcap))
+    {
+        crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        crop.c = cropcap.defrect; /* reset to default */
+
+        if (-1 == xioctl(source->fd, VIDIOC_S_CROP, &crop))
+        {
+            switch (errno)
+            {
+            case EINVAL:
+                /* Cropping not supported. */
+                break;
+            default:
+                /* Errors ignored. */
+                break;
+            }
+        }
+    }
+    else
+    {
+        /* Errors ignored. */
+    }
+
+    CLEAR(fmt);
+
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (source->negotiate_format)
+    {
+        CaptureMode mode;
+        if (!choose_capture_mode(source, request, &mode))
+        {
+            fprintf(stderr, "%s has no YUYV, NV12 or YUV420 capture modes\n", source->dev_name);
+            exit(EXIT_FAILURE);
+        }
+
+        fmt.fmt.pix.width = mode.width;
+        fmt.fmt.pix.height = mode.height;
+        fmt.fmt.pix.pixelformat = mode.pixel_format;
+        fmt.fmt.pix.field = V4L2_FIELD_ANY;
+
+        if (-1 == xioctl(source->fd, VIDIOC_S_FMT, &fmt))
+            errno_exit("VIDIOC_S_FMT");
+
+        /* Note VIDIOC_S_FMT may change width and height. */
+
+        set_frame_interval(source, &mode, &frame_interval);
+    }
+    else
+    {
+        /* Preserve original settings as set by v4l2-ctl for example */
+        if (-1 == xioctl(source->fd, VIDIOC_G_FMT, &fmt))
+            errno_exit("VIDIOC_G_FMT");
+
+        get_frame_interval(source, &frame_interval);
+    }
+
+    if (!frame_format_for_pixel_format(fmt.fmt.pix.pixelformat, &format->format))
+    {
+        fprintf(stderr, "%s is set to an unsupported pixel format, only YUYV, NV12 and YUV420 can be converted\n",
+                source->dev_name);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Buggy driver paranoia. */
+    min = fmt.fmt.pix.width * ((format->format == FRAME_FORMAT_YUYV) ? 2 : 1);
+    if (fmt.fmt.pix.bytesperline < min)
+        fmt.fmt.pix.bytesperline = min;
+    min = capture_image_byte_count(format->format, fmt.fmt.pix.bytesperline, fmt.fmt.pix.height);
+    if (fmt.fmt.pix.sizeimage < min)
+        fmt.fmt.pix.sizeimage = min;
+
+    format->width = fmt.fmt.pix.width;
+    format->height = fmt.fmt.pix.height;
+    format->stride = fmt.fmt.pix.bytesperline;
+    format->byte_count = fmt.fmt.pix.sizeimage;
+    format->fps = (frame_interval.numerator > 0) ? ((double)(frame_interval.denominator) / frame_interval.numerator)
+                                                 : 0.0;
+
+    switch (source->io)
+    {
+    case V4L2_SOURCE_IO_READ:
+        init_read(source, fmt.fmt.pix.sizeimage);
+        break;
+
+    case V4L2_SOURCE_IO_MMAP:
+        init_mmap(source);
+        break;
+
+    case V4L2_SOURCE_IO_USERPTR:
+        init_userp(source, fmt.fmt.pix.sizeimage);
+        break;
+    }
+}
+
+static void close_device(V4l2Source *source)
+{
+    if (-1 == close(source->fd))
+        errno_exit("close");
+
+    source->fd = -1;
+}
+
+static void v4l2_source_open(CaptureSource *base)
+{
+    V4l2Source *source = (V4l2Source *)(base);
+    struct stat st;
+
+    if (-1 == stat(source->dev_name, &st))
+    {
+        fprintf(stderr, "Cannot identify '%s': %d, %s\n", source->dev_name, errno,
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (!S_ISCHR(st.st_mode))
+    {
+        fprintf(stderr, "%s is no device\n", source->dev_name);
+        exit(EXIT_FAILURE);
+    }
+
+    source->fd = open(source->dev_name, O_RDWR /* required */ | O_NONBLOCK, 0);
+
+    if (-1 == source->fd)
+    {
+        fprintf(stderr, "Cannot open '%s': %d, %s\n", source->dev_name, errno,
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void v4l2_source_free(CaptureSource *base)
+{
+    V4l2Source *source = (V4l2Source *)(base);
+    uninit_device(source);
+    if (-1 != source->fd)
+        close_device(source);
+    pthread_mutex_destroy(&source->lock);
+    free(source);
+}
+
+static const CaptureSourceOps v4l2_source_ops = {
+    .name = "V4L2",
+    .open = v4l2_source_open,
+    .configure = v4l2_source_configure,
+    .start = v4l2_source_start,
+    .dequeue = v4l2_source_dequeue,
+    .requeue = v4l2_source_requeue,
+    .lease_count = v4l2_source_lease_count,
+    .poll_fd = v4l2_source_poll_fd,
+    .has_failed = v4l2_source_has_failed,
+    .restart = v4l2_source_restart,
+    .stop = v4l2_source_stop,
+    .free = v4l2_source_free,
+};
+
+CaptureSource *v4l2_source_alloc(const char *dev_name, V4l2SourceIo io, bool negotiate_format)
+{
+    V4l2Source *source = calloc(1, sizeof(V4l2Source));
+    if (!source)
+        return NULL;
+    source->base.ops = &v4l2_source_ops;
+    source->dev_name = dev_name;
+    source->io = io;
+    source->negotiate_format = negotiate_format;
+    source->fd = -1;
+    pthread_mutex_init(&source->lock, NULL);
+    atomic_init(&source->failed, false);
+    return &source->base;
+}
@@ -0,0 +1,31 @@
+#ifndef INCLUDE_V4L2_SOURCE_H
+#define INCLUDE_V4L2_SOURCE_H
+
+#include <stdbool.h>
+
+#include "capture_source.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    // How image data gets from the driver to us.
+    typedef enum
+    {
+        V4L2_SOURCE_IO_READ,
+        V4L2_SOURCE_IO_MMAP,
+        V4L2_SOURCE_IO_USERPTR,
+    } V4l2SourceIo;
+
+    // A camera behind a Video4Linux2 device node. If negotiate_format is true,
+    // the driver's modes are enumerated and the closest one to the request is
+    // set. Otherwise whatever format the device is already using is kept, so
+    // it can be set up beforehand with v4l2-ctl.
+    CaptureSource *v4l2_source_alloc(const char *dev_name, V4l2SourceIo io, bool negotiate_format);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // INCLUDE_V4L2_SOURCE_H
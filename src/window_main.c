@@ -1,17 +1,31 @@
+// For ppoll().
+#define _GNU_SOURCE
+
 #include "window_main.h"
 
+#include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <memory.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <X11/X.h>
 #include <X11/Xlib.h>
+// Buffer objects are core since OpenGL 1.5, but only declared in glext.h.
+#define GL_GLEXT_PROTOTYPES
 #include <GL/gl.h>
+#include <GL/glext.h>
 #include <GL/glx.h>
 #include <GL/glu.h>
 
 #include "app_main.h"
 #include "capture_main.h"
+#include "frame_latency.h"
+#include "metrics.h"
+#include "time_utils.h"
 #include "trace.h"
 
 Display *dpy;
@@ -22,9 +36,118 @@ Colormap cmap;
 XSetWindowAttributes swa;
 Window win;
 GLXContext glc;
-XWindowAttributes gwa;
 XEvent xev;
-unsigned int g_texture_id = 0;
+
+// Kept up to date from ConfigureNotify events, rather than asking the server.
+static int g_window_width = 640;
+static int g_window_height = 480;
+
+// Frames are drawn from whatever layout they were published in, with each
+// plane in its own texture and any YUV conversion done in a shader, so raw
+// camera frames can go straight to the GPU at half the size of RGBA.
+#define MAX_PLANES 3
+
+// Which shader a frame needs. RGBA and BGRA only differ in how they're
+// uploaded.
+typedef enum
+{
+    SHADER_RGB,
+    SHADER_YUYV,
+    SHADER_NV12,
+    SHADER_I420,
+    SHADER_COUNT,
+} ShaderLayout;
+
+typedef struct
+{
+    GLuint program;
+    GLint frame_width;
+    GLint y_offset_scale;
+    GLint chroma_weights;
+} ShaderProgram;
+
+static ShaderProgram g_programs[SHADER_COUNT];
+// Plane i always lives on texture unit i.
+static GLuint g_textures[MAX_PLANES];
+
+// Every camera is shown at once, in a grid of tiles with one per device.
+#define MAX_FEEDS 16
+
+// Each feed's frames are streamed into its tile through a pair of pixel
+// buffer objects, which are lent to the device's capture workers while
+// they're mapped so they can copy frames straight into them. Uploading from a
+// buffer object returns without waiting for the copy, so the GPU can fetch one
+// frame while the next is written.
+typedef struct
+{
+    UploadSlots *upload_slots;
+    GLuint pixel_buffers[UPLOAD_SLOT_COUNT];
+    bool pixel_buffer_mapped[UPLOAD_SLOT_COUNT];
+    size_t pixel_buffer_byte_count;
+    // Only the layout and colour space of this frame are used, not its data.
+    Frame layout;
+    // The sequence number of the frame in the tile, zero if there isn't one,
+    // with the driver's number for it and when it was captured.
+    uint64_t uploaded_sequence;
+    uint32_t uploaded_driver_sequence;
+    int64_t uploaded_timestamp_ns;
+    // The newest frame that's been on the screen.
+    uint64_t presented_sequence;
+    // Set once we've said that the feed's frames don't fit the atlas.
+    bool is_incompatible;
+} Feed;
+
+static Feed g_feeds[MAX_FEEDS];
+static int g_feed_count = 0;
+
+// All the feeds share one set of plane textures, laid out as a grid of cells
+// that are each big enough for the largest frame seen so far. Only tiles with
+// a new frame are uploaded, and the rasterizer scales each tile to its part of
+// the window, so however many feeds there are, the whole picture is one draw
+// and one swap. Every feed has to be in the same layout, since one shader
+// draws them all. The textures' storage is only allocated when the grid or
+// the cell size changes.
+typedef struct
+{
+    // Zero until the first frame arrives.
+    int cell_width;
+    int cell_height;
+    FrameFormat format;
+    int columns;
+    int rows;
+} AtlasLayout;
+
+static AtlasLayout g_atlas;
+// Goes up every time the textures are reallocated.
+static int g_atlas_generation = 0;
+
+// Two triangles for each tile with a frame in it, as x, y, s, t, rebuilt when
+// any of them move.
+static GLuint g_tile_buffer = 0;
+static int g_tile_vertex_count = 0;
+static bool g_tiles_changed = false;
+
+// Shared with the shm display, which counts the same things.
+static Metric *g_frames_consumed_metric;
+static Metric *g_frames_displayed_metric;
+static Metric *g_frames_dropped_display_metric;
+
+// When frames go out, for latching the newest as late as possible before a
+// swap. Swaps are only timed properly when each is followed by glFinish(),
+// which returns once the frame has gone out, so that's required. The period
+// is the shortest time seen between two swaps, which is the refresh period
+// times the swap interval once there have been frames on consecutive vblanks,
+// and some multiple of it until then, which still lands on a vblank.
+static int64_t g_last_present_ns = 0;
+static int64_t g_present_period_ns = 0;
+// The slowest recent time from latching a frame to swapping, decaying slowly,
+// so a single slow frame makes us start early for a while.
+static int64_t g_render_ns = 0;
+// Extra time left before the predicted vblank, for scheduling jitter.
+#define LATCH_MARGIN_NS 2000000
+// Shorter gaps between swaps than this mean they aren't being paced by the
+// display, so they say nothing about its refresh rate.
+#define MIN_PRESENT_PERIOD_NS 4000000
 
 #define CHECK_GL_ERRORS()                                                      \
     do                                                                         \
@@ -37,50 +160,711 @@ unsigned int g_texture_id = 0;
         }                                                                      \
     } while (false)
 
-static void DrawAQuad()
+// Where each plane of a frame goes, in texels, and where it starts in the
+// frame's data.
+typedef struct
 {
     int width;
     int height;
-    uint8_t *texture_data;
-    if (!get_latest_capture(&width, &height, &texture_data))
+    GLenum internal_format;
+    GLenum format;
+    int bytes_per_texel;
+    size_t offset;
+    int stride;
+} TexturePlane;
+
+static int FramePlanes(const Frame *frame, TexturePlane *planes)
+{
+    const int chroma_width = (frame->width + 1) / 2;
+    const int chroma_height = (frame->height + 1) / 2;
+    const size_t luma_bytes = (size_t)(frame->stride) * frame->height;
+    switch (frame->format)
+    {
+    case FRAME_FORMAT_RGBA:
+    case FRAME_FORMAT_BGRA:
+    {
+        // BGRA matches how drivers lay out textures in memory, so it can be
+        // copied as it is. RGBA has to be swizzled on the way.
+        const GLenum format = (frame->format == FRAME_FORMAT_BGRA) ? GL_BGRA : GL_RGBA;
+        planes[0] = (TexturePlane){frame->width, frame->height, GL_RGBA8, format, 4, 0, frame->stride};
+        return 1;
+    }
+
+    case FRAME_FORMAT_YUYV:
+        // Each texel holds a pair of pixels, with Y0 U Y1 V as red, green,
+        // blue, and alpha.
+        planes[0] = (TexturePlane){chroma_width, frame->height, GL_RGBA8, GL_RGBA, 4, 0, frame->stride};
+        return 1;
+
+    case FRAME_FORMAT_NV12:
+        planes[0] = (TexturePlane){frame->width, frame->height, GL_LUMINANCE8, GL_LUMINANCE, 1, 0, frame->stride};
+        // U ends up in luminance and V in alpha.
+        planes[1] = (TexturePlane){chroma_width, chroma_height, GL_LUMINANCE8_ALPHA8, GL_LUMINANCE_ALPHA, 2,
+                                   luma_bytes,   frame->stride};
+        return 2;
+
+    case FRAME_FORMAT_I420:
+    {
+        const int chroma_stride = frame->stride / 2;
+        planes[0] = (TexturePlane){frame->width, frame->height, GL_LUMINANCE8, GL_LUMINANCE, 1, 0, frame->stride};
+        planes[1] = (TexturePlane){chroma_width, chroma_height, GL_LUMINANCE8, GL_LUMINANCE, 1,
+                                   luma_bytes,   chroma_stride};
+        planes[2] = (TexturePlane){chroma_width, chroma_height, GL_LUMINANCE8, GL_LUMINANCE, 1,
+                                   luma_bytes + ((size_t)(chroma_stride) * chroma_height), chroma_stride};
+        return 3;
+    }
+    }
+    return 0;
+}
+
+static ShaderLayout ShaderLayoutForFrame(const Frame *frame)
+{
+    switch (frame->format)
+    {
+    case FRAME_FORMAT_YUYV:
+        return SHADER_YUYV;
+    case FRAME_FORMAT_NV12:
+        return SHADER_NV12;
+    case FRAME_FORMAT_I420:
+        return SHADER_I420;
+    default:
+        return SHADER_RGB;
+    }
+}
+
+// GLSL 1.20 is as far as the Pi's GL 2.1 driver goes, and what llvmpipe
+// offers in a legacy context.
+static const char *shader_version = "#version 120\n";
+
+static const char *vertex_shader_source =
+    "attribute vec2 position;\n"
+    "attribute vec2 tex_coord;\n"
+    "varying vec2 frag_tex_coord;\n"
+    "void main()\n"
+    "{\n"
+    "    frag_tex_coord = tex_coord;\n"
+    "    gl_Position = vec4(position, 0.0, 1.0);\n"
+    "}\n";
+
+// Shared by every layout, with a define choosing how samples are read.
+static const char *fragment_shader_source =
+    "uniform sampler2D plane0;\n"
+    "uniform sampler2D plane1;\n"
+    "uniform sampler2D plane2;\n"
+    "uniform float frame_width;\n"
+    "uniform vec2 y_offset_scale;\n"
+    "uniform vec4 chroma_weights;\n"
+    "varying vec2 frag_tex_coord;\n"
+    "vec4 yuv_to_rgba(float y, float u, float v)\n"
+    "{\n"
+    "    float luma = (y - y_offset_scale.x) * y_offset_scale.y;\n"
+    "    u -= 128.0 / 255.0;\n"
+    "    v -= 128.0 / 255.0;\n"
+    "    return vec4(luma + (chroma_weights.x * v), luma + (chroma_weights.y * u) + (chroma_weights.z * v),\n"
+    "                luma + (chroma_weights.w * u), 1.0);\n"
+    "}\n"
+    "void main()\n"
+    "{\n"
+    "#if defined(LAYOUT_YUYV)\n"
+    "    vec4 pair = texture2D(plane0, frag_tex_coord);\n"
+    "    float y = (mod(floor(frag_tex_coord.x * frame_width), 2.0) < 0.5) ? pair.r : pair.b;\n"
+    "    gl_FragColor = yuv_to_rgba(y, pair.g, pair.a);\n"
+    "#elif defined(LAYOUT_NV12)\n"
+    "    vec4 uv = texture2D(plane1, frag_tex_coord);\n"
+    "    gl_FragColor = yuv_to_rgba(texture2D(plane0, frag_tex_coord).r, uv.r, uv.a);\n"
+    "#elif defined(LAYOUT_I420)\n"
+    "    gl_FragColor = yuv_to_rgba(texture2D(plane0, frag_tex_coord).r, texture2D(plane1, frag_tex_coord).r,\n"
+    "                               texture2D(plane2, frag_tex_coord).r);\n"
+    "#else\n"
+    "    gl_FragColor = texture2D(plane0, frag_tex_coord);\n"
+    "#endif\n"
+    "}\n";
+
+static const char *shader_layout_defines[SHADER_COUNT] = {
+    [SHADER_RGB] = "",
+    [SHADER_YUYV] = "#define LAYOUT_YUYV\n",
+    [SHADER_NV12] = "#define LAYOUT_NV12\n",
+    [SHADER_I420] = "#define LAYOUT_I420\n",
+};
+
+enum
+{
+    ATTRIBUTE_POSITION,
+    ATTRIBUTE_TEX_COORD,
+};
+
+static GLuint CompileShader(GLenum type, const char *define, const char *source)
+{
+    const char *sources[3] = {shader_version, define, source};
+    const GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 3, sources, NULL);
+    glCompileShader(shader);
+    GLint is_compiled;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &is_compiled);
+    if (!is_compiled)
+    {
+        char log[1024];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        fprintf(stderr, "Couldn't compile shader: %s\n", log);
+        exit(EXIT_FAILURE);
+    }
+    return shader;
+}
+
+static void CreateShaderProgram(ShaderLayout layout, ShaderProgram *program)
+{
+    const GLuint vertex_shader = CompileShader(GL_VERTEX_SHADER, "", vertex_shader_source);
+    const GLuint fragment_shader =
+        CompileShader(GL_FRAGMENT_SHADER, shader_layout_defines[layout], fragment_shader_source);
+    program->program = glCreateProgram();
+    glAttachShader(program->program, vertex_shader);
+    glAttachShader(program->program, fragment_shader);
+    glBindAttribLocation(program->program, ATTRIBUTE_POSITION, "position");
+    glBindAttribLocation(program->program, ATTRIBUTE_TEX_COORD, "tex_coord");
+    glLinkProgram(program->program);
+    // Only needed until the program is deleted, which is never.
+    glDeleteShader(vertex_shader);
+    glDeleteShader(fragment_shader);
+    GLint is_linked;
+    glGetProgramiv(program->program, GL_LINK_STATUS, &is_linked);
+    if (!is_linked)
+    {
+        char log[1024];
+        glGetProgramInfoLog(program->program, sizeof(log), NULL, log);
+        fprintf(stderr, "Couldn't link shader program: %s\n", log);
+        exit(EXIT_FAILURE);
+    }
+
+    glUseProgram(program->program);
+    glUniform1i(glGetUniformLocation(program->program, "plane0"), 0);
+    glUniform1i(glGetUniformLocation(program->program, "plane1"), 1);
+    glUniform1i(glGetUniformLocation(program->program, "plane2"), 2);
+    glUseProgram(0);
+    // Any the compiler optimized away come back as -1, which glUniform*()
+    // quietly ignores.
+    program->frame_width = glGetUniformLocation(program->program, "frame_width");
+    program->y_offset_scale = glGetUniformLocation(program->program, "y_offset_scale");
+    program->chroma_weights = glGetUniformLocation(program->program, "chroma_weights");
+    CHECK_GL_ERRORS();
+}
+
+static void CreateRenderer()
+{
+    for (int i = 0; i < SHADER_COUNT; ++i)
+    {
+        CreateShaderProgram(i, &g_programs[i]);
+    }
+
+    // The tiles are filled in once there are frames to show.
+    glGenBuffers(1, &g_tile_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, g_tile_buffer);
+    glVertexAttribPointer(ATTRIBUTE_POSITION, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), (const void *)(0));
+    glVertexAttribPointer(ATTRIBUTE_TEX_COORD, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat),
+                          (const void *)(2 * sizeof(GLfloat)));
+    glEnableVertexAttribArray(ATTRIBUTE_POSITION);
+    glEnableVertexAttribArray(ATTRIBUTE_TEX_COORD);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glGenTextures(MAX_PLANES, g_textures);
+    for (int i = 0; i < MAX_PLANES; ++i)
+    {
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(GL_TEXTURE_2D, g_textures[i]);
+        // Nearest keeps each YUYV texel's pair of pixels apart.
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+    glActiveTexture(GL_TEXTURE0);
+    CHECK_GL_ERRORS();
+}
+
+// Orphans the buffer's old storage, so there's no waiting for an upload that
+// may still be reading from it, then maps the new storage and lends it to the
+// feed's capture workers.
+static void OfferPixelBuffer(Feed *feed, int index)
+{
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, feed->pixel_buffers[index]);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, feed->pixel_buffer_byte_count, NULL, GL_STREAM_DRAW);
+    uint8_t *data = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    CHECK_GL_ERRORS();
+    feed->pixel_buffer_mapped[index] = (data != NULL);
+    if (data != NULL)
+    {
+        upload_slots_offer(feed->upload_slots, index, data, feed->pixel_buffer_byte_count);
+    }
+}
+
+static void UnmapPixelBuffer(Feed *feed, int index)
+{
+    if (!feed->pixel_buffer_mapped[index])
     {
-        // Camera capture is not yet ready.
         return;
     }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, feed->pixel_buffers[index]);
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    feed->pixel_buffer_mapped[index] = false;
+}
+
+// Picks up any devices that have started since we last looked.
+static void AddFeeds()
+{
+    int feed_count = get_capture_device_count();
+    if (feed_count > MAX_FEEDS)
+    {
+        feed_count = MAX_FEEDS;
+    }
+    for (int i = g_feed_count; i < feed_count; ++i)
+    {
+        Feed *feed = &g_feeds[i];
+        memset(feed, 0, sizeof(Feed));
+        feed->upload_slots = get_device_upload_slots(i);
+        if (feed->upload_slots != NULL)
+        {
+            glGenBuffers(UPLOAD_SLOT_COUNT, feed->pixel_buffers);
+        }
+    }
+    g_feed_count = feed_count;
+}
+
+static void GridForFeeds(int feed_count, int *columns, int *rows)
+{
+    int grid_columns = 1;
+    while ((grid_columns * grid_columns) < feed_count)
+    {
+        grid_columns += 1;
+    }
+    *columns = grid_columns;
+    *rows = (feed_count + grid_columns - 1) / grid_columns;
+}
+
+// Where each plane of a cell goes in the atlas textures, in texels.
+static int AtlasCellPlanes(TexturePlane *planes)
+{
+    const Frame cell = {.width = g_atlas.cell_width, .height = g_atlas.cell_height, .format = g_atlas.format};
+    return FramePlanes(&cell, planes);
+}
+
+// Reallocates the textures for the given cell size and the current number of
+// feeds. Every tile has to be uploaded again afterwards.
+static void ResizeAtlas(FrameFormat format, int cell_width, int cell_height)
+{
+    // Even sizes keep YUYV pairs and subsampled chroma from straddling cells.
+    g_atlas.cell_width = (cell_width + 1) & ~1;
+    g_atlas.cell_height = (cell_height + 1) & ~1;
+    g_atlas.format = format;
+    GridForFeeds(g_feed_count, &g_atlas.columns, &g_atlas.rows);
+
+    GLint max_texture_size;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+    TexturePlane planes[MAX_PLANES];
+    const int plane_count = AtlasCellPlanes(planes);
+    for (int i = 0; i < plane_count; ++i)
+    {
+        const int width = planes[i].width * g_atlas.columns;
+        const int height = planes[i].height * g_atlas.rows;
+        if ((width > max_texture_size) || (height > max_texture_size))
+        {
+            fprintf(stderr, "A %dx%d grid of %dx%d frames needs a %dx%d texture, but the limit is %d\n",
+                    g_atlas.columns, g_atlas.rows, g_atlas.cell_width, g_atlas.cell_height, width, height,
+                    max_texture_size);
+            exit(EXIT_FAILURE);
+        }
+        glActiveTexture(GL_TEXTURE0 + i);
+        glTexImage2D(GL_TEXTURE_2D, 0, planes[i].internal_format, width, height, 0, planes[i].format,
+                     GL_UNSIGNED_BYTE, NULL);
+    }
+    glActiveTexture(GL_TEXTURE0);
+    CHECK_GL_ERRORS();
+    fprintf(stderr, "Showing %d feeds in a %dx%d grid of %dx%d %s tiles\n", g_feed_count, g_atlas.columns,
+            g_atlas.rows, g_atlas.cell_width, g_atlas.cell_height, frame_format_name(format));
+
+    for (int i = 0; i < g_feed_count; ++i)
+    {
+        g_feeds[i].uploaded_sequence = 0;
+    }
+    g_atlas_generation += 1;
+    g_tiles_changed = true;
+}
+
+static bool FitsAtlas(const Frame *frame)
+{
+    return (g_atlas.cell_width != 0) && (frame->format == g_atlas.format) && (frame->width <= g_atlas.cell_width) &&
+           (frame->height <= g_atlas.cell_height);
+}
+
+static bool HasFeedLayout(const Feed *feed, const Frame *frame)
+{
+    return (frame->format == feed->layout.format) && (frame->width == feed->layout.width) &&
+           (frame->height == feed->layout.height) && (frame->stride == feed->layout.stride);
+}
+
+// Makes room in the atlas for the feed's frame, and reallocates the feed's
+// pixel buffers if its layout has changed. Returns false if the frame can't
+// be shown, because other feeds are already being drawn in another format.
+static bool PrepareTile(int index, const Frame *frame)
+{
+    Feed *feed = &g_feeds[index];
+    if ((g_atlas.cell_width != 0) && (frame->format != g_atlas.format))
+    {
+        // Switching is fine as long as nobody else is using the atlas, as
+        // when the only camera changes its format.
+        for (int i = 0; i < g_feed_count; ++i)
+        {
+            if ((i != index) && (g_feeds[i].uploaded_sequence != 0) && (g_feeds[i].layout.format == g_atlas.format))
+            {
+                if (!feed->is_incompatible)
+                {
+                    fprintf(stderr, "Not showing feed %d, since it's %s and the others are %s\n", index,
+                            frame_format_name(frame->format), frame_format_name(g_atlas.format));
+                    feed->is_incompatible = true;
+                }
+                return false;
+            }
+        }
+        ResizeAtlas(frame->format, frame->width, frame->height);
+    }
+    else if (!FitsAtlas(frame))
+    {
+        const int cell_width = (frame->width > g_atlas.cell_width) ? frame->width : g_atlas.cell_width;
+        const int cell_height = (frame->height > g_atlas.cell_height) ? frame->height : g_atlas.cell_height;
+        ResizeAtlas(frame->format, cell_width, cell_height);
+    }
+    feed->is_incompatible = false;
+
+    if (HasFeedLayout(feed, frame))
+    {
+        return true;
+    }
+    feed->layout = *frame;
+    feed->layout.data = NULL;
+    g_tiles_changed = true;
+    if (feed->upload_slots != NULL)
+    {
+        for (int i = 0; i < UPLOAD_SLOT_COUNT; ++i)
+        {
+            upload_slots_withdraw(feed->upload_slots, i);
+            UnmapPixelBuffer(feed, i);
+        }
+        feed->pixel_buffer_byte_count = frame_byte_count(frame);
+        for (int i = 0; i < UPLOAD_SLOT_COUNT; ++i)
+        {
+            OfferPixelBuffer(feed, i);
+        }
+    }
+    return true;
+}
+
+// Copies every plane of the frame into the feed's tile. With a pixel buffer
+// bound the base is zero, since the plane offsets are into the buffer.
+static void UploadPlanes(int index, const Frame *frame, uintptr_t base)
+{
+    Feed *feed = &g_feeds[index];
+    const int column = index % g_atlas.columns;
+    const int row = index / g_atlas.columns;
+    TexturePlane cells[MAX_PLANES];
+    AtlasCellPlanes(cells);
+    TexturePlane planes[MAX_PLANES];
+    const int plane_count = FramePlanes(frame, planes);
+    for (int i = 0; i < plane_count; ++i)
+    {
+        glActiveTexture(GL_TEXTURE0 + i);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, planes[i].bytes_per_texel);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, planes[i].stride / planes[i].bytes_per_texel);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, column * cells[i].width, row * cells[i].height, planes[i].width,
+                        planes[i].height, planes[i].format, GL_UNSIGNED_BYTE, (const void *)(base + planes[i].offset));
+    }
+    glActiveTexture(GL_TEXTURE0);
+    if (feed->uploaded_sequence == 0)
+    {
+        // The tile has something to show for the first time.
+        g_tiles_changed = true;
+    }
+    else if (frame->sequence > (feed->uploaded_sequence + 1))
+    {
+        // Published while we were busy, and replaced before we got to them.
+        metrics_add(g_frames_dropped_display_metric, frame->sequence - feed->uploaded_sequence - 1);
+    }
+    metrics_add(g_frames_consumed_metric, 1);
+    feed->layout.yuv_matrix = frame->yuv_matrix;
+    feed->layout.yuv_range = frame->yuv_range;
+    feed->uploaded_sequence = frame->sequence;
+    feed->uploaded_driver_sequence = frame->driver_sequence;
+    feed->uploaded_timestamp_ns = frame->timestamp_ns;
+    frame_latency_record(FRAME_LATENCY_CONSUMED, frame->timestamp_ns, time_monotonic_ns());
+}
+
+// Uploads the newest frame the feed's capture workers have copied into a pixel
+// buffer, returning false if there isn't one newer than what's in its tile.
+static bool UploadFromPixelBuffer(int index)
+{
+    Feed *feed = &g_feeds[index];
+    Frame frame;
+    const int slot = upload_slots_take_newest(feed->upload_slots, &frame);
+    if (slot == -1)
+    {
+        return false;
+    }
+    const bool is_usable =
+        (frame.sequence > feed->uploaded_sequence) && HasFeedLayout(feed, &frame) && FitsAtlas(&frame);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, feed->pixel_buffers[slot]);
+    // The contents can be lost while mapped, on a display mode change for
+    // example, in which case the frame store still has the frame.
+    const bool is_intact = glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    feed->pixel_buffer_mapped[slot] = false;
+    if (is_usable && is_intact)
+    {
+        UploadPlanes(index, &frame, 0);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
     CHECK_GL_ERRORS();
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA,
-                 GL_UNSIGNED_BYTE, texture_data);
+    OfferPixelBuffer(feed, slot);
+    return is_usable && is_intact;
+}
+
+// Copies the feed's newest frame into its tile, returning false if there's
+// nothing newer than what's already there.
+static bool UploadLatestFeedFrame(int index)
+{
+    if ((g_feeds[index].upload_slots != NULL) && UploadFromPixelBuffer(index))
+    {
+        return true;
+    }
+
+    // The first frame, and the first after a layout change, come straight
+    // from the frame store, as do any that arrive while both buffers are busy.
+    const Frame *frame = get_latest_device_frame(index);
+    if (frame == NULL)
+    {
+        // Camera capture is not yet ready.
+        return false;
+    }
+    bool is_new = (frame->sequence > g_feeds[index].uploaded_sequence) && PrepareTile(index, frame);
+    if (is_new)
+    {
+        UploadPlanes(index, frame, (uintptr_t)(frame->data));
+        CHECK_GL_ERRORS();
+    }
+    frame_release(frame);
+    return is_new;
+}
+
+// Brings every tile up to date, returning true if any of them changed.
+static bool UploadLatestFrames()
+{
+    TRACE_SCOPE("upload frames");
+    const int old_feed_count = g_feed_count;
+    AddFeeds();
+    if ((g_feed_count != old_feed_count) && (g_atlas.cell_width != 0))
+    {
+        int columns;
+        int rows;
+        GridForFeeds(g_feed_count, &columns, &rows);
+        if ((columns != g_atlas.columns) || (rows != g_atlas.rows))
+        {
+            ResizeAtlas(g_atlas.format, g_atlas.cell_width, g_atlas.cell_height);
+        }
+    }
+    bool any_new = false;
+    for (int i = 0; i < g_feed_count; ++i)
+    {
+        const int generation = g_atlas_generation;
+        any_new |= UploadLatestFeedFrame(i);
+        if (g_atlas_generation != generation)
+        {
+            // The atlas was reallocated, so tiles that were already done need
+            // uploading again.
+            i = -1;
+        }
+    }
+    return any_new || g_tiles_changed;
+}
+
+// Lays out a quad for every tile with a frame in it, filling its grid cell in
+// the window, with the first row of each image at the top.
+static void BuildTiles()
+{
+    GLfloat vertices[MAX_FEEDS * 6 * 4];
+    int vertex_count = 0;
+    const float atlas_width = (float)(g_atlas.columns * g_atlas.cell_width);
+    const float atlas_height = (float)(g_atlas.rows * g_atlas.cell_height);
+    for (int i = 0; i < g_feed_count; ++i)
+    {
+        const Feed *feed = &g_feeds[i];
+        if ((feed->uploaded_sequence == 0) || (feed->layout.format != g_atlas.format))
+        {
+            continue;
+        }
+        const int column = i % g_atlas.columns;
+        const int row = i / g_atlas.columns;
+        const float left = -1.0f + ((2.0f * column) / g_atlas.columns);
+        const float right = -1.0f + ((2.0f * (column + 1)) / g_atlas.columns);
+        const float top = 1.0f - ((2.0f * row) / g_atlas.rows);
+        const float bottom = 1.0f - ((2.0f * (row + 1)) / g_atlas.rows);
+        const float s0 = (column * g_atlas.cell_width) / atlas_width;
+        const float s1 = ((column * g_atlas.cell_width) + feed->layout.width) / atlas_width;
+        const float t0 = (row * g_atlas.cell_height) / atlas_height;
+        const float t1 = ((row * g_atlas.cell_height) + feed->layout.height) / atlas_height;
+        const GLfloat tile[6 * 4] = {
+            left,  bottom, s0, t1, //
+            right, bottom, s1, t1, //
+            left,  top,    s0, t0, //
+            left,  top,    s0, t0, //
+            right, bottom, s1, t1, //
+            right, top,    s1, t0, //
+        };
+        memcpy(&vertices[vertex_count * 4], tile, sizeof(tile));
+        vertex_count += 6;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, g_tile_buffer);
+    glBufferData(GL_ARRAY_BUFFER, vertex_count * 4 * sizeof(GLfloat), vertices, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
     CHECK_GL_ERRORS();
-    free(texture_data);
+    g_tile_vertex_count = vertex_count;
+    g_tiles_changed = false;
+}
 
+// Draws every tile in one call.
+static void DrawFrame()
+{
+    TRACE_SCOPE("draw frame");
     glClearColor(0.0, 0.0, 0.0, 0.0);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     CHECK_GL_ERRORS();
+    if (g_tiles_changed)
+    {
+        BuildTiles();
+    }
+    if (g_tile_vertex_count == 0)
+    {
+        return;
+    }
 
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    glOrtho(-1., 1., -1., 1., 1., 20.);
-
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
-    gluLookAt(0., 0., 10., 0., 0., 0., 0., 1., 0.);
+    // The cameras are all set up alike, so the first feed's colour space
+    // stands for all of them.
+    const Frame *layout = &g_feeds[0].layout;
+    for (int i = 0; i < g_feed_count; ++i)
+    {
+        if (g_feeds[i].uploaded_sequence != 0)
+        {
+            layout = &g_feeds[i].layout;
+            break;
+        }
+    }
+    const ShaderProgram *program = &g_programs[ShaderLayoutForFrame(layout)];
+    glUseProgram(program->program);
+    // The shader picks the Y sample for YUYV from the pixel's column in the
+    // whole atlas, which works because every cell starts on an even column.
+    glUniform1f(program->frame_width, g_atlas.columns * g_atlas.cell_width);
+    YuvFloatCoefficients coefficients;
+    if (yuv_float_coefficients(layout->yuv_matrix, layout->yuv_range, &coefficients))
+    {
+        glUniform2f(program->y_offset_scale, coefficients.y_offset, coefficients.y_scale);
+        glUniform4f(program->chroma_weights, coefficients.v_to_r, coefficients.u_to_g, coefficients.v_to_g,
+                    coefficients.u_to_b);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, g_tile_buffer);
+    glDrawArrays(GL_TRIANGLES, 0, g_tile_vertex_count);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glUseProgram(0);
     CHECK_GL_ERRORS();
+}
 
-    glBegin(GL_QUADS);
-    glColor3f(1.0f, 1.0f, 1.0f);
-    glTexCoord2f(0.0f, 1.0f);
-    glVertex3f(-1.0f, -1.0f, 0.0f);
-    glColor3f(1.0f, 1.0f, 1.0f);
-    glTexCoord2f(1.0f, 1.0f);
-    glVertex3f(1.0f, -1.0f, 0.0f);
-    glColor3f(1.0f, 1.0f, 1.0f);
-    glTexCoord2f(1.0f, 0.0f);
-    glVertex3f(1.0f, 1.0f, 0.0f);
-    glColor3f(1.0f, 1.0f, 1.0f);
-    glTexCoord2f(0.0f, 0.0f);
-    glVertex3f(-1.0f, 1.0f, 0.0f);
-    glEnd();
-    CHECK_GL_ERRORS();
+// Tries each of the swap control extensions in turn, since drivers offer
+// different ones.
+static void SetSwapInterval(int interval)
+{
+    const char *extensions = glXQueryExtensionsString(dpy, DefaultScreen(dpy));
+    if (strstr(extensions, "GLX_EXT_swap_control") != NULL)
+    {
+        PFNGLXSWAPINTERVALEXTPROC swap_interval_ext =
+            (PFNGLXSWAPINTERVALEXTPROC)(glXGetProcAddressARB((const GLubyte *)("glXSwapIntervalEXT")));
+        swap_interval_ext(dpy, win, interval);
+        fprintf(stderr, "Swap interval set to %d with GLX_EXT_swap_control\n", interval);
+        return;
+    }
+    if (strstr(extensions, "GLX_MESA_swap_control") != NULL)
+    {
+        PFNGLXSWAPINTERVALMESAPROC swap_interval_mesa =
+            (PFNGLXSWAPINTERVALMESAPROC)(glXGetProcAddressARB((const GLubyte *)("glXSwapIntervalMESA")));
+        if (swap_interval_mesa(interval) == 0)
+        {
+            fprintf(stderr, "Swap interval set to %d with GLX_MESA_swap_control\n", interval);
+            return;
+        }
+    }
+    // The oldest one can't turn waiting for vblank off.
+    if ((interval > 0) && (strstr(extensions, "GLX_SGI_swap_control") != NULL))
+    {
+        PFNGLXSWAPINTERVALSGIPROC swap_interval_sgi =
+            (PFNGLXSWAPINTERVALSGIPROC)(glXGetProcAddressARB((const GLubyte *)("glXSwapIntervalSGI")));
+        if (swap_interval_sgi(interval) == 0)
+        {
+            fprintf(stderr, "Swap interval set to %d with GLX_SGI_swap_control\n", interval);
+            return;
+        }
+    }
+    fprintf(stderr, "Couldn't set the swap interval to %d, so the driver's default is used\n", interval);
+}
+
+// When to pick up the newest frame so it's drawn just in time for the next
+// vblank we can still make.
+static int64_t NextLatchTime(int64_t now_ns)
+{
+    if (g_present_period_ns == 0)
+    {
+        return now_ns;
+    }
+    const int64_t lead_ns = g_render_ns + LATCH_MARGIN_NS;
+    int64_t latch_ns = (g_last_present_ns + g_present_period_ns) - lead_ns;
+    if (latch_ns < now_ns)
+    {
+        latch_ns += (((now_ns - latch_ns) / g_present_period_ns) + 1) * g_present_period_ns;
+    }
+    return latch_ns;
+}
+
+// Called once a frame has been swapped, and waited for if we're finishing
+// frames, to update the timings and report how long each new frame took to
+// reach the screen.
+static void RecordPresent(int64_t latch_ns, int64_t swap_ns, const DisplayOptions *options)
+{
+    const int64_t present_ns = time_monotonic_ns();
+    const int64_t render_ns = swap_ns - latch_ns;
+    g_render_ns = (render_ns > g_render_ns) ? render_ns : (g_render_ns - (g_render_ns / 16));
+    if (options->finish_frames && (g_last_present_ns != 0))
+    {
+        const int64_t period_ns = present_ns - g_last_present_ns;
+        if ((period_ns >= MIN_PRESENT_PERIOD_NS) && ((g_present_period_ns == 0) || (period_ns < g_present_period_ns)))
+        {
+            g_present_period_ns = period_ns;
+        }
+    }
+    g_last_present_ns = present_ns;
+
+    for (int i = 0; i < g_feed_count; ++i)
+    {
+        Feed *feed = &g_feeds[i];
+        if ((feed->uploaded_sequence == 0) || (feed->uploaded_sequence == feed->presented_sequence))
+        {
+            continue;
+        }
+        feed->presented_sequence = feed->uploaded_sequence;
+        frame_latency_record(FRAME_LATENCY_PRESENTED, feed->uploaded_timestamp_ns, present_ns);
+        metrics_add(g_frames_displayed_metric, 1);
+        TRACE_COUNTER("capture to present us", (present_ns - feed->uploaded_timestamp_ns) / 1000);
+        if (options->report_latency)
+        {
+            // Without glFinish() this is only until the swap was queued.
+            fprintf(stderr, "Feed %d frame %llu (driver %u): %.2f ms from capture to %s, %.2f ms after latching\n",
+                    i, (unsigned long long)(feed->uploaded_sequence), (unsigned)(feed->uploaded_driver_sequence),
+                    (present_ns - feed->uploaded_timestamp_ns) / 1e6, options->finish_frames ? "present" : "swap",
+                    (present_ns - latch_ns) / 1e6);
+        }
+    }
 }
 
 void *window_main(void *cookie)
@@ -88,6 +872,12 @@ void *window_main(void *cookie)
     Args *args = (Args *)(cookie);
     int argc = args->argc;
     char **argv = args->argv;
+    const DisplayOptions *options = &args->display;
+    TRACE_THREAD_NAME("display");
+    metrics_register_thread("display");
+    g_frames_consumed_metric = metrics_counter("frames_consumed");
+    g_frames_displayed_metric = metrics_counter("frames_displayed");
+    g_frames_dropped_display_metric = metrics_counter("frames_dropped_display");
 
     dpy = XOpenDisplay(NULL);
 
@@ -114,7 +904,7 @@ void *window_main(void *cookie)
     cmap = XCreateColormap(dpy, root, vi->visual, AllocNone);
 
     swa.colormap = cmap;
-    swa.event_mask = ExposureMask | KeyPressMask;
+    swa.event_mask = ExposureMask | KeyPressMask | StructureNotifyMask;
 
     win = XCreateWindow(dpy, root, 0, 0, 640, 480, 0, vi->depth, InputOutput, vi->visual, CWColormap | CWEventMask, &swa);
 
@@ -126,18 +916,110 @@ void *window_main(void *cookie)
 
     glEnable(GL_DEPTH_TEST);
 
-    glGenTextures(1, &g_texture_id);
-    glEnable(GL_TEXTURE_2D);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, g_texture_id);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    CreateRenderer();
+    if (options->has_swap_interval)
+    {
+        SetSwapInterval(options->swap_interval);
+    }
+
+    const int capture_fd = get_capture_event_fd();
+    if (capture_fd == -1)
+    {
+        fprintf(stderr, "Couldn't create the capture event fd, error %d, %s\n", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
+    // Sleeps until either a camera has a new frame or the X server has
+    // something for us, and only redraws when one of them means the picture
+    // on screen would change.
+    bool needs_redraw = true;
     while (1)
     {
-        XGetWindowAttributes(dpy, win, &gwa);
-        glViewport(0, 0, gwa.width, gwa.height);
-        DrawAQuad();
-        glXSwapBuffers(dpy, win);
+        while (XPending(dpy))
+        {
+            XNextEvent(dpy, &xev);
+            if (xev.type == ConfigureNotify)
+            {
+                if ((xev.xconfigure.width != g_window_width) || (xev.xconfigure.height != g_window_height))
+                {
+                    g_window_width = xev.xconfigure.width;
+                    g_window_height = xev.xconfigure.height;
+                    needs_redraw = true;
+                }
+            }
+            else if (xev.type == Expose)
+            {
+                needs_redraw = true;
+            }
+        }
+
+        if (!needs_redraw)
+        {
+            struct pollfd fds[2] = {
+                {.fd = ConnectionNumber(dpy), .events = POLLIN},
+                {.fd = capture_fd, .events = POLLIN},
+            };
+            if (poll(fds, 2, -1) == -1)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                fprintf(stderr, "poll error %d, %s\n", errno, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            if (fds[1].revents & POLLIN)
+            {
+                uint64_t frame_count;
+                const ssize_t bytes_read = read(capture_fd, &frame_count, sizeof(frame_count));
+                (void)(bytes_read);
+                // When latching late, frames are only picked up just before
+                // the swap they'll go out on.
+                needs_redraw = options->late_latch || UploadLatestFrames();
+            }
+            // Any X events get handled at the top of the loop.
+            continue;
+        }
+
+        if (options->late_latch)
+        {
+            const int64_t now_ns = time_monotonic_ns();
+            const int64_t wait_ns = NextLatchTime(now_ns) - now_ns;
+            if (wait_ns > 0)
+            {
+                // Newer frames can arrive in the meantime, and we'll still
+                // get them, but anything from X is dealt with first.
+                struct pollfd x_fd = {.fd = ConnectionNumber(dpy), .events = POLLIN};
+                const struct timespec timeout = {wait_ns / 1000000000, wait_ns % 1000000000};
+                TRACE_BEGIN("wait to latch");
+                const int ready_count = ppoll(&x_fd, 1, &timeout, NULL);
+                TRACE_END("wait to latch");
+                if (ready_count != 0)
+                {
+                    continue;
+                }
+            }
+        }
+
+        // A redraw from an X event might be the first chance to show a frame
+        // that arrived earlier.
+        const int64_t latch_ns = time_monotonic_ns();
+        UploadLatestFrames();
+        glViewport(0, 0, g_window_width, g_window_height);
+        DrawFrame();
+        const int64_t swap_ns = time_monotonic_ns();
+        {
+            TRACE_SCOPE("swap buffers");
+            glXSwapBuffers(dpy, win);
+        }
+        if (options->finish_frames)
+        {
+            // Keeps frames from queueing up in the driver, where nothing
+            // newer can overtake them.
+            TRACE_SCOPE("finish");
+            glFinish();
+        }
+        RecordPresent(latch_ns, swap_ns, options);
+        needs_redraw = false;
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,720 @@
+#include "yuv_convert.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define YUV_HAVE_X86 1
+#define YUV_TARGET_SSE2 __attribute__((target("sse2")))
+#define YUV_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#define YUV_HAVE_NEON 1
+#endif
+
+#define YUV_INLINE static inline __attribute__((always_inline))
+
+static const int yuyv_bytes_per_pixel = 2;
+static const int rgba_bytes_per_pixel = 4;
+static const int rgb_bytes_per_pixel = 3;
+
+// All the maths is done in Q13 fixed point, so that every coefficient fits in a
+// signed 16-bit value and the SIMD versions can use 16x16->32 multiply-adds.
+// Rounding is folded into the luma term, which means every kernel does exactly
+// the same integer operations and they all produce identical results.
+#define YUV_SHIFT 13
+#define YUV_ROUND (1 << (YUV_SHIFT - 1))
+
+// The coefficients are 2(1-Kr), -2(1-Kb)Kb/Kg, -2(1-Kr)Kr/Kg, and 2(1-Kb) using
+// the Kr/Kb constants of each standard, times 8192. Limited range also scales
+// luma by 255/219 and chroma by 255/224.
+#define YUV_FOR_EACH_COLORSPACE(X)                                                              \
+    X(bt601_limited, YUV_MATRIX_BT601, YUV_RANGE_LIMITED, 16, 9539, 13075, -3209, -6660, 16525) \
+    X(bt601_full, YUV_MATRIX_BT601, YUV_RANGE_FULL, 0, 8192, 11485, -2819, -5850, 14516)        \
+    X(bt709_limited, YUV_MATRIX_BT709, YUV_RANGE_LIMITED, 16, 9539, 14686, -1747, -4366, 17305) \
+    X(bt709_full, YUV_MATRIX_BT709, YUV_RANGE_FULL, 0, 8192, 12901, -1535, -3835, 15201)
+
+// The kernels just write three colour bytes per pixel, each one luma plus
+// weighted U and V, so BGRA output is RGBA with the first and third sets of
+// chroma weights swapped. The weights that are zero get folded away, since
+// every kernel is compiled with its coefficients as constants.
+typedef struct
+{
+    int y_offset;
+    int y_scale;
+    int u_to_0;
+    int v_to_0;
+    int u_to_1;
+    int v_to_1;
+    int u_to_2;
+    int v_to_2;
+} YuvCoefficients;
+
+#define YUV_RGBA_COEFFICIENTS(y_offset, y_scale, v_to_r, u_to_g, v_to_g, u_to_b) \
+    {y_offset, y_scale, 0, v_to_r, u_to_g, v_to_g, u_to_b, 0}
+#define YUV_BGRA_COEFFICIENTS(y_offset, y_scale, v_to_r, u_to_g, v_to_g, u_to_b) \
+    {y_offset, y_scale, u_to_b, 0, u_to_g, v_to_g, 0, v_to_r}
+
+typedef enum
+{
+    YUV_ORDER_RGBA,
+    YUV_ORDER_BGRA,
+    YUV_ORDER_COUNT,
+} YuvOrder;
+
+YUV_INLINE uint8_t yuv_clamp(int value)
+{
+    return (value < 0) ? 0 : ((value > 255) ? 255 : value);
+}
+
+// Takes a luma value, and chroma that has already been centered on zero.
+YUV_INLINE void yuv_to_rgb_pixel(int y, int u, int v, const YuvCoefficients *c, uint8_t *rgb)
+{
+    const int y_term = ((y - c->y_offset) * c->y_scale) + YUV_ROUND;
+    rgb[0] = yuv_clamp((y_term + (u * c->u_to_0) + (v * c->v_to_0)) >> YUV_SHIFT);
+    rgb[1] = yuv_clamp((y_term + (u * c->u_to_1) + (v * c->v_to_1)) >> YUV_SHIFT);
+    rgb[2] = yuv_clamp((y_term + (u * c->u_to_2) + (v * c->v_to_2)) >> YUV_SHIFT);
+}
+
+YUV_INLINE void yuyv_to_rgba_row_scalar(const uint8_t *yuyv_row, uint8_t *rgba_row, int width,
+                                        const YuvCoefficients *c)
+{
+    for (int x = 0; x < width; x += 2)
+    {
+        const uint8_t *yuyv_pixel0 = yuyv_row + (x * yuyv_bytes_per_pixel);
+        const uint8_t *yuyv_pixel1 = yuyv_pixel0 + yuyv_bytes_per_pixel;
+        const int u = yuyv_pixel0[1] - 128;
+        const int v = yuyv_pixel1[1] - 128;
+        uint8_t *rgba_pixel0 = rgba_row + (x * rgba_bytes_per_pixel);
+        uint8_t *rgba_pixel1 = rgba_pixel0 + rgba_bytes_per_pixel;
+        yuv_to_rgb_pixel(yuyv_pixel0[0], u, v, c, rgba_pixel0);
+        rgba_pixel0[3] = 255;
+        yuv_to_rgb_pixel(yuyv_pixel1[0], u, v, c, rgba_pixel1);
+        rgba_pixel1[3] = 255;
+    }
+}
+
+// Shared by the RGBA and RGB outputs, with the pixel size known at compile time.
+YUV_INLINE void i420_to_rgbx_row_scalar(const uint8_t *y_row, const uint8_t *u_row, const uint8_t *v_row,
+                                        uint8_t *out_row, int width, const YuvCoefficients *c,
+                                        int bytes_per_pixel)
+{
+    for (int x = 0; x < width; ++x)
+    {
+        const int u = u_row[x / 2] - 128;
+        const int v = v_row[x / 2] - 128;
+        uint8_t *out_pixel = out_row + (x * bytes_per_pixel);
+        yuv_to_rgb_pixel(y_row[x], u, v, c, out_pixel);
+        if (bytes_per_pixel == 4)
+        {
+            out_pixel[3] = 255;
+        }
+    }
+}
+
+YUV_INLINE void i420_to_rgba_row_scalar(const uint8_t *y_row, const uint8_t *u_row, const uint8_t *v_row,
+                                        uint8_t *rgba_row, int width, const YuvCoefficients *c)
+{
+    i420_to_rgbx_row_scalar(y_row, u_row, v_row, rgba_row, width, c, rgba_bytes_per_pixel);
+}
+
+YUV_INLINE void i420_to_rgb_row_scalar(const uint8_t *y_row, const uint8_t *u_row, const uint8_t *v_row,
+                                       uint8_t *rgb_row, int width, const YuvCoefficients *c)
+{
+    i420_to_rgbx_row_scalar(y_row, u_row, v_row, rgb_row, width, c, rgb_bytes_per_pixel);
+}
+
+// Packs two 16-bit coefficients into the layout _mm_madd_epi16() expects, with
+// the first one multiplying the even lanes.
+YUV_INLINE int yuv_coefficient_pair(int even, int odd)
+{
+    return (int)(((uint32_t)(uint16_t)odd << 16) | (uint16_t)even);
+}
+
+#if defined(YUV_HAVE_X86)
+
+// Converts eight pixels of YUYV held in a register, and writes them out as RGBA.
+YUV_INLINE YUV_TARGET_SSE2 void yuyv_sse2_convert8(__m128i yuyv, const YuvCoefficients *c, uint8_t *rgba)
+{
+    const __m128i y16 = _mm_sub_epi16(_mm_and_si128(yuyv, _mm_set1_epi16(0xff)), _mm_set1_epi16(c->y_offset));
+    const __m128i uv16 = _mm_sub_epi16(_mm_srli_epi16(yuyv, 8), _mm_set1_epi16(128));
+
+    // Pair each luma value with a one, so the rounding term comes out of the
+    // same multiply-add as the scaled luma.
+    const __m128i y_coefficients = _mm_set1_epi32(yuv_coefficient_pair(c->y_scale, YUV_ROUND));
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i y_lo = _mm_madd_epi16(_mm_unpacklo_epi16(y16, ones), y_coefficients);
+    const __m128i y_hi = _mm_madd_epi16(_mm_unpackhi_epi16(y16, ones), y_coefficients);
+
+    // Each U/V pair is shared by two neighbouring pixels.
+    const __m128i uv_lo = _mm_shuffle_epi32(uv16, _MM_SHUFFLE(1, 1, 0, 0));
+    const __m128i uv_hi = _mm_shuffle_epi32(uv16, _MM_SHUFFLE(3, 3, 2, 2));
+    const __m128i r_coefficients = _mm_set1_epi32(yuv_coefficient_pair(c->u_to_0, c->v_to_0));
+    const __m128i g_coefficients = _mm_set1_epi32(yuv_coefficient_pair(c->u_to_1, c->v_to_1));
+    const __m128i b_coefficients = _mm_set1_epi32(yuv_coefficient_pair(c->u_to_2, c->v_to_2));
+
+    const __m128i r_lo = _mm_srai_epi32(_mm_add_epi32(y_lo, _mm_madd_epi16(uv_lo, r_coefficients)), YUV_SHIFT);
+    const __m128i r_hi = _mm_srai_epi32(_mm_add_epi32(y_hi, _mm_madd_epi16(uv_hi, r_coefficients)), YUV_SHIFT);
+    const __m128i g_lo = _mm_srai_epi32(_mm_add_epi32(y_lo, _mm_madd_epi16(uv_lo, g_coefficients)), YUV_SHIFT);
+    const __m128i g_hi = _mm_srai_epi32(_mm_add_epi32(y_hi, _mm_madd_epi16(uv_hi, g_coefficients)), YUV_SHIFT);
+    const __m128i b_lo = _mm_srai_epi32(_mm_add_epi32(y_lo, _mm_madd_epi16(uv_lo, b_coefficients)), YUV_SHIFT);
+    const __m128i b_hi = _mm_srai_epi32(_mm_add_epi32(y_hi, _mm_madd_epi16(uv_hi, b_coefficients)), YUV_SHIFT);
+
+    // The saturating packs do the clamping for us.
+    const __m128i r16 = _mm_packs_epi32(r_lo, r_hi);
+    const __m128i g16 = _mm_packs_epi32(g_lo, g_hi);
+    const __m128i b16 = _mm_packs_epi32(b_lo, b_hi);
+    const __m128i r8 = _mm_packus_epi16(r16, r16);
+    const __m128i g8 = _mm_packus_epi16(g16, g16);
+    const __m128i b8 = _mm_packus_epi16(b16, b16);
+    const __m128i rg = _mm_unpacklo_epi8(r8, g8);
+    const __m128i ba = _mm_unpacklo_epi8(b8, _mm_set1_epi8((char)0xff));
+    _mm_storeu_si128((__m128i *)(rgba), _mm_unpacklo_epi16(rg, ba));
+    _mm_storeu_si128((__m128i *)(rgba + 16), _mm_unpackhi_epi16(rg, ba));
+}
+
+// Gathers four bytes from an unaligned address into the bottom of a register.
+YUV_INLINE YUV_TARGET_SSE2 __m128i yuv_sse2_load4(const uint8_t *source)
+{
+    int32_t value;
+    memcpy(&value, source, sizeof(value));
+    return _mm_cvtsi32_si128(value);
+}
+
+YUV_INLINE YUV_TARGET_SSE2 void yuyv_to_rgba_row_sse2(const uint8_t *yuyv_row, uint8_t *rgba_row, int width,
+                                                      const YuvCoefficients *c)
+{
+    int x = 0;
+    for (; (x + 8) <= width; x += 8)
+    {
+        const __m128i yuyv = _mm_loadu_si128((const __m128i *)(yuyv_row + (x * yuyv_bytes_per_pixel)));
+        yuyv_sse2_convert8(yuyv, c, rgba_row + (x * rgba_bytes_per_pixel));
+    }
+    yuyv_to_rgba_row_scalar(yuyv_row + (x * yuyv_bytes_per_pixel), rgba_row + (x * rgba_bytes_per_pixel),
+                            width - x, c);
+}
+
+YUV_INLINE YUV_TARGET_SSE2 void i420_to_rgba_row_sse2(const uint8_t *y_row, const uint8_t *u_row, const uint8_t *v_row,
+                                                      uint8_t *rgba_row, int width, const YuvCoefficients *c)
+{
+    int x = 0;
+    for (; (x + 8) <= width; x += 8)
+    {
+        // Interleaving the planes gives us exactly the YUYV layout.
+        const __m128i y8 = _mm_loadl_epi64((const __m128i *)(y_row + x));
+        const __m128i uv8 = _mm_unpacklo_epi8(yuv_sse2_load4(u_row + (x / 2)), yuv_sse2_load4(v_row + (x / 2)));
+        yuyv_sse2_convert8(_mm_unpacklo_epi8(y8, uv8), c, rgba_row + (x * rgba_bytes_per_pixel));
+    }
+    i420_to_rgba_row_scalar(y_row + x, u_row + (x / 2), v_row + (x / 2), rgba_row + (x * rgba_bytes_per_pixel),
+                            width - x, c);
+}
+
+// The 256-bit version of yuyv_sse2_convert8(). Everything stays within 128-bit
+// lanes until the final stores, so each lane holds eight consecutive pixels.
+YUV_INLINE YUV_TARGET_AVX2 void yuyv_avx2_convert16(__m256i yuyv, const YuvCoefficients *c, uint8_t *rgba)
+{
+    const __m256i y16 = _mm256_sub_epi16(_mm256_and_si256(yuyv, _mm256_set1_epi16(0xff)),
+                                         _mm256_set1_epi16(c->y_offset));
+    const __m256i uv16 = _mm256_sub_epi16(_mm256_srli_epi16(yuyv, 8), _mm256_set1_epi16(128));
+
+    const __m256i y_coefficients = _mm256_set1_epi32(yuv_coefficient_pair(c->y_scale, YUV_ROUND));
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i y_lo = _mm256_madd_epi16(_mm256_unpacklo_epi16(y16, ones), y_coefficients);
+    const __m256i y_hi = _mm256_madd_epi16(_mm256_unpackhi_epi16(y16, ones), y_coefficients);
+
+    const __m256i uv_lo = _mm256_shuffle_epi32(uv16, _MM_SHUFFLE(1, 1, 0, 0));
+    const __m256i uv_hi = _mm256_shuffle_epi32(uv16, _MM_SHUFFLE(3, 3, 2, 2));
+    const __m256i r_coefficients = _mm256_set1_epi32(yuv_coefficient_pair(c->u_to_0, c->v_to_0));
+    const __m256i g_coefficients = _mm256_set1_epi32(yuv_coefficient_pair(c->u_to_1, c->v_to_1));
+    const __m256i b_coefficients = _mm256_set1_epi32(yuv_coefficient_pair(c->u_to_2, c->v_to_2));
+
+    const __m256i r_lo = _mm256_srai_epi32(_mm256_add_epi32(y_lo, _mm256_madd_epi16(uv_lo, r_coefficients)), YUV_SHIFT);
+    const __m256i r_hi = _mm256_srai_epi32(_mm256_add_epi32(y_hi, _mm256_madd_epi16(uv_hi, r_coefficients)), YUV_SHIFT);
+    const __m256i g_lo = _mm256_srai_epi32(_mm256_add_epi32(y_lo, _mm256_madd_epi16(uv_lo, g_coefficients)), YUV_SHIFT);
+    const __m256i g_hi = _mm256_srai_epi32(_mm256_add_epi32(y_hi, _mm256_madd_epi16(uv_hi, g_coefficients)), YUV_SHIFT);
+    const __m256i b_lo = _mm256_srai_epi32(_mm256_add_epi32(y_lo, _mm256_madd_epi16(uv_lo, b_coefficients)), YUV_SHIFT);
+    const __m256i b_hi = _mm256_srai_epi32(_mm256_add_epi32(y_hi, _mm256_madd_epi16(uv_hi, b_coefficients)), YUV_SHIFT);
+
+    const __m256i r16 = _mm256_packs_epi32(r_lo, r_hi);
+    const __m256i g16 = _mm256_packs_epi32(g_lo, g_hi);
+    const __m256i b16 = _mm256_packs_epi32(b_lo, b_hi);
+    const __m256i r8 = _mm256_packus_epi16(r16, r16);
+    const __m256i g8 = _mm256_packus_epi16(g16, g16);
+    const __m256i b8 = _mm256_packus_epi16(b16, b16);
+    const __m256i rg = _mm256_unpacklo_epi8(r8, g8);
+    const __m256i ba = _mm256_unpacklo_epi8(b8, _mm256_set1_epi8((char)0xff));
+    const __m256i rgba_lo = _mm256_unpacklo_epi16(rg, ba);
+    const __m256i rgba_hi = _mm256_unpackhi_epi16(rg, ba);
+    _mm256_storeu_si256((__m256i *)(rgba), _mm256_permute2x128_si256(rgba_lo, rgba_hi, 0x20));
+    _mm256_storeu_si256((__m256i *)(rgba + 32), _mm256_permute2x128_si256(rgba_lo, rgba_hi, 0x31));
+}
+
+YUV_INLINE YUV_TARGET_AVX2 void yuyv_to_rgba_row_avx2(const uint8_t *yuyv_row, uint8_t *rgba_row, int width,
+                                                      const YuvCoefficients *c)
+{
+    int x = 0;
+    for (; (x + 16) <= width; x += 16)
+    {
+        const __m256i yuyv = _mm256_loadu_si256((const __m256i *)(yuyv_row + (x * yuyv_bytes_per_pixel)));
+        yuyv_avx2_convert16(yuyv, c, rgba_row + (x * rgba_bytes_per_pixel));
+    }
+    yuyv_to_rgba_row_sse2(yuyv_row + (x * yuyv_bytes_per_pixel), rgba_row + (x * rgba_bytes_per_pixel),
+                          width - x, c);
+}
+
+YUV_INLINE YUV_TARGET_AVX2 void i420_to_rgba_row_avx2(const uint8_t *y_row, const uint8_t *u_row, const uint8_t *v_row,
+                                                      uint8_t *rgba_row, int width, const YuvCoefficients *c)
+{
+    int x = 0;
+    for (; (x + 16) <= width; x += 16)
+    {
+        const __m128i y8 = _mm_loadu_si128((const __m128i *)(y_row + x));
+        const __m128i uv8 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(u_row + (x / 2))),
+                                              _mm_loadl_epi64((const __m128i *)(v_row + (x / 2))));
+        const __m256i yuyv = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi8(y8, uv8)),
+                                                     _mm_unpackhi_epi8(y8, uv8), 1);
+        yuyv_avx2_convert16(yuyv, c, rgba_row + (x * rgba_bytes_per_pixel));
+    }
+    i420_to_rgba_row_sse2(y_row + x, u_row + (x / 2), v_row + (x / 2), rgba_row + (x * rgba_bytes_per_pixel),
+                          width - x, c);
+}
+
+#endif // YUV_HAVE_X86
+
+#if defined(YUV_HAVE_NEON)
+
+// Adds the chroma terms for one output byte, skipping any with zero weights.
+YUV_INLINE int16x4_t yuv_neon_channel(int32x4_t y_term, int16x4_t u, int16x4_t v, int u_weight, int v_weight)
+{
+    int32x4_t sum = y_term;
+    if (u_weight != 0)
+    {
+        sum = vmlal_n_s16(sum, u, u_weight);
+    }
+    if (v_weight != 0)
+    {
+        sum = vmlal_n_s16(sum, v, v_weight);
+    }
+    return vqmovn_s32(vshrq_n_s32(sum, YUV_SHIFT));
+}
+
+// Converts four pixels with luma already offset, and chroma centered on zero.
+YUV_INLINE void yuv_neon_convert4(int16x4_t y, int16x4_t u, int16x4_t v, const YuvCoefficients *c,
+                                  int16x4_t *r, int16x4_t *g, int16x4_t *b)
+{
+    const int32x4_t y_term = vmlal_n_s16(vdupq_n_s32(YUV_ROUND), y, c->y_scale);
+    *r = yuv_neon_channel(y_term, u, v, c->u_to_0, c->v_to_0);
+    *g = yuv_neon_channel(y_term, u, v, c->u_to_1, c->v_to_1);
+    *b = yuv_neon_channel(y_term, u, v, c->u_to_2, c->v_to_2);
+}
+
+// Converts eight pixels which each have their own chroma sample.
+YUV_INLINE void yuv_neon_convert8(uint8x8_t y8, int16x8_t u, int16x8_t v, const YuvCoefficients *c,
+                                  uint8x8_t *r, uint8x8_t *g, uint8x8_t *b)
+{
+    const int16x8_t y = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(y8)), vdupq_n_s16(c->y_offset));
+    int16x4_t r_lo, g_lo, b_lo, r_hi, g_hi, b_hi;
+    yuv_neon_convert4(vget_low_s16(y), vget_low_s16(u), vget_low_s16(v), c, &r_lo, &g_lo, &b_lo);
+    yuv_neon_convert4(vget_high_s16(y), vget_high_s16(u), vget_high_s16(v), c, &r_hi, &g_hi, &b_hi);
+    *r = vqmovun_s16(vcombine_s16(r_lo, r_hi));
+    *g = vqmovun_s16(vcombine_s16(g_lo, g_hi));
+    *b = vqmovun_s16(vcombine_s16(b_lo, b_hi));
+}
+
+// Converts sixteen pixels, where each even/odd pair shares a chroma sample, and
+// writes them out as RGBA.
+YUV_INLINE void yuv_neon_convert16(uint8x8_t y_even, uint8x8_t y_odd, uint8x8_t u8, uint8x8_t v8,
+                                   const YuvCoefficients *c, uint8_t *rgba)
+{
+    const int16x8_t u = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(u8)), vdupq_n_s16(128));
+    const int16x8_t v = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v8)), vdupq_n_s16(128));
+    uint8x8_t r_even, g_even, b_even, r_odd, g_odd, b_odd;
+    yuv_neon_convert8(y_even, u, v, c, &r_even, &g_even, &b_even);
+    yuv_neon_convert8(y_odd, u, v, c, &r_odd, &g_odd, &b_odd);
+    const uint8x8x2_t r = vzip_u8(r_even, r_odd);
+    const uint8x8x2_t g = vzip_u8(g_even, g_odd);
+    const uint8x8x2_t b = vzip_u8(b_even, b_odd);
+    const uint8x8_t alpha = vdup_n_u8(255);
+    const uint8x8x4_t rgba0 = {{r.val[0], g.val[0], b.val[0], alpha}};
+    const uint8x8x4_t rgba1 = {{r.val[1], g.val[1], b.val[1], alpha}};
+    vst4_u8(rgba, rgba0);
+    vst4_u8(rgba + 32, rgba1);
+}
+
+YUV_INLINE void yuyv_to_rgba_row_neon(const uint8_t *yuyv_row, uint8_t *rgba_row, int width,
+                                      const YuvCoefficients *c)
+{
+    int x = 0;
+    for (; (x + 16) <= width; x += 16)
+    {
+        // De-interleaves into even Ys, Us, odd Ys, and Vs.
+        const uint8x8x4_t yuyv = vld4_u8(yuyv_row + (x * yuyv_bytes_per_pixel));
+        yuv_neon_convert16(yuyv.val[0], yuyv.val[2], yuyv.val[1], yuyv.val[3], c,
+                           rgba_row + (x * rgba_bytes_per_pixel));
+    }
+    yuyv_to_rgba_row_scalar(yuyv_row + (x * yuyv_bytes_per_pixel), rgba_row + (x * rgba_bytes_per_pixel),
+                            width - x, c);
+}
+
+YUV_INLINE void i420_to_rgba_row_neon(const uint8_t *y_row, const uint8_t *u_row, const uint8_t *v_row,
+                                      uint8_t *rgba_row, int width, const YuvCoefficients *c)
+{
+    int x = 0;
+    for (; (x + 16) <= width; x += 16)
+    {
+        const uint8x8x2_t y = vld2_u8(y_row + x);
+        yuv_neon_convert16(y.val[0], y.val[1], vld1_u8(u_row + (x / 2)), vld1_u8(v_row + (x / 2)), c,
+                           rgba_row + (x * rgba_bytes_per_pixel));
+    }
+    i420_to_rgba_row_scalar(y_row + x, u_row + (x / 2), v_row + (x / 2), rgba_row + (x * rgba_bytes_per_pixel),
+                            width - x, c);
+}
+
+#endif // YUV_HAVE_NEON
+
+// Stamps out a copy of a kernel's row functions for every colour space and
+// output order, with the coefficients as compile-time constants, so there's no
+// run-time switching on the matrix, range, or order inside the loops.
+#define YUV_DEFINE_ORDERED_ROW_FUNCS(kernel, target, order, ORDER, name, ...)                            \
+    static target void yuyv_to_##order##_row_##kernel##_##name(const uint8_t *yuyv_row, uint8_t *out_row, \
+                                                               int width)                                 \
+    {                                                                                                     \
+        static const YuvCoefficients coefficients = YUV_##ORDER##_COEFFICIENTS(__VA_ARGS__);              \
+        yuyv_to_rgba_row_##kernel(yuyv_row, out_row, width, &coefficients);                               \
+    }                                                                                                     \
+    static target void i420_to_##order##_row_##kernel##_##name(const uint8_t *y_row, const uint8_t *u_row, \
+                                                               const uint8_t *v_row, uint8_t *out_row,    \
+                                                               int width)                                 \
+    {                                                                                                     \
+        static const YuvCoefficients coefficients = YUV_##ORDER##_COEFFICIENTS(__VA_ARGS__);              \
+        i420_to_rgba_row_##kernel(y_row, u_row, v_row, out_row, width, &coefficients);                    \
+    }
+
+#define YUV_DEFINE_ROW_FUNCS(kernel, target, name, ...)                            \
+    YUV_DEFINE_ORDERED_ROW_FUNCS(kernel, target, rgba, RGBA, name, __VA_ARGS__) \
+    YUV_DEFINE_ORDERED_ROW_FUNCS(kernel, target, bgra, BGRA, name, __VA_ARGS__)
+
+#define YUV_TABLE_ENTRY(kernel, name, matrix, range)                                                            \
+    [matrix][range][YUV_ORDER_RGBA] = {yuyv_to_rgba_row_##kernel##_##name, i420_to_rgba_row_##kernel##_##name}, \
+    [matrix][range][YUV_ORDER_BGRA] = {yuyv_to_bgra_row_##kernel##_##name, i420_to_bgra_row_##kernel##_##name},
+
+typedef struct
+{
+    yuyv_to_rgba_row_func yuyv_to_rgba;
+    i420_to_rgba_row_func i420_to_rgba;
+} YuvRowFuncs;
+
+typedef YuvRowFuncs YuvRowFuncTable[YUV_MATRIX_COUNT][YUV_RANGE_COUNT][YUV_ORDER_COUNT];
+
+#define YUV_DEFINE_SCALAR(name, matrix, range, ...) YUV_DEFINE_ROW_FUNCS(scalar, , name, __VA_ARGS__)
+#define YUV_SCALAR_ENTRY(name, matrix, range, ...) YUV_TABLE_ENTRY(scalar, name, matrix, range)
+YUV_FOR_EACH_COLORSPACE(YUV_DEFINE_SCALAR)
+static const YuvRowFuncTable g_scalar_row_funcs = {YUV_FOR_EACH_COLORSPACE(YUV_SCALAR_ENTRY)};
+
+#define YUV_DEFINE_I420_TO_RGB(name, matrix, range, ...)                                              \
+    static void i420_to_rgb_row_scalar_##name(const uint8_t *y_row, const uint8_t *u_row,              \
+                                              const uint8_t *v_row, uint8_t *rgb_row, int width)       \
+    {                                                                                                  \
+        static const YuvCoefficients coefficients = YUV_RGBA_COEFFICIENTS(__VA_ARGS__);                \
+        i420_to_rgb_row_scalar(y_row, u_row, v_row, rgb_row, width, &coefficients);                    \
+    }
+#define YUV_I420_TO_RGB_ENTRY(name, matrix, range, ...) [matrix][range] = i420_to_rgb_row_scalar_##name,
+YUV_FOR_EACH_COLORSPACE(YUV_DEFINE_I420_TO_RGB)
+static const i420_to_rgba_row_func g_i420_to_rgb_row_funcs[YUV_MATRIX_COUNT][YUV_RANGE_COUNT] = {
+    YUV_FOR_EACH_COLORSPACE(YUV_I420_TO_RGB_ENTRY)};
+
+#if defined(YUV_HAVE_X86)
+#define YUV_DEFINE_SSE2(name, matrix, range, ...) YUV_DEFINE_ROW_FUNCS(sse2, YUV_TARGET_SSE2, name, __VA_ARGS__)
+#define YUV_SSE2_ENTRY(name, matrix, range, ...) YUV_TABLE_ENTRY(sse2, name, matrix, range)
+YUV_FOR_EACH_COLORSPACE(YUV_DEFINE_SSE2)
+static const YuvRowFuncTable g_sse2_row_funcs = {YUV_FOR_EACH_COLORSPACE(YUV_SSE2_ENTRY)};
+
+#define YUV_DEFINE_AVX2(name, matrix, range, ...) YUV_DEFINE_ROW_FUNCS(avx2, YUV_TARGET_AVX2, name, __VA_ARGS__)
+#define YUV_AVX2_ENTRY(name, matrix, range, ...) YUV_TABLE_ENTRY(avx2, name, matrix, range)
+YUV_FOR_EACH_COLORSPACE(YUV_DEFINE_AVX2)
+static const YuvRowFuncTable g_avx2_row_funcs = {YUV_FOR_EACH_COLORSPACE(YUV_AVX2_ENTRY)};
+#endif // YUV_HAVE_X86
+
+#if defined(YUV_HAVE_NEON)
+#define YUV_DEFINE_NEON(name, matrix, range, ...) YUV_DEFINE_ROW_FUNCS(neon, , name, __VA_ARGS__)
+#define YUV_NEON_ENTRY(name, matrix, range, ...) YUV_TABLE_ENTRY(neon, name, matrix, range)
+YUV_FOR_EACH_COLORSPACE(YUV_DEFINE_NEON)
+static const YuvRowFuncTable g_neon_row_funcs = {YUV_FOR_EACH_COLORSPACE(YUV_NEON_ENTRY)};
+#endif // YUV_HAVE_NEON
+
+static bool yuv_kernel_is_supported(YuvKernel kernel)
+{
+    switch (kernel)
+    {
+    case YUV_KERNEL_SCALAR:
+        return true;
+
+#if defined(YUV_HAVE_X86)
+    case YUV_KERNEL_SSE2:
+        return __builtin_cpu_supports("sse2");
+
+    case YUV_KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+
+#if defined(YUV_HAVE_NEON)
+    case YUV_KERNEL_NEON:
+        return true;
+#endif
+
+    default:
+        return false;
+    }
+}
+
+static const YuvRowFuncs *yuv_row_funcs_for_kernel(YuvKernel kernel, YuvMatrix matrix, YuvRange range,
+                                                   YuvOrder order)
+{
+    if ((matrix < 0) || (matrix >= YUV_MATRIX_COUNT) || (range < 0) || (range >= YUV_RANGE_COUNT))
+    {
+        return NULL;
+    }
+    if (!yuv_kernel_is_supported(kernel))
+    {
+        return NULL;
+    }
+    switch (kernel)
+    {
+    case YUV_KERNEL_SCALAR:
+        return &g_scalar_row_funcs[matrix][range][order];
+
+#if defined(YUV_HAVE_X86)
+    case YUV_KERNEL_SSE2:
+        return &g_sse2_row_funcs[matrix][range][order];
+
+    case YUV_KERNEL_AVX2:
+        return &g_avx2_row_funcs[matrix][range][order];
+#endif
+
+#if defined(YUV_HAVE_NEON)
+    case YUV_KERNEL_NEON:
+        return &g_neon_row_funcs[matrix][range][order];
+#endif
+
+    default:
+        return NULL;
+    }
+}
+
+yuyv_to_rgba_row_func yuyv_to_rgba_row_for_kernel(YuvKernel kernel, YuvMatrix matrix, YuvRange range)
+{
+    const YuvRowFuncs *funcs = yuv_row_funcs_for_kernel(kernel, matrix, range, YUV_ORDER_RGBA);
+    return (funcs != NULL) ? funcs->yuyv_to_rgba : NULL;
+}
+
+i420_to_rgba_row_func i420_to_rgba_row_for_kernel(YuvKernel kernel, YuvMatrix matrix, YuvRange range)
+{
+    const YuvRowFuncs *funcs = yuv_row_funcs_for_kernel(kernel, matrix, range, YUV_ORDER_RGBA);
+    return (funcs != NULL) ? funcs->i420_to_rgba : NULL;
+}
+
+yuyv_to_rgba_row_func yuyv_to_bgra_row_for_kernel(YuvKernel kernel, YuvMatrix matrix, YuvRange range)
+{
+    const YuvRowFuncs *funcs = yuv_row_funcs_for_kernel(kernel, matrix, range, YUV_ORDER_BGRA);
+    return (funcs != NULL) ? funcs->yuyv_to_rgba : NULL;
+}
+
+i420_to_rgba_row_func i420_to_bgra_row_for_kernel(YuvKernel kernel, YuvMatrix matrix, YuvRange range)
+{
+    const YuvRowFuncs *funcs = yuv_row_funcs_for_kernel(kernel, matrix, range, YUV_ORDER_BGRA);
+    return (funcs != NULL) ? funcs->i420_to_rgba : NULL;
+}
+
+#define YUV_FLOAT_ENTRY(name, matrix, range, y_offset, y_scale, v_to_r, u_to_g, v_to_g, u_to_b) \
+    [matrix][range] = {(y_offset) / 255.0f,                                                    \
+                       (y_scale) / (float)(1 << YUV_SHIFT),                                    \
+                       (v_to_r) / (float)(1 << YUV_SHIFT),                                     \
+                       (u_to_g) / (float)(1 << YUV_SHIFT),                                     \
+                       (v_to_g) / (float)(1 << YUV_SHIFT),                                     \
+                       (u_to_b) / (float)(1 << YUV_SHIFT)},
+static const YuvFloatCoefficients g_float_coefficients[YUV_MATRIX_COUNT][YUV_RANGE_COUNT] = {
+    YUV_FOR_EACH_COLORSPACE(YUV_FLOAT_ENTRY)};
+
+bool yuv_float_coefficients(YuvMatrix matrix, YuvRange range, YuvFloatCoefficients *coefficients)
+{
+    if ((matrix < 0) || (matrix >= YUV_MATRIX_COUNT) || (range < 0) || (range >= YUV_RANGE_COUNT))
+    {
+        return false;
+    }
+    *coefficients = g_float_coefficients[matrix][range];
+    return true;
+}
+
+static pthread_once_t g_best_kernel_once = PTHREAD_ONCE_INIT;
+static YuvKernel g_best_kernel = YUV_KERNEL_SCALAR;
+
+static void yuv_pick_best_kernel(void)
+{
+#if defined(YUV_HAVE_X86)
+    __builtin_cpu_init();
+#endif
+    // Later entries in the enum are preferred when they're available.
+    for (int kernel = YUV_KERNEL_SCALAR; kernel < YUV_KERNEL_COUNT; ++kernel)
+    {
+        if (yuv_kernel_is_supported(kernel))
+        {
+            g_best_kernel = kernel;
+        }
+    }
+}
+
+YuvKernel yuv_best_kernel(void)
+{
+    pthread_once(&g_best_kernel_once, yuv_pick_best_kernel);
+    return g_best_kernel;
+}
+
+const char *yuv_kernel_name(YuvKernel kernel)
+{
+    switch (kernel)
+    {
+    case YUV_KERNEL_SCALAR:
+        return "scalar";
+    case YUV_KERNEL_SSE2:
+        return "sse2";
+    case YUV_KERNEL_AVX2:
+        return "avx2";
+    case YUV_KERNEL_NEON:
+        return "neon";
+    default:
+        return "unknown";
+    }
+}
+
+const char *yuv_matrix_name(YuvMatrix matrix)
+{
+    switch (matrix)
+    {
+    case YUV_MATRIX_BT601:
+        return "BT.601";
+    case YUV_MATRIX_BT709:
+        return "BT.709";
+    default:
+        return "unknown";
+    }
+}
+
+const char *yuv_range_name(YuvRange range)
+{
+    switch (range)
+    {
+    case YUV_RANGE_LIMITED:
+        return "limited";
+    case YUV_RANGE_FULL:
+        return "full";
+    default:
+        return "unknown";
+    }
+}
+
+static void yuyv_convert(yuyv_to_rgba_row_func row_func, const uint8_t *yuyv, int yuyv_stride, uint8_t *out,
+                         int out_stride, int width, int height)
+{
+    for (int y = 0; y < height; ++y)
+    {
+        row_func(yuyv + (y * yuyv_stride), out + (y * out_stride), width);
+    }
+}
+
+static void i420_convert(i420_to_rgba_row_func row_func, const uint8_t *y_plane, int y_stride,
+                         const uint8_t *u_plane, const uint8_t *v_plane, int uv_stride, uint8_t *out, int out_stride,
+                         int width, int height)
+{
+    for (int y = 0; y < height; ++y)
+    {
+        const int uv_offset = (y / 2) * uv_stride;
+        row_func(y_plane + (y * y_stride), u_plane + uv_offset, v_plane + uv_offset, out + (y * out_stride), width);
+    }
+}
+
+// NV12 interleaves the U and V samples in one plane. Rather than having a
+// second set of kernels, each row is split into small planar U and V chunks on
+// the stack, which stay in L1, and then run through the I420 kernels.
+#define YUV_NV12_CHUNK_PIXELS 1024
+
+static void nv12_convert(i420_to_rgba_row_func row_func, const uint8_t *y_plane, int y_stride,
+                         const uint8_t *uv_plane, int uv_stride, uint8_t *out, int out_stride, int width, int height)
+{
+    uint8_t u_chunk[YUV_NV12_CHUNK_PIXELS / 2];
+    uint8_t v_chunk[YUV_NV12_CHUNK_PIXELS / 2];
+    for (int y = 0; y < height; ++y)
+    {
+        const uint8_t *y_row = y_plane + (y * y_stride);
+        const uint8_t *uv_row = uv_plane + ((y / 2) * uv_stride);
+        uint8_t *out_row = out + (y * out_stride);
+        for (int x = 0; x < width; x += YUV_NV12_CHUNK_PIXELS)
+        {
+            const int chunk_width = ((width - x) < YUV_NV12_CHUNK_PIXELS) ? (width - x) : YUV_NV12_CHUNK_PIXELS;
+            const int chroma_width = (chunk_width + 1) / 2;
+            const uint8_t *uv_chunk = uv_row + x;
+            for (int i = 0; i < chroma_width; ++i)
+            {
+                u_chunk[i] = uv_chunk[(i * 2) + 0];
+                v_chunk[i] = uv_chunk[(i * 2) + 1];
+            }
+            row_func(y_row + x, u_chunk, v_chunk, out_row + (x * rgba_bytes_per_pixel), chunk_width);
+        }
+    }
+}
+
+void yuyv_to_rgba(const uint8_t *yuyv, int yuyv_stride, uint8_t *rgba, int rgba_stride, int width, int height,
+                  YuvMatrix matrix, YuvRange range)
+{
+    yuyv_convert(yuyv_to_rgba_row_for_kernel(yuv_best_kernel(), matrix, range), yuyv, yuyv_stride, rgba,
+                 rgba_stride, width, height);
+}
+
+void i420_to_rgba(const uint8_t *y_plane, int y_stride, const uint8_t *u_plane, const uint8_t *v_plane,
+                  int uv_stride, uint8_t *rgba, int rgba_stride, int width, int height,
+                  YuvMatrix matrix, YuvRange range)
+{
+    i420_convert(i420_to_rgba_row_for_kernel(yuv_best_kernel(), matrix, range), y_plane, y_stride, u_plane,
+                 v_plane, uv_stride, rgba, rgba_stride, width, height);
+}
+
+void nv12_to_rgba(const uint8_t *y_plane, int y_stride, const uint8_t *uv_plane, int uv_stride, uint8_t *rgba,
+                  int rgba_stride, int width, int height, YuvMatrix matrix, YuvRange range)
+{
+    nv12_convert(i420_to_rgba_row_for_kernel(yuv_best_kernel(), matrix, range), y_plane, y_stride, uv_plane,
+                 uv_stride, rgba, rgba_stride, width, height);
+}
+
+void yuyv_to_bgra(const uint8_t *yuyv, int yuyv_stride, uint8_t *bgra, int bgra_stride, int width, int height,
+                  YuvMatrix matrix, YuvRange range)
+{
+    yuyv_convert(yuyv_to_bgra_row_for_kernel(yuv_best_kernel(), matrix, range), yuyv, yuyv_stride, bgra,
+                 bgra_stride, width, height);
+}
+
+void i420_to_bgra(const uint8_t *y_plane, int y_stride, const uint8_t *u_plane, const uint8_t *v_plane,
+                  int uv_stride, uint8_t *bgra, int bgra_stride, int width, int height,
+                  YuvMatrix matrix, YuvRange range)
+{
+    i420_convert(i420_to_bgra_row_for_kernel(yuv_best_kernel(), matrix, range), y_plane, y_stride, u_plane,
+                 v_plane, uv_stride, bgra, bgra_stride, width, height);
+}
+
+void nv12_to_bgra(const uint8_t *y_plane, int y_stride, const uint8_t *uv_plane, int uv_stride, uint8_t *bgra,
+                  int bgra_stride, int width, int height, YuvMatrix matrix, YuvRange range)
+{
+    nv12_convert(i420_to_bgra_row_for_kernel(yuv_best_kernel(), matrix, range), y_plane, y_stride, uv_plane,
+                 uv_stride, bgra, bgra_stride, width, height);
+}
+
+void i420_to_rgb(const uint8_t *y_plane, int y_stride, const uint8_t *u_plane, const uint8_t *v_plane,
+                 int uv_stride, uint8_t *rgb, int rgb_stride, int width, int height,
+                 YuvMatrix matrix, YuvRange range)
+{
+    i420_convert(g_i420_to_rgb_row_funcs[matrix][range], y_plane, y_stride, u_plane, v_plane, uv_stride, rgb,
+                 rgb_stride, width, height);
+}
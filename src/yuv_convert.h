@@ -0,0 +1,110 @@
+#ifndef INCLUDE_YUV_CONVERT_H
+#define INCLUDE_YUV_CONVERT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    // The different implementations of the pixel conversion loops. The scalar
+    // version is the reference that all the others are checked against.
+    typedef enum
+    {
+        YUV_KERNEL_SCALAR,
+        YUV_KERNEL_SSE2,
+        YUV_KERNEL_AVX2,
+        YUV_KERNEL_NEON,
+        YUV_KERNEL_COUNT,
+    } YuvKernel;
+
+    // Which standard the YUV data was encoded with.
+    typedef enum
+    {
+        YUV_MATRIX_BT601,
+        YUV_MATRIX_BT709,
+        YUV_MATRIX_COUNT,
+    } YuvMatrix;
+
+    // Limited (or "video") range puts black at Y=16 and white at Y=235, full
+    // range uses all of 0 to 255.
+    typedef enum
+    {
+        YUV_RANGE_LIMITED,
+        YUV_RANGE_FULL,
+        YUV_RANGE_COUNT,
+    } YuvRange;
+
+    // Converts a single row of packed YUYV (Y0 U Y1 V) pixels into RGBA. The
+    // width is in pixels, and must be even.
+    typedef void (*yuyv_to_rgba_row_func)(const uint8_t *yuyv_row, uint8_t *rgba_row, int width);
+
+    // Converts a single row of planar YUV420 into RGBA. The U and V rows are half
+    // the width of the Y row, and any width is supported.
+    typedef void (*i420_to_rgba_row_func)(const uint8_t *y_row, const uint8_t *u_row, const uint8_t *v_row,
+                                          uint8_t *rgba_row, int width);
+
+    // These return NULL if the kernel isn't compiled in, or the CPU we're
+    // running on doesn't support the instructions it needs. Every kernel is
+    // specialized for each matrix and range at compile time.
+    yuyv_to_rgba_row_func yuyv_to_rgba_row_for_kernel(YuvKernel kernel, YuvMatrix matrix, YuvRange range);
+    i420_to_rgba_row_func i420_to_rgba_row_for_kernel(YuvKernel kernel, YuvMatrix matrix, YuvRange range);
+    // The same rows with blue and red swapped, which is how most GPU drivers
+    // store textures, so BGRA can be uploaded without any swizzling.
+    yuyv_to_rgba_row_func yuyv_to_bgra_row_for_kernel(YuvKernel kernel, YuvMatrix matrix, YuvRange range);
+    i420_to_rgba_row_func i420_to_bgra_row_for_kernel(YuvKernel kernel, YuvMatrix matrix, YuvRange range);
+
+    // The same conversion in floating point, for GPU shaders. With samples
+    // normalized to 0 to 1, red is y_scale * (Y - y_offset) plus
+    // v_to_r * (V - 128 / 255), and likewise for the other channels.
+    typedef struct
+    {
+        float y_offset;
+        float y_scale;
+        float v_to_r;
+        float u_to_g;
+        float v_to_g;
+        float u_to_b;
+    } YuvFloatCoefficients;
+    // Returns false for an unknown matrix or range.
+    bool yuv_float_coefficients(YuvMatrix matrix, YuvRange range, YuvFloatCoefficients *coefficients);
+
+    // The fastest kernel available on this machine, picked once at startup.
+    YuvKernel yuv_best_kernel(void);
+    const char *yuv_kernel_name(YuvKernel kernel);
+    const char *yuv_matrix_name(YuvMatrix matrix);
+    const char *yuv_range_name(YuvRange range);
+
+    // Whole-frame conversions using the best available kernel.
+    void yuyv_to_rgba(const uint8_t *yuyv, int yuyv_stride, uint8_t *rgba, int rgba_stride, int width, int height,
+                      YuvMatrix matrix, YuvRange range);
+    void i420_to_rgba(const uint8_t *y_plane, int y_stride, const uint8_t *u_plane, const uint8_t *v_plane,
+                      int uv_stride, uint8_t *rgba, int rgba_stride, int width, int height,
+                      YuvMatrix matrix, YuvRange range);
+    // NV12 has a full-size Y plane followed by one half-size plane of
+    // interleaved U and V samples.
+    void nv12_to_rgba(const uint8_t *y_plane, int y_stride, const uint8_t *uv_plane, int uv_stride, uint8_t *rgba,
+                      int rgba_stride, int width, int height, YuvMatrix matrix, YuvRange range);
+
+    // Whole-frame conversions to BGRA, with the same arguments as above.
+    void yuyv_to_bgra(const uint8_t *yuyv, int yuyv_stride, uint8_t *bgra, int bgra_stride, int width, int height,
+                      YuvMatrix matrix, YuvRange range);
+    void i420_to_bgra(const uint8_t *y_plane, int y_stride, const uint8_t *u_plane, const uint8_t *v_plane,
+                      int uv_stride, uint8_t *bgra, int bgra_stride, int width, int height,
+                      YuvMatrix matrix, YuvRange range);
+    void nv12_to_bgra(const uint8_t *y_plane, int y_stride, const uint8_t *uv_plane, int uv_stride, uint8_t *bgra,
+                      int bgra_stride, int width, int height, YuvMatrix matrix, YuvRange range);
+
+    // Packed three-byte RGB output, for consumers like neural networks that
+    // don't want an alpha channel. Only a scalar version exists.
+    void i420_to_rgb(const uint8_t *y_plane, int y_stride, const uint8_t *u_plane, const uint8_t *v_plane,
+                     int uv_stride, uint8_t *rgb, int rgb_stride, int width, int height,
+                     YuvMatrix matrix, YuvRange range);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // INCLUDE_YUV_CONVERT_H
@@ -0,0 +1,428 @@
+// For pthread_setaffinity_np() and sched_getcpu().
+#define _GNU_SOURCE
+
+// Times every colour conversion kernel on synthetic frames at the common
+// capture sizes, so changes to the kernels can be compared against each other
+// and against earlier releases. Each kernel converts whole frames row by row,
+// just as the capture paths do, with YUYV covering V4L2 cameras and I420 the
+// Pi's. The threaded pool is timed too, running the best kernel, along with
+// the scalar-only I420 to packed RGB conversion used by post-processing.
+//
+// Every measurement starts with a few frames of warm-up, to fault in the
+// buffers and settle the caches, followed by a set of timed trials. The median
+// trial is reported, and speedups are relative to the scalar kernel on the
+// same format and size. The thread running the single-threaded kernels is
+// pinned to one CPU, so it isn't migrated mid-trial.
+//
+// Usage: yuv_convert_bench [-o results.json] [-t trials] [-C cpu] [-j pool threads]
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "convert_pool.h"
+#include "time_utils.h"
+#include "yuv_convert.h"
+
+#define BENCH_MAX_TRIALS 101
+#define BENCH_MAX_RESULTS 64
+// Each trial converts enough frames to run for at least this long, so the
+// clock's resolution doesn't matter even for the smallest frames.
+#define BENCH_MIN_TRIAL_NS 20000000
+#define BENCH_WARM_UP_FRAMES 3
+
+typedef enum
+{
+    BENCH_FORMAT_YUYV,
+    BENCH_FORMAT_I420,
+    BENCH_FORMAT_I420_RGB,
+    BENCH_FORMAT_COUNT,
+} BenchFormat;
+
+static const char *format_names[BENCH_FORMAT_COUNT] = {"yuyv", "i420", "i420_rgb"};
+
+typedef struct
+{
+    const char *name;
+    int width;
+    int height;
+} BenchSize;
+
+static const BenchSize bench_sizes[] = {
+    {"480p", 640, 480},
+    {"720p", 1280, 720},
+    {"1080p", 1920, 1080},
+    {"4k", 3840, 2160},
+};
+static const int bench_size_count = sizeof(bench_sizes) / sizeof(bench_sizes[0]);
+
+// One frame's worth of input in both formats, and somewhere to put the output.
+typedef struct
+{
+    int width;
+    int height;
+    uint8_t *yuyv;
+    uint8_t *y_plane;
+    uint8_t *u_plane;
+    uint8_t *v_plane;
+    uint8_t *bgra;
+} BenchFrame;
+
+// What's being timed, either a single kernel's rows, or the pool.
+typedef struct
+{
+    BenchFormat format;
+    const char *variant;
+    yuyv_to_rgba_row_func yuyv_row;
+    i420_to_rgba_row_func i420_row;
+    ConvertPool *pool;
+} BenchVariant;
+
+typedef struct
+{
+    BenchFormat format;
+    const char *variant;
+    int threads;
+    const BenchSize *size;
+    int frames_per_trial;
+    double median_ns;
+    double min_ns;
+    double ns_per_pixel;
+    double gb_per_second;
+    double speedup;
+} BenchResult;
+
+static BenchResult results[BENCH_MAX_RESULTS];
+static int result_count = 0;
+
+static uint8_t *alloc_noise(size_t byte_count)
+{
+    uint8_t *buffer = malloc(byte_count);
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "Couldn't allocate %zu bytes for the benchmark frames\n", byte_count);
+        exit(EXIT_FAILURE);
+    }
+    // Noise rather than a flat colour, in case a kernel ever gets clever
+    // about repeated pixels.
+    uint32_t state = 12345;
+    for (size_t i = 0; i < byte_count; ++i)
+    {
+        state = (state * 1103515245) + 12345;
+        buffer[i] = (state >> 16) & 0xff;
+    }
+    return buffer;
+}
+
+static void frame_alloc(BenchFrame *frame, const BenchSize *size)
+{
+    const size_t pixels = (size_t)(size->width) * size->height;
+    const size_t chroma_pixels = pixels / 4;
+    frame->width = size->width;
+    frame->height = size->height;
+    frame->yuyv = alloc_noise(pixels * 2);
+    frame->y_plane = alloc_noise(pixels);
+    frame->u_plane = alloc_noise(chroma_pixels);
+    frame->v_plane = alloc_noise(chroma_pixels);
+    frame->bgra = alloc_noise(pixels * 4);
+}
+
+static void frame_free(BenchFrame *frame)
+{
+    free(frame->yuyv);
+    free(frame->y_plane);
+    free(frame->u_plane);
+    free(frame->v_plane);
+    free(frame->bgra);
+}
+
+// Bytes read and written for each pixel.
+static double bytes_per_pixel(BenchFormat format)
+{
+    switch (format)
+    {
+    case BENCH_FORMAT_YUYV:
+        return 2.0 + 4.0;
+
+    case BENCH_FORMAT_I420:
+        return 1.5 + 4.0;
+
+    default:
+        return 1.5 + 3.0;
+    }
+}
+
+static void convert_frame(const BenchVariant *variant, BenchFrame *frame)
+{
+    const int width = frame->width;
+    const int height = frame->height;
+    const int uv_stride = width / 2;
+    if (variant->format == BENCH_FORMAT_I420_RGB)
+    {
+        i420_to_rgb(frame->y_plane, width, frame->u_plane, frame->v_plane, uv_stride, frame->bgra, width * 3, width,
+                    height, YUV_MATRIX_BT601, YUV_RANGE_LIMITED);
+        return;
+    }
+    if (variant->pool != NULL)
+    {
+        if (variant->format == BENCH_FORMAT_YUYV)
+        {
+            convert_pool_yuyv_to_bgra(variant->pool, frame->yuyv, width * 2, frame->bgra, width * 4, width, height,
+                                      YUV_MATRIX_BT601, YUV_RANGE_LIMITED);
+        }
+        else
+        {
+            convert_pool_i420_to_bgra(variant->pool, frame->y_plane, width, frame->u_plane, frame->v_plane,
+                                      uv_stride, frame->bgra, width * 4, width, height, YUV_MATRIX_BT601,
+                                      YUV_RANGE_LIMITED);
+        }
+        return;
+    }
+    for (int y = 0; y < height; ++y)
+    {
+        uint8_t *out_row = frame->bgra + ((size_t)(y) * width * 4);
+        if (variant->format == BENCH_FORMAT_YUYV)
+        {
+            variant->yuyv_row(frame->yuyv + ((size_t)(y) * width * 2), out_row, width);
+        }
+        else
+        {
+            const size_t uv_offset = (size_t)(y / 2) * uv_stride;
+            variant->i420_row(frame->y_plane + ((size_t)(y) * width), frame->u_plane + uv_offset,
+                              frame->v_plane + uv_offset, out_row, width);
+        }
+    }
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    const double difference = *(const double *)(a) - *(const double *)(b);
+    return (difference > 0) - (difference < 0);
+}
+
+static void run_variant(const BenchVariant *variant, BenchFrame *frame, const BenchSize *size, int trial_count)
+{
+    if (result_count == BENCH_MAX_RESULTS)
+    {
+        fprintf(stderr, "Too many benchmark results, skipping %s %s\n", format_names[variant->format],
+                variant->variant);
+        return;
+    }
+    // The warm-up frames also tell us how many frames a trial needs.
+    const int64_t warm_up_start_ns = time_monotonic_ns();
+    for (int i = 0; i < BENCH_WARM_UP_FRAMES; ++i)
+    {
+        convert_frame(variant, frame);
+    }
+    const int64_t warm_up_frame_ns = (time_monotonic_ns() - warm_up_start_ns) / BENCH_WARM_UP_FRAMES;
+    int frames_per_trial = (int)(BENCH_MIN_TRIAL_NS / ((warm_up_frame_ns > 0) ? warm_up_frame_ns : 1)) + 1;
+
+    double trial_ns[BENCH_MAX_TRIALS];
+    for (int trial = 0; trial < trial_count; ++trial)
+    {
+        const int64_t start_ns = time_monotonic_ns();
+        for (int i = 0; i < frames_per_trial; ++i)
+        {
+            convert_frame(variant, frame);
+        }
+        trial_ns[trial] = (double)(time_monotonic_ns() - start_ns) / frames_per_trial;
+    }
+    qsort(trial_ns, trial_count, sizeof(trial_ns[0]), compare_doubles);
+
+    BenchResult *result = &results[result_count++];
+    const double pixels = (double)(size->width) * size->height;
+    result->format = variant->format;
+    result->variant = variant->variant;
+    result->threads = (variant->pool != NULL) ? convert_pool_thread_count(variant->pool) : 1;
+    result->size = size;
+    result->frames_per_trial = frames_per_trial;
+    result->median_ns = trial_ns[trial_count / 2];
+    result->min_ns = trial_ns[0];
+    result->ns_per_pixel = result->median_ns / pixels;
+    // Bytes per nanosecond is the same as gigabytes per second.
+    result->gb_per_second = (pixels * bytes_per_pixel(variant->format)) / result->median_ns;
+    result->speedup = 0.0;
+    // The scalar kernel always runs first, so it's there to compare with.
+    for (int i = 0; i < result_count; ++i)
+    {
+        const BenchResult *reference = &results[i];
+        if ((reference->format == result->format) && (reference->size == size) &&
+            (strcmp(reference->variant, yuv_kernel_name(YUV_KERNEL_SCALAR)) == 0))
+        {
+            result->speedup = reference->median_ns / result->median_ns;
+        }
+    }
+
+    printf("%-5s  %-8s  %-7s  %7d  %9.3f ms  %6.3f ns  %6.2f GB/s  %6.2fx\n", size->name,
+           format_names[result->format], result->variant, result->threads, result->median_ns / 1e6,
+           result->ns_per_pixel, result->gb_per_second, result->speedup);
+    fflush(stdout);
+}
+
+static void pin_to_cpu(int cpu)
+{
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    const int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (error != 0)
+    {
+        fprintf(stderr, "Couldn't pin the benchmark to CPU %d, error %d, %s\n", cpu, error, strerror(error));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static bool write_json(const char *path, int cpu, int trial_count)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Couldn't open '%s' for the results, error %d, %s\n", path, errno, strerror(errno));
+        return false;
+    }
+    fprintf(file, "{\n  \"benchmark\": \"yuv_convert\",\n  \"best_kernel\": \"%s\",\n  \"cpu\": %d,\n",
+            yuv_kernel_name(yuv_best_kernel()), cpu);
+    fprintf(file, "  \"warm_up_frames\": %d,\n  \"trials\": %d,\n  \"results\": [\n", BENCH_WARM_UP_FRAMES,
+            trial_count);
+    for (int i = 0; i < result_count; ++i)
+    {
+        const BenchResult *result = &results[i];
+        fprintf(file,
+                "    {\"size\": \"%s\", \"width\": %d, \"height\": %d, \"format\": \"%s\", \"variant\": \"%s\", "
+                "\"threads\": %d, \"frames_per_trial\": %d, \"median_ns_per_frame\": %.0f, "
+                "\"min_ns_per_frame\": %.0f, \"ns_per_pixel\": %.4f, \"gb_per_second\": %.3f, "
+                "\"speedup\": %.3f}%s\n",
+                result->size->name, result->size->width, result->size->height, format_names[result->format],
+                result->variant, result->threads, result->frames_per_trial, result->median_ns, result->min_ns,
+                result->ns_per_pixel, result->gb_per_second, result->speedup, (i < (result_count - 1)) ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+    return true;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n\n"
+            "Options:\n"
+            "-o | --output file   Write the results as JSON too\n"
+            "-t | --trials N      Timed trials for each kernel and size [7]\n"
+            "-C | --cpu N         CPU to pin to, or -1 to stay on the current one [-1]\n"
+            "-j | --threads N     Threads for the pool, or 0 for one per CPU [0]\n"
+            "-h | --help          Print this message\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    const char *output_path = NULL;
+    int trial_count = 7;
+    int cpu = -1;
+    int pool_thread_count = 0;
+    static const struct option long_options[] = {
+        {"output", required_argument, NULL, 'o'},
+        {"trials", required_argument, NULL, 't'},
+        {"cpu", required_argument, NULL, 'C'},
+        {"threads", required_argument, NULL, 'j'},
+        {"help", no_argument, NULL, 'h'},
+        {0, 0, 0, 0},
+    };
+    for (;;)
+    {
+        const int c = getopt_long(argc, argv, "o:t:C:j:h", long_options, NULL);
+        if (c == -1)
+        {
+            break;
+        }
+        switch (c)
+        {
+        case 'o':
+            output_path = optarg;
+            break;
+
+        case 't':
+            trial_count = atoi(optarg);
+            if ((trial_count < 1) || (trial_count > BENCH_MAX_TRIALS))
+            {
+                fprintf(stderr, "Trials must be between 1 and %d\n", BENCH_MAX_TRIALS);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'C':
+            cpu = atoi(optarg);
+            break;
+
+        case 'j':
+            pool_thread_count = atoi(optarg);
+            break;
+
+        case 'h':
+            usage(argv[0]);
+            exit(EXIT_SUCCESS);
+
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // The pool's workers are started before pinning, since they'd inherit
+    // the affinity and all end up sharing the one CPU.
+    ConvertPool *pool = convert_pool_alloc(pool_thread_count);
+    if (pool == NULL)
+    {
+        fprintf(stderr, "Couldn't start the conversion pool\n");
+        exit(EXIT_FAILURE);
+    }
+    if (cpu < 0)
+    {
+        cpu = sched_getcpu();
+    }
+    pin_to_cpu(cpu);
+
+    BenchVariant variants[(YUV_KERNEL_COUNT + 1) * BENCH_FORMAT_COUNT];
+    int variant_count = 0;
+    for (int format = 0; format < BENCH_FORMAT_I420_RGB; ++format)
+    {
+        for (int kernel = 0; kernel < YUV_KERNEL_COUNT; ++kernel)
+        {
+            yuyv_to_rgba_row_func yuyv_row = yuyv_to_bgra_row_for_kernel(kernel, YUV_MATRIX_BT601, YUV_RANGE_LIMITED);
+            i420_to_rgba_row_func i420_row = i420_to_bgra_row_for_kernel(kernel, YUV_MATRIX_BT601, YUV_RANGE_LIMITED);
+            if ((yuyv_row == NULL) || (i420_row == NULL))
+            {
+                continue;
+            }
+            variants[variant_count++] = (BenchVariant){format, yuv_kernel_name(kernel), yuyv_row, i420_row, NULL};
+        }
+        variants[variant_count++] = (BenchVariant){format, "pool", NULL, NULL, pool};
+    }
+    variants[variant_count++] =
+        (BenchVariant){BENCH_FORMAT_I420_RGB, yuv_kernel_name(YUV_KERNEL_SCALAR), NULL, NULL, NULL};
+
+    printf("BT.601 limited range to BGRA, or RGB, on CPU %d, median of %d trials, best kernel %s\n", cpu, trial_count,
+           yuv_kernel_name(yuv_best_kernel()));
+    printf("size   format    variant  threads      frame  per pixel    bandwidth  speedup\n");
+    for (int s = 0; s < bench_size_count; ++s)
+    {
+        BenchFrame frame;
+        frame_alloc(&frame, &bench_sizes[s]);
+        for (int v = 0; v < variant_count; ++v)
+        {
+            run_variant(&variants[v], &frame, &bench_sizes[s], trial_count);
+        }
+        frame_free(&frame);
+    }
+    convert_pool_free(pool);
+
+    if ((output_path != NULL) && !write_json(output_path, cpu, trial_count))
+    {
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
@@ -0,0 +1,380 @@
+#include "acutest.h"
+
+#include "yuv_convert.c"
+
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t test_random_state = 12345;
+
+static uint8_t test_random_byte() {
+  test_random_state = (test_random_state * 1103515245) + 12345;
+  return (test_random_state >> 16) & 0xff;
+}
+
+static void fill_random(uint8_t* buffer, int byte_count) {
+  for (int i = 0; i < byte_count; ++i) {
+    buffer[i] = test_random_byte();
+  }
+}
+
+// Every U/V pair, with a spread of Y values, so clamping is exercised at both
+// ends of the range.
+static uint8_t* alloc_all_chroma_yuyv(int* width, int* height) {
+  *width = 512;
+  *height = 256;
+  uint8_t* yuyv = malloc(*width * *height * 2);
+  for (int v = 0; v < *height; ++v) {
+    for (int u = 0; u < (*width / 2); ++u) {
+      uint8_t* pair = yuyv + (v * *width * 2) + (u * 4);
+      pair[0] = (u + v) & 0xff;
+      pair[1] = u;
+      pair[2] = ((u * 7) + (v * 3)) & 0xff;
+      pair[3] = v;
+    }
+  }
+  return yuyv;
+}
+
+static int count_yuyv_mismatches(yuyv_to_rgba_row_func expected_func,
+  yuyv_to_rgba_row_func actual_func, const uint8_t* yuyv, int width,
+  int height) {
+  const int rgba_stride = width * 4;
+  uint8_t* expected = calloc(height, rgba_stride);
+  uint8_t* actual = calloc(height, rgba_stride);
+  for (int y = 0; y < height; ++y) {
+    expected_func(yuyv + (y * width * 2), expected + (y * rgba_stride), width);
+    actual_func(yuyv + (y * width * 2), actual + (y * rgba_stride), width);
+  }
+  int mismatches = 0;
+  for (int i = 0; i < (height * rgba_stride); ++i) {
+    if (expected[i] != actual[i]) {
+      mismatches += 1;
+    }
+  }
+  free(expected);
+  free(actual);
+  return mismatches;
+}
+
+static int count_i420_mismatches(i420_to_rgba_row_func expected_func,
+  i420_to_rgba_row_func actual_func, const uint8_t* y_row,
+  const uint8_t* u_row, const uint8_t* v_row, int width) {
+  uint8_t* expected = calloc(width, 4);
+  uint8_t* actual = calloc(width, 4);
+  expected_func(y_row, u_row, v_row, expected, width);
+  actual_func(y_row, u_row, v_row, actual, width);
+  int mismatches = 0;
+  for (int i = 0; i < (width * 4); ++i) {
+    if (expected[i] != actual[i]) {
+      mismatches += 1;
+    }
+  }
+  free(expected);
+  free(actual);
+  return mismatches;
+}
+
+void test_yuv_kernels_all_chroma() {
+  int width;
+  int height;
+  uint8_t* yuyv = alloc_all_chroma_yuyv(&width, &height);
+  for (int matrix = 0; matrix < YUV_MATRIX_COUNT; ++matrix) {
+    for (int range = 0; range < YUV_RANGE_COUNT; ++range) {
+      yuyv_to_rgba_row_func reference =
+        yuyv_to_rgba_row_for_kernel(YUV_KERNEL_SCALAR, matrix, range);
+      for (int kernel = 0; kernel < YUV_KERNEL_COUNT; ++kernel) {
+        yuyv_to_rgba_row_func func =
+          yuyv_to_rgba_row_for_kernel(kernel, matrix, range);
+        if (func == NULL) {
+          continue;
+        }
+        const int mismatches =
+          count_yuyv_mismatches(reference, func, yuyv, width, height);
+        TEST_CHECK(mismatches == 0);
+        TEST_MSG("%s %s %s: %d", yuv_kernel_name(kernel),
+          yuv_matrix_name(matrix), yuv_range_name(range), mismatches);
+      }
+    }
+  }
+  free(yuyv);
+}
+
+void test_yuv_kernels_odd_widths() {
+  // Widths that leave a tail for the fallbacks in every kernel.
+  const int widths[] = {1, 2, 6, 7, 14, 18, 23, 30, 31, 646};
+  for (int i = 0; i < (int)(sizeof(widths) / sizeof(widths[0])); ++i) {
+    const int width = widths[i];
+    const int chroma_width = (width + 1) / 2;
+    uint8_t* yuyv = malloc((width + 1) * 2);
+    uint8_t* y_row = malloc(width);
+    uint8_t* u_row = malloc(chroma_width);
+    uint8_t* v_row = malloc(chroma_width);
+    fill_random(yuyv, (width + 1) * 2);
+    fill_random(y_row, width);
+    fill_random(u_row, chroma_width);
+    fill_random(v_row, chroma_width);
+    for (int matrix = 0; matrix < YUV_MATRIX_COUNT; ++matrix) {
+      for (int range = 0; range < YUV_RANGE_COUNT; ++range) {
+        for (int kernel = 0; kernel < YUV_KERNEL_COUNT; ++kernel) {
+          i420_to_rgba_row_func i420_func =
+            i420_to_rgba_row_for_kernel(kernel, matrix, range);
+          if (i420_func == NULL) {
+            continue;
+          }
+          int mismatches = count_i420_mismatches(
+            i420_to_rgba_row_for_kernel(YUV_KERNEL_SCALAR, matrix, range),
+            i420_func, y_row, u_row, v_row, width);
+          TEST_CHECK(mismatches == 0);
+          TEST_MSG("i420 %s, width %d: %d", yuv_kernel_name(kernel), width,
+            mismatches);
+
+          // YUYV can only hold an even number of pixels.
+          const int yuyv_width = width & ~1;
+          mismatches = count_yuyv_mismatches(
+            yuyv_to_rgba_row_for_kernel(YUV_KERNEL_SCALAR, matrix, range),
+            yuyv_to_rgba_row_for_kernel(kernel, matrix, range), yuyv,
+            yuyv_width, 1);
+          TEST_CHECK(mismatches == 0);
+          TEST_MSG("yuyv %s, width %d: %d", yuv_kernel_name(kernel),
+            yuyv_width, mismatches);
+        }
+      }
+    }
+    free(yuyv);
+    free(y_row);
+    free(u_row);
+    free(v_row);
+  }
+}
+
+void test_yuv_reference_accuracy() {
+  // Checks the fixed-point reference against the textbook float formulas.
+  const double kr[YUV_MATRIX_COUNT] = {0.299, 0.2126};
+  const double kb[YUV_MATRIX_COUNT] = {0.114, 0.0722};
+  for (int matrix = 0; matrix < YUV_MATRIX_COUNT; ++matrix) {
+    for (int range = 0; range < YUV_RANGE_COUNT; ++range) {
+      const bool is_full = (range == YUV_RANGE_FULL);
+      const double y_offset = is_full ? 0.0 : 16.0;
+      const double y_scale = is_full ? 1.0 : (255.0 / 219.0);
+      const double c_scale = is_full ? 1.0 : (255.0 / 224.0);
+      const double kg = 1.0 - kr[matrix] - kb[matrix];
+      i420_to_rgba_row_func func =
+        i420_to_rgba_row_for_kernel(YUV_KERNEL_SCALAR, matrix, range);
+      int max_difference = 0;
+      for (int u = 0; u < 256; u += 5) {
+        for (int v = 0; v < 256; v += 3) {
+          uint8_t y_row[256];
+          uint8_t u_row[128];
+          uint8_t v_row[128];
+          for (int i = 0; i < 256; ++i) {
+            y_row[i] = i;
+          }
+          memset(u_row, u, sizeof(u_row));
+          memset(v_row, v, sizeof(v_row));
+          uint8_t rgba[256 * 4];
+          func(y_row, u_row, v_row, rgba, 256);
+          for (int i = 0; i < 256; ++i) {
+            const double yf = (i - y_offset) * y_scale;
+            const double uf = (u - 128) * c_scale;
+            const double vf = (v - 128) * c_scale;
+            const double expected[3] = {
+              yf + (2.0 * (1.0 - kr[matrix]) * vf),
+              yf - (2.0 * (1.0 - kb[matrix]) * kb[matrix] / kg * uf) -
+                (2.0 * (1.0 - kr[matrix]) * kr[matrix] / kg * vf),
+              yf + (2.0 * (1.0 - kb[matrix]) * uf),
+            };
+            for (int channel = 0; channel < 3; ++channel) {
+              double clamped = expected[channel];
+              clamped = (clamped < 0.0) ? 0.0 : clamped;
+              clamped = (clamped > 255.0) ? 255.0 : clamped;
+              const int difference =
+                abs((int)(clamped + 0.5) - rgba[(i * 4) + channel]);
+              if (difference > max_difference) {
+                max_difference = difference;
+              }
+            }
+            TEST_CHECK(rgba[(i * 4) + 3] == 255);
+          }
+        }
+      }
+      TEST_CHECK(max_difference <= 1);
+      TEST_MSG("%s %s: %d", yuv_matrix_name(matrix), yuv_range_name(range),
+        max_difference);
+    }
+  }
+}
+
+void test_yuv_black_and_white() {
+  uint8_t black_yuyv[4] = {16, 128, 16, 128};
+  uint8_t white_yuyv[4] = {235, 128, 235, 128};
+  uint8_t rgba[8];
+  yuyv_to_rgba(black_yuyv, 4, rgba, 8, 2, 1, YUV_MATRIX_BT709, YUV_RANGE_LIMITED);
+  TEST_CHECK(rgba[0] == 0 && rgba[1] == 0 && rgba[2] == 0 && rgba[3] == 255);
+  yuyv_to_rgba(white_yuyv, 4, rgba, 8, 2, 1, YUV_MATRIX_BT709, YUV_RANGE_LIMITED);
+  TEST_CHECK(rgba[0] == 255 && rgba[1] == 255 && rgba[2] == 255);
+
+  const uint8_t y_plane[4] = {0, 255, 0, 255};
+  const uint8_t u_plane[1] = {128};
+  const uint8_t v_plane[1] = {128};
+  uint8_t rgb[2][6];
+  i420_to_rgb(y_plane, 2, u_plane, v_plane, 1, &rgb[0][0], 6, 2, 2, YUV_MATRIX_BT601, YUV_RANGE_FULL);
+  const uint8_t expected_rgb[6] = {0, 0, 0, 255, 255, 255};
+  TEST_CHECK(memcmp(rgb[0], expected_rgb, 6) == 0);
+  TEST_CHECK(memcmp(rgb[1], expected_rgb, 6) == 0);
+}
+
+void test_yuv_best_kernel() {
+  const YuvKernel best = yuv_best_kernel();
+  TEST_CHECK(yuyv_to_rgba_row_for_kernel(best, YUV_MATRIX_BT601, YUV_RANGE_LIMITED) != NULL);
+  TEST_MSG("%s", yuv_kernel_name(best));
+  TEST_CHECK(yuyv_to_rgba_row_for_kernel(YUV_KERNEL_SCALAR, YUV_MATRIX_BT709, YUV_RANGE_FULL) != NULL);
+  TEST_CHECK(yuyv_to_rgba_row_for_kernel(YUV_KERNEL_SCALAR, YUV_MATRIX_COUNT, YUV_RANGE_FULL) == NULL);
+}
+
+void test_yuv_nv12_matches_i420() {
+  // Wider than one chunk, and odd, so the chunk and chroma edges are covered.
+  const int widths[] = {2, 7, 640, 1023, 1024, 1025, 2051};
+  const int height = 6;
+  for (int w = 0; w < (int)(sizeof(widths) / sizeof(widths[0])); ++w) {
+    const int width = widths[w];
+    const int chroma_width = (width + 1) / 2;
+    const int chroma_height = (height + 1) / 2;
+    uint8_t* y_plane = malloc(width * height);
+    uint8_t* u_plane = malloc(chroma_width * chroma_height);
+    uint8_t* v_plane = malloc(chroma_width * chroma_height);
+    uint8_t* uv_plane = malloc(chroma_width * 2 * chroma_height);
+    fill_random(y_plane, width * height);
+    fill_random(u_plane, chroma_width * chroma_height);
+    fill_random(v_plane, chroma_width * chroma_height);
+    for (int i = 0; i < (chroma_width * chroma_height); ++i) {
+      uv_plane[(i * 2) + 0] = u_plane[i];
+      uv_plane[(i * 2) + 1] = v_plane[i];
+    }
+
+    const int rgba_stride = width * 4;
+    uint8_t* expected = calloc(height, rgba_stride);
+    uint8_t* actual = calloc(height, rgba_stride);
+    i420_to_rgba(y_plane, width, u_plane, v_plane, chroma_width, expected,
+      rgba_stride, width, height, YUV_MATRIX_BT709, YUV_RANGE_LIMITED);
+    nv12_to_rgba(y_plane, width, uv_plane, chroma_width * 2, actual,
+      rgba_stride, width, height, YUV_MATRIX_BT709, YUV_RANGE_LIMITED);
+    TEST_CHECK(memcmp(expected, actual, height * rgba_stride) == 0);
+    TEST_MSG("width %d", width);
+
+    free(y_plane);
+    free(u_plane);
+    free(v_plane);
+    free(uv_plane);
+    free(expected);
+    free(actual);
+  }
+}
+
+static bool is_swizzled(const uint8_t* rgba, const uint8_t* bgra, int pixel_count) {
+  for (int i = 0; i < pixel_count; ++i) {
+    const uint8_t* from = rgba + (i * 4);
+    const uint8_t* to = bgra + (i * 4);
+    if ((to[0] != from[2]) || (to[1] != from[1]) || (to[2] != from[0]) || (to[3] != from[3])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void test_yuv_bgra_swaps_red_and_blue() {
+  const int width = 646;
+  const int chroma_width = (width + 1) / 2;
+  uint8_t* yuyv = malloc(width * 2);
+  uint8_t* y_row = malloc(width);
+  uint8_t* u_row = malloc(chroma_width);
+  uint8_t* v_row = malloc(chroma_width);
+  uint8_t* rgba = malloc(width * 4);
+  uint8_t* bgra = malloc(width * 4);
+  fill_random(yuyv, width * 2);
+  fill_random(y_row, width);
+  fill_random(u_row, chroma_width);
+  fill_random(v_row, chroma_width);
+  for (int matrix = 0; matrix < YUV_MATRIX_COUNT; ++matrix) {
+    for (int range = 0; range < YUV_RANGE_COUNT; ++range) {
+      for (int kernel = 0; kernel < YUV_KERNEL_COUNT; ++kernel) {
+        yuyv_to_rgba_row_func yuyv_bgra = yuyv_to_bgra_row_for_kernel(kernel, matrix, range);
+        i420_to_rgba_row_func i420_bgra = i420_to_bgra_row_for_kernel(kernel, matrix, range);
+        if ((yuyv_bgra == NULL) || (i420_bgra == NULL)) {
+          continue;
+        }
+        yuyv_to_rgba_row_for_kernel(YUV_KERNEL_SCALAR, matrix, range)(yuyv, rgba, width);
+        yuyv_bgra(yuyv, bgra, width);
+        TEST_CHECK(is_swizzled(rgba, bgra, width));
+        TEST_MSG("yuyv %s %s %s", yuv_kernel_name(kernel), yuv_matrix_name(matrix), yuv_range_name(range));
+
+        i420_to_rgba_row_for_kernel(YUV_KERNEL_SCALAR, matrix, range)(y_row, u_row, v_row, rgba, width);
+        i420_bgra(y_row, u_row, v_row, bgra, width);
+        TEST_CHECK(is_swizzled(rgba, bgra, width));
+        TEST_MSG("i420 %s %s %s", yuv_kernel_name(kernel), yuv_matrix_name(matrix), yuv_range_name(range));
+      }
+    }
+  }
+
+  // The whole-frame NV12 path has its own chunking, so check that too.
+  uint8_t* uv_row = malloc(chroma_width * 2);
+  fill_random(uv_row, chroma_width * 2);
+  nv12_to_rgba(y_row, width, uv_row, chroma_width * 2, rgba, width * 4, width, 1, YUV_MATRIX_BT709,
+    YUV_RANGE_FULL);
+  nv12_to_bgra(y_row, width, uv_row, chroma_width * 2, bgra, width * 4, width, 1, YUV_MATRIX_BT709,
+    YUV_RANGE_FULL);
+  TEST_CHECK(is_swizzled(rgba, bgra, width));
+
+  free(uv_row);
+  free(bgra);
+  free(rgba);
+  free(v_row);
+  free(u_row);
+  free(y_row);
+  free(yuyv);
+}
+
+void test_yuv_float_coefficients() {
+  for (int matrix = 0; matrix < YUV_MATRIX_COUNT; ++matrix) {
+    for (int range = 0; range < YUV_RANGE_COUNT; ++range) {
+      YuvFloatCoefficients c;
+      TEST_ASSERT(yuv_float_coefficients(matrix, range, &c));
+      i420_to_rgba_row_func reference = i420_to_rgba_row_for_kernel(YUV_KERNEL_SCALAR, matrix, range);
+      int max_difference = 0;
+      for (int i = 0; i < 4096; ++i) {
+        const uint8_t y = test_random_byte();
+        const uint8_t u = test_random_byte();
+        const uint8_t v = test_random_byte();
+        uint8_t rgba[4];
+        reference(&y, &u, &v, rgba, 1);
+        // What a shader would do with normalized samples.
+        const float luma = c.y_scale * ((y / 255.0f) - c.y_offset);
+        const float cu = (u / 255.0f) - (128.0f / 255.0f);
+        const float cv = (v / 255.0f) - (128.0f / 255.0f);
+        const float rgb[3] = {luma + (c.v_to_r * cv), luma + (c.u_to_g * cu) + (c.v_to_g * cv),
+          luma + (c.u_to_b * cu)};
+        for (int channel = 0; channel < 3; ++channel) {
+          const float clamped = (rgb[channel] < 0.0f) ? 0.0f : ((rgb[channel] > 1.0f) ? 1.0f : rgb[channel]);
+          const int difference = abs((int)((clamped * 255.0f) + 0.5f) - rgba[channel]);
+          max_difference = (difference > max_difference) ? difference : max_difference;
+        }
+      }
+      TEST_CHECK(max_difference <= 1);
+      TEST_MSG("%s %s: %d", yuv_matrix_name(matrix), yuv_range_name(range), max_difference);
+    }
+  }
+  YuvFloatCoefficients c;
+  TEST_CHECK(!yuv_float_coefficients(YUV_MATRIX_COUNT, YUV_RANGE_FULL, &c));
+}
+
+TEST_LIST = {
+  {"yuv_kernels_all_chroma", test_yuv_kernels_all_chroma},
+  {"yuv_kernels_odd_widths", test_yuv_kernels_odd_widths},
+  {"yuv_reference_accuracy", test_yuv_reference_accuracy},
+  {"yuv_black_and_white", test_yuv_black_and_white},
+  {"yuv_best_kernel", test_yuv_best_kernel},
+  {"yuv_nv12_matches_i420", test_yuv_nv12_matches_i420},
+  {"yuv_bgra_swaps_red_and_blue", test_yuv_bgra_swaps_red_and_blue},
+  {"yuv_float_coefficients", test_yuv_float_coefficients},
+  {NULL, NULL},
+};